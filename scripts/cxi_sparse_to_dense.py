@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# cxi_sparse_to_dense.py
+# =============================================================================
+# Re-densifies frames that were saved with saveSparse=1
+# (sparse_index / sparse_value stacks in /entry_1/instrument_1/detector_N/<version>)
+# Frames are written to a new file as a dense 3D stack (N_frames x pix_ny x pix_nx),
+# or a single frame is printed when FRAME is given.
+
+import h5py, sys
+import numpy as np
+
+
+def sparse_to_dense(group, frame):
+    """
+    Returns frame number 'frame' of the sparse stacks in 'group' as a dense 2D array.
+    The frame shape is taken from mask_shared, which is always saved next to the sparse stacks.
+    """
+    shape = group["mask_shared"].shape
+    n = int(group["sparse_npixels"][frame])
+    index = group["sparse_index"][frame, :n]
+    value = group["sparse_value"][frame, :n]
+    dense = np.zeros(shape[0] * shape[1], dtype=np.float32)
+    dense[index] = value
+    return dense.reshape(shape)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        print("ERROR: No cxi file specified.")
+        print("Usage: ./cxi_sparse_to_dense.py FILENAME [GROUP=/entry_1/instrument_1/detector_1] [OUTFILE=FILENAME+_dense.h5] [FRAME]")
+        exit(0)
+
+    filename = sys.argv[1]
+
+    if len(sys.argv) >= 3:
+        group_name = sys.argv[2]
+    else:
+        group_name = "/entry_1/instrument_1/detector_1"
+
+    if len(sys.argv) >= 4:
+        out_filename = sys.argv[3]
+    else:
+        out_filename = filename
+        if ".h5" in filename:
+            out_filename = out_filename[:-3]
+        elif ".cxi" in filename:
+            out_filename = out_filename[:-4]
+        out_filename += "_dense.h5"
+
+    f = h5py.File(filename, "r")
+    group = f[group_name]
+    nframes = group["sparse_npixels"].shape[0]
+
+    if len(sys.argv) >= 5:
+        frame = int(sys.argv[4])
+        I = sparse_to_dense(group, frame)
+        print("Frame %i: %i stored pixels, sum %g" % (frame, int(group["sparse_npixels"][frame]), I.sum()))
+        exit(0)
+
+    shape = group["mask_shared"].shape
+    out = h5py.File(out_filename, "w")
+    data = out.create_dataset("data/data", (nframes, shape[0], shape[1]), dtype=np.float32,
+                              chunks=(1, shape[0], shape[1]), compression="gzip")
+    for i in range(nframes):
+        data[i] = sparse_to_dense(group, i)
+    out.close()
+    f.close()
+    print("Wrote %i frames to %s" % (nframes, out_filename))
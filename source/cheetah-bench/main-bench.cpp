@@ -0,0 +1,475 @@
+//
+//  cheetah-bench
+//
+//  Synthetic data benchmark for libcheetah
+//  Generates frames for the built-in detector geometries (noise, Bragg peaks, streaks) and pushes them
+//  through cheetahProcessEventMultithreaded() as fast as possible, so that throughput can be measured
+//  without facility data or a facility frontend.
+//
+//  Each thread count is run in a forked child process with its own working directory (bench-t<n>),
+//  libcheetah keeps global state that is not meant to be initialised twice in one process.
+//
+//  Usage:
+//  > cheetah-bench --detector=agipd --frames=2000 --threads=1,2,4,8 --hitfraction=0.1 --peaks=50
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "cheetah.h"
+
+
+// This is for parsing getopt_long()
+struct tCheetahBenchParams {
+	std::string detector;
+	std::string iniFile;
+	std::vector<int> nThreads;
+	long	nFrames;
+	long	nPool;
+	float	noise;
+	float	background;
+	float	hitFraction;
+	long	nPeaks;
+	float	peakIntensity;
+	float	peakWidth;
+	long	nStreaks;
+	float	streakIntensity;
+	int		saveHits;
+	unsigned int seed;
+} CheetahBenchParams;
+void parse_config(int, char *[], tCheetahBenchParams*);
+
+
+/*
+ *	Small xorshift random number generator (reproducible and cheap, rand() is not thread-local)
+ */
+static inline uint32_t benchRandom(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static inline float benchUniform(uint32_t *state) {
+	return (benchRandom(state) >> 8) * (1.0f/16777216.0f);
+}
+
+static inline float benchGaussian(uint32_t *state) {
+	float u1 = benchUniform(state) + 1e-7f;
+	float u2 = benchUniform(state);
+	return sqrtf(-2.0f*logf(u1)) * cosf(6.2831853f*u2);
+}
+
+
+/*
+ *	Generate one synthetic frame: flat background + gaussian noise, optionally Bragg peaks (2D gaussians) and streaks (lines)
+ */
+void generateFrame(float *data, long pix_nx, long pix_ny, int isHit, tCheetahBenchParams *params, uint32_t *rng) {
+
+	long pix_nn = pix_nx*pix_ny;
+	for(long i=0; i<pix_nn; i++) {
+		data[i] = params->background + params->noise*benchGaussian(rng);
+	}
+
+	// Bragg peaks
+	if(isHit) {
+		long hw = lrintf(2.5f*params->peakWidth);
+		if(hw < 2)
+			hw = 2;
+		for(long p=0; p<params->nPeaks; p++) {
+			float cx = 2 + benchUniform(rng)*(pix_nx-4);
+			float cy = 2 + benchUniform(rng)*(pix_ny-4);
+			float I = params->peakIntensity*(0.5f + benchUniform(rng));
+			for(long y=(long)cy-hw; y<=(long)cy+hw; y++) {
+				if(y < 0 || y >= pix_ny)
+					continue;
+				for(long x=(long)cx-hw; x<=(long)cx+hw; x++) {
+					if(x < 0 || x >= pix_nx)
+						continue;
+					float r2 = (x-cx)*(x-cx) + (y-cy)*(y-cy);
+					data[y*pix_nx+x] += I*expf(-r2/(2*params->peakWidth*params->peakWidth));
+				}
+			}
+		}
+	}
+
+	// Streaks (jet streaks, ice rings are not simulated)
+	for(long s=0; s<params->nStreaks; s++) {
+		float x0 = benchUniform(rng)*pix_nx;
+		float y0 = benchUniform(rng)*pix_ny;
+		float angle = benchUniform(rng)*3.14159265f;
+		float length = 50 + benchUniform(rng)*200;
+		for(float t=0; t<length; t+=0.5f) {
+			long x = lrintf(x0 + t*cosf(angle));
+			long y = lrintf(y0 + t*sinf(angle));
+			if(x < 0 || x >= pix_nx || y < 0 || y >= pix_ny)
+				break;
+			data[y*pix_nx+x] += params->streakIntensity;
+		}
+	}
+}
+
+
+/*
+ *	Write a cheetah.ini for the selected built-in geometry (used when no ini file is given)
+ */
+void writeBenchIni(const char *filename, tCheetahBenchParams *params) {
+	const char *detectorType = params->detector.c_str();
+	if(params->detector == "agipd")
+		detectorType = "agipd-1M";
+	else if(params->detector == "jungfrau")
+		detectorType = "jungfrau1M";
+	else if(params->detector == "pilatus")
+		detectorType = "pilatus6M";
+
+	FILE *fp = fopen(filename, "w");
+	if(fp == NULL) {
+		printf("Error: Can not open %s for writing\n", filename);
+		exit(1);
+	}
+	fprintf(fp, "# Generated by cheetah-bench\n");
+	fprintf(fp, "defaultPhotonEnergyeV=9000\n");
+	fprintf(fp, "hitfinder=1\n");
+	fprintf(fp, "hitfinderDetectorID=0\n");
+	fprintf(fp, "hitfinderAlgorithm=8\n");
+	fprintf(fp, "hitfinderADC=%g\n", params->background + 5*params->noise);
+	fprintf(fp, "hitfinderMinSNR=6\n");
+	fprintf(fp, "hitfinderMinPixCount=2\n");
+	fprintf(fp, "hitfinderMaxPixCount=30\n");		// 0 (the default) rejects every peak
+	fprintf(fp, "hitfinderNpeaks=%ld\n", params->nPeaks > 1 ? params->nPeaks/2 : 1);
+	fprintf(fp, "saveHits=%d\n", params->saveHits);
+	fprintf(fp, "saveBlanks=0\n");
+	fprintf(fp, "writeRunningSumsFiles=0\n");
+	fprintf(fp, "saveInterval=0\n");
+	fprintf(fp, "[bench]\n");
+	fprintf(fp, "detectorType=%s\n", detectorType);
+	fprintf(fp, "detectorName=%s\n", detectorType);
+	fprintf(fp, "detectorID=0\n");
+	fprintf(fp, "defaultCameraLengthMm=100\n");
+	fclose(fp);
+}
+
+
+/*
+ *	Run the benchmark with a given number of threads (in a child process)
+ *	Progress output of libcheetah goes to cheetah.log in the working directory, the summary goes to out
+ *	Returns frames/s (cheetahInit and cheetahExit are not included)
+ */
+double runBenchmark(int nThreads, tCheetahBenchParams *params, FILE *out) {
+
+	// Separate working directory per thread count
+	char dirname[1024];
+	sprintf(dirname, "bench-t%d", nThreads);
+	mkdir(dirname, 0755);
+	if(chdir(dirname) != 0) {
+		fprintf(out, "Error: Can not change to directory %s\n", dirname);
+		exit(1);
+	}
+	if(freopen("cheetah.log", "w", stdout) == NULL) {
+		fprintf(out, "Error: Can not redirect output to %s/cheetah.log\n", dirname);
+		exit(1);
+	}
+
+	// Configuration: generated or given ini, nThreads override goes through the calibration file (parsed last)
+	static cGlobal cheetahGlobal;
+	if(params->iniFile == "") {
+		writeBenchIni("cheetah-bench.ini", params);
+		strcpy(cheetahGlobal.configFile, "cheetah-bench.ini");
+	}
+	else if(params->iniFile[0] == '/') {
+		strcpy(cheetahGlobal.configFile, params->iniFile.c_str());
+	}
+	else {
+		sprintf(cheetahGlobal.configFile, "../%s", params->iniFile.c_str());
+	}
+	FILE *fp = fopen("bench-threads.ini", "w");
+	fprintf(fp, "nThreads=%d\n", nThreads);
+	fclose(fp);
+	strcpy(cheetahGlobal.calibFile, "bench-threads.ini");
+	strcpy(cheetahGlobal.facility, "bench");
+	strcpy(cheetahGlobal.experimentID, "bench");
+
+	cheetahInit(&cheetahGlobal);
+	cheetahGlobal.runNumber = 1;
+
+	long pix_nx = cheetahGlobal.detector[0].pix_nx;
+	long pix_ny = cheetahGlobal.detector[0].pix_ny;
+	long pix_nn = cheetahGlobal.detector[0].pix_nn;
+
+	// Pre-generate a pool of hits and blanks so that frame generation does not count against throughput
+	uint32_t rng = params->seed;
+	long nPoolHalf = params->nPool/2 > 0 ? params->nPool/2 : 1;
+	std::vector<float*> hitPool, blankPool;
+	for(long i=0; i<nPoolHalf; i++) {
+		float *frame = (float*) malloc(pix_nn*sizeof(float));
+		generateFrame(frame, pix_nx, pix_ny, 1, params, &rng);
+		hitPool.push_back(frame);
+		frame = (float*) malloc(pix_nn*sizeof(float));
+		generateFrame(frame, pix_nx, pix_ny, 0, params, &rng);
+		blankPool.push_back(frame);
+	}
+
+	// Push frames through cheetah at maximum rate
+	struct timeval t0, t1;
+	gettimeofday(&t0, NULL);
+	long nHitsGenerated = 0;
+	for(long frameNumber=0; frameNumber<params->nFrames; frameNumber++) {
+		int isHit = benchUniform(&rng) < params->hitFraction;
+		float *frame = isHit ? hitPool[frameNumber % nPoolHalf] : blankPool[frameNumber % nPoolHalf];
+		nHitsGenerated += isHit;
+
+		cEventData *eventData = cheetahNewEvent(&cheetahGlobal);
+		eventData->frameNumber = frameNumber;
+		eventData->runNumber = cheetahGlobal.runNumber;
+		sprintf(eventData->eventname, "bench-%06ld", frameNumber);
+		eventData->photonEnergyeV = cheetahGlobal.defaultPhotonEnergyeV;
+		eventData->wavelengthA = 12398.42 / cheetahGlobal.defaultPhotonEnergyeV;
+		eventData->pGlobal = &cheetahGlobal;
+
+		memcpy(eventData->detector[0].data_raw, frame, pix_nn*sizeof(float));
+		eventData->detector[0].data_raw_is_float = true;
+
+		cheetahProcessEventMultithreaded(&cheetahGlobal, eventData);
+	}
+	cheetahGlobal.waitForThreadsToFinish();
+	gettimeofday(&t1, NULL);
+	double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)*1e-6;
+
+	// Summary (per-stage timing comes from the worker stage histograms)
+	fprintf(out, "----------------\n");
+	fprintf(out, "nThreads=%d: %ld frames (%ld generated hits, %ld found) in %0.2lf sec: %0.2lf frames/s, %0.1lf MB/s\n",
+			nThreads, params->nFrames, nHitsGenerated, cheetahGlobal.nhits, dt, params->nFrames/dt,
+			params->nFrames/dt*pix_nn*sizeof(float)/(1024.*1024.));
+	cheetahGlobal.timeProfile.reportStages(out);
+	fflush(out);
+
+	cheetahExit(&cheetahGlobal);
+	// The child leaves through _exit(), which does not flush cheetah.log
+	fflush(stdout);
+
+	for(long i=0; i<nPoolHalf; i++) {
+		free(hitPool[i]);
+		free(blankPool[i]);
+	}
+	return params->nFrames/dt;
+}
+
+
+// Main entry point for the benchmark
+int main(int argc, char* argv[]) {
+
+	std::cout << "Cheetah synthetic data benchmark\n";
+
+	parse_config(argc, argv, &CheetahBenchParams);
+
+	// Summaries of all children go to the original stdout, frames/s comes back through a pipe for the scaling table
+	std::vector<double> fps;
+	for(size_t t=0; t<CheetahBenchParams.nThreads.size(); t++) {
+		int nThreads = CheetahBenchParams.nThreads[t];
+		int pipefd[2];
+		if(pipe(pipefd) != 0) {
+			printf("Error: pipe() failed\n");
+			return 1;
+		}
+		fflush(stdout);
+
+		pid_t pid = fork();
+		if(pid == 0) {
+			close(pipefd[0]);
+			FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+			double rate = runBenchmark(nThreads, &CheetahBenchParams, out);
+			fclose(out);
+			FILE *pfp = fdopen(pipefd[1], "w");
+			fprintf(pfp, "%lf\n", rate);
+			fclose(pfp);
+			_exit(0);
+		}
+		close(pipefd[1]);
+		double rate = 0;
+		FILE *pfp = fdopen(pipefd[0], "r");
+		if(fscanf(pfp, "%lf", &rate) != 1)
+			rate = 0;
+		fclose(pfp);
+		int status;
+		waitpid(pid, &status, 0);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 || rate == 0) {
+			printf("nThreads=%d: benchmark failed, see bench-t%d/cheetah.log\n", nThreads, nThreads);
+		}
+		fps.push_back(rate);
+	}
+
+	// Scaling table
+	printf("----------------\n");
+	printf("Scaling (%s, %ld frames per run):\n", CheetahBenchParams.iniFile == "" ? CheetahBenchParams.detector.c_str() : CheetahBenchParams.iniFile.c_str(), CheetahBenchParams.nFrames);
+	printf("\t%8s %12s %10s %12s\n", "nThreads", "frames/s", "speedup", "efficiency");
+	for(size_t t=0; t<fps.size(); t++) {
+		double speedup = fps[0] > 0 ? fps[t]/fps[0] : 0;
+		double base = CheetahBenchParams.nThreads[t] / (double) CheetahBenchParams.nThreads[0];
+		printf("\t%8d %12.2lf %10.2lf %11.0lf%%\n", CheetahBenchParams.nThreads[t], fps[t], speedup, 100*speedup/base);
+	}
+	printf("Per-run logs are in bench-t<nThreads>/cheetah.log\n");
+	return 0;
+}
+
+
+/*
+ *  Print some useful information
+ */
+void print_help(void){
+	std::cout << "Cheetah synthetic data benchmark\n";
+	std::cout << std::endl;
+	std::cout << "usage: cheetah-bench [options]\n";
+	std::cout << std::endl;
+	std::cout << "\t--detector=<name>      Built-in geometry {cspad, pnccd, agipd, jungfrau, pilatus} (default agipd)\n";
+	std::cout << "\t--inifile=<file>       Use this cheetah.ini instead of the generated one (detector 0 is filled)\n";
+	std::cout << "\t--frames=<n>           Number of frames per run (default 1000)\n";
+	std::cout << "\t--threads=<n,m,...>    Thread counts to run for the scaling table (default 1,2,4,... up to the number of cores)\n";
+	std::cout << "\t--noise=<adu>          Gaussian noise sigma (default 10)\n";
+	std::cout << "\t--background=<adu>     Flat background level (default 20)\n";
+	std::cout << "\t--hitfraction=<f>      Fraction of frames with Bragg peaks (default 0.1)\n";
+	std::cout << "\t--peaks=<n>            Bragg peaks per hit (default 50)\n";
+	std::cout << "\t--peakintensity=<adu>  Mean peak height (default 1000)\n";
+	std::cout << "\t--peakwidth=<pixels>   Gaussian sigma of the Bragg peaks (default 0.8), wider peaks give the peakfinders larger connected regions\n";
+	std::cout << "\t--streaks=<n>          Streaks per frame (default 0)\n";
+	std::cout << "\t--streakintensity=<adu> Height of the streaks above background (default 200)\n";
+	std::cout << "\t--pool=<n>             Number of distinct pre-generated frames (default 32)\n";
+	std::cout << "\t--save                 Save hits to .cxi (default off)\n";
+	std::cout << "\t--seed=<n>             Random seed\n";
+	std::cout << std::endl;
+}
+
+
+/*
+ *	Configuration parser (getopt_long)
+ */
+void parse_config(int argc, char *argv[], tCheetahBenchParams *global) {
+
+	// Defaults
+	global->detector = "agipd";
+	global->iniFile = "";
+	global->nFrames = 1000;
+	global->nPool = 32;
+	global->noise = 10;
+	global->background = 20;
+	global->hitFraction = 0.1;
+	global->nPeaks = 50;
+	global->peakIntensity = 1000;
+	global->peakWidth = 0.8;
+	global->nStreaks = 0;
+	global->streakIntensity = 200;
+	global->saveHits = 0;
+	global->seed = 12345;
+
+	const struct option longOpts[] = {
+		{ "detector", required_argument, NULL, 'd' },
+		{ "inifile", required_argument, NULL, 'i' },
+		{ "frames", required_argument, NULL, 'n' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "noise", required_argument, NULL, 0 },
+		{ "background", required_argument, NULL, 0 },
+		{ "hitfraction", required_argument, NULL, 0 },
+		{ "peaks", required_argument, NULL, 0 },
+		{ "peakintensity", required_argument, NULL, 0 },
+		{ "peakwidth", required_argument, NULL, 0 },
+		{ "streaks", required_argument, NULL, 0 },
+		{ "streakintensity", required_argument, NULL, 0 },
+		{ "pool", required_argument, NULL, 0 },
+		{ "seed", required_argument, NULL, 0 },
+		{ "save", no_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, no_argument, NULL, 0 }
+	};
+	const char optString[] = "d:i:n:t:sh?";
+
+	int opt;
+	int longIndex;
+	while( (opt=getopt_long(argc, argv, optString, longOpts, &longIndex )) != -1 ) {
+		switch( opt ) {
+			case 'd':
+				global->detector = optarg;
+				break;
+			case 'i':
+				global->iniFile = optarg;
+				break;
+			case 'n':
+				global->nFrames = atol(optarg);
+				break;
+			case 't': {
+				char *s = strtok(optarg, ",");
+				while(s != NULL) {
+					if(atoi(s) > 0)
+						global->nThreads.push_back(atoi(s));
+					s = strtok(NULL, ",");
+				}
+				break;
+			}
+			case 's':
+				global->saveHits = 1;
+				break;
+			case 'h':   /* fall-through is intentional */
+			case '?':
+				print_help();
+				exit(1);
+				break;
+
+			case 0:     /* long option without a short arg */
+				if( strcmp( "noise", longOpts[longIndex].name ) == 0 )
+					global->noise = atof(optarg);
+				if( strcmp( "background", longOpts[longIndex].name ) == 0 )
+					global->background = atof(optarg);
+				if( strcmp( "hitfraction", longOpts[longIndex].name ) == 0 )
+					global->hitFraction = atof(optarg);
+				if( strcmp( "peaks", longOpts[longIndex].name ) == 0 )
+					global->nPeaks = atol(optarg);
+				if( strcmp( "peakintensity", longOpts[longIndex].name ) == 0 )
+					global->peakIntensity = atof(optarg);
+				if( strcmp( "peakwidth", longOpts[longIndex].name ) == 0 )
+					global->peakWidth = atof(optarg);
+				if( strcmp( "streaks", longOpts[longIndex].name ) == 0 )
+					global->nStreaks = atol(optarg);
+				if( strcmp( "streakintensity", longOpts[longIndex].name ) == 0 )
+					global->streakIntensity = atof(optarg);
+				if( strcmp( "pool", longOpts[longIndex].name ) == 0 )
+					global->nPool = atol(optarg);
+				if( strcmp( "seed", longOpts[longIndex].name ) == 0 )
+					global->seed = strtoul(optarg, NULL, 10);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	// Default scaling: 1, 2, 4, ... up to the number of cores
+	if(global->nThreads.size() == 0) {
+		long nCores = sysconf(_SC_NPROCESSORS_ONLN);
+		for(int n=1; n<nCores; n*=2)
+			global->nThreads.push_back(n);
+		global->nThreads.push_back(nCores > 0 ? (int) nCores : 1);
+	}
+	if(global->seed == 0)
+		global->seed = 12345;
+
+	if(global->detector != "cspad" && global->detector != "pnccd" && global->detector != "agipd" &&
+	   global->detector != "jungfrau" && global->detector != "pilatus" && global->iniFile == "") {
+		std::cout << "Unknown detector: " << global->detector << std::endl;
+		print_help();
+		exit(1);
+	}
+
+	std::cout << "Detector: " << (global->iniFile == "" ? global->detector : global->iniFile) << std::endl;
+	std::cout << "Frames per run: " << global->nFrames << std::endl;
+	std::cout << "Hit fraction: " << global->hitFraction << ", peaks per hit: " << global->nPeaks << ", streaks per frame: " << global->nStreaks << std::endl;
+}
@@ -0,0 +1,158 @@
+//
+//  cbf-byte-offset.cpp
+//  cheetah-cbf
+//
+//  Native byte-offset decoder (see cbf-byte-offset.h)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cbf-byte-offset.h"
+
+static const char CBF_BINARY_SECTION[] = "--CIF-BINARY-FORMAT-SECTION--";
+static const char CBF_BINARY_MARKER[] = "\x0c\x1a\x04\xd5";
+
+
+/*
+ *  Value of a MIME header field within [header, end), or NULL if not present
+ */
+static const char *cbfHeaderField(const char *header, const char *end, const char *field) {
+	size_t	n = strlen(field);
+	for(const char *p = header; p + n < end; p++) {
+		if(strncasecmp(p, field, n) == 0) {
+			p += n;
+			while(p < end && (*p == ' ' || *p == '\t'))
+				p++;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static size_t cbfHeaderSize(const char *header, const char *end, const char *field) {
+	const char *p = cbfHeaderField(header, end, field);
+	if(p == NULL)
+		return 0;
+	return (size_t) strtoull(p, NULL, 10);
+}
+
+
+/*
+ *  Locate the binary section and check that it is something we can decode ourselves
+ */
+int cbfFindByteOffsetSection(const char *buf, size_t len, tCbfBinarySection *section) {
+
+	const char *start = (const char*) memmem(buf, len, CBF_BINARY_SECTION, strlen(CBF_BINARY_SECTION));
+	if(start == NULL)
+		return 1;
+	const char *marker = (const char*) memmem(start, len - (start-buf), CBF_BINARY_MARKER, 4);
+	if(marker == NULL)
+		return 1;
+
+	// Only byte-offset compressed, raw binary (not base64...)
+	const char *conversions = cbfHeaderField(start, marker, "conversions=");
+	if(conversions == NULL || strncasecmp(conversions, "\"x-CBF_BYTE_OFFSET\"", 19) != 0)
+		return 1;
+	const char *encoding = cbfHeaderField(start, marker, "Content-Transfer-Encoding:");
+	if(encoding == NULL || strncasecmp(encoding, "BINARY", 6) != 0)
+		return 1;
+
+	section->data = (const unsigned char*) marker + 4;
+	section->size = cbfHeaderSize(start, marker, "X-Binary-Size:");
+	section->nElements = cbfHeaderSize(start, marker, "X-Binary-Number-of-Elements:");
+	section->fs = cbfHeaderSize(start, marker, "X-Binary-Size-Fastest-Dimension:");
+	section->ss = cbfHeaderSize(start, marker, "X-Binary-Size-Second-Dimension:");
+	if(section->size == 0 || section->nElements == 0)
+		return 1;
+	if((const char*) section->data + section->size > buf + len)
+		return 1;
+
+	// A second binary section would be ignored here, let CBFlib deal with such files
+	const char *after = (const char*) section->data + section->size;
+	if(memmem(after, len - (after-buf), CBF_BINARY_MARKER, 4) != NULL)
+		return 1;
+
+	return 0;
+}
+
+
+/*
+ *  Byte-offset decompression
+ *  Each value is stored as the difference to the previous one: one byte, or an escape (0x80) followed by
+ *  a little-endian int16, then int32 and int64 for larger steps.
+ *  Most steps fit in one byte, so 8 source bytes are tested for escapes at once and decoded without branches
+ *  when there is none; blocks containing an escape take the byte-by-byte path.
+ */
+static inline int cbfHasEscapeByte(uint64_t w) {
+	uint64_t x = w ^ 0x8080808080808080ULL;
+	return ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL) != 0;
+}
+
+static inline float cbfValue(int64_t v, int clampNegative) {
+	return (clampNegative && v < 0) ? 0.f : (float) v;
+}
+
+size_t cbfDecodeByteOffset(const unsigned char *src, size_t srclen, float *dest, size_t nElements, int clampNegative) {
+
+	const unsigned char	*p = src;
+	const unsigned char	*end = src + srclen;
+	int64_t	value = 0;
+	size_t	n = 0;
+
+	while(n < nElements && p < end) {
+
+		// Word-at-a-time fast path
+		if(end - p >= 8 && nElements - n >= 8) {
+			uint64_t w;
+			memcpy(&w, p, 8);
+			if(!cbfHasEscapeByte(w)) {
+				for(int k=0; k<8; k++) {
+					value += (int8_t) p[k];
+					dest[n+k] = cbfValue(value, clampNegative);
+				}
+				p += 8;
+				n += 8;
+				continue;
+			}
+		}
+
+		// One value, possibly escaped
+		if(*p != 0x80) {
+			value += (int8_t) *p;
+			p += 1;
+		}
+		else {
+			if(end - p < 3)
+				break;
+			int16_t d16 = (int16_t) (p[1] | (p[2] << 8));
+			if(d16 != INT16_MIN) {
+				value += d16;
+				p += 3;
+			}
+			else {
+				if(end - p < 7)
+					break;
+				int32_t d32 = (int32_t) ((uint32_t) p[3] | ((uint32_t) p[4] << 8) | ((uint32_t) p[5] << 16) | ((uint32_t) p[6] << 24));
+				if(d32 != INT32_MIN) {
+					value += d32;
+					p += 7;
+				}
+				else {
+					if(end - p < 15)
+						break;
+					uint64_t d64 = 0;
+					for(int k=7; k>=0; k--)
+						d64 = (d64 << 8) | p[7+k];
+					value += (int64_t) d64;
+					p += 15;
+				}
+			}
+		}
+		dest[n++] = cbfValue(value, clampNegative);
+	}
+
+	return n;
+}
@@ -0,0 +1,33 @@
+//
+//  cbf-byte-offset.h
+//  cheetah-cbf
+//
+//  Native reader for the binary section of CBF files written with byte-offset compression
+//  (Pilatus, Eiger CBF), so that the image does not have to go through the generic CBFlib path.
+//  Anything else (other compressions, base64 encoding, several binary sections...) is left to CBFlib.
+//
+
+#ifndef CBF_BYTE_OFFSET_H
+#define CBF_BYTE_OFFSET_H
+
+#include <stddef.h>
+
+/*
+ *  What we need to know about the (first) binary section of a CBF file
+ */
+typedef struct {
+	const unsigned char	*data;		// Start of compressed data (after the binary marker)
+	size_t	size;					// X-Binary-Size
+	size_t	nElements;				// X-Binary-Number-of-Elements
+	size_t	fs;						// X-Binary-Size-Fastest-Dimension
+	size_t	ss;						// X-Binary-Size-Second-Dimension
+} tCbfBinarySection;
+
+
+// Return 0 if buf holds a single byte-offset compressed binary section the native decoder can handle
+int cbfFindByteOffsetSection(const char *buf, size_t len, tCbfBinarySection *section);
+
+// Decode up to nElements values into dest (negative values set to 0 if clampNegative); returns the number decoded
+size_t cbfDecodeByteOffset(const unsigned char *src, size_t srclen, float *dest, size_t nElements, int clampNegative);
+
+#endif
@@ -16,8 +16,13 @@
 #include <math.h>
 #include <cbf.h>
 #include <cbf_simple.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
 
 #include "cheetah.h"
+#include "cbf-byte-offset.h"
 
 #define CHECK_RETURN(x,y) { if (x) { ERROR(y); } }
 
@@ -39,23 +44,158 @@ static void chomp(char *s)
 int parseCBFHeader(cbf_handle &, cEventData*);
 int loadImage(cbf_handle &, cEventData*);
 
+
+/*
+ *  CBF files are read, parsed and decompressed by a pool of decoder threads, straight into new events.
+ *  Decoded events are handed to Cheetah by the main thread in list order.
+ *  At most <window> files are in flight (being decoded or waiting for their turn) at any time.
+ */
+typedef struct {
+    std::vector<std::string> files;
+    std::vector<long> frameNumbers;     // Position of each file in the list file
+    cGlobal     *global;
+    long        runNumber;
+    long        window;
+    long        nextClaim;          // Next file for a decoder thread to pick up
+    long        nextSubmit;         // Next file the main thread hands to Cheetah
+    std::map<long, cEventData*> decoded;
+    long        nNative;            // Images decompressed by cbfDecodeByteOffset
+    long        nCBFlib;            // Images decompressed by CBFlib
+    pthread_mutex_t mutex;
+    pthread_cond_t  claimable;
+    pthread_cond_t  ready;
+    pthread_mutex_t cbflibMutex;    // CBFlib is not known to be thread safe
+} tCbfDecodeQueue;
+
+
+/*
+ *  Read, parse and decompress one file into a new event
+ *  fileBuffer is the calling thread's own, reused from file to file
+ */
+static cEventData *decodeCbfFile(tCbfDecodeQueue *q, long fileIndex, std::vector<char> &fileBuffer) {
+    const char *curFile = q->files[fileIndex].c_str();
+    cGlobal *global = q->global;
+
+    // Whole file into memory
+    FILE* cbfFH = fopen(curFile, "rb");
+    if (cbfFH == NULL)
+        ERROR("Couldn't open %s\n", curFile);
+    fseek(cbfFH, 0, SEEK_END);
+    long fileSize = ftell(cbfFH);
+    fseek(cbfFH, 0, SEEK_SET);
+    if (fileSize <= 0)
+        ERROR("Empty file %s\n", curFile);
+    if ((long) fileBuffer.size() < fileSize)
+        fileBuffer.resize(fileSize);
+    if (fread(&fileBuffer[0], 1, fileSize, cbfFH) != (size_t) fileSize)
+        ERROR("Couldn't read %s\n", curFile);
+    fclose(cbfFH);
+
+    // Build Event Data
+    cEventData * eventData = cheetahNewEvent(global);
+
+    eventData->frameNumber = q->frameNumbers[fileIndex];
+    const char *basename = strrchr(curFile,'/');
+    strncpy(eventData->eventname, basename ? basename+1 : curFile, sizeof(eventData->eventname)-1);
+    eventData->runNumber = q->runNumber;
+    eventData->nPeaks = 0;
+    eventData->pumpLaserCode = 0;
+    eventData->pumpLaserDelay = 0;
+    eventData->photonEnergyeV = global->defaultPhotonEnergyeV;
+    eventData->wavelengthA = 0; // find in parseSLSHeader
+    eventData->pGlobal = global;
+
+    // Byte-offset images are decompressed here, without going through CBFlib
+    int detId = 0;
+    tCbfBinarySection section;
+    bool native = (cbfFindByteOffsetSection(&fileBuffer[0], fileSize, &section) == 0);
+    if (native) {
+        if (section.fs != (size_t) global->detector[detId].pix_nx || section.ss != (size_t) global->detector[detId].pix_ny)
+            ERROR("Error: File image dimensions of %zu x %zu did not match detector dimensions of %li x %li\n",
+                   section.fs, section.ss, global->detector[detId].pix_nx, global->detector[detId].pix_ny);
+        // Negative values (gaps, bad pixels) are set to 0, as before
+        size_t elements_read = cbfDecodeByteOffset(section.data, section.size, eventData->detector[detId].data_raw,
+                                                   global->detector[detId].pix_nn, 1);
+        if (elements_read != (size_t) global->detector[detId].pix_nn)
+            ERROR("Error: Only %zu of %li pixels could be decompressed from %s\n", elements_read, global->detector[detId].pix_nn, curFile);
+        eventData->detector[detId].data_raw_is_float = true;
+    }
+
+    // Header (and the image, for anything the native decoder does not handle) through CBFlib
+    pthread_mutex_lock(&q->cbflibMutex);
+    cbf_handle cbfh;
+    CHECK_RETURN(cbf_make_handle(&cbfh), "creating cbf handle");
+    FILE* memFH = fmemopen(&fileBuffer[0], fileSize, "rb");
+    if (memFH == NULL)
+        ERROR("Couldn't open %s from memory\n", curFile);
+    CHECK_RETURN(cbf_read_widefile(cbfh, memFH, MSG_NODIGEST), "reading cbf file");
+
+    // Header will fill in photonEnergyeV and wavelengthA
+    parseCBFHeader(cbfh, eventData);
+    if (!native)
+        loadImage(cbfh, eventData);
+
+    // done with that cbf file, cleanup (also closes memFH)
+    CHECK_RETURN(cbf_free_handle(cbfh), "Cleaning up cbf file\n");
+    if (native) q->nNative++;
+    else q->nCBFlib++;
+    pthread_mutex_unlock(&q->cbflibMutex);
+
+    return eventData;
+}
+
+
+/*
+ *  Decoder thread: claims the next file within the window, decodes it and leaves it for the main thread
+ */
+static void *cbfDecoderThread(void *threadarg) {
+    tCbfDecodeQueue *q = (tCbfDecodeQueue*) threadarg;
+    std::vector<char> fileBuffer;
+    long nFiles = q->files.size();
+
+    while (true) {
+        pthread_mutex_lock(&q->mutex);
+        while (q->nextClaim < nFiles && q->nextClaim - q->nextSubmit >= q->window)
+            pthread_cond_wait(&q->claimable, &q->mutex);
+        if (q->nextClaim >= nFiles) {
+            pthread_mutex_unlock(&q->mutex);
+            break;
+        }
+        long fileIndex = q->nextClaim++;
+        pthread_mutex_unlock(&q->mutex);
+
+        cEventData *eventData = decodeCbfFile(q, fileIndex, fileBuffer);
+
+        pthread_mutex_lock(&q->mutex);
+        q->decoded[fileIndex] = eventData;
+        pthread_cond_broadcast(&q->ready);
+        pthread_mutex_unlock(&q->mutex);
+    }
+    pthread_exit(NULL);
+}
+
+
 int main(int argc, const char * argv[])
 {
     // Parse Arguments
     printf("CBF file parser\n");
     printf("Natasha Stander, December 2015\n");
 
-    if (argc != 4) {
-        printf("Usage: cheetah-cbf listfile inifile runnumber\n");
+    if (argc != 4 && argc != 5) {
+        printf("Usage: cheetah-cbf listfile inifile runnumber [ndecoders]\n");
         return 0;
     }
 
     char filename[1024];
     strcpy(filename, argv[1]);
+    int nDecoders = 4;
+    if (argc == 5)
+        nDecoders = atoi(argv[4]);
+    if (nDecoders < 1)
+        nDecoders = 1;
 
     // Initialize Cheetah
 	printf("Setting up Cheetah...\n");
-    static long frameNumber = 0;
     long runNumber = atoi(argv[3]); /* ?? */
 	static cGlobal cheetahGlobal;
 	static time_t startT = 0;
@@ -64,65 +204,81 @@ int main(int argc, const char * argv[])
     strcpy(cheetahGlobal.experimentID, "APS2016");
 	cheetahInit(&cheetahGlobal);
     cheetahGlobal.runNumber = runNumber;
-    strcpy(cheetahGlobal.facility,"APS")
+    strcpy(cheetahGlobal.facility,"APS");
     
 
-    // Open List file
+    // Read list file
     FILE *fh = fopen(argv[1], "r");
     if (fh == NULL) {
         fprintf(stderr, "Couldn't open '%s'\n", argv[1]);
 		return 1;
 	}
-
-    // Loop through each CBF file given
+    // Replaying a hit list: files that are not listed (by event name, ie: the file name) are not read
+    tCbfDecodeQueue q;
     char curline[MAX_FILENAME_LENGTH];
     char * curFile;
+    long nListed = 0;
     while ( (curFile = fgets(curline, MAX_FILENAME_LENGTH, fh)) ) {
         chomp(curFile);
-        printf("Processing %s\n", curFile);
-        frameNumber ++;
-
-        // Create CBF Object for file
-        cbf_handle cbfh;
-        CHECK_RETURN(cbf_make_handle(&cbfh), "creating cbf handle");
-
-        // Open File
-        FILE* cbfFH = fopen(curFile, "rb");
-        if (cbfFH == NULL)
-            ERROR("Couldn't open %s\n", curFile);
-
-        // Read into cbf object
-        CHECK_RETURN(cbf_read_widefile(cbfh, cbfFH, MSG_NODIGEST), "reading cbf file");
-
-        // Build Event Data
-        cEventData * eventData = cheetahNewEvent(&cheetahGlobal);
-
-        eventData->frameNumber = frameNumber;
-        strcpy(eventData->eventname,strrchr(curFile,'/')+1);
-        eventData->runNumber = runNumber;
-        eventData->nPeaks = 0;
-        eventData->pumpLaserCode = 0;
-        eventData->pumpLaserDelay = 0;
-        eventData->photonEnergyeV = cheetahGlobal.defaultPhotonEnergyeV;
-        eventData->wavelengthA = 0; // find in parseSLSHeader
-        eventData->pGlobal = &cheetahGlobal;
-
-        // Header will fill in photonEnergyeV and wavelengthA
-        parseCBFHeader(cbfh, eventData);
-
-        // Now, load image
-        loadImage(cbfh, eventData);
+        if (curFile[0] == 0)
+            continue;
+        nListed++;
+        const char *basename = strrchr(curFile,'/');
+        if (cheetahGlobal.useHitlist && !cheetahGlobal.hitlistContains(basename ? basename+1 : curFile))
+            continue;
+        q.files.push_back(curFile);
+        q.frameNumbers.push_back(nListed);
+    }
+    fclose(fh);
+    long nFiles = q.files.size();
+    if (nFiles != nListed)
+        printf("%li of %li CBF files in the hit list\n", nFiles, nListed);
+    printf("%li CBF files, %i decoder threads\n", nFiles, nDecoders);
+
+    // Start decoder threads
+    q.global = &cheetahGlobal;
+    q.runNumber = runNumber;
+    q.window = 2*nDecoders;
+    q.nextClaim = 0;
+    q.nextSubmit = 0;
+    q.nNative = 0;
+    q.nCBFlib = 0;
+    pthread_mutex_init(&q.mutex, NULL);
+    pthread_cond_init(&q.claimable, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    pthread_mutex_init(&q.cbflibMutex, NULL);
+    std::vector<pthread_t> decoders(nDecoders);
+    for (int i = 0; i < nDecoders; i++) {
+        if (pthread_create(&decoders[i], NULL, cbfDecoderThread, (void*) &q) != 0)
+            ERROR("Couldn't start CBF decoder thread\n");
+    }
+
+    // Hand decoded events to Cheetah in list order
+    for (long fileIndex = 0; fileIndex < nFiles; fileIndex++) {
+        pthread_mutex_lock(&q.mutex);
+        std::map<long, cEventData*>::iterator it;
+        while ((it = q.decoded.find(fileIndex)) == q.decoded.end())
+            pthread_cond_wait(&q.ready, &q.mutex);
+        cEventData *eventData = it->second;
+        q.decoded.erase(it);
+        q.nextSubmit = fileIndex + 1;
+        pthread_cond_broadcast(&q.claimable);
+        pthread_mutex_unlock(&q.mutex);
 
-        // done with that cbf file, cleanup
-        CHECK_RETURN(cbf_free_handle(cbfh), "Cleaning up cbf file\n");
+        printf("Processing %s\n", q.files[fileIndex].c_str());
 
         // Process event
         cheetahProcessEventMultithreaded(&cheetahGlobal, eventData);
-
     }
 
     // Cleanup
-    fclose(fh);
+    for (int i = 0; i < nDecoders; i++)
+        pthread_join(decoders[i], NULL);
+    pthread_mutex_destroy(&q.mutex);
+    pthread_cond_destroy(&q.claimable);
+    pthread_cond_destroy(&q.ready);
+    pthread_mutex_destroy(&q.cbflibMutex);
+    printf("Images decompressed natively: %li, by CBFlib: %li\n", q.nNative, q.nCBFlib);
     cheetahExit(&cheetahGlobal);
     
     printf("Clean Exit\n");
@@ -238,8 +394,8 @@ int loadImage(cbf_handle & cbfh, cEventData* eventData) {
                fs, ss, eventData->pGlobal->detector[detId].pix_nx, eventData->pGlobal->detector[detId].pix_ny);
 
     // At least with the files I'm testing with, the binary data is signed 32 bit integers,
-    // which matches neither data_raw16 (uint16_t type nor data_raw (float)). So, like SACLA,
-    // read into temporary array and then convert.
+    // which matches neither data_raw16 (uint16_t type nor data_raw (float)). So read into
+    // temporary array and then convert to float (no 16 bit truncation).
     size_t elements_read = 0;
     int* arr = (int*) calloc(eventData->pGlobal->detector[detId].pix_nn, sizeof(int));
     CHECK_RETURN(cbf_get_integerarray(cbfh, &binId, arr, sizeof(int), 1, elements, &elements_read), "Reading image");
@@ -254,12 +410,13 @@ int loadImage(cbf_handle & cbfh, cEventData* eventData) {
 	// copy, setting negative values to 0
 	// (memory already allocated)
     for (size_t i = 0; i < elements_read; i++) {
-        eventData->detector[detId].data_raw16[i] = arr[i] < 0? 0 : (uint16_t) arr[i];
+        eventData->detector[detId].data_raw[i] = arr[i] < 0? 0 : (float) arr[i];
     }
+    eventData->detector[detId].data_raw_is_float = true;
 
 //    printf("Debugging: First 10 elements are: ");
 //    for (int i = 0; i < 10; i++) {
-//        printf ("%u, ", eventData->detector[detId].data_raw16[i]);
+//        printf ("%f, ", eventData->detector[detId].data_raw[i]);
 //    }
 
     free(arr);
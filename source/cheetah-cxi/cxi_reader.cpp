@@ -0,0 +1,467 @@
+//
+//  cxi_reader.cpp
+//  cheetah-cxi
+//
+//  Reads frames and per-frame metadata back out of CXI files written by Cheetah (writeCXI)
+//  Distributed under the GPLv3 license
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <hdf5.h>
+
+#include "cxi_reader.h"
+
+
+/*
+ *	Open a dataset only if it exists, without HDF5 printing an error stack when it does not
+ */
+static hid_t openDatasetIfExists(hid_t file_id, const char *path) {
+	hid_t	dataset_id;
+	H5E_BEGIN_TRY {
+		dataset_id = H5Dopen(file_id, path, H5P_DEFAULT);
+	} H5E_END_TRY;
+	return dataset_id;
+}
+
+static int datasetDims(hid_t dataset_id, hsize_t *dims) {
+	hid_t	dataspace_id = H5Dget_space(dataset_id);
+	int		ndims = H5Sget_simple_extent_ndims(dataspace_id);
+	H5Sget_simple_extent_dims(dataspace_id, dims, NULL);
+	H5Sclose(dataspace_id);
+	return ndims;
+}
+
+static std::string parentPath(std::string path) {
+	size_t pos = path.rfind("/");
+	if(pos == std::string::npos || pos == 0)
+		return "/";
+	return path.substr(0, pos);
+}
+
+
+void freeCxiBatch(tCxiBatch *batch) {
+	if(batch == NULL)
+		return;
+	free(batch->data);
+	free(batch->mask);
+	free(batch->photonEnergyeV);
+	free(batch->detectorDistanceMm);
+	free(batch->trainID);
+	free(batch->pulseID);
+	free(batch->cellID);
+	free(batch->eventName);
+	free(batch);
+}
+
+
+
+cCxiReader::cCxiReader() {
+	nframes = 0;
+	pix_nx = 0;
+	pix_ny = 0;
+	pix_nn = 0;
+	chunkFrames = 1;
+	sparse = false;
+	hasMask = false;
+	hasTrainID = false;
+	verbose = 0;
+
+	file_id = -1;
+	data_id = -1;
+	mask_id = -1;
+	sparse_n_id = -1;
+	sparse_index_id = -1;
+	sparse_value_id = -1;
+
+	photonEnergyeV = NULL;
+	detectorDistanceMm = NULL;
+	trainID = NULL;
+	pulseID = NULL;
+	cellID = NULL;
+	eventName = NULL;
+}
+
+cCxiReader::~cCxiReader() {
+	close();
+}
+
+
+/*
+ *	Open a CXI file and find the frame stack
+ *	dataPath is the non-assembled data stack, eg: /entry_1/data_1/data
+ *	If it does not exist but sparse_index/sparse_value stacks are found next to it (saveSparseOnly=1), frames are re-densified
+ *	maskPath is the per-frame mask stack, or "none" to ignore masks in the file
+ */
+int cCxiReader::open(const char *filename, const char *dataPath, const char *maskPath) {
+	hsize_t	dims[4];
+	int		ndims;
+
+	this->filename = filename;
+	std::string groupPath = parentPath(dataPath);
+
+	file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+	if(file_id < 0) {
+		printf("Error: Could not open HDF5 file %s\n", filename);
+		return -1;
+	}
+
+	data_id = openDatasetIfExists(file_id, dataPath);
+	if(data_id >= 0) {
+		ndims = datasetDims(data_id, dims);
+		if(ndims != 3) {
+			printf("Error: %s:%s has %i dimensions (expected 3: frames x pix_ny x pix_nx)\n", filename, dataPath, ndims);
+			printf("Assembled and modular (saveModular=1) stacks can not be replayed, use the non-assembled data\n");
+			close();
+			return -1;
+		}
+		nframes = dims[0];
+		pix_ny = dims[1];
+		pix_nx = dims[2];
+
+		// Frames per chunk (Cheetah writes one frame per chunk, other writers may not)
+		hid_t dcpl_id = H5Dget_create_plist(data_id);
+		if(H5Pget_layout(dcpl_id) == H5D_CHUNKED) {
+			hsize_t	chunk[4];
+			H5Pget_chunk(dcpl_id, 3, chunk);
+			chunkFrames = chunk[0];
+		}
+		H5Pclose(dcpl_id);
+	}
+	else {
+		std::string	sparsePath = groupPath + "/sparse_index";
+		sparse_index_id = openDatasetIfExists(file_id, sparsePath.c_str());
+		if(sparse_index_id < 0) {
+			printf("Error: %s contains neither %s nor %s\n", filename, dataPath, sparsePath.c_str());
+			close();
+			return -1;
+		}
+		sparse = true;
+		sparse_value_id = openDatasetIfExists(file_id, (groupPath + "/sparse_value").c_str());
+		sparse_n_id = openDatasetIfExists(file_id, (groupPath + "/sparse_npixels").c_str());
+		hid_t shape_id = openDatasetIfExists(file_id, (groupPath + "/mask_shared").c_str());
+		if(sparse_value_id < 0 || sparse_n_id < 0 || shape_id < 0) {
+			printf("Error: Incomplete sparse frame data in %s:%s\n", filename, groupPath.c_str());
+			if(shape_id >= 0) H5Dclose(shape_id);
+			close();
+			return -1;
+		}
+		datasetDims(sparse_n_id, dims);
+		nframes = dims[0];
+		datasetDims(shape_id, dims);
+		pix_ny = dims[0];
+		pix_nx = dims[1];
+		H5Dclose(shape_id);
+		chunkFrames = 1;
+	}
+	pix_nn = pix_nx*pix_ny;
+	if(chunkFrames < 1)
+		chunkFrames = 1;
+
+
+	// Per-frame mask
+	hasMask = false;
+	if(strcasecmp(maskPath, "none") != 0) {
+		std::string	path = maskPath;
+		if(path == "")
+			path = groupPath + "/mask";
+		mask_id = openDatasetIfExists(file_id, path.c_str());
+		if(mask_id >= 0) {
+			ndims = datasetDims(mask_id, dims);
+			if(ndims == 3 && (long) dims[1] == pix_ny && (long) dims[2] == pix_nx && (long) dims[0] >= nframes) {
+				hasMask = true;
+			}
+			else {
+				printf("Warning: %s:%s does not match the data stack, ignoring it\n", filename, path.c_str());
+				H5Dclose(mask_id);
+				mask_id = -1;
+			}
+		}
+	}
+
+	readMetadata(groupPath.c_str());
+
+	if(verbose) {
+		printf("%s: %li frames of %li x %li pixels (%s, %li frames per chunk, mask %s)\n", filename, nframes, pix_nx, pix_ny,
+			   sparse ? "sparse" : "dense", chunkFrames, hasMask ? "yes" : "no");
+	}
+	return 0;
+}
+
+
+void cCxiReader::close(void) {
+	if(data_id >= 0) H5Dclose(data_id);
+	if(mask_id >= 0) H5Dclose(mask_id);
+	if(sparse_n_id >= 0) H5Dclose(sparse_n_id);
+	if(sparse_index_id >= 0) H5Dclose(sparse_index_id);
+	if(sparse_value_id >= 0) H5Dclose(sparse_value_id);
+	if(file_id >= 0) H5Fclose(file_id);
+	data_id = mask_id = sparse_n_id = sparse_index_id = sparse_value_id = file_id = -1;
+
+	free(photonEnergyeV);
+	free(detectorDistanceMm);
+	free(trainID);
+	free(pulseID);
+	free(cellID);
+	free(eventName);
+	photonEnergyeV = detectorDistanceMm = NULL;
+	trainID = pulseID = cellID = NULL;
+	eventName = NULL;
+}
+
+
+/*
+ *	Round a requested batch size up to a whole number of chunks
+ */
+long cCxiReader::alignedBatchSize(long requested) {
+	if(requested < 1)
+		requested = 1;
+	return ((requested + chunkFrames - 1) / chunkFrames) * chunkFrames;
+}
+
+
+/*
+ *	Per-frame metadata written by writeCXI()
+ *	Missing fields are left as NaN (or 0 for IDs) and the frontend falls back to cheetah.ini defaults
+ */
+void cCxiReader::readMetadata(const char *groupPath) {
+	photonEnergyeV = (double*) malloc(nframes*sizeof(double));
+	detectorDistanceMm = (double*) malloc(nframes*sizeof(double));
+	trainID = (uint64_t*) calloc(nframes, sizeof(uint64_t));
+	pulseID = (uint64_t*) calloc(nframes, sizeof(uint64_t));
+	cellID = (uint64_t*) calloc(nframes, sizeof(uint64_t));
+	eventName = (char*) calloc(nframes, CXI_READER_STRING_SIZE);
+
+	// Photon energy: facility group, otherwise the CXI source energy (in J)
+	if(!readDoubleStack("/instrument/photon_energy_eV", photonEnergyeV)) {
+		if(readDoubleStack("/entry_1/instrument_1/source_1/energy", photonEnergyeV)) {
+			for(long i=0; i<nframes; i++)
+				photonEnergyeV[i] /= 1.60217646e-19;
+		}
+		else {
+			for(long i=0; i<nframes; i++)
+				photonEnergyeV[i] = NAN;
+		}
+	}
+
+	// Detector distance (in m) sits in the detector group, which may be one level up from a data version group
+	std::string	group = groupPath;
+	if(!readDoubleStack((group + "/distance").c_str(), detectorDistanceMm) &&
+	   !readDoubleStack((parentPath(group) + "/distance").c_str(), detectorDistanceMm)) {
+		for(long i=0; i<nframes; i++)
+			detectorDistanceMm[i] = NAN;
+	}
+	else {
+		for(long i=0; i<nframes; i++)
+			detectorDistanceMm[i] *= 1000;
+	}
+
+	// EuXFEL train, pulse and memory cell IDs
+	hasTrainID = readUint64Stack("/instrument/trainID", trainID);
+	readUint64Stack("/instrument/pulseID", pulseID);
+	readUint64Stack("/instrument/cellID", cellID);
+
+	// Original event names
+	readStringStack("/entry_1/experiment_identifier", eventName);
+}
+
+
+bool cCxiReader::readDoubleStack(const char *path, double *dest) {
+	hid_t	dataset_id = openDatasetIfExists(file_id, path);
+	if(dataset_id < 0)
+		return false;
+
+	hsize_t	dims[4];
+	int		ndims = datasetDims(dataset_id, dims);
+	if(ndims != 1 || (long) dims[0] < nframes) {
+		H5Dclose(dataset_id);
+		return false;
+	}
+	hsize_t	offset[1] = {0};
+	hsize_t	count[1] = {(hsize_t) nframes};
+	hid_t	filespace = H5Dget_space(dataset_id);
+	H5Sselect_hyperslab(filespace, H5S_SELECT_SET, offset, NULL, count, NULL);
+	hid_t	memspace = H5Screate_simple(1, count, NULL);
+	herr_t	status = H5Dread(dataset_id, H5T_NATIVE_DOUBLE, memspace, filespace, H5P_DEFAULT, dest);
+	H5Sclose(memspace);
+	H5Sclose(filespace);
+	H5Dclose(dataset_id);
+	return status >= 0;
+}
+
+
+bool cCxiReader::readUint64Stack(const char *path, uint64_t *dest) {
+	hid_t	dataset_id = openDatasetIfExists(file_id, path);
+	if(dataset_id < 0)
+		return false;
+
+	hsize_t	dims[4];
+	int		ndims = datasetDims(dataset_id, dims);
+	if(ndims != 1 || (long) dims[0] < nframes) {
+		H5Dclose(dataset_id);
+		return false;
+	}
+	hsize_t	offset[1] = {0};
+	hsize_t	count[1] = {(hsize_t) nframes};
+	hid_t	filespace = H5Dget_space(dataset_id);
+	H5Sselect_hyperslab(filespace, H5S_SELECT_SET, offset, NULL, count, NULL);
+	hid_t	memspace = H5Screate_simple(1, count, NULL);
+	herr_t	status = H5Dread(dataset_id, H5T_NATIVE_UINT64, memspace, filespace, H5P_DEFAULT, dest);
+	H5Sclose(memspace);
+	H5Sclose(filespace);
+	H5Dclose(dataset_id);
+	return status >= 0;
+}
+
+
+bool cCxiReader::readStringStack(const char *path, char *dest) {
+	hid_t	dataset_id = openDatasetIfExists(file_id, path);
+	if(dataset_id < 0)
+		return false;
+
+	hsize_t	dims[4];
+	int		ndims = datasetDims(dataset_id, dims);
+	if(ndims != 1 || (long) dims[0] < nframes) {
+		H5Dclose(dataset_id);
+		return false;
+	}
+	hid_t	memtype = H5Tcopy(H5T_C_S1);
+	H5Tset_size(memtype, CXI_READER_STRING_SIZE);
+	hsize_t	offset[1] = {0};
+	hsize_t	count[1] = {(hsize_t) nframes};
+	hid_t	filespace = H5Dget_space(dataset_id);
+	H5Sselect_hyperslab(filespace, H5S_SELECT_SET, offset, NULL, count, NULL);
+	hid_t	memspace = H5Screate_simple(1, count, NULL);
+	herr_t	status = H5Dread(dataset_id, memtype, memspace, filespace, H5P_DEFAULT, dest);
+	H5Sclose(memspace);
+	H5Sclose(filespace);
+	H5Tclose(memtype);
+	H5Dclose(dataset_id);
+	return status >= 0;
+}
+
+
+/*
+ *	Read n frames starting at firstFrame with one hyperslab read per stack
+ *	(callers should use alignedBatchSize() so that no chunk is decompressed twice)
+ */
+tCxiBatch *cCxiReader::readBatch(long firstFrame, long n) {
+	if(firstFrame >= nframes)
+		return NULL;
+	if(firstFrame + n > nframes)
+		n = nframes - firstFrame;
+
+	tCxiBatch	*batch = (tCxiBatch*) calloc(1, sizeof(tCxiBatch));
+	batch->firstFrame = firstFrame;
+	batch->nframes = n;
+	batch->pix_nn = pix_nn;
+	batch->data = (float*) malloc(n*pix_nn*sizeof(float));
+	if(hasMask)
+		batch->mask = (uint16_t*) malloc(n*pix_nn*sizeof(uint16_t));
+
+	if(sparse)
+		readSparseFrames(firstFrame, n, batch->data);
+	else
+		readDenseFrames(firstFrame, n, batch->data, batch->mask);
+
+	batch->photonEnergyeV = (double*) malloc(n*sizeof(double));
+	batch->detectorDistanceMm = (double*) malloc(n*sizeof(double));
+	batch->trainID = (uint64_t*) malloc(n*sizeof(uint64_t));
+	batch->pulseID = (uint64_t*) malloc(n*sizeof(uint64_t));
+	batch->cellID = (uint64_t*) malloc(n*sizeof(uint64_t));
+	batch->eventName = (char*) malloc(n*CXI_READER_STRING_SIZE);
+	memcpy(batch->photonEnergyeV, photonEnergyeV+firstFrame, n*sizeof(double));
+	memcpy(batch->detectorDistanceMm, detectorDistanceMm+firstFrame, n*sizeof(double));
+	memcpy(batch->trainID, trainID+firstFrame, n*sizeof(uint64_t));
+	memcpy(batch->pulseID, pulseID+firstFrame, n*sizeof(uint64_t));
+	memcpy(batch->cellID, cellID+firstFrame, n*sizeof(uint64_t));
+	memcpy(batch->eventName, eventName+firstFrame*CXI_READER_STRING_SIZE, n*CXI_READER_STRING_SIZE);
+
+	return batch;
+}
+
+
+void cCxiReader::readDenseFrames(long firstFrame, long n, float *data, uint16_t *mask) {
+	hsize_t	offset[3] = {(hsize_t) firstFrame, 0, 0};
+	hsize_t	count[3] = {(hsize_t) n, (hsize_t) pix_ny, (hsize_t) pix_nx};
+	hid_t	memspace = H5Screate_simple(3, count, NULL);
+
+	// Data stack (converted to float by HDF5 if saved as INT16 or INT32)
+	hid_t	filespace = H5Dget_space(data_id);
+	H5Sselect_hyperslab(filespace, H5S_SELECT_SET, offset, NULL, count, NULL);
+	if(H5Dread(data_id, H5T_NATIVE_FLOAT, memspace, filespace, H5P_DEFAULT, data) < 0) {
+		printf("Error: Failed to read frames %li-%li from %s\n", firstFrame, firstFrame+n-1, filename.c_str());
+		memset(data, 0, n*pix_nn*sizeof(float));
+	}
+	H5Sclose(filespace);
+
+	// Mask stack
+	if(mask != NULL) {
+		filespace = H5Dget_space(mask_id);
+		H5Sselect_hyperslab(filespace, H5S_SELECT_SET, offset, NULL, count, NULL);
+		if(H5Dread(mask_id, H5T_NATIVE_UINT16, memspace, filespace, H5P_DEFAULT, mask) < 0) {
+			memset(mask, 0, n*pix_nn*sizeof(uint16_t));
+		}
+		H5Sclose(filespace);
+	}
+	H5Sclose(memspace);
+}
+
+
+/*
+ *	Re-densify frames saved as sparse_index/sparse_value stacks (see sparsifyFrame in saveCXI.cpp)
+ *	Rows are padded to the widest frame in the file, so only the first sparse_npixels entries of each row are read
+ */
+void cCxiReader::readSparseFrames(long firstFrame, long n, float *data) {
+	memset(data, 0, n*pix_nn*sizeof(float));
+
+	int		*npixels = (int*) malloc(n*sizeof(int));
+	hsize_t	offset1[1] = {(hsize_t) firstFrame};
+	hsize_t	count1[1] = {(hsize_t) n};
+	hid_t	memspace = H5Screate_simple(1, count1, NULL);
+	hid_t	filespace = H5Dget_space(sparse_n_id);
+	H5Sselect_hyperslab(filespace, H5S_SELECT_SET, offset1, NULL, count1, NULL);
+	herr_t	status = H5Dread(sparse_n_id, H5T_NATIVE_INT, memspace, filespace, H5P_DEFAULT, npixels);
+	H5Sclose(filespace);
+	H5Sclose(memspace);
+	if(status < 0) {
+		printf("Error: Failed to read sparse_npixels for frames %li-%li from %s\n", firstFrame, firstFrame+n-1, filename.c_str());
+		free(npixels);
+		return;
+	}
+
+	int		maxpix = 0;
+	for(long f=0; f<n; f++)
+		if(npixels[f] > maxpix) maxpix = npixels[f];
+	int32_t	*index = (int32_t*) malloc((maxpix+1)*sizeof(int32_t));
+	float	*value = (float*) malloc((maxpix+1)*sizeof(float));
+
+	hid_t	index_space = H5Dget_space(sparse_index_id);
+	hid_t	value_space = H5Dget_space(sparse_value_id);
+	for(long f=0; f<n; f++) {
+		if(npixels[f] <= 0)
+			continue;
+		hsize_t	offset[2] = {(hsize_t) (firstFrame+f), 0};
+		hsize_t	count[2] = {1, (hsize_t) npixels[f]};
+		memspace = H5Screate_simple(2, count, NULL);
+		H5Sselect_hyperslab(index_space, H5S_SELECT_SET, offset, NULL, count, NULL);
+		H5Sselect_hyperslab(value_space, H5S_SELECT_SET, offset, NULL, count, NULL);
+		if(H5Dread(sparse_index_id, H5T_NATIVE_INT32, memspace, index_space, H5P_DEFAULT, index) >= 0 &&
+		   H5Dread(sparse_value_id, H5T_NATIVE_FLOAT, memspace, value_space, H5P_DEFAULT, value) >= 0) {
+			float	*frame = data + f*pix_nn;
+			for(int i=0; i<npixels[f]; i++) {
+				if(index[i] >= 0 && index[i] < pix_nn)
+					frame[index[i]] = value[i];
+			}
+		}
+		H5Sclose(memspace);
+	}
+	H5Sclose(index_space);
+	H5Sclose(value_space);
+
+	free(index);
+	free(value);
+	free(npixels);
+}
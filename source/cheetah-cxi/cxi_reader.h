@@ -0,0 +1,96 @@
+//
+//  cxi_reader.h
+//  cheetah-cxi
+//
+//  Reads frames and per-frame metadata back out of CXI files written by Cheetah (writeCXI)
+//  Distributed under the GPLv3 license
+//
+
+#ifndef cxi_reader_h
+#define cxi_reader_h
+
+#include <string>
+#include <stdint.h>
+#include <hdf5.h>
+
+
+/*
+ *	One batch of consecutive frames read from a CXI file
+ *	Buffers are allocated by cCxiReader::readBatch() and released with freeCxiBatch()
+ */
+typedef struct {
+	long		fileIndex;		// Index into the list of input files
+	long		firstFrame;		// Frame number of the first frame in this batch (within the file)
+	long		nframes;		// Number of frames in this batch
+	long		pix_nn;			// Pixels per frame
+
+	float		*data;			// nframes * pix_nn
+	uint16_t	*mask;			// nframes * pix_nn, NULL if the file has no per-frame mask
+	double		*photonEnergyeV;
+	double		*detectorDistanceMm;
+	uint64_t	*trainID;
+	uint64_t	*pulseID;
+	uint64_t	*cellID;
+	char		*eventName;		// nframes * CXI_READER_STRING_SIZE
+} tCxiBatch;
+
+#define CXI_READER_STRING_SIZE 256
+
+void freeCxiBatch(tCxiBatch*);
+
+
+/*
+ *	This class handles reading of one CXI file
+ *	Frames are read in batches aligned to the chunk layout of the data stack, so that each HDF5 chunk
+ *	is read and decompressed exactly once
+ */
+class cCxiReader {
+
+public:
+	cCxiReader();
+	~cCxiReader();
+
+	int open(const char *filename, const char *dataPath, const char *maskPath);
+	void close(void);
+	tCxiBatch *readBatch(long firstFrame, long nframes);
+	long alignedBatchSize(long requested);
+
+public:
+	std::string	filename;
+	long		nframes;
+	long		pix_nx;
+	long		pix_ny;
+	long		pix_nn;
+	long		chunkFrames;		// Frames per HDF5 chunk of the data stack
+	bool		sparse;				// Data saved with saveSparseOnly (sparse_index/sparse_value stacks)
+	bool		hasMask;
+	bool		hasTrainID;
+	int			verbose;
+
+private:
+	hid_t		file_id;
+	hid_t		data_id;
+	hid_t		mask_id;
+	hid_t		sparse_n_id;
+	hid_t		sparse_index_id;
+	hid_t		sparse_value_id;
+
+	// Per-frame metadata is small and read once when the file is opened
+	double		*photonEnergyeV;
+	double		*detectorDistanceMm;
+	uint64_t	*trainID;
+	uint64_t	*pulseID;
+	uint64_t	*cellID;
+	char		*eventName;
+
+private:
+	void		readMetadata(const char *groupPath);
+	bool		readDoubleStack(const char *path, double *dest);
+	bool		readUint64Stack(const char *path, uint64_t *dest);
+	bool		readStringStack(const char *path, char *dest);
+	void		readDenseFrames(long firstFrame, long n, float *data, uint16_t *mask);
+	void		readSparseFrames(long firstFrame, long n, float *data);
+};
+
+
+#endif /* cxi_reader_h */
@@ -0,0 +1,441 @@
+//
+//  cheetah-cxi
+//
+//  Replays frames saved in Cheetah CXI files through libcheetah
+//  Intended for fast re-processing of saved hits (eg: re-tuning hitfinder parameters) without going back to
+//  the raw facility data or the facility software stack.
+//
+//  Frames are read from several files in parallel by reader threads, in batches aligned to the HDF5 chunks of the
+//  data stack, and handed to the main thread through a bounded queue.
+//  Distributed under the GPLv3 license
+//
+//  Usage:
+//  > cheetah-cxi -i reprocess.ini --readers=4 r0123-class1.cxi r0124-class1.cxi
+//
+//  Note that the saved frames have usually been through detector corrections already (data_detCorr),
+//  so the cheetah.ini used for replay should normally not apply darkcal, gaincal or common mode again.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "cheetah.h"
+#include "cxi_reader.h"
+
+
+// This is for parsing getopt_long()
+struct tCheetahCxiParams {
+	std::vector<std::string> inputFiles;
+	std::string iniFile;
+	std::string calibFile;
+	std::string exptName;
+	std::string facility;
+	std::string dataPath;
+	std::string maskPath;
+	uint16_t	maskBits;
+	int			nReaders;
+	long		batchSize;
+	long		maxQueuedBatches;
+	long		runNumber;
+	int			verbose;
+} CheetahCxiParams;
+void parse_config(int, char *[], tCheetahCxiParams*);
+
+
+/*
+ *	Batches travel from the reader threads to the main thread through this queue
+ */
+typedef struct {
+	tCheetahCxiParams	*params;
+	long				pix_nn;
+	long				nextFile;
+	int					nActiveReaders;
+	std::deque<tCxiBatch*>	queue;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		notEmpty;
+	pthread_cond_t		notFull;
+} tCxiReplayQueue;
+
+
+/*
+ *	Reader thread: claims the next unread file and pushes its frames onto the queue, one chunk-aligned batch at a time
+ */
+void *cxiReaderThread(void *threadarg) {
+	tCxiReplayQueue	*q = (tCxiReplayQueue*) threadarg;
+	tCheetahCxiParams *params = q->params;
+
+	while(true) {
+		pthread_mutex_lock(&q->mutex);
+		long fileIndex = q->nextFile++;
+		pthread_mutex_unlock(&q->mutex);
+		if(fileIndex >= (long) params->inputFiles.size())
+			break;
+
+		const char *filename = params->inputFiles[fileIndex].c_str();
+		cCxiReader reader;
+		reader.verbose = params->verbose;
+		if(reader.open(filename, params->dataPath.c_str(), params->maskPath.c_str()) != 0) {
+			printf("Skipping %s\n", filename);
+			continue;
+		}
+		if(reader.pix_nn != q->pix_nn) {
+			printf("Error: %s has %li x %li pixel frames, which does not match the detector in cheetah.ini (%li pixels)\n", filename, reader.pix_nx, reader.pix_ny, q->pix_nn);
+			printf("Skipping %s\n", filename);
+			reader.close();
+			continue;
+		}
+		printf("Reading %li frames from %s\n", reader.nframes, filename);
+
+		long batchSize = reader.alignedBatchSize(params->batchSize);
+		for(long frame=0; frame<reader.nframes; frame+=batchSize) {
+			tCxiBatch *batch = reader.readBatch(frame, batchSize);
+			if(batch == NULL)
+				break;
+			batch->fileIndex = fileIndex;
+
+			pthread_mutex_lock(&q->mutex);
+			while((long) q->queue.size() >= params->maxQueuedBatches)
+				pthread_cond_wait(&q->notFull, &q->mutex);
+			q->queue.push_back(batch);
+			pthread_cond_signal(&q->notEmpty);
+			pthread_mutex_unlock(&q->mutex);
+		}
+		reader.close();
+	}
+
+	pthread_mutex_lock(&q->mutex);
+	q->nActiveReaders--;
+	pthread_cond_broadcast(&q->notEmpty);
+	pthread_mutex_unlock(&q->mutex);
+	pthread_exit(NULL);
+}
+
+
+/*
+ *	Guess the run number from file names like r0123-class1.cxi
+ */
+long guessRunNumber(std::string filename) {
+	size_t pos = filename.rfind("/");
+	std::string name = (pos == std::string::npos) ? filename : filename.substr(pos+1);
+	for(size_t i=0; i+4<name.size(); i++) {
+		if((name[i] == 'r' || name[i] == 'R') && (i == 0 || !isalnum(name[i-1]))) {
+			long run;
+			if(sscanf(name.c_str()+i+1, "%4ld", &run) == 1)
+				return run;
+		}
+	}
+	return 0;
+}
+
+
+// Main entry point for CXI replay version of Cheetah
+int main(int argc, char* argv[]) {
+
+	std::cout << "Cheetah interface for replaying CXI files\n";
+
+	// Parse configurations
+	parse_config(argc, argv, &CheetahCxiParams);
+
+	std::cout << "----------------" << std::endl;
+	std::cout << "cheetah.ini file: " << CheetahCxiParams.iniFile << std::endl;
+	std::cout << "calib.ini file: " << CheetahCxiParams.calibFile << std::endl;
+	std::cout << "Data stack: " << CheetahCxiParams.dataPath << std::endl;
+	std::cout << "Reader threads: " << CheetahCxiParams.nReaders << std::endl;
+	std::cout << "Input files: " << std::endl;
+	for(size_t i=0; i<CheetahCxiParams.inputFiles.size(); i++) {
+		std::cout << "\t " << CheetahCxiParams.inputFiles[i] << std::endl;
+	}
+	std::cout << "----------------" << std::endl;
+
+
+	// Facility determines which instrument metadata is written to the output, follow the input file if not specified
+	if(CheetahCxiParams.facility == "") {
+		cCxiReader probe;
+		CheetahCxiParams.facility = "CXI";
+		if(probe.open(CheetahCxiParams.inputFiles[0].c_str(), CheetahCxiParams.dataPath.c_str(), "none") == 0 && probe.hasTrainID)
+			CheetahCxiParams.facility = "EuXFEL";
+		probe.close();
+	}
+	if(CheetahCxiParams.runNumber < 0)
+		CheetahCxiParams.runNumber = guessRunNumber(CheetahCxiParams.inputFiles[0]);
+
+
+	// Initialize Cheetah
+	std::cout << "Setting up Cheetah" << std::endl;
+	static cGlobal cheetahGlobal;
+	strcpy(cheetahGlobal.facility, CheetahCxiParams.facility.c_str());
+	strcpy(cheetahGlobal.configFile, CheetahCxiParams.iniFile.c_str());
+	strcpy(cheetahGlobal.calibFile, CheetahCxiParams.calibFile.c_str());
+	strcpy(cheetahGlobal.experimentID, CheetahCxiParams.exptName.c_str());
+	cheetahInit(&cheetahGlobal);
+	cheetahGlobal.runNumber = CheetahCxiParams.runNumber;
+
+	if(cheetahGlobal.nDetectors != 1) {
+		printf("Error: cheetah-cxi replays a single detector, but cheetah.ini defines %i\n", cheetahGlobal.nDetectors);
+		exit(1);
+	}
+	int		detId = 0;
+	long	pix_nn = cheetahGlobal.detector[detId].pix_nn;
+
+
+	// Start reader threads
+	tCxiReplayQueue	q;
+	q.params = &CheetahCxiParams;
+	q.pix_nn = pix_nn;
+	q.nextFile = 0;
+	q.nActiveReaders = CheetahCxiParams.nReaders;
+	pthread_mutex_init(&q.mutex, NULL);
+	pthread_cond_init(&q.notEmpty, NULL);
+	pthread_cond_init(&q.notFull, NULL);
+
+	std::vector<pthread_t> readers(CheetahCxiParams.nReaders);
+	for(int i=0; i<CheetahCxiParams.nReaders; i++) {
+		if(pthread_create(&readers[i], NULL, cxiReaderThread, (void*) &q) != 0) {
+			printf("Error: Unable to create reader thread\n");
+			exit(1);
+		}
+	}
+
+
+	// Hand frames to Cheetah as batches arrive
+	cMyTimer timer_dataLoad;
+	cMyTimer timer_evtCopy;
+	long	frameNumber = 0;
+	timer_dataLoad.start();
+	while(true) {
+		pthread_mutex_lock(&q.mutex);
+		while(q.queue.empty() && q.nActiveReaders > 0)
+			pthread_cond_wait(&q.notEmpty, &q.mutex);
+		if(q.queue.empty()) {
+			pthread_mutex_unlock(&q.mutex);
+			break;
+		}
+		tCxiBatch *batch = q.queue.front();
+		q.queue.pop_front();
+		pthread_cond_signal(&q.notFull);
+		pthread_mutex_unlock(&q.mutex);
+		timer_dataLoad.stop();
+		cheetahGlobal.timeProfile.addToTimer(timer_dataLoad.duration, cheetahGlobal.timeProfile.TIMER_EVENTDATA);
+
+		const char *filename = CheetahCxiParams.inputFiles[batch->fileIndex].c_str();
+		for(long f=0; f<batch->nframes; f++) {
+			timer_evtCopy.start();
+			frameNumber++;
+
+			cEventData *eventData = cheetahNewEvent(&cheetahGlobal);
+			eventData->frameNumber = frameNumber;
+			eventData->runNumber = cheetahGlobal.runNumber;
+			eventData->nPeaks = 0;
+			eventData->pumpLaserCode = 0;
+			eventData->pumpLaserDelay = 0;
+			eventData->pGlobal = &cheetahGlobal;
+			strcpy(eventData->filename, filename);
+			eventData->stackSlice = batch->firstFrame + f;
+
+			// Keep the original event name so that replayed hits can be matched with the first pass
+			char *savedName = batch->eventName + f*CXI_READER_STRING_SIZE;
+			if(savedName[0] != 0)
+				strncpy(eventData->eventname, savedName, sizeof(eventData->eventname)-1);
+			else
+				sprintf(eventData->eventname, "%s_%li", filename, batch->firstFrame + f);
+
+			// Saved metadata, falling back to cheetah.ini defaults when missing
+			double photonEnergyeV = batch->photonEnergyeV[f];
+			if(isnan(photonEnergyeV) || photonEnergyeV <= 0)
+				photonEnergyeV = cheetahGlobal.defaultPhotonEnergyeV;
+			eventData->photonEnergyeV = photonEnergyeV;
+			eventData->wavelengthA = 12400 / photonEnergyeV;
+
+			// The saved distance already includes cameraLengthOffset, cheetahUpdateGlobal adds it again
+			if(!isnan(batch->detectorDistanceMm[f]))
+				eventData->detector[detId].detectorZ = batch->detectorDistanceMm[f] - cheetahGlobal.detector[detId].cameraLengthOffset;
+
+			eventData->trainID = batch->trainID[f];
+			eventData->pulseID = batch->pulseID[f];
+			eventData->cellID = batch->cellID[f];
+
+			// Frame data
+			memcpy(eventData->detector[detId].data_raw, batch->data + f*pix_nn, pix_nn*sizeof(float));
+			eventData->detector[detId].data_raw_is_float = true;
+
+			// Carry over selected mask bits (bad, dead, ...), everything else is recomputed by the pipeline
+			if(batch->mask != NULL) {
+				uint16_t *mask = batch->mask + f*pix_nn;
+				uint16_t maskBits = CheetahCxiParams.maskBits;
+				for(long i=0; i<pix_nn; i++) {
+					eventData->detector[detId].pixelmask[i] |= (mask[i] & maskBits);
+				}
+			}
+			timer_evtCopy.stop();
+			cheetahGlobal.timeProfile.addToTimer(timer_evtCopy.duration, cheetahGlobal.timeProfile.TIMER_EVENTCOPY);
+
+			// Process event
+			cheetahProcessEventMultithreaded(&cheetahGlobal, eventData);
+		}
+		freeCxiBatch(batch);
+		timer_dataLoad.start();
+	}
+
+	for(int i=0; i<CheetahCxiParams.nReaders; i++) {
+		pthread_join(readers[i], NULL);
+	}
+	pthread_mutex_destroy(&q.mutex);
+	pthread_cond_destroy(&q.notEmpty);
+	pthread_cond_destroy(&q.notFull);
+	printf("Replayed %li frames from %li files\n", frameNumber, (long) CheetahCxiParams.inputFiles.size());
+
+
+	// Cleanup
+	cheetahExit(&cheetahGlobal);
+	printf("Clean Exit\n");
+	return 0;
+}
+
+
+/*
+ *  Print some useful information
+ */
+void print_help(void){
+	std::cout << "Cheetah interface for replaying CXI files\n";
+	std::cout << std::endl;
+	std::cout << "usage: cheetah-cxi -i <INIFILE> file1.cxi [file2.cxi ...]\n";
+	std::cout << std::endl;
+	std::cout << "\t--inifile=<file>     Specifies cheetah.ini file to use\n";
+	std::cout << "\t--calibfile=<file>   Specifies calib.ini file to use (overrides keywords in cheetah.ini)\n";
+	std::cout << "\t--experiment=<name>  String specifying the experiment name\n";
+	std::cout << "\t--facility=<name>    Facility metadata to write (default: EuXFEL if the input has train IDs, otherwise none)\n";
+	std::cout << "\t--data=<path>        Non-assembled data stack (default /entry_1/data_1/data)\n";
+	std::cout << "\t--mask=<path|none>   Per-frame mask stack (default: mask next to the data stack)\n";
+	std::cout << "\t--maskbits=<n>       Mask bits carried over from the file (default: invalid, saturated, dead, shadowed, bad, missing)\n";
+	std::cout << "\t--readers=<n>        Number of files read in parallel (default 2)\n";
+	std::cout << "\t--batch=<n>          Frames per read, rounded up to whole HDF5 chunks (default 16)\n";
+	std::cout << "\t--queue=<n>          Maximum number of batches buffered ahead of processing (default 4 per reader)\n";
+	std::cout << "\t--run=<n>            Run number (default: guessed from the first file name)\n";
+	std::cout << std::endl;
+	std::cout << "End of help\n";
+}
+
+
+/*
+ *	Configuration parser (getopt_long)
+ */
+void parse_config(int argc, char *argv[], tCheetahCxiParams *global) {
+
+	// Defaults
+	global->iniFile = "cheetah.ini";
+	global->calibFile = "None";
+	global->exptName = "CXI";
+	global->facility = "";
+	global->dataPath = "/entry_1/data_1/data";
+	global->maskPath = "";
+	global->maskBits = PIXEL_IS_INVALID | PIXEL_IS_SATURATED | PIXEL_IS_DEAD | PIXEL_IS_SHADOWED | PIXEL_IS_BAD | PIXEL_IS_MISSING;
+	global->nReaders = 2;
+	global->batchSize = 16;
+	global->maxQueuedBatches = -1;
+	global->runNumber = -1;
+	global->verbose = 0;
+
+	// Add getopt-long options
+	// three legitimate values: no_argument, required_argument and optional_argument
+	const struct option longOpts[] = {
+		{ "inifile", required_argument, NULL, 'i' },
+		{ "calibfile", required_argument, NULL, 'c' },
+		{ "experiment", required_argument, NULL, 'e' },
+		{ "facility", required_argument, NULL, 0 },
+		{ "data", required_argument, NULL, 0 },
+		{ "mask", required_argument, NULL, 0 },
+		{ "maskbits", required_argument, NULL, 0 },
+		{ "readers", required_argument, NULL, 'r' },
+		{ "batch", required_argument, NULL, 0 },
+		{ "queue", required_argument, NULL, 0 },
+		{ "run", required_argument, NULL, 0 },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, no_argument, NULL, 0 }
+	};
+	const char optString[] = "i:c:e:r:vh?";
+
+	int opt;
+	int longIndex;
+	while( (opt=getopt_long(argc, argv, optString, longOpts, &longIndex )) != -1 ) {
+		switch( opt ) {
+			case 'v':
+				global->verbose++;
+				break;
+			case 'i':
+				global->iniFile = optarg;
+				break;
+			case 'c':
+				global->calibFile = optarg;
+				break;
+			case 'e':
+				global->exptName = optarg;
+				break;
+			case 'r':
+				global->nReaders = atoi(optarg);
+				break;
+			case 'h':   /* fall-through is intentional */
+			case '?':
+				print_help();
+				exit(1);
+				break;
+
+			case 0:     /* long option without a short arg */
+				if( strcmp( "facility", longOpts[longIndex].name ) == 0 ) {
+					global->facility = optarg;
+				}
+				if( strcmp( "data", longOpts[longIndex].name ) == 0 ) {
+					global->dataPath = optarg;
+				}
+				if( strcmp( "mask", longOpts[longIndex].name ) == 0 ) {
+					global->maskPath = optarg;
+				}
+				if( strcmp( "maskbits", longOpts[longIndex].name ) == 0 ) {
+					global->maskBits = (uint16_t) strtol(optarg, NULL, 0);
+				}
+				if( strcmp( "batch", longOpts[longIndex].name ) == 0 ) {
+					global->batchSize = atol(optarg);
+				}
+				if( strcmp( "queue", longOpts[longIndex].name ) == 0 ) {
+					global->maxQueuedBatches = atol(optarg);
+				}
+				if( strcmp( "run", longOpts[longIndex].name ) == 0 ) {
+					global->runNumber = atol(optarg);
+				}
+				break;
+
+			default:
+				/* You won't actually get here. */
+				break;
+		}
+	}
+
+	// This is where unprocessed arguments end up
+	for(long i=optind; i<argc; i++) {
+		global->inputFiles.push_back(argv[i]);
+	}
+
+	if(global->inputFiles.size() == 0) {
+		std::cout << "No input files specified" << std::endl;
+		print_help();
+		exit(1);
+	}
+
+	if(global->nReaders < 1)
+		global->nReaders = 1;
+	if(global->nReaders > (int) global->inputFiles.size())
+		global->nReaders = (int) global->inputFiles.size();
+	if(global->batchSize < 1)
+		global->batchSize = 1;
+	if(global->maxQueuedBatches < 1)
+		global->maxQueuedBatches = 4*global->nReaders;
+}
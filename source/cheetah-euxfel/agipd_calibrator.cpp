@@ -134,7 +134,7 @@ void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *ga
             badpixMask[p] = 0;
             if(cellBadpix[0][p] != 0) {
                 aduData[p] = 0;
-                badpixMask[p] = 1;
+                badpixMask[p] = _myModule->badpixValue;
             }
 		}
 		// Bypass the gain calibration stage
@@ -144,6 +144,7 @@ void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *ga
 
 	int		pixGain = 0;
 	long	pixelsInGainLevel[3] = {0,0,0};
+	long	nbad = 0;
 	
     // Loop through pixels
 	for (long p=0; p<_myModule->nn; p++) {
@@ -173,8 +174,9 @@ void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *ga
         
         // Check whether this ia a bad pixel
         if(cellBadpix[pixGain][p] != 0) {
-            badpixMask[p]= 1;
+            badpixMask[p] = _myModule->badpixValue;
             aduData[p] = 0;
+            nbad++;
             continue;
         }
         
@@ -188,6 +190,11 @@ void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *ga
 		aduData[p] *= cellRelativeGain[pixGain][p];
 	}
 
+	// Statistics for this frame, counted in the same pass
+	for (int g = 0; g<3; g++)
+		_myModule->pixelsInGainStage[g] = pixelsInGainLevel[g];
+	_myModule->nBadPixels = nbad;
+
 	// 	This is verbose but sometimes useful
 	if(false) {
         pixelsInGainLevel[0] = _myModule->nn - pixelsInGainLevel[1] - pixelsInGainLevel[2];
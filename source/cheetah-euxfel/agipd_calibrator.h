@@ -37,6 +37,7 @@ public:
 	void readCalibrationData();
     void readDESYCalibrationData();
 	void applyCalibration(int, float*, uint16_t*, uint16_t*);
+	void setModule(cAgipdModuleReader &reader) { _myModule = &reader; }
 
 
 	int16_t *darkOffsetForGainAndCell(int gain, int cell);
@@ -0,0 +1,216 @@
+//
+//  agipd_darkcal.cpp
+//  agipd
+//
+//  Dark calibration of one AGIPD module (see agipd_darkcal.h)
+//  Distributed under the GPLv3 license
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+#include <hdf5.h>
+#include "agipd_darkcal.h"
+
+
+cAgipdDarkcal::cAgipdDarkcal(long n0, long n1)
+{
+	_n0 = n0;
+	_n1 = n1;
+	_nn = n0*n1;
+	nFrames = 0;
+}
+
+cAgipdDarkcal::~cAgipdDarkcal()
+{
+	for (int g = 0; g < nGains; g++) {
+		for (size_t c = 0; c < _cells[g].size(); c++) {
+			if (_cells[g][c] == NULL)
+				continue;
+			free(_cells[g][c]->mean);
+			free(_cells[g][c]->m2);
+			free(_cells[g][c]->digital);
+			free(_cells[g][c]);
+		}
+		_cells[g].clear();
+	}
+}
+
+
+/*
+ *	Running sums for this gain stage and cell, allocated the first time the cell is seen
+ */
+cAgipdDarkcal::tAccumulator *cAgipdDarkcal::accumulator(int gain, int cell)
+{
+	if ((size_t) cell >= _cells[gain].size())
+		_cells[gain].resize(cell+1, NULL);
+
+	if (_cells[gain][cell] == NULL) {
+		tAccumulator *a = (tAccumulator*) malloc(sizeof(tAccumulator));
+		a->n = 0;
+		a->mean = (float*) calloc(_nn, sizeof(float));
+		a->m2 = (float*) calloc(_nn, sizeof(float));
+		a->digital = (float*) calloc(_nn, sizeof(float));
+		_cells[gain][cell] = a;
+	}
+	return _cells[gain][cell];
+}
+
+
+/*
+ *	Add one dark frame (analog and raw digital values) taken in the given gain stage
+ */
+void cAgipdDarkcal::addFrame(int gain, int cell, float *analog, uint16_t *digital)
+{
+	if (gain < 0 || gain >= nGains || cell < 0 || analog == NULL || digital == NULL)
+		return;
+
+	tAccumulator *a = accumulator(gain, cell);
+	a->n += 1;
+	float	w = 1.0f / a->n;
+	float	*mean = a->mean;
+	float	*m2 = a->m2;
+	float	*dmean = a->digital;
+
+	// Welford's update, one pass over the frame
+	for (long p = 0; p < _nn; p++) {
+		float	x = analog[p];
+		float	d = x - mean[p];
+		mean[p] += d * w;
+		m2[p] += d * (x - mean[p]);
+		dmean[p] += (digital[p] - dmean[p]) * w;
+	}
+	nFrames++;
+}
+
+
+static void writeDarkcalDataset(hid_t fh, const char *name, hid_t type, hid_t memtype, int ndims, hsize_t *dims, void *data)
+{
+	hid_t	sh = H5Screate_simple(ndims, dims, NULL);
+	hid_t	dh = H5Dcreate(fh, name, type, sh, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	if (dh < 0) {
+		std::cout << "Error: could not create dataset " << name << std::endl;
+	}
+	else {
+		H5Dwrite(dh, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
+		H5Dclose(dh);
+	}
+	H5Sclose(sh);
+}
+
+
+/*
+ *	Offsets, noise, gain thresholds and bad pixels for every gain stage and cell seen
+ */
+int cAgipdDarkcal::write(const char *filename)
+{
+	long	nCells = 0;
+	for (int g = 0; g < nGains; g++)
+		nCells = std::max(nCells, (long) _cells[g].size());
+	if (nCells == 0) {
+		std::cout << "No dark frames for " << filename << ", not written" << std::endl;
+		return 1;
+	}
+
+	long	n = nGains*nCells*_nn;
+	int16_t		*offset = (int16_t*) calloc(n, sizeof(int16_t));
+	uint8_t		*badpix = (uint8_t*) calloc(n, sizeof(uint8_t));
+	uint16_t	*level = (uint16_t*) calloc(n, sizeof(uint16_t));
+	float		*relativeGain = (float*) calloc(n, sizeof(float));
+	float		*noise = (float*) calloc(n, sizeof(float));
+	int32_t		*frames = (int32_t*) calloc(nGains*nCells, sizeof(int32_t));
+	std::vector<float> valid;
+	valid.reserve(_nn);
+
+	for (int g = 0; g < nGains; g++) {
+		for (long c = 0; c < nCells; c++) {
+			long	o = (g*nCells + c)*_nn;
+			tAccumulator *a = (c < (long) _cells[g].size()) ? _cells[g][c] : NULL;
+
+			for (long p = 0; p < _nn; p++)
+				relativeGain[o+p] = 1;
+
+			if (a == NULL || a->n < AGIPD_DARK_MIN_FRAMES) {
+				memset(&badpix[o], AGIPD_DARK_NO_DATA, _nn);
+				continue;
+			}
+			frames[g*nCells + c] = a->n;
+
+			// Offset and noise
+			valid.clear();
+			for (long p = 0; p < _nn; p++) {
+				float	mean = a->mean[p];
+				noise[o+p] = sqrtf(std::max(a->m2[p], 0.0f) / (a->n - 1));
+				offset[o+p] = (int16_t) lrintf(std::min(std::max(mean, -32768.0f), 32767.0f));
+				if (mean <= 0 || mean >= AGIPD_DARK_ADC_MAX)
+					badpix[o+p] |= AGIPD_DARK_OFFSET;
+				else
+					valid.push_back(noise[o+p]);
+			}
+
+			// Noise far from the typical noise of the module
+			float	median = 0;
+			if (valid.size() > 0) {
+				std::nth_element(valid.begin(), valid.begin() + valid.size()/2, valid.end());
+				median = valid[valid.size()/2];
+			}
+			for (long p = 0; p < _nn; p++) {
+				if (noise[o+p] <= 0 || noise[o+p] < median/AGIPD_DARK_NOISE_RATIO || noise[o+p] > median*AGIPD_DARK_NOISE_RATIO)
+					badpix[o+p] |= AGIPD_DARK_NOISE;
+			}
+		}
+	}
+
+	// Digital gain thresholds: half way between the digital values of this gain stage and the one below,
+	// pixels are never put in a gain stage that was not measured
+	for (int g = 1; g < nGains; g++) {
+		for (long c = 0; c < nCells; c++) {
+			long	o = (g*nCells + c)*_nn;
+			if (frames[g*nCells + c] == 0) {
+				for (long p = 0; p < _nn; p++)
+					level[o+p] = AGIPD_DARK_NO_THRESHOLD;
+				continue;
+			}
+			int		h = g-1;
+			while (h >= 0 && frames[h*nCells + c] == 0)
+				h--;
+			if (h < 0)
+				continue;
+			float	*upper = _cells[g][c]->digital;
+			float	*lower = _cells[h][c]->digital;
+			for (long p = 0; p < _nn; p++)
+				level[o+p] = (uint16_t) lrintf(0.5f*(lower[p] + upper[p]));
+		}
+	}
+
+
+	// Write it all out
+	std::cout << "Writing dark calibration to " << filename << " (" << nCells << " cells)" << std::endl;
+	int		status = 0;
+	hid_t	fh = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	if (fh < 0) {
+		std::cout << "Error: could not create " << filename << std::endl;
+		status = 1;
+	}
+	else {
+		hsize_t	dims[4] = {(hsize_t) nGains, (hsize_t) nCells, (hsize_t) _n1, (hsize_t) _n0};
+		writeDarkcalDataset(fh, "AnalogOffset", H5T_STD_I16LE, H5T_NATIVE_INT16, 4, dims, offset);
+		writeDarkcalDataset(fh, "Badpixel", H5T_STD_U8LE, H5T_NATIVE_UINT8, 4, dims, badpix);
+		writeDarkcalDataset(fh, "DigitalGainLevel", H5T_STD_U16LE, H5T_NATIVE_UINT16, 4, dims, level);
+		writeDarkcalDataset(fh, "RelativeGain", H5T_IEEE_F32LE, H5T_NATIVE_FLOAT, 4, dims, relativeGain);
+		writeDarkcalDataset(fh, "AnalogNoise", H5T_IEEE_F32LE, H5T_NATIVE_FLOAT, 4, dims, noise);
+		writeDarkcalDataset(fh, "NFrames", H5T_STD_I32LE, H5T_NATIVE_INT32, 2, dims, frames);
+		H5Fclose(fh);
+	}
+
+	free(offset);
+	free(badpix);
+	free(level);
+	free(relativeGain);
+	free(noise);
+	free(frames);
+	return status;
+}
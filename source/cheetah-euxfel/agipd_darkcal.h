@@ -0,0 +1,70 @@
+//
+//  agipd_darkcal.h
+//  agipd
+//
+//  Dark calibration of one AGIPD module from dark runs, accumulated one frame at a time
+//  Distributed under the GPLv3 license
+//
+//  Offsets and noise are kept per gain stage and memory cell with Welford's running mean and variance,
+//  so a dark run is calibrated in a single pass without holding the frames in memory.
+//  Output is in the layout read by cAgipdCalibrator::readCalibrationData():
+//  /AnalogOffset            Dataset {3, nCells, 512, 128}   int16_t
+//  /Badpixel                Dataset {3, nCells, 512, 128}   uint8_t
+//  /DigitalGainLevel        Dataset {3, nCells, 512, 128}   uint16_t
+//  /RelativeGain            Dataset {3, nCells, 512, 128}   float (1, gains are not measured from darks)
+//  /AnalogNoise             Dataset {3, nCells, 512, 128}   float
+//  /NFrames                 Dataset {3, nCells}             int32_t
+//
+
+#ifndef __agipd__agipd_darkcal__
+#define __agipd__agipd_darkcal__
+
+#include <stdint.h>
+#include <vector>
+
+
+// Bad pixel flags written to /Badpixel (any non-zero value marks the pixel bad in cAgipdCalibrator)
+enum {
+	AGIPD_DARK_NO_DATA = 1,			// Fewer than AGIPD_DARK_MIN_FRAMES frames for this gain stage and cell
+	AGIPD_DARK_NOISE = 2,			// Noise far from the module median (or zero)
+	AGIPD_DARK_OFFSET = 4			// Offset outside the ADC range
+};
+
+#define AGIPD_DARK_MIN_FRAMES		5
+#define AGIPD_DARK_NOISE_RATIO		5.0
+#define AGIPD_DARK_ADC_MAX			16383
+#define AGIPD_DARK_NO_THRESHOLD		32767
+
+
+class cAgipdDarkcal
+{
+public:
+	static const int nGains = 3;
+
+	cAgipdDarkcal(long n0, long n1);
+	~cAgipdDarkcal();
+
+	void addFrame(int gain, int cell, float *analog, uint16_t *digital);
+	int write(const char *filename);
+
+	long nFrames;
+
+private:
+	// Running sums for one gain stage and memory cell
+	// (all frames of a dark run are in the same gain stage, so the frame count is the same for every pixel)
+	typedef struct {
+		long	n;
+		float	*mean;
+		float	*m2;
+		float	*digital;
+	} tAccumulator;
+
+	long	_n0;
+	long	_n1;
+	long	_nn;
+	std::vector<tAccumulator*> _cells[nGains];
+
+	tAccumulator *accumulator(int gain, int cell);
+};
+
+#endif /* defined(__agipd__agipd_darkcal__) */
@@ -89,6 +89,18 @@ cAgipdModuleReader::cAgipdModuleReader(void){
 	data = NULL;
 	digitalGain = NULL;
 	badpixMask = NULL;
+	badpixValue = 1;
+	pixelsInGainStage[0] = pixelsInGainStage[1] = pixelsInGainStage[2] = 0;
+	nBadPixels = 0;
+	frameData = NULL;
+	frameGain = NULL;
+	frameMask = NULL;
+	frameMask8 = NULL;
+	frameBufferNN = 0;
+	nframes = 0;
+	n0 = 0;
+	n1 = 0;
+	nn = 0;
 	rawDetectorData = true;
 	noData = false;
 	verbose = 0;
@@ -97,6 +109,7 @@ cAgipdModuleReader::cAgipdModuleReader(void){
 	gainDataOffset[1] = 1;
 
 	_doNotApplyGainSwitch = false;
+	_rawDigitalGain = false;
 
 	calibGainFactor = NULL;
 
@@ -108,6 +121,12 @@ cAgipdModuleReader::cAgipdModuleReader(void){
 cAgipdModuleReader::~cAgipdModuleReader(){
 	std::cout << "\tModule destructor called" << std::endl;
 	cAgipdModuleReader::close();
+	if (calibrator != NULL)
+		delete calibrator;
+	free(frameData);
+	free(frameGain);
+	free(frameMask);
+	free(frameMask8);
 };
 
 /*
@@ -116,6 +135,7 @@ cAgipdModuleReader::~cAgipdModuleReader(){
 void cAgipdModuleReader::open(char filename[], int mNum) {
 	std::cout << "Opening " << filename << std::endl;
 	cAgipdModuleReader::filename = filename;
+	nframes = 0;
 	
 	h5_file_id = fileCheckAndOpen(filename);
 	if (h5_file_id == NULL) {
@@ -205,6 +225,15 @@ void cAgipdModuleReader::open(char filename[], int mNum) {
 	}
 	nn = n0*n1;
 
+	// Frame buffers from the previous file are only any use if the module size is the same
+	if (nn != frameBufferNN) {
+		free(frameData); frameData = NULL;
+		free(frameGain); frameGain = NULL;
+		free(frameMask); frameMask = NULL;
+		free(frameMask8); frameMask8 = NULL;
+		frameBufferNN = nn;
+	}
+
     
     // Check the index length
     int success2 = H5LTget_dataset_info(h5_file_id, h5_index_first_field.c_str(), dims, &dataclass, &datasize);
@@ -260,7 +289,7 @@ void cAgipdModuleReader::close(void) {
 	if (noData || !fileOK)
         return;
 
-	if(data==NULL)
+	if(trainIDlist==NULL)
 		return;
 	if(h5_file_id==NULL)
 		return;
@@ -287,17 +316,14 @@ void cAgipdModuleReader::close(void) {
 
     
 	// Free array memory
-	if(data != NULL) {
+	if(trainIDlist != NULL) {
 		std::cout << "\tFreeing memory " << filename << "\n";
 		free(pulseIDlist);
 		free(trainIDlist);
 		free(cellIDlist);
 		free(statusIDlist);
-		free(data);
-		free(digitalGain);
-		free(badpixMask);
 		
-		// Pointers to NULL
+		// Pointers to NULL (frame buffers are kept for the next file)
 		pulseIDlist = NULL;
 		trainIDlist = NULL;
 		cellIDlist = NULL;
@@ -375,6 +401,8 @@ void cAgipdModuleReader::readDarkcal(char *filename){
 		return;
 	}
 	darkcalFilename = filename;
+	if (calibrator != NULL)
+		delete calibrator;
 
 	printf("\tDarkcal file: %s\n", darkcalFilename.c_str());
 	printf("\tGaincal file: %s\n", gaincalFilename.c_str());
@@ -386,6 +414,25 @@ void cAgipdModuleReader::readDarkcal(char *filename){
 // cAgipdModuleReader::readDarkcal
 
 
+/*
+ *	Take over the calibration constants already read by another reader of the same module
+ *	(eg: the previous sequence file of the run), instead of reading them again.
+ *	Returns false if the other reader has none.
+ */
+bool cAgipdModuleReader::adoptCalibrator(cAgipdModuleReader &from){
+	if (!fileOK || from.calibrator == NULL)
+		return false;
+	if (calibrator != NULL)
+		delete calibrator;
+	calibrator = from.calibrator;
+	darkcalFilename = from.darkcalFilename;
+	from.calibrator = NULL;
+	calibrator->setModule(*this);
+	return true;
+}
+// cAgipdModuleReader::adoptCalibrator
+
+
 void cAgipdModuleReader::readGaincal(char *filename){
     // If file is absent or not OK, no need to load gains as we will skip anyway
     if(!fileOK)
@@ -431,6 +478,15 @@ void cAgipdModuleReader::readImageStack(void){
  *	Read one frame of data
  */
 void cAgipdModuleReader::readFrame(long frameNum){
+	readFrame(frameNum, NULL, NULL, NULL);
+}
+
+/*
+ *	Read, convert and calibrate one frame straight into the caller's arrays (nn elements each),
+ *	eg: this module's part of a Cheetah event
+ *	Without target arrays the frame goes into buffers owned by the module
+ */
+void cAgipdModuleReader::readFrame(long frameNum, float *dstData, uint16_t *dstGain, uint16_t *dstMask){
 	// Read a single image at position frameNum
 	// Will have both fs and ss, and stack...
 
@@ -456,12 +512,33 @@ void cAgipdModuleReader::readFrame(long frameNum){
 	statusID = statusIDlist[frameNum];
 	
 
+	// Module buffers (allocated once) for whatever the caller did not supply
+	if(dstData == NULL) {
+		if(frameData == NULL)
+			frameData = (float *) malloc(nn*sizeof(float));
+		dstData = frameData;
+	}
+	if(dstGain == NULL) {
+		if(frameGain == NULL)
+			frameGain = (uint16_t *) malloc(nn*sizeof(uint16_t));
+		dstGain = frameGain;
+	}
+	if(dstMask == NULL) {
+		if(frameMask == NULL)
+			frameMask = (uint16_t *) malloc(nn*sizeof(uint16_t));
+		dstMask = frameMask;
+	}
+
+	// Statistics are filled in by the calibration pass
+	pixelsInGainStage[0] = pixelsInGainStage[1] = pixelsInGainStage[2] = 0;
+	nBadPixels = 0;
+
 	// Read the data frame
 	if (rawDetectorData) {
-		readFrameRaw(frameNum);
+		readFrameRaw(frameNum, dstData, dstGain, dstMask);
 	}
 	else {
-		readFrameXFELCalib(frameNum);
+		readFrameXFELCalib(frameNum, dstData, dstGain, dstMask);
 	}
 }
 // cAgipdModuleReader::readFrame
@@ -470,7 +547,7 @@ void cAgipdModuleReader::readFrame(long frameNum){
 /*
  *	Read one frame of data from RAW files
  */
-void cAgipdModuleReader::readFrameRaw(long frameNum) {
+void cAgipdModuleReader::readFrameRaw(long frameNum, float *dstData, uint16_t *dstGain, uint16_t *dstMask) {
     if (noData) {
 		return;
     }
@@ -488,46 +565,49 @@ void cAgipdModuleReader::readFrameRaw(long frameNum) {
 	slab_size[3] = n0;
 	int ndims = 4;
 	
-	// Free existing memory
-	free(data); data = NULL;
-	free(digitalGain); digitalGain = NULL;
-	free(badpixMask); badpixMask = NULL;
+	// Nothing valid until it has been read
+	data = NULL;
+	digitalGain = NULL;
+	badpixMask = NULL;
 
 
-    // Read data from hyperslab in RAW data file (which is unit16_t, so convert it to float)
-	uint16_t *tempdata = NULL;
+    // Read data from hyperslab in RAW data file (which is unit16_t, HDF5 converts it to float on the way in)
     if(useNewDatasetReader) {
-        tempdata = (uint16_t*) raw_image_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+        if(!raw_image_dataset.readHyperslab(ndims, slab_start, slab_size, H5T_NATIVE_FLOAT, dstData))
+            return;
     }
     else {
-        tempdata = (uint16_t*) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
-
+        uint16_t *tempdata = (uint16_t*) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+        if (!tempdata) {
+            return;
+        }
+        for (long i = 0; i < nn; i++) {
+            dstData[i] = tempdata[i];
+        }
+        free(tempdata);
     }
-	
-    if (!tempdata) {
-		return;
-	}
-    
-    // Convert uint16_t to float
-	data = (float *)malloc(n0 * n1 * sizeof(float));
-	for (int i = 0; i < n0 * n1; i++) {
-		data[i] = tempdata[i];
-	}
-	free(tempdata);
+	data = dstData;
 	
 	// Digital gain is in the second dimension (at least that's the way it was meant to be)
 	// For the first few experiments digital gain is actually in the next analog memory location: location configured via gainDataOffset
 	slab_start[0] += gainDataOffset[0];
 	slab_start[1] += gainDataOffset[1];
     if(useNewDatasetReader) {
-        digitalGain = (uint16_t*) raw_image_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+        if(raw_image_dataset.readHyperslab(ndims, slab_start, slab_size, H5T_STD_U16LE, dstGain))
+            digitalGain = dstGain;
     }
     else {
-        digitalGain = (uint16_t*) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+        uint16_t *tempgain = (uint16_t*) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+        if(tempgain != NULL) {
+            memcpy(dstGain, tempgain, nn*sizeof(uint16_t));
+            free(tempgain);
+            digitalGain = dstGain;
+        }
     }
 	// Bad pixel mask added by raw data calibration, or left alone if uncalibrated
-    // Pixel good = 0, pixel bad = anything else; deliberate use of calloc() to zero the array
-	badpixMask = (uint16_t *)calloc(nn, sizeof(uint16_t));
+    // Pixel good = 0, pixel bad = badpixValue
+	memset(dstMask, 0, nn*sizeof(uint16_t));
+	badpixMask = dstMask;
 
 	
 	// Update timestamp, status bits and other stuff
@@ -548,7 +628,7 @@ void cAgipdModuleReader::readFrameRaw(long frameNum) {
  *	usually found in {$EXPT}/proc
  *  as provided by Steffen Hauf's calibration routines
  */
-void cAgipdModuleReader::readFrameXFELCalib(long frameNum) {
+void cAgipdModuleReader::readFrameXFELCalib(long frameNum, float *dstData, uint16_t *dstGain, uint16_t *dstMask) {
 	if (noData) {
 		return;
 	}
@@ -564,62 +644,61 @@ void cAgipdModuleReader::readFrameXFELCalib(long frameNum) {
 	slab_size[2] = n0;
 	int ndims = 3;
 	
-	// Free existing memory
-	free(data); data = NULL;
-	free(digitalGain); digitalGain = NULL;
-	free(badpixMask); badpixMask = NULL;
+	// Nothing valid until it has been read
+	data = NULL;
+	digitalGain = NULL;
+	badpixMask = NULL;
 
     //std::cout << "ndims=" << ndims << ", size=[" << slab_size[0] << ", " << slab_size[1] << ", " << slab_size[2] << std::endl;
     
 	// Read data directly from hyperslab in corrected data file (which is already a float)
-    if(useNewDatasetReader) {
-        data = (float *) proc_image_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_IEEE_F32LE, sizeof(float));
-    }
-    else {
-        data = (float *) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_IEEE_F32LE, sizeof(float));
-    }
-    if (!data) {
-        return;
-    }
-
-	// Digital gain is in a different field and is H5T_STD_U8LE Dataset {7500, 512, 128}
-	// Default format is uint16_t so we must convert
-	uint8_t *tempgain = NULL;
-    if(useNewDatasetReader) {
-        tempgain = (uint8_t*) proc_gain_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
-    }
-    else {
-        tempgain = (uint8_t*) checkAllocReadHyperslab((char *)h5_image_gain_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
-    }
-	digitalGain = (uint16_t *)malloc(nn * sizeof(uint16_t));
-	for (int i = 0; i < nn; i++) {
-		digitalGain[i] = tempgain[i];
-	}
-	free(tempgain);
-
-	
+	// Digital gain is in a different field and is H5T_STD_U8LE Dataset {7500, 512, 128}, HDF5 widens it to uint16_t
 	// Bad pixel mask is a H5T_STD_U8LE Dataset {7500, 512, 128, 3}  <--- Not any more
 	//slab_start[3] = 0;
 	//slab_size[3] = 3;
 	//ndims = 4;
-	uint8_t *tempmask = NULL;
+	if(frameMask8 == NULL)
+		frameMask8 = (uint8_t *) malloc(nn*sizeof(uint8_t));
     if(useNewDatasetReader) {
-        tempmask = (uint8_t*) proc_mask_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
+        if(!proc_image_dataset.readHyperslab(ndims, slab_start, slab_size, H5T_IEEE_F32LE, dstData))
+            return;
+        if(!proc_gain_dataset.readHyperslab(ndims, slab_start, slab_size, H5T_STD_U16LE, dstGain))
+            return;
+        if(!proc_mask_dataset.readHyperslab(ndims, slab_start, slab_size, H5T_STD_U8LE, frameMask8))
+            return;
     }
     else {
-        tempmask = (uint8_t*) checkAllocReadHyperslab((char *)h5_image_mask_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
+        float *tempdata = (float *) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_IEEE_F32LE, sizeof(float));
+        uint16_t *tempgain = (uint16_t*) checkAllocReadHyperslab((char *)h5_image_gain_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+        uint8_t *tempmask = (uint8_t*) checkAllocReadHyperslab((char *)h5_image_mask_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
+        bool ok = (tempdata != NULL && tempgain != NULL && tempmask != NULL);
+        if(ok) {
+            memcpy(dstData, tempdata, nn*sizeof(float));
+            memcpy(dstGain, tempgain, nn*sizeof(uint16_t));
+            memcpy(frameMask8, tempmask, nn*sizeof(uint8_t));
+        }
+        free(tempdata);
+        free(tempgain);
+        free(tempmask);
+        if(!ok)
+            return;
     }
-	badpixMask = (uint16_t *)calloc(nn, sizeof(uint16_t));
-    // Copy across mask
-    long nbad = 0;
+	data = dstData;
+	digitalGain = dstGain;
+	badpixMask = dstMask;
+
+    // Copy across mask, counting bad pixels and pixels in each gain stage on the way
     for (long i = 0; i < nn; i++) {
-        if(tempmask[i] != 0) {
-            data[i] = 0;
-            badpixMask[i] = 1;
-            nbad++;
+        if(dstGain[i] <= 2)
+            pixelsInGainStage[dstGain[i]] += 1;
+        if(frameMask8[i] != 0) {
+            dstData[i] = 0;
+            dstMask[i] = badpixValue;
+            nBadPixels++;
         }
+        else
+            dstMask[i] = 0;
     }
-    free(tempmask);
 
     
     // Check for screwy intensity values: Sometimes we get +/- 1e9 appearing
@@ -628,7 +707,7 @@ void cAgipdModuleReader::readFrameXFELCalib(long frameNum) {
         for (long i = 0; i < nn; i++) {
             if(data[i] > 1e7 || data[i] < -1e6) {
                 data[i] = 0;
-                badpixMask[i] = 1;
+                badpixMask[i] = badpixValue;
             }
         }
     }
@@ -654,7 +733,8 @@ void cAgipdModuleReader::applyCalibration(long frameNum) {
     
     // No calibrator = no calibration; return and zero out digital gain
     if(calibrator == NULL) {
-        memset(digitalGain, 0, nn*sizeof(uint16_t));
+        if(!_rawDigitalGain && digitalGain != NULL)
+            memset(digitalGain, 0, nn*sizeof(uint16_t));
 		return;
     }
 
@@ -76,13 +76,16 @@ public:
 	void close(void);
 	void readHeaders(void);
 	void readDarkcal(char[]);
+	bool adoptCalibrator(cAgipdModuleReader &from);
 	void readGaincal(char[]);
 	void readImageStack(void);
 	void readFrame(long);
+	void readFrame(long, float*, uint16_t*, uint16_t*);
 
 	void setGainDataOffset(int d0, int d1) {gainDataOffset[0] = d0; gainDataOffset[1] = d1; }
 	void setCellIDcorrection(int mod) { cellIDcorrection = mod; if (cellIDcorrection <= 0) cellIDcorrection = 1; }
 	void setDoNotApplyGainSwitch(bool _val) {_doNotApplyGainSwitch = _val; }
+	void setRawDigitalGain(bool _val) {_rawDigitalGain = _val; }
 
 	
 // Pubic variables
@@ -95,9 +98,13 @@ public:
 	long		nn;
 
 	// data and ID for the last read event.  Only updated after readFrame is called! 
+	// Arrays are the ones passed to readFrame(), or buffers owned by the module if none were passed (NULL if the read failed)
 	float   	*data;
 	uint16_t	*digitalGain;
 	uint16_t	*badpixMask;
+	uint16_t	badpixValue;		// Value badpixMask is set to for bad pixels (good pixels are 0)
+	long		pixelsInGainStage[3];	// Counted while the frame is read and calibrated (all 0 if the gain stage is unknown)
+	long		nBadPixels;
     uint64_t	trainID;
     uint64_t	pulseID;
     uint16_t	cellID;
@@ -114,6 +121,7 @@ public:
 	int			gainDataOffset[2];	// Gain data hyperslab offset relative to image data frame
 
 	bool		_doNotApplyGainSwitch;		// Bypass gain switching
+	bool		_rawDigitalGain;			// Without calibration, keep the raw digital values instead of gain stage 0 (dark calibration)
 	
 // Private variables
 private:
@@ -136,6 +144,14 @@ private:
 
 	cAgipdCalibrator *calibrator;
 	float		*calibGainFactor;
+
+	// Buffers for frames read without target arrays, and for the 8-bit calibrated mask
+	// (kept from one file to the next while the module size stays the same)
+	float		*frameData;
+	uint16_t	*frameGain;
+	uint16_t	*frameMask;
+	uint8_t		*frameMask8;
+	long		frameBufferNN;
     
     // Persistent chunked data sets
     cHDF5dataset    raw_image_dataset;
@@ -147,8 +163,8 @@ private:
 
 // Private functions
 private:
-	void		readFrameRaw(long frameNum);
-	void		readFrameXFELCalib(long frameNum);
+	void		readFrameRaw(long frameNum, float *dstData, uint16_t *dstGain, uint16_t *dstMask);
+	void		readFrameXFELCalib(long frameNum, float *dstData, uint16_t *dstGain, uint16_t *dstMask);
 	void		applyCalibration(long frameNum);
 };
 
@@ -17,7 +17,12 @@
 #include <string.h>
 #include <vector>
 #include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <limits.h>
 #include "agipd_reader.h"
+#include "agipd_darkcal.h"
 #include <algorithm>
 
 cAgipdReader::cAgipdReader(void){
@@ -39,6 +44,26 @@ cAgipdReader::cAgipdReader(void){
     _stride = 1;
     _newFileSkip = 0;
 	_doNotApplyGainSwitch = false;
+	_badpixValue = 1;
+	_frameFilter = NULL;
+	_frameFilterArg = NULL;
+	_reportInterval = 0;
+	_reportFrames = 0;
+	_reportPixelsInGainStage[0] = _reportPixelsInGainStage[1] = _reportPixelsInGainStage[2] = 0;
+	_reportBadPixels = 0;
+	module = _moduleSet[0];
+	_currentSet = 0;
+	_nextSequence = 0;
+	_nextOK = false;
+	_nextPending = false;
+	_openThreadRunning = false;
+	currentSequence = -1;
+	nframes = 0;
+	n0 = n1 = nn = 0;
+	modulenn = 0;
+	_referenceModule = 0;
+	pixelsInGainStage[0] = pixelsInGainStage[1] = pixelsInGainStage[2] = 0;
+	nBadPixels = 0;
 	
 	_gainDataOffset[0] = 0;
 	_gainDataOffset[1] = 1;
@@ -56,7 +81,7 @@ cAgipdReader::~cAgipdReader()
 {
 	std::cout << "\tAGIPD destructor called" << std::endl;
 
-	if(data == NULL)
+	if(data == NULL && !_openThreadRunning)
 		return;
 	cAgipdReader::close();
 };
@@ -156,8 +181,9 @@ void cAgipdReader::setScheme(char *scheme) {
 /*
  *	Create a list of filenames for all 16 AGIPD modules based on the filename for one module
  *	Small function but isolated here so it's easy to swap conventions if needed
+ *	(only touches its arguments, so sequences can be opened in the background)
  */
-void cAgipdReader::generateModuleFilenames(char *module0filename){
+void cAgipdReader::generateModuleFilenames(const char *module0filename, std::string *moduleFilename, int *referenceModule){
 	long	pos;
 	char	tempstr[10];
 
@@ -166,8 +192,8 @@ void cAgipdReader::generateModuleFilenames(char *module0filename){
     std::string     referenceModuleName;
     referenceModuleName = module0filename;
     pos = referenceModuleName.find("AGIPD");
-    _referenceModule = atoi(referenceModuleName.substr(pos+5,2).c_str());
-    std::cout << "Using module number " << _referenceModule << " as a reference" << std::endl;
+    *referenceModule = atoi(referenceModuleName.substr(pos+5,2).c_str());
+    std::cout << "Using module number " << *referenceModule << " as a reference" << std::endl;
     
 	// Filenames for all the other modules
 	for(long i=0; i<nAGIPDmodules; i++) {
@@ -182,7 +208,7 @@ void cAgipdReader::generateModuleFilenames(char *module0filename){
 			continue;
 		}
         
-		sprintf(tempstr, "%0.2li", i);
+		snprintf(tempstr, sizeof(tempstr), "%02li", i);
 		moduleFilename[i].replace(pos+5,2,tempstr);
 		
 		// Which chunk/sequence are we looking at?
@@ -201,9 +227,18 @@ void cAgipdReader::generateModuleFilenames(char *module0filename){
 		//firstModule = (stackInt == 0);
 		
 		if(verbose) {
-			printf("\tModule %0.2li = %s\n",i, moduleFilename[i].c_str());
+			printf("\tModule %02li = %s\n",i, moduleFilename[i].c_str());
 		}
 	}
+}
+
+
+/*
+ *	Create the list of calibration filenames for all 16 modules from darkcalFile and gaincalFile
+ */
+void cAgipdReader::generateCalibrationFilenames(void){
+	long	pos;
+	char	tempstr[10];
 
 	// Filenames for all the darkcal files
     if(darkcalFile != "No_file_specified") {
@@ -212,7 +247,7 @@ void cAgipdReader::generateModuleFilenames(char *module0filename){
             darkcalFilename[i] = darkcalFile;
             pos = darkcalFilename[i].find("AGIPD");
             if (pos != std::string::npos) {
-                sprintf(tempstr, "%0.2li", i);
+                snprintf(tempstr, sizeof(tempstr), "%02li", i);
                 darkcalFilename[i].replace(pos+5,2,tempstr);
             }
             std::cout << "\t\t" << darkcalFilename[i] << std::endl;
@@ -227,7 +262,7 @@ void cAgipdReader::generateModuleFilenames(char *module0filename){
 			gaincalFilename[i] = gaincalFile;
 			pos = gaincalFilename[i].find("AGIPD");
             if (pos != std::string::npos) {
-                sprintf(tempstr, "%0.2li", i);
+                snprintf(tempstr, sizeof(tempstr), "%02li", i);
                 gaincalFilename[i].replace(pos+5,2,tempstr);
             }
 			std::cout << "\t\t" << gaincalFilename[i] << std::endl;
@@ -238,45 +273,84 @@ void cAgipdReader::generateModuleFilenames(char *module0filename){
 
 
 /*
- *	Open all AGIPD module files relating to the specified module
+ *	Find the sequence files of a run in a directory (eg: /gpfs/exfel/exp/SPB/201802/p002160/raw/r0123)
+ *	Files are named <prefix>-AGIPDnn-Snnnnn.h5; one file is listed per sequence (the lowest module number present,
+ *	the other modules are found from it as usual), in sequence order.
+ *	Returns the number of files added to the list.
+ */
+int cAgipdReader::findSequenceFiles(std::string dir, std::vector<std::string> &files) {
+	DIR		*dirp = opendir(dir.c_str());
+	if (dirp == NULL) {
+		std::cout << "Error: cannot read directory " << dir << std::endl;
+		return 0;
+	}
+	if (dir.size() > 0 && dir[dir.size()-1] != '/')
+		dir += "/";
+
+	// Keyed on the filename with the module number replaced by 00, which also sorts by sequence
+	std::map<std::string, std::pair<int, std::string> > sequences;
+	struct dirent	*entry;
+	while ((entry = readdir(dirp)) != NULL) {
+		std::string name = entry->d_name;
+		size_t pos = name.find("-AGIPD");
+		if (pos == std::string::npos || name.size() < pos+18)
+			continue;
+		if (!isdigit(name[pos+6]) || !isdigit(name[pos+7]) || name.compare(pos+8, 2, "-S") != 0)
+			continue;
+		if (name.compare(name.size()-3, 3, ".h5") != 0)
+			continue;
+
+		int moduleNum = atoi(name.substr(pos+6, 2).c_str());
+		std::string key = name;
+		key.replace(pos+6, 2, "00");
+		std::map<std::string, std::pair<int, std::string> >::iterator it = sequences.find(key);
+		if (it == sequences.end() || moduleNum < it->second.first)
+			sequences[key] = std::make_pair(moduleNum, dir + name);
+	}
+	closedir(dirp);
+
+	for (std::map<std::string, std::pair<int, std::string> >::iterator it = sequences.begin(); it != sequences.end(); it++)
+		files.push_back(it->second.second);
+	return (int) sequences.size();
+}
+
+
+
+/*
+ *	Open all AGIPD module files of one sequence into module set <set>
  *  and perform a bunch of sanity checks.
  *  XFEL files are not versioned so we have to make some gueses
+ *	Only touches the module set and its tAgipdSequence, so that the next sequence can be opened in the background.
+ *	Returns false if there are no frames.
  */
-void cAgipdReader::open(char *baseFilename){
-	
+bool cAgipdReader::openSequence(int set, std::string baseFilename){
+	cAgipdModuleReader	*module = _moduleSet[set];
+	tAgipdSequence		&seq = _sequence[set];
+	int					referenceModule;
+
 	// Create a list of filenames for all 16 modules
-	printf("Opening all modules for %s\n", baseFilename);
-	generateModuleFilenames(baseFilename);
+	printf("Opening all modules for %s\n", baseFilename.c_str());
+	seq.filename = baseFilename;
+	generateModuleFilenames(baseFilename.c_str(), seq.moduleFilename, &referenceModule);
+	seq.referenceModule = referenceModule;
 	
 	
 	
 	// Open all module files and read the header
 	for(long i=0; i<nAGIPDmodules; i++) {
 		if(verbose) {
-			printf("Module %0.2li:\n", i);
+			printf("Module %02li:\n", i);
 		}
 		module[i].verbose = 0;
-		module[i].open((char *) moduleFilename[i].data(), i);
+		module[i].open((char *) seq.moduleFilename[i].data(), i);
 		module[i].readHeaders();
-		module[i].readDarkcal((char *)darkcalFilename[i].c_str());
 		module[i].setGainDataOffset(_gainDataOffset[0],_gainDataOffset[1]);
 		module[i].setCellIDcorrection(_cellIDcorrection);
 		//module[i].setDoNotApplyGainSwitch(_doNotApplyGainSwitch);
 	}
 
-	// Det up size and layout of the assembled data stack
 	// Use module[0] as the reference and stack the modules one on top of another
-	nframes = module[_referenceModule].nframes;
-	modulen[0] = module[_referenceModule].n0;
-	modulen[1] = module[_referenceModule].n1;
-	modulenn = modulen[0]*modulen[1];
-	nmodules[0] = 1;
-	nmodules[1] = nAGIPDmodules;
-	dims[0] = modulen[0]*nmodules[0];
-	dims[1] = modulen[1]*nmodules[1];
-	n0 = dims[0];
-	n1 = dims[1];
-	nn = n0*n1;
+	seq.nframes = module[referenceModule].nframes;
 
 	
 	// Check for inconsistencies
@@ -285,26 +359,25 @@ void cAgipdReader::open(char *baseFilename){
 		if (module[i].noData)
 			continue;
 
-		if(module[i].nframes != module[_referenceModule].nframes) {
-			std::cout << "\tInconsistent number of frames between modules " << _referenceModule << " and " << i << std::endl;
-			std::cout << "\t" << module[i].nframes << " != " << module[_referenceModule].nframes << std::endl;
+		if(module[i].nframes != module[referenceModule].nframes) {
+			std::cout << "\tInconsistent number of frames between modules " << referenceModule << " and " << i << std::endl;
+			std::cout << "\t" << module[i].nframes << " != " << module[referenceModule].nframes << std::endl;
             std::cout << "\tsetting moduleOK[i] = false\n";
-			moduleOK[i] = false;
+			seq.moduleOK[i] = false;
 		}
 		else {
-			moduleOK[i] = true;
+			seq.moduleOK[i] = true;
 		}
 	}
 	std::cout << " [OK]" <<  std::endl;
 	
     
 	std::cout << "\tChecking all data is of the same type";
-	rawDetectorData = module[_referenceModule].rawDetectorData;
 	for(long i=0; i<nAGIPDmodules; i++) {
 		if (module[i].noData)
 			continue;
 
-		if(module[i].rawDetectorData != rawDetectorData) {
+		if(module[i].rawDetectorData != module[referenceModule].rawDetectorData) {
 			std::cout << std::endl;
             std::cout << "\tInconsistent data, some is RAW and some is not\n";
             std::cout << "\tError found for module: " << i << std::endl;
@@ -320,15 +393,15 @@ void cAgipdReader::open(char *baseFilename){
 		if (module[i].noData)
 			continue;
 
-		if(module[i].n0 != module[_referenceModule].n0 || module[i].n1 != module[_referenceModule].n1) {
+		if(module[i].n0 != module[referenceModule].n0 || module[i].n1 != module[referenceModule].n1) {
 			std::cout << std::endl;
-            std::cout << "\tInconsistent image sizes between modules " << _referenceModule << " and " << i << std::endl;
-			std::cout << "\t ( " << module[i].n0 << " != " << module[_referenceModule].n0 << " )" << std::endl;
-			std::cout << "\t ( " << module[i].n1 << " != " << module[_referenceModule].n1 << " )" << std::endl;
-			moduleOK[i] = false;
+            std::cout << "\tInconsistent image sizes between modules " << referenceModule << " and " << i << std::endl;
+			std::cout << "\t ( " << module[i].n0 << " != " << module[referenceModule].n0 << " )" << std::endl;
+			std::cout << "\t ( " << module[i].n1 << " != " << module[referenceModule].n1 << " )" << std::endl;
+			seq.moduleOK[i] = false;
 		}
 		else {
-			moduleOK[i] = true;
+			seq.moduleOK[i] = true;
 		}
 	}
 	std::cout << " [OK]" <<  std::endl;
@@ -339,19 +412,19 @@ void cAgipdReader::open(char *baseFilename){
 
     
     // Check for start and end trainID and pulseID
-    minTrain = INT_MAX;
-    maxTrain = INT_MIN;
-    minPulse = INT_MAX;
-    maxPulse = INT_MIN;
-    minCell = INT_MAX;
-    maxCell = INT_MIN;
+    long	minTrain = INT_MAX;
+    long	maxTrain = INT_MIN;
+    long	minPulse = INT_MAX;
+    long	maxPulse = INT_MIN;
+    long	minCell = INT_MAX;
+    long	maxCell = INT_MIN;
 
     for(long i=0; i<nAGIPDmodules; i++)
 	{
 		if (module[i].noData)
 			continue;
 
-		if (moduleOK[i] == false)
+		if (seq.moduleOK[i] == false)
 			continue;
 
 
@@ -384,15 +457,10 @@ void cAgipdReader::open(char *baseFilename){
 		}
 	}
 
-	currentTrain = minTrain;
-	currentPulse = minPulse;
-
     std::cout << "****** Begin AGIPD configuration ******\n";
 
 	std::cout << "Trains extend from IDs " << minTrain << " to " << maxTrain << std::endl;
 	std::cout << "Pulses extend from IDs " << minPulse << " to " << maxPulse << std::endl;
-    std::cout << "Current train set to minimum, " << minTrain << std::endl;
-	std::cout << "Current pulse set to minimum, " << minPulse << std::endl;
 	std::cout << "Cells of module readout extend from IDs " << minCell << " to " << maxCell << std::endl;
 
     
@@ -409,14 +477,22 @@ void cAgipdReader::open(char *baseFilename){
 
     std::cout << "****** End AGIPD configuration ******\n";
 
+	seq.minTrain = minTrain;
+	seq.maxTrain = maxTrain;
+	seq.minPulse = minPulse;
+	seq.maxPulse = maxPulse;
+	seq.minCell = minCell;
+	seq.maxCell = maxCell;
+
     
     // Create trainID/pulseID pairs
+	seq.trainPulseMap.clear();
 	for(long module_num=0; module_num<nAGIPDmodules; module_num++) {
 		for (long train = minTrain; train <= maxTrain; train++) {
 			for (long pulse = minPulse; pulse <= maxPulse; pulse++) {
 				TrainPulsePair train2Pulse = std::make_pair(train, pulse);
 				TrainPulseModulePair tp2Module = std::make_pair(train2Pulse, module_num);
-				trainPulseMap[tp2Module] = -1; // start with unassigned
+				seq.trainPulseMap[tp2Module] = -1; // start with unassigned
 			}
 		}
 	}
@@ -431,15 +507,81 @@ void cAgipdReader::open(char *baseFilename){
 
 			TrainPulsePair train2Pulse = std::make_pair(trainID, pulseID);
 			TrainPulseModulePair tp2Module = std::make_pair(train2Pulse, module_num);
-			trainPulseMap[tp2Module] = frame;
+			seq.trainPulseMap[tp2Module] = frame;
 		}
 	}
 
+	return (seq.nframes > 0);
+}
+// cAgipdReader::openSequence()
+
+
+/*
+ *	Make module set <set> (opened by openSequence()) the one frames are read from.
+ *	handOverCalibration: take the calibration constants over from the current set instead of reading them again
+ */
+void cAgipdReader::installSequence(int set, bool handOverCalibration){
+	int				oldSet = _currentSet;
+	tAgipdSequence	&seq = _sequence[set];
+
+	module = _moduleSet[set];
+	_currentSet = set;
+
+	// Calibration constants do not change within a run
+	for(long i=0; i<nAGIPDmodules; i++) {
+		if(handOverCalibration && oldSet != set && module[i].adoptCalibrator(_moduleSet[oldSet][i]))
+			continue;
+		module[i].readDarkcal((char *)darkcalFilename[i].c_str());
+	}
+
+	_referenceModule = seq.referenceModule;
+	for(long i=0; i<nAGIPDmodules; i++) {
+		moduleFilename[i] = seq.moduleFilename[i];
+		moduleOK[i] = seq.moduleOK[i];
+	}
+	nframes = seq.nframes;
+	rawDetectorData = module[_referenceModule].rawDetectorData;
+	minTrain = seq.minTrain;
+	maxTrain = seq.maxTrain;
+	minPulse = seq.minPulse;
+	maxPulse = seq.maxPulse;
+	minCell = seq.minCell;
+	maxCell = seq.maxCell;
+	trainPulseMap.swap(seq.trainPulseMap);
+	currentFilename = seq.filename;
+
+	currentTrain = minTrain;
+	currentPulse = minPulse;
+    std::cout << "Current train set to minimum, " << minTrain << std::endl;
+	std::cout << "Current pulse set to minimum, " << minPulse << std::endl;
 	
-	// Allocate memory for data and masks
-	data = (float*) malloc(nn*sizeof(float));
-	badpixMask = (uint16_t*) malloc(nn*sizeof(uint16_t));
-	digitalGain = (uint16_t*) malloc(nn*sizeof(uint16_t));
+
+	// Det up size and layout of the assembled data stack
+	// Use module[0] as the reference and stack the modules one on top of another
+	long	oldnn = nn;
+	modulen[0] = module[_referenceModule].n0;
+	modulen[1] = module[_referenceModule].n1;
+	modulenn = modulen[0]*modulen[1];
+	nmodules[0] = 1;
+	nmodules[1] = nAGIPDmodules;
+	dims[0] = modulen[0]*nmodules[0];
+	dims[1] = modulen[1]*nmodules[1];
+	n0 = dims[0];
+	n1 = dims[1];
+	nn = n0*n1;
+
+	
+	// Allocate memory for data and masks (kept from the previous sequence if the size is the same)
+	if(data != NULL && nn != oldnn) {
+		free(data); data = NULL;
+		free(badpixMask); badpixMask = NULL;
+		free(digitalGain); digitalGain = NULL;
+	}
+	if(data == NULL) {
+		data = (float*) malloc(nn*sizeof(float));
+		badpixMask = (uint16_t*) malloc(nn*sizeof(uint16_t));
+		digitalGain = (uint16_t*) malloc(nn*sizeof(uint16_t));
+	}
 	
 	
 	// Pointer to the data location for each module
@@ -450,7 +592,21 @@ void cAgipdReader::open(char *baseFilename){
 		pdata[i] = data + i * offset;
 		pgain[i] = digitalGain + i*offset;
 		pmask[i] = badpixMask + i*offset;
+		module[i].badpixValue = _badpixValue;
 	}
+}
+// cAgipdReader::installSequence()
+
+
+/*
+ *	Open all AGIPD module files relating to the specified module
+ */
+void cAgipdReader::open(char *baseFilename){
+	generateCalibrationFilenames();
+	_runFiles.clear();
+	openSequence(_currentSet, baseFilename);
+	installSequence(_currentSet, false);
+	currentSequence = 0;
 
 	// Bye bye
 	std::cout << "All AGIPD files successfully opened\n";
@@ -458,16 +614,137 @@ void cAgipdReader::open(char *baseFilename){
 // cAgipdReader::open()
 
 
+/*
+ *	Open a run made of several sequence files (one file per sequence, for any module), read as one stream of frames:
+ *	nextFrame() carries on into the next sequence when one runs out.
+ *	Each following sequence is opened and indexed in the background while the current one is being read.
+ *	Sequences without frames are skipped. Returns false if no sequence has any.
+ */
+bool cAgipdReader::openRun(std::vector<std::string> &files){
+	generateCalibrationFilenames();
+	_runFiles = files;
+
+	for(long seq=0; seq<(long)_runFiles.size(); seq++) {
+		if(!openSequence(_currentSet, _runFiles[seq])) {
+			std::cout << "No frames in " << _runFiles[seq] << ", skipping this file" << std::endl;
+			closeSequence(_currentSet);
+			continue;
+		}
+		installSequence(_currentSet, false);
+		currentSequence = seq;
+		std::cout << "All AGIPD files successfully opened\n";
+
+		startOpening(seq+1);
+		return true;
+	}
+	nframes = 0;
+	return false;
+}
+// cAgipdReader::openRun()
+
+
+/*
+ *	Start opening sequence file <sequence> of the run into the spare module set, in the background
+ *	Opening makes HDF5 calls alongside the frame reads of the current set, so without a thread safe HDF5
+ *	the sequence is only opened when nextSequence() needs it.
+ */
+void cAgipdReader::startOpening(long sequence){
+	if(sequence >= (long)_runFiles.size())
+		return;
+
+	_nextSequence = sequence;
+	_nextOK = false;
+	_nextPending = true;
+#ifdef H5_HAVE_THREADSAFE
+	if(pthread_create(&_openThread, NULL, openThread, (void*) this) != 0) {
+		std::cout << "Error: unable to create AGIPD file opening thread" << std::endl;
+		exit(1);
+	}
+	_openThreadRunning = true;
+#endif
+}
+
+
+void *cAgipdReader::openThread(void *arg) {
+	cAgipdReader	*reader = (cAgipdReader*) arg;
+	reader->_nextOK = reader->openSequence(1-reader->_currentSet, reader->_runFiles[reader->_nextSequence]);
+	return NULL;
+}
+
+
+/*
+ *	Switch to the next sequence of the run (opened in the background by now, or opened here) and start opening the one after.
+ *	Sequences with no frames, or a different image size or type, are skipped.
+ *	Returns false at the end of the run.
+ */
+bool cAgipdReader::nextSequence(void){
+	while(_nextPending) {
+		_nextPending = false;
+		if(_openThreadRunning) {
+			pthread_join(_openThread, NULL);
+			_openThreadRunning = false;
+		}
+		else
+			_nextOK = openSequence(1-_currentSet, _runFiles[_nextSequence]);
+
+		int		set = 1-_currentSet;
+		long	seq = _nextSequence;
+		bool	usable = _nextOK;
+		if(!usable)
+			std::cout << "No frames in " << _runFiles[seq] << ", skipping this file" << std::endl;
+		else {
+			cAgipdModuleReader	&reference = _moduleSet[set][_sequence[set].referenceModule];
+			if(reference.n0 != modulen[0] || reference.n1 != modulen[1] || reference.rawDetectorData != rawDetectorData) {
+				std::cout << "Image size or data type of " << _runFiles[seq] << " differs from the rest of the run, skipping this file" << std::endl;
+				usable = false;
+			}
+		}
+		if(!usable) {
+			closeSequence(set);
+			startOpening(seq+1);
+			continue;
+		}
+
+		int		oldSet = _currentSet;
+		installSequence(set, true);
+		closeSequence(oldSet);
+		currentSequence = seq;
+		goodImages4ThisTrain = -1;
+		std::cout << "Now reading " << currentFilename << std::endl;
+
+		startOpening(seq+1);
+		return true;
+	}
+	return false;
+}
+// cAgipdReader::nextSequence()
+
+
+void cAgipdReader::closeSequence(int set){
+	for(long i=0; i<nAGIPDmodules; i++) {
+		if(verbose)
+			std::cout << "\tClosing " << _sequence[set].moduleFilename[i] << std::endl;
+		_moduleSet[set][i].close();
+	}
+	std::cout << "\t" << nAGIPDmodules << " module elements closed " << std::endl;
+}
+
+
 void cAgipdReader::close(void){
 
 	std::cout << "Closing AGIPD files " << std::endl;
+
+	// A sequence may still be opening
+	if(_openThreadRunning) {
+		pthread_join(_openThread, NULL);
+		_openThreadRunning = false;
+	}
+	_nextPending = false;
+	_runFiles.clear();
 	
 	// Close files for each module
-	for(long i=0; i<nAGIPDmodules; i++) {
-		std::cout << "\tClosing " << moduleFilename[i] << std::endl;
-		module[i].close();
-	}
-	std::cout << "\t" << nAGIPDmodules << " module elements closed " << std::endl;
+	closeSequence(0);
+	closeSequence(1);
 	
 	// Clean up memory
 	if(data != NULL) {
@@ -475,6 +752,7 @@ void cAgipdReader::close(void){
 		free(badpixMask); badpixMask = NULL;
 		free(digitalGain); digitalGain = NULL;
 	}
+	nn = 0;
 	std::cout << "\tAGIPD reader closed " << std::endl;
 }
 // cAgipdReader::close()
@@ -482,7 +760,29 @@ void cAgipdReader::close(void){
 
 // Why is there a separate private and public function for this?
 bool cAgipdReader::nextFrame() {
-	return nextFramePrivate();
+	return nextFrame(data, badpixMask, 1);
+}
+
+
+/*
+ *	Next frame, read and calibrated module by module straight into frameData and frameMask (nn elements each),
+ *	eg: the data_raw and pixelmask arrays of a Cheetah event. Bad pixels are set to badpixValue in frameMask, other pixels to 0.
+ *	Digital gain stages always go into digitalGain.
+ */
+bool cAgipdReader::nextFrame(float *frameData, uint16_t *frameMask, uint16_t badpixValue) {
+	_badpixValue = badpixValue;
+
+	// At the end of a sequence carry on with the next one of the run (if any)
+	do {
+		for (long i=0; i < nAGIPDmodules; i++) {
+			pdata[i] = frameData + i*modulenn;
+			pmask[i] = frameMask + i*modulenn;
+			module[i].badpixValue = badpixValue;
+		}
+		if (nextFramePrivate())
+			return true;
+	} while (nextSequence());
+	return false;
 }
 
 
@@ -512,6 +812,10 @@ bool cAgipdReader::nextFramePrivate() {
 		if(currentPulse % _pulseIDmodulo > 0)
 			continue;
 		
+		// Frames the caller does not want (eg: not in a hit list) are not read at all
+		if(_frameFilter != NULL && currentTrain < maxTrain && !_frameFilter(currentTrain, currentPulse, _frameFilterArg))
+			continue;
+		
 		success = readFrame(currentTrain, currentPulse);
 
 		if (lastModule >= 0) {
@@ -519,36 +823,27 @@ bool cAgipdReader::nextFramePrivate() {
 		}
 	}
     
-	// Statistics on bad pixels etc.
-    if(true) {
-        long    pixelsInGainLevel[3] = {0,0,0};
-        
-        // Pixels in each gain mode
-        for(long p=0; p<nn; p++) {
-            if(true) {
-                if(digitalGain[p]<0 || digitalGain[p] > 2 ){
-                    std::cout << "Bad digital gain value " << digitalGain[p] << " at p=" << p << std::endl;
-                    continue;
-                }
-            }
-            pixelsInGainLevel[digitalGain[p]] += 1;
-        }
-
-        // Bad pixels
-        long    nbad=0;
-        for(long p=0; p<nn; p++) {
-            if(badpixMask[p] != 0)
-                nbad++;
-        }
-        
-        std::cout << "nPixels in gain mode (0,1,2) = (";
-        std::cout << pixelsInGainLevel[0] << ", ";
-        std::cout << pixelsInGainLevel[1] << ", ";
-        std::cout << pixelsInGainLevel[2] << "),   ";
-        printf("%li bad pixels (%f%%)\n", nbad, (100.*nbad)/nn);
-    }
+	// Statistics on bad pixels etc. (counted during calibration), printed every _reportInterval frames
+	if(lastModule >= 0 && _reportInterval > 0) {
+		for(int g=0; g<3; g++)
+			_reportPixelsInGainStage[g] += pixelsInGainStage[g];
+		_reportBadPixels += nBadPixels;
+		_reportFrames++;
+
+		if(_reportFrames >= _reportInterval) {
+			std::cout << "AGIPD average over " << _reportFrames << " frames: nPixels in gain mode (0,1,2) = (";
+			std::cout << _reportPixelsInGainStage[0]/_reportFrames << ", ";
+			std::cout << _reportPixelsInGainStage[1]/_reportFrames << ", ";
+			std::cout << _reportPixelsInGainStage[2]/_reportFrames << "),   ";
+			printf("%li bad pixels (%f%%)\n", _reportBadPixels/_reportFrames, (100.*_reportBadPixels)/(_reportFrames*nn));
+			_reportFrames = 0;
+			_reportPixelsInGainStage[0] = _reportPixelsInGainStage[1] = _reportPixelsInGainStage[2] = 0;
+			_reportBadPixels = 0;
+		}
+	}
 
-    std::cout << "Returning image number " << goodImages4ThisTrain << " in train "  << currentTrain << std::endl;
+	if(verbose > 1)
+		std::cout << "Returning image number " << goodImages4ThisTrain << " in train "  << currentTrain << std::endl;
     return success;
 }
 
@@ -563,10 +858,12 @@ void cAgipdReader::resetCurrentFrame() {
 // Set the frame to blank if there is an error
 void cAgipdReader::setModuleToBlank(int moduleID) {
     statusID[moduleID] = 1;
+	modulePixelsInGainStage[moduleID][0] = modulePixelsInGainStage[moduleID][1] = modulePixelsInGainStage[moduleID][2] = 0;
+	moduleBadPixels[moduleID] = modulenn;
 	for(long p=0; p<modulenn; p++) {
         pdata[moduleID][p] = 0;
         pgain[moduleID][p] = 0;
-		pmask[moduleID][p] = 1;
+		pmask[moduleID][p] = _badpixValue;
 	}
 }
 
@@ -604,10 +901,11 @@ bool cAgipdReader::readFrame(long trainID, long pulseID)
 
 		// Read the requested frame number (and update metadata in structure)
         //std::cout << "Reading train " << trainID << " pulse " << pulseID << " module " << i << std::endl;
-        module[moduleID].readFrame(frameNum);
+        // Module reads and calibrates its panel in place in the target arrays
+        module[moduleID].readFrame(frameNum, pdata[moduleID], pgain[moduleID], pmask[moduleID]);
         // std::cout << "Reading frame done" << std::endl;
 
-		if (module[moduleID].noData) {
+		if (module[moduleID].noData || module[moduleID].data == NULL || module[moduleID].digitalGain == NULL) {
             setModuleToBlank(moduleID);
 			continue;
 		}
@@ -617,39 +915,42 @@ bool cAgipdReader::readFrame(long trainID, long pulseID)
 		cellID[moduleID] = module[moduleID].cellID;
 		statusID[moduleID] = module[moduleID].statusID;
 
-        memcpy(pdata[moduleID], module[moduleID].data, modulenn*sizeof(float));
-		memcpy(pgain[moduleID], module[moduleID].digitalGain, modulenn*sizeof(uint16_t));
-
 		lastModule = (int)moduleID;
 		
-		// Set entire panel mask to whatever the status is.
+		// Statistics from the calibration pass
+		for(int g=0; g<3; g++)
+			modulePixelsInGainStage[moduleID][g] = module[moduleID].pixelsInGainStage[g];
+		moduleBadPixels[moduleID] = module[moduleID].nBadPixels;
+
+		// Set entire panel mask to bad if the status is.
         //std::cout << "Memset mask" << std::endl;
 		if(module[moduleID].statusID != 0) {
 			for(long p=0; p<modulenn; p++) {
-				pmask[moduleID][p] = module[moduleID].statusID;
+				pmask[moduleID][p] = _badpixValue;
 			}
-		}
-		else {
-			memcpy(pmask[moduleID], module[moduleID].badpixMask, modulenn*sizeof(uint16_t));
+			moduleBadPixels[moduleID] = modulenn;
 		}
 	}
 
-	if (lastModule >= 0)
-	{
-		std::cout << "Read train " << trainID << ", pulseID " << pulseID << " with " << moduleCount << " modules";
+	// Event totals
+	pixelsInGainStage[0] = pixelsInGainStage[1] = pixelsInGainStage[2] = 0;
+	nBadPixels = 0;
+	for(int moduleID=0; moduleID<nAGIPDmodules; moduleID++) {
+		for(int g=0; g<3; g++)
+			pixelsInGainStage[g] += modulePixelsInGainStage[moduleID][g];
+		nBadPixels += moduleBadPixels[moduleID];
 	}
 
-    
-    // Print out the module IDs
-    if(true) {
+	// Per-frame console output only when asked for: at several kHz it swamps the log
+	if (lastModule >= 0 && verbose > 1)
+	{
+		std::cout << "Read train " << trainID << ", pulseID " << pulseID << " with " << moduleCount << " modules";
         std::cout << ", cellIDs=[";
         for(int moduleID=0; moduleID<nAGIPDmodules; moduleID++) {
             std::cout << cellID[moduleID] << ",";
         }
-        std::cout << "]"; // << std::endl;
-    }
-    
-    std::cout << std::endl;
+        std::cout << "]" << std::endl;
+	}
     
 	currentTrain = trainID;
 	currentPulse = pulseID;
@@ -717,3 +1018,160 @@ float *cAgipdReader::getCellAverage(int i)
 {
 	return cellAveData[i];
 }
+
+
+
+/*
+ *	Dark calibration
+ *	Modules are independent, so each module is calibrated by one thread reading that module's files
+ *	one frame at a time, in the same order as given on the command line.
+ *	Frames are read concurrently, which needs an HDF5 library built with thread safety (otherwise one thread is used).
+ */
+typedef struct {
+	cAgipdReader	*reader;
+	std::vector<std::string> moduleFiles[cAgipdReader::nAGIPDmodules];
+	std::string		outputFile[cAgipdReader::nAGIPDmodules];
+	std::vector<int> *gainStage;
+	int				nextModule;
+	int				nErrors;
+	pthread_mutex_t	mutex;			// Also held while opening and closing files (the H5LT helpers are not thread safe even with a thread safe HDF5)
+} tAgipdDarkcalJob;
+
+
+void *cAgipdReader::darkcalThread(void *arg) {
+	tAgipdDarkcalJob	*job = (tAgipdDarkcalJob*) arg;
+	cAgipdReader		*reader = job->reader;
+
+	while (true) {
+		pthread_mutex_lock(&job->mutex);
+		int moduleID = job->nextModule++;
+		pthread_mutex_unlock(&job->mutex);
+		if (moduleID >= nAGIPDmodules)
+			break;
+
+		cAgipdDarkcal	*darkcal = NULL;
+		for (size_t f = 0; f < job->moduleFiles[moduleID].size(); f++) {
+			int gain = (*job->gainStage)[f];
+			if (gain < 0)
+				continue;
+
+			cAgipdModuleReader	*module = new cAgipdModuleReader();
+			pthread_mutex_lock(&job->mutex);
+			module->open((char *) job->moduleFiles[moduleID][f].c_str(), moduleID);
+			module->readHeaders();
+			pthread_mutex_unlock(&job->mutex);
+
+			if (module->noData || !module->rawDetectorData) {
+				if (!module->noData)
+					std::cout << "\tDark calibration needs RAW data, skipping " << job->moduleFiles[moduleID][f] << std::endl;
+				pthread_mutex_lock(&job->mutex);
+				delete module;
+				pthread_mutex_unlock(&job->mutex);
+				continue;
+			}
+			module->setGainDataOffset(reader->_gainDataOffset[0], reader->_gainDataOffset[1]);
+			module->setCellIDcorrection(reader->_cellIDcorrection);
+			module->setRawDigitalGain(true);
+			if (darkcal == NULL)
+				darkcal = new cAgipdDarkcal(module->n0, module->n1);
+
+			// Same choice of frames as nextFrame(), and the first pulse in a train is junk
+			for (long frame = 0; frame < module->nframes; frame++) {
+				long pulseID = module->pulseIDlist[frame];
+				if (module->trainIDlist[frame] <= 0 || module->statusIDlist[frame] != 0)
+					continue;
+				if (pulseID == 0 || pulseID < reader->_firstPulseId || pulseID % reader->_pulseIDmodulo > 0)
+					continue;
+
+				module->readFrame(frame);
+				if (module->data == NULL || module->digitalGain == NULL)
+					continue;
+				int cell = module->cellID;
+				if (module->cellIDcorrection != 1 && module->cellIDcorrection != 0)
+					cell /= module->cellIDcorrection;
+				darkcal->addFrame(gain, cell, module->data, module->digitalGain);
+			}
+			std::cout << "\tModule " << moduleID << ": " << darkcal->nFrames << " dark frames after " << job->moduleFiles[moduleID][f] << std::endl;
+
+			pthread_mutex_lock(&job->mutex);
+			delete module;
+			pthread_mutex_unlock(&job->mutex);
+		}
+
+		int status = 1;
+		if (darkcal != NULL) {
+			pthread_mutex_lock(&job->mutex);
+			status = darkcal->write(job->outputFile[moduleID].c_str());
+			pthread_mutex_unlock(&job->mutex);
+			delete darkcal;
+		}
+		if (status != 0) {
+			pthread_mutex_lock(&job->mutex);
+			std::cout << "\tNo dark calibration written for module " << moduleID << std::endl;
+			job->nErrors++;
+			pthread_mutex_unlock(&job->mutex);
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ *	Generate dark calibration files (in the format read by cAgipdCalibrator) from dark runs.
+ *	files: RAW files for any one module (files for the other modules are guessed as in open())
+ *	gainStage: gain stage each file was taken in (0=high, 1=medium, 2=low), -1 to skip the file
+ *	outputFile: calibration file for module 00, the other modules replace AGIPD00 with AGIPD01...
+ *	Returns the number of modules for which no calibration could be written.
+ */
+int cAgipdReader::generateDarkcal(std::vector<std::string> &files, std::vector<int> &gainStage, std::string outputFile, int nThreads) {
+	tAgipdDarkcalJob	job;
+	char	tempstr[10];
+
+	if (outputFile.find("AGIPD") == std::string::npos) {
+		std::cout << "Error: dark calibration filename must contain AGIPD00 (replaced by the module number): " << outputFile << std::endl;
+		return nAGIPDmodules;
+	}
+
+	for (size_t f = 0; f < files.size(); f++) {
+		std::string	names[nAGIPDmodules];
+		int			reference;
+		generateModuleFilenames(files[f].c_str(), names, &reference);
+		for (long i = 0; i < nAGIPDmodules; i++)
+			job.moduleFiles[i].push_back(names[i]);
+	}
+	for (long i = 0; i < nAGIPDmodules; i++) {
+		job.outputFile[i] = outputFile;
+		snprintf(tempstr, sizeof(tempstr), "%02li", i);
+		job.outputFile[i].replace(outputFile.find("AGIPD")+5, 2, tempstr);
+	}
+	job.reader = this;
+	job.gainStage = &gainStage;
+	job.nextModule = 0;
+	job.nErrors = 0;
+	pthread_mutex_init(&job.mutex, NULL);
+
+	if (nThreads < 1)
+		nThreads = 1;
+	if (nThreads > nAGIPDmodules)
+		nThreads = nAGIPDmodules;
+#ifndef H5_HAVE_THREADSAFE
+	if (nThreads > 1) {
+		std::cout << "HDF5 library is not thread safe, dark calibration runs in a single thread" << std::endl;
+		nThreads = 1;
+	}
+#endif
+	std::cout << "Dark calibration of " << files.size() << " file(s) with " << nThreads << " thread(s)" << std::endl;
+
+	std::vector<pthread_t> threads(nThreads);
+	for (int t = 0; t < nThreads; t++) {
+		if (pthread_create(&threads[t], NULL, darkcalThread, (void*) &job) != 0) {
+			std::cout << "Error: unable to create dark calibration thread" << std::endl;
+			exit(1);
+		}
+	}
+	for (int t = 0; t < nThreads; t++)
+		pthread_join(threads[t], NULL);
+
+	pthread_mutex_destroy(&job.mutex);
+	return job.nErrors;
+}
@@ -21,6 +21,7 @@
 #include <hdf5_hl.h>
 #include <map>
 #include <sstream>
+#include <pthread.h>
 #include "agipd_module_reader.h"
 #include "hdf5_functions.h"
 #include "agipd_calibrator.h"
@@ -42,10 +43,13 @@ public:
 	~cAgipdReader();
 	
 	void open(char[]);
+	bool openRun(std::vector<std::string> &files);
+	bool nextSequence(void);
     void setScheme(char[]);
 	void close(void);
 	bool readFrame(long trainID, long pulseID);
 	bool nextFrame();
+	bool nextFrame(float *frameData, uint16_t *frameMask, uint16_t badpixValue);
 	void resetCurrentFrame();
 	bool goodFrame() { return (lastModule >= 0); }
 
@@ -62,6 +66,11 @@ public:
 	
 	
 	void setDoNotApplyGainSwitch(bool _val) {_doNotApplyGainSwitch = _val; }
+	void setFrameFilter(bool (*filter)(long trainID, long pulseID, void *arg), void *arg) { _frameFilter = filter; _frameFilterArg = arg; }
+	void setReportInterval(long n) { _reportInterval = n; if (_reportInterval < 0) _reportInterval = 0; }
+
+	int generateDarkcal(std::vector<std::string> &files, std::vector<int> &gainStage, std::string outputFile, int nThreads);
+	static int findSequenceFiles(std::string dir, std::vector<std::string> &files);
 
 	
 
@@ -75,6 +84,10 @@ public:
 	long        currentPulse;
 	uint16_t	currentCell;
 	
+	// Sequence file being read (the file given for it, and its position in the list given to openRun())
+	std::string	currentFilename;
+	long		currentSequence;
+
 	// Calibration files (set to "No_file_specified" in constructor)
 	std::string	gaincalFile;
 	std::string	darkcalFile;
@@ -92,6 +105,13 @@ public:
 	// Metadata for this event
 	uint16_t	cellID[nAGIPDmodules];
 	uint16_t	statusID[nAGIPDmodules];
+
+	// Pixels in each digital gain stage and bad pixels in this event, per module and in total
+	// (counted during calibration; a missing or bad module counts all its pixels as bad)
+	long		modulePixelsInGainStage[nAGIPDmodules][3];
+	long		moduleBadPixels[nAGIPDmodules];
+	long		pixelsInGainStage[3];
+	long		nBadPixels;
 	
 	// Module dimensions (how modules are placed in the 2D slab of data)
 	long		nmodules[2];
@@ -100,6 +120,7 @@ public:
 	
 	// Pointer to the data location for each module for easy memcpy()
 	// and those who want to look at the data as a stack of panels
+	// (data and mask point into the arrays given to nextFrame(), or into data and badpixMask)
 	float*  	pdata[nAGIPDmodules];
 	uint16_t*	pgain[nAGIPDmodules];
 	uint16_t*	pmask[nAGIPDmodules];
@@ -114,14 +135,46 @@ public:
 	int **      cellAveCounts;
 
 private:
-	void				generateModuleFilenames(char[]);
+	/*
+	 *	Everything opened and worked out for one sequence file (all 16 modules) before it is read.
+	 *	The next sequence of a run is prepared in the second module set while the current one is read.
+	 */
+	typedef struct {
+		std::string		filename;
+		std::string		moduleFilename[nAGIPDmodules];
+		bool			moduleOK[nAGIPDmodules];
+		int				referenceModule;
+		long			nframes;
+		long			minTrain, maxTrain;
+		long			minPulse, maxPulse;
+		long			minCell, maxCell;
+		TrainPulseMap	trainPulseMap;
+	} tAgipdSequence;
+
+	void				generateModuleFilenames(const char *filename, std::string *moduleFilename, int *referenceModule);
+	void				generateCalibrationFilenames(void);
+	bool				openSequence(int set, std::string filename);
+	void				installSequence(int set, bool handOverCalibration);
+	void				closeSequence(int set);
+	void				startOpening(long sequence);
+	static void			*openThread(void *);
 
 	long				currentFrame;
 	std::string			moduleFilename[nAGIPDmodules];
-	cAgipdModuleReader	module[nAGIPDmodules];
+	cAgipdModuleReader	*module;			// The current module set
 	bool				moduleOK[nAGIPDmodules];
     void                setModuleToBlank(int);
 
+	cAgipdModuleReader	_moduleSet[2][nAGIPDmodules];
+	tAgipdSequence		_sequence[2];
+	int					_currentSet;
+	std::vector<std::string> _runFiles;		// Sequence files of the run, from openRun()
+	long				_nextSequence;		// Sequence being opened in the background
+	bool				_nextOK;
+	bool				_nextPending;		// _nextSequence is still to be switched to (opened, or being opened, if _openThreadRunning)
+	bool				_openThreadRunning;
+	pthread_t			_openThread;
+
 
 	std::string			darkcalFilename[nAGIPDmodules];
 	std::string			gaincalFilename[nAGIPDmodules];
@@ -136,6 +189,13 @@ private:
     int                 _referenceModule;   // The module number passed on the command line (evidently it exists)
 	int					_gainDataOffset[2];	// Gain data hyperslab offset relative to image data frame
 	bool				_doNotApplyGainSwitch;		// Bypass gain switching
+	uint16_t			_badpixValue;		// Mask value of bad pixels in the current target arrays
+	bool				(*_frameFilter)(long, long, void*);	// Frames it rejects are skipped without being read
+	void				*_frameFilterArg;
+	long				_reportInterval;	// Print gain stage and bad pixel statistics every this many frames (0 = never)
+	long				_reportFrames;
+	long				_reportPixelsInGainStage[3];
+	long				_reportBadPixels;
 
 
 	/* Housekeeping for trains and pulses */
@@ -155,6 +215,7 @@ private:
 	TrainPulseMap       trainPulseMap;
 
 	bool nextFramePrivate();
+	static void *darkcalThread(void *);
 };
 
 
@@ -17,9 +17,12 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <string.h>
 #include <cxxabi.h>
+#include <pthread.h>
+#include <deque>
 #include "agipd_reader.h"
 #include "cheetah.h"
 
@@ -66,6 +69,11 @@ struct tCheetahEuXFELparams {
     std::string calibFile;
     std::string exptName;
 	std::string dataFormat;
+	std::string shard;
+	std::string darkcal;
+	std::string darkruns;
+	int darkThreads;
+	int readAhead;
     int frameStride;
     int frameSkip;
 	int verbose;
@@ -75,6 +83,203 @@ void parse_config(int, char *[], tCheetahEuXFELparams*);
 void waitForCheetahWorkers(cGlobal*);
 
 
+/*
+ *	Hit list replay: is this frame in the list (by train and pulse, or by event name)?
+ */
+typedef struct {
+	cGlobal		*global;
+	cAgipdReader *agipd;
+} tHitlistFilter;
+
+static bool hitlistFrameFilter(long trainID, long pulseID, void *arg) {
+	tHitlistFilter *filter = (tHitlistFilter*) arg;
+	if(filter->global->hitlistContains(trainID, pulseID, -1))
+		return true;
+	std::string eventName = filter->agipd->currentFilename + "_" + i_to_str(trainID) + "_" + i_to_str(pulseID);
+	return filter->global->hitlistContains(eventName.c_str());
+}
+
+
+
+/*
+ *	AGIPD frames are read by a reader thread, calibrated straight into the data_raw and pixelmask arrays of new events
+ *	(bad pixels as PIXEL_IS_BAD), and handed to Cheetah by the main thread.
+ *	At most <window> events wait in the queue, so the reader stays that far ahead of the hand-off.
+ */
+typedef struct {
+	cGlobal			*global;
+	cAgipdReader	*agipd;
+	tHitlistFilter	*hitlistFilter;
+	long			window;
+	bool			done;
+	std::deque<cEventData*> ready;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	readyCond;
+	pthread_cond_t	spaceCond;
+} tAgipdReadAhead;
+
+
+static void queueEvent(tAgipdReadAhead *q, cEventData *eventData) {
+	pthread_mutex_lock(&q->mutex);
+	while((long) q->ready.size() >= q->window)
+		pthread_cond_wait(&q->spaceCond, &q->mutex);
+	q->ready.push_back(eventData);
+	pthread_cond_signal(&q->readyCond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+
+static void *agipdReaderThread(void *threadarg) {
+	tAgipdReadAhead	*q = (tAgipdReadAhead*) threadarg;
+	cGlobal			*global = q->global;
+	cAgipdReader	&agipd = *q->agipd;
+	long			frameNumber = 0;
+	int				detId = 0;
+
+    // Timing stuff
+    cMyTimer timer_dataLoad;
+    cMyTimer timer_evtCopy;
+
+	// Event the next frame is read into; skipped frames leave it for the frame after
+	cEventData		*eventData = NULL;
+
+
+	// Multi-process runs: each shard takes a contiguous range of the files
+	std::vector<std::string> files;
+	for(long fnum=0; fnum<CheetahEuXFELparams.inputFiles.size(); fnum++) {
+		if(global->inRunShard(fnum, CheetahEuXFELparams.inputFiles.size()))
+			files.push_back(CheetahEuXFELparams.inputFiles[fnum]);
+	}
+
+	// All listed *AGIPD00*.h5 files are read as one stream of frames
+	// (each following file is opened in the background while the current one is read, empty files are skipped)
+	bool	opened = (files.size() > 0 && agipd.openRun(files));
+	if(!opened)
+		std::cout << "Uh oh - no frames in any of the files, nothing to do" << std::endl;
+
+	// Check image dimensions: frames are read straight into the events
+	else if (agipd.n0 != global->detector[detId].pix_nx || agipd.n1 != global->detector[detId].pix_ny) {
+		printf("Error: File image dimensions of %li x %li did not match detector dimensions of %li x %li\n", agipd.n0, agipd.n1, global->detector[detId].pix_nx, global->detector[detId].pix_ny);
+		opened = false;
+	}
+
+
+	// Process frames
+	std::cout << "Reading individual frames\n";
+	long	sequence = -1;
+	long	runNumber = 0;
+	while (opened) {
+		if(eventData == NULL)
+			eventData = cheetahNewEvent(global);
+
+		// Image and bad pixels go straight into the event
+        timer_dataLoad.start();
+		bool more = agipd.nextFrame(eventData->detector[detId].data_raw, eventData->detector[detId].pixelmask, PIXEL_IS_BAD);
+        timer_dataLoad.stop();
+        global->timeProfile.addToTimer(timer_dataLoad.duration, global->timeProfile.TIMER_EVENTDATA);
+		if(!more)
+			break;
+
+
+		// Guess the run number (once per file)
+		if(agipd.currentSequence != sequence) {
+			sequence = agipd.currentSequence;
+			long pos = agipd.currentFilename.rfind("-AGIPD");
+			runNumber = atoi(agipd.currentFilename.substr(pos-4,4).c_str());
+			std::cout << "Reading " << agipd.currentFilename << ": this is run number " << runNumber << std::endl;
+			global->runNumber = (int) runNumber;
+		}
+
+
+        // Incrememnt the frame number
+        frameNumber++;
+
+
+        if (!agipd.goodFrame()) {
+			continue;
+		}
+
+
+		// First pulse in a train is junk
+		if(agipd.currentPulse == 0) {
+			std::cout << "Skipping pulse 0 in train (in cheetah-euxfel.cpp)" << std::endl;
+			continue;
+		}
+
+        if(false) {
+            if(agipd.currentCell >= 62) {
+                std::cout << "!! Hack for Orville June 2018: Skipping pulses beyond 62 in train (in cheetah-euxfel.cpp)" << std::endl;
+                continue;
+            }
+        }
+
+        // Sort by XFEL pulse ID.
+        // This may not always be a good idea as the number of pulses is currently set to a maximum 15 elsewhere
+		bool sortByPulseID = (strcmp(global->pumpLaserScheme, "xfelpulseid") == 0);
+		if(sortByPulseID) {
+			if(agipd.currentPulse < 0 || agipd.currentPulse >= global->nPowderClasses-1) {
+				continue;
+			}
+		}
+
+
+		// Fill in the rest of the Cheetah event
+        timer_evtCopy.start();
+		eventData->frameNumber = frameNumber;
+
+        // Add a sensible event name
+        std::string eventName = agipd.currentFilename + "_" + i_to_str(agipd.currentTrain) + "_" + i_to_str(agipd.currentPulse);
+		strcpy(eventData->eventname,eventName.c_str());
+
+        // Copy other information into event (extract from EuXFEL data once it's available)
+		eventData->runNumber = runNumber;
+		eventData->nPeaks = 0;
+		eventData->pumpLaserCode = 0;
+		eventData->pumpLaserDelay = 0;
+		eventData->photonEnergyeV = global->defaultPhotonEnergyeV;
+		eventData->wavelengthA = 12400 / global->defaultPhotonEnergyeV;
+		eventData->pGlobal = global;
+		//eventData->detectorZ = 15e-3;
+
+		// Add train and pulse ID to event data.
+		eventData->trainID = agipd.currentTrain;
+		eventData->pulseID = agipd.currentPulse;
+		eventData->cellID = agipd.currentCell;
+
+		if(sortByPulseID) {
+			eventData->pumpLaserCode = agipd.currentPulse;
+			eventData->powderClass = agipd.currentPulse;
+		}
+		eventData->detector[detId].data_raw_is_float = true;
+
+		// Gain stage and bad pixel counts from the calibration pass (for the CXI file and frame log)
+		for(int g=0; g<3; g++)
+			eventData->detector[detId].nPixelsInGainStage[g] = agipd.pixelsInGainStage[g];
+		eventData->detector[detId].nBadPixels = agipd.nBadPixels;
+        timer_evtCopy.stop();
+        global->timeProfile.addToTimer(timer_evtCopy.duration, global->timeProfile.TIMER_EVENTCOPY);
+
+
+		// Over to the main thread
+		queueEvent(q, eventData);
+		eventData = NULL;
+	}
+    // end agipd.nextFrame()
+
+	std::cout << "Closing AGIPD modules" << std::endl;
+	agipd.close();
+
+	if(eventData != NULL)
+		cheetahDestroyEvent(eventData);
+
+	pthread_mutex_lock(&q->mutex);
+	q->done = true;
+	pthread_cond_signal(&q->readyCond);
+	pthread_mutex_unlock(&q->mutex);
+	return NULL;
+}
+
+
 
 //static char testfile[]="R0126-AGG01-S00002.h5";
 
@@ -82,6 +287,7 @@ void waitForCheetahWorkers(cGlobal*);
 // Main entry point for EuXFEL version of Cheetah
 // Usage:
 // > cheetah-euxfel -i inifile.ini -c calib.ini <*AGIPD00*.h5>
+// > cheetah-euxfel -i inifile.ini -c calib.ini <run directory>
 //
 int main(int argc, char* argv[]) {
 	
@@ -107,15 +313,48 @@ int main(int argc, char* argv[]) {
 	
 	std::cout << "----------------" << std::endl;
 
-    // Timing stuff
-    cMyTimer timer_dataLoad;
-    cMyTimer timer_evtCopy;
 
-	
+	// Dark calibration mode: accumulate the dark runs, write the calibration files and stop
+	if(CheetahEuXFELparams.darkcal != "") {
+		std::vector<int> darkRuns;
+		std::string list = CheetahEuXFELparams.darkruns;
+		while(list != "") {
+			size_t comma = list.find(',');
+			darkRuns.push_back(atoi(list.substr(0, comma).c_str()));
+			list = (comma == std::string::npos) ? "" : list.substr(comma+1);
+		}
+
+		// Gain stage of each file from its run number (high, medium, low gain runs in --darkruns order)
+		std::vector<int> gainStage;
+		for(size_t i=0; i<CheetahEuXFELparams.inputFiles.size(); i++) {
+			std::string file = CheetahEuXFELparams.inputFiles[i];
+			int stage = 0;
+			if(darkRuns.size() > 0) {
+				size_t pos = file.rfind("-AGIPD");
+				int run = (pos != std::string::npos && pos >= 4) ? atoi(file.substr(pos-4,4).c_str()) : -1;
+				stage = -1;
+				for(size_t r=0; r<darkRuns.size() && r<3; r++)
+					if(darkRuns[r] == run)
+						stage = r;
+				if(stage < 0)
+					std::cout << "Run " << run << " is not in --darkruns, skipping " << file << std::endl;
+			}
+			gainStage.push_back(stage);
+		}
+
+		cAgipdReader agipd;
+		agipd.setScheme((char*) CheetahEuXFELparams.dataFormat.c_str());
+		int nErrors = agipd.generateDarkcal(CheetahEuXFELparams.inputFiles, gainStage, CheetahEuXFELparams.darkcal, CheetahEuXFELparams.darkThreads);
+		std::cout << "Dark calibration finished";
+		if(nErrors > 0)
+			std::cout << " (" << nErrors << " module(s) not calibrated)";
+		std::cout << std::endl;
+		exit(nErrors > 0 ? 1 : 0);
+	}
+
 	// Initialize Cheetah
 	std::cout << "Setting up Cheetah" << std::endl;
 	static cGlobal cheetahGlobal;
-	static long frameNumber = 0;
 	static time_t startT;
 	time(&startT);
 
@@ -123,6 +362,8 @@ int main(int argc, char* argv[]) {
 	strcpy(cheetahGlobal.configFile, CheetahEuXFELparams.iniFile.c_str());
     strcpy(cheetahGlobal.calibFile, CheetahEuXFELparams.calibFile.c_str());
 	strcpy(cheetahGlobal.experimentID, CheetahEuXFELparams.exptName.c_str());
+	if(CheetahEuXFELparams.shard != "" && cheetahGlobal.setRunShard(CheetahEuXFELparams.shard.c_str()) != 0)
+		exit(1);
 
 	cheetahInit(&cheetahGlobal);
 	
@@ -143,153 +384,63 @@ int main(int argc, char* argv[]) {
 	if(CheetahEuXFELparams.nogainswitch)
 		agipd.setDoNotApplyGainSwitch(CheetahEuXFELparams.nogainswitch);
 
+	// Gain stage statistics go to the console as often as status.txt is updated
+	agipd.setReportInterval(cheetahGlobal.saveInterval);
+
 	//  Files for calibration stuff
 	//	Will pick up darkcal and gaincal filenames from cheetah.ini: maintains the same 'feel'as before
 	//	Specify file for AGIPD00 - files for other modules are guessed automatically
 	//	cheetahGlobal.detector[0] defaults to "No_file_specified" if nothing set in cheetah.ini
 	agipd.darkcalFile = cheetahGlobal.detector[0].darkcalFile;
 	agipd.gaincalFile = cheetahGlobal.detector[0].gaincalFile;
+
+	// Replaying a hit list: frames that are not listed are not read
+	tHitlistFilter hitlistFilter;
+	hitlistFilter.global = &cheetahGlobal;
+	hitlistFilter.agipd = &agipd;
+	if(cheetahGlobal.useHitlist)
+		agipd.setFrameFilter(hitlistFrameFilter, &hitlistFilter);
 	
     
     
-	// Loop through all listed *AGIPD00*.h5 files
-	for(long fnum=0; fnum<CheetahEuXFELparams.inputFiles.size(); fnum++) {
-
-		
-		// Open the file
-		std::cout << "Opening " << CheetahEuXFELparams.inputFiles[fnum] << std::endl;
-		agipd.open((char *)CheetahEuXFELparams.inputFiles[fnum].c_str());
-
-        // How big is this file?
-        std::cout << "Number of frames in this file: " << agipd.nframes << std::endl;
-        
-        // Handle empty files, which now appear quite commonly
-        if(agipd.nframes == 0) {
-            std::cout << "Uh oh - we seem to have an empty file here, agipd.nframes == " << agipd.nframes << std::endl;
-            std::cout << "Skipping this file \n" ;
-            agipd.close();
-            continue;
-        }
-        
-        
-		// Guess the run number
-		long	pos;
-		long	runNumber;
-		pos = CheetahEuXFELparams.inputFiles[fnum].rfind("-AGIPD");
-		runNumber = atoi(CheetahEuXFELparams.inputFiles[fnum].substr(pos-4,4).c_str());
-		std::cout << "This is run number " << runNumber << std::endl;
-		cheetahGlobal.runNumber = (int) runNumber;
-
-		
-		
-		// Process frames in this file
-		std::cout << "Reading individual frames\n";
-		agipd.resetCurrentFrame();
-        timer_dataLoad.start();
-		while (agipd.nextFrame()) {
-            timer_dataLoad.stop();
-
-			
-            // Incrememnt the frame number
-            frameNumber++;
-
-            
-            if (!agipd.goodFrame()) {
-				continue;
-			}
-
-			
-			// First pulse in a train is junk
-			if(agipd.currentPulse == 0) {
-				std::cout << "Skipping pulse 0 in train (in cheetah-euxfel.cpp)" << std::endl;
-				continue;
-			}
-            
-            if(false) {
-                if(agipd.currentCell >= 62) {
-                    std::cout << "!! Hack for Orville June 2018: Skipping pulses beyond 62 in train (in cheetah-euxfel.cpp)" << std::endl;
-                    continue;
-                }
-            }
-
-            
-			// Set up new Cheetah event
-            timer_evtCopy.start();
-			cEventData * eventData = cheetahNewEvent(&cheetahGlobal);
-			eventData->frameNumber = frameNumber;
-
-            // Add a sensible event name
-            std::string eventName = CheetahEuXFELparams.inputFiles[fnum] + "_" + i_to_str(agipd.currentTrain) + "_" + i_to_str(agipd.currentPulse);
-			strcpy(eventData->eventname,eventName.c_str());
-            
-            // Copy other information into event (extract from EuXFEL data once it's available)
-			eventData->runNumber = runNumber;
-			eventData->nPeaks = 0;
-			eventData->pumpLaserCode = 0;
-			eventData->pumpLaserDelay = 0;
-			eventData->photonEnergyeV = cheetahGlobal.defaultPhotonEnergyeV;
-			eventData->wavelengthA = 12400 / cheetahGlobal.defaultPhotonEnergyeV;
-			eventData->pGlobal = &cheetahGlobal;
-			//eventData->detectorZ = 15e-3;
-			
-			// Add train and pulse ID to event data.
-			eventData->trainID = agipd.currentTrain;
-			eventData->pulseID = agipd.currentPulse;
-			eventData->cellID = agipd.currentCell;
-			
-			
-            // Sort by XFEL pulse ID.
-            // This may not always be a good idea as the number of pulses is currently set to a maximum 15 elsewhere
-			if(strcmp(cheetahGlobal.pumpLaserScheme, "xfelpulseid") == 0) {
-				if(agipd.currentPulse >= 0 && agipd.currentPulse < cheetahGlobal.nPowderClasses-1) {
-					eventData->pumpLaserCode = agipd.currentPulse;
-					eventData->powderClass = agipd.currentPulse;
-				}
-				else {
-					continue;
-				}
-			}
-
-			
-			// Check image dimensions
-			int detId = 0;
-			if (agipd.n0 != cheetahGlobal.detector[detId].pix_nx || agipd.n1 != cheetahGlobal.detector[detId].pix_ny) {
-				printf("Error: File image dimensions of %zu x %zu did not match detector dimensions of %li x %li\n", agipd.n0, agipd.n1, eventData->pGlobal->detector[detId].pix_nx, eventData->pGlobal->detector[detId].pix_ny);
-				continue;
-			}
-
-			// Copy AGIPD image into Cheetah event
-			memcpy(eventData->detector[detId].data_raw, agipd.data, agipd.nn*sizeof(float));
-			eventData->detector[detId].data_raw_is_float = true;
-					   
-            
-            // Copy AGIPD bad pixel mask into Cheetah event
-            // We do nothing with the gain information beyond checking how many pixels in each gain stage
-            for (long i = 0; i < cheetahGlobal.detector[detId].pix_nn; i++) {
-                if(agipd.badpixMask[i] != 0) {
-                    eventData->detector[detId].pixelmask[i] = PIXEL_IS_BAD;
-                }
-            }
-            timer_evtCopy.stop();
-
+	// Start the reader thread
+	tAgipdReadAhead readAhead;
+	readAhead.global = &cheetahGlobal;
+	readAhead.agipd = &agipd;
+	readAhead.hitlistFilter = &hitlistFilter;
+	readAhead.window = CheetahEuXFELparams.readAhead;
+	readAhead.done = false;
+	pthread_mutex_init(&readAhead.mutex, NULL);
+	pthread_cond_init(&readAhead.readyCond, NULL);
+	pthread_cond_init(&readAhead.spaceCond, NULL);
+	pthread_t readerThread;
+	if(pthread_create(&readerThread, NULL, agipdReaderThread, (void*) &readAhead) != 0) {
+		std::cout << "Error: could not start AGIPD reader thread" << std::endl;
+		exit(1);
+	}
 
-			// Process event
-			cheetahProcessEventMultithreaded(&cheetahGlobal, eventData);
-            
-            // Timing
-            cheetahGlobal.timeProfile.addToTimer(timer_evtCopy.duration, cheetahGlobal.timeProfile.TIMER_EVENTCOPY);
-            cheetahGlobal.timeProfile.addToTimer(timer_dataLoad.duration, cheetahGlobal.timeProfile.TIMER_EVENTDATA);
-            timer_dataLoad.start();
+	// Hand events to Cheetah as the reader delivers them
+	while(true) {
+		pthread_mutex_lock(&readAhead.mutex);
+		while(readAhead.ready.empty() && !readAhead.done)
+			pthread_cond_wait(&readAhead.readyCond, &readAhead.mutex);
+		if(readAhead.ready.empty()) {
+			pthread_mutex_unlock(&readAhead.mutex);
+			break;
 		}
-        // end agipd.nextFrame()
-	
-		usleep(5000);
-		std::cout << "Closing AGIPD modules" << std::endl;
-		agipd.close();
-		std::cout << "Finished with " << CheetahEuXFELparams.inputFiles[fnum] << std::endl;
+		cEventData *eventData = readAhead.ready.front();
+		readAhead.ready.pop_front();
+		pthread_cond_signal(&readAhead.spaceCond);
+		pthread_mutex_unlock(&readAhead.mutex);
 
+		// Process event
+		cheetahProcessEventMultithreaded(&cheetahGlobal, eventData);
 	}
-	// File loop
+
+	pthread_join(readerThread, NULL);
+	pthread_mutex_destroy(&readAhead.mutex);
+	pthread_cond_destroy(&readAhead.readyCond);
+	pthread_cond_destroy(&readAhead.spaceCond);
 
 	
 	/*
@@ -369,6 +520,7 @@ void print_help(void){
     std::cout << "Anton Barty, Helen Ginn, September 2015-\n";
     std::cout << std::endl;
     std::cout << "usage: cheetah-euxfel -i <INIFILE> -c calib.ini *AGIPD00.s*.h5 \n";
+    std::cout << "       cheetah-euxfel -i <INIFILE> -c calib.ini <run directory> \n";
     std::cout << std::endl;
     std::cout << "\t--inifile=<file)     Specifies cheetah.ini file to use\n";
     std::cout << "\t--experiment=<name>  String specifying the experiment name (used for lableling and setting the file layout)\n";
@@ -376,6 +528,12 @@ void print_help(void){
     std::cout << "\t--skip=<n>           Skip the first <n> frame of each .h5 file\n";
 	std::cout << "\t--nogainswitch       Disable gain switching calibration (assume all high gain)\n";
 	std::cout << "\t--dataformat         Data layout {XFEL2012, XFEL2066}\n";
+	std::cout << "\t--shard=<i/N>        Process only the i-th of N contiguous ranges of the files (combine the outputs with cheetah-merge)\n";
+	std::cout << "\t--darkcal=<file>     Generate dark calibration files from the input (dark) files instead of processing them,\n";
+	std::cout << "\t                     <file> names the file for module 00 (eg Cheetah-AGIPD00-calib.h5)\n";
+	std::cout << "\t--darkruns=<h,m,l>   Run numbers of the high, medium and low gain dark runs (default: all files are high gain)\n";
+	std::cout << "\t--darkthreads=<n>    Number of modules calibrated in parallel (default 4)\n";
+	std::cout << "\t--readahead=<n>      Number of events the reader thread may have ready ahead of processing (default 4)\n";
     std::cout << std::endl;
     std::cout << "End of help\n";
 }
@@ -391,6 +549,11 @@ void parse_config(int argc, char *argv[], tCheetahEuXFELparams *global) {
     global->calibFile = "None";
     global->exptName = "XFEL";
 	global->dataFormat = "XFEL2012";
+	global->shard = "";
+	global->darkcal = "";
+	global->darkruns = "";
+	global->darkThreads = 4;
+	global->readAhead = 4;
     global->frameStride = -1;
     global->frameSkip = -1;
 	global->nogainswitch = false;
@@ -407,6 +570,11 @@ void parse_config(int argc, char *argv[], tCheetahEuXFELparams *global) {
 		{ "dataformat", required_argument, NULL, 'f' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "nogainswitch", no_argument, NULL, 'g' },
+		{ "shard", required_argument, NULL, 0 },
+		{ "darkcal", required_argument, NULL, 0 },
+		{ "darkruns", required_argument, NULL, 0 },
+		{ "darkthreads", required_argument, NULL, 0 },
+		{ "readahead", required_argument, NULL, 0 },
 		{ "help", no_argument, NULL, 'h' },
 		{ NULL, no_argument, NULL, 0 }
 	};
@@ -458,6 +626,28 @@ void parse_config(int argc, char *argv[], tCheetahEuXFELparams *global) {
 					global->nogainswitch = true;
 					std::cout << "No gain switching " << global->nogainswitch << std::endl;
 				}
+				if( strcmp( "shard", longOpts[longIndex].name ) == 0 ) {
+					global->shard = optarg;
+					std::cout << "Shard set to " << global->shard << std::endl;
+				}
+				if( strcmp( "darkcal", longOpts[longIndex].name ) == 0 ) {
+					global->darkcal = optarg;
+					std::cout << "Dark calibration will be written to " << global->darkcal << std::endl;
+				}
+				if( strcmp( "darkruns", longOpts[longIndex].name ) == 0 ) {
+					global->darkruns = optarg;
+					std::cout << "Dark runs (high, medium, low gain) " << global->darkruns << std::endl;
+				}
+				if( strcmp( "darkthreads", longOpts[longIndex].name ) == 0 ) {
+					global->darkThreads = atoi(optarg);
+					std::cout << "Dark calibration threads set to " << global->darkThreads << std::endl;
+				}
+				if( strcmp( "readahead", longOpts[longIndex].name ) == 0 ) {
+					global->readAhead = atoi(optarg);
+					if(global->readAhead < 1)
+						global->readAhead = 1;
+					std::cout << "Read-ahead set to " << global->readAhead << " events" << std::endl;
+				}
 				if( strcmp( "dataformat", longOpts[longIndex].name ) == 0 ) {
 					global->dataFormat = true;
 					std::cout << "Data format will be " << global->dataFormat << std::endl;
@@ -474,7 +664,16 @@ void parse_config(int argc, char *argv[], tCheetahEuXFELparams *global) {
 	// This is where unprocessed arguments end up
 	std::cout << "optind: " << optind << std::endl;
 	std::cout << "Number of unprocessed arguments: " << argc-optind << std::endl;
+	// A run directory stands for all of its sequence files
 	for(long i=optind; i<argc; i++) {
+		struct stat	st;
+		if(stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+			int n = cAgipdReader::findSequenceFiles(argv[i], global->inputFiles);
+			std::cout << "\t" << argv[i] << ": " << n << " sequence file(s)" << std::endl;
+			for(size_t f=global->inputFiles.size()-n; f<global->inputFiles.size(); f++)
+				std::cout << "\t\t" << global->inputFiles[f] << std::endl;
+			continue;
+		}
 		global->inputFiles.push_back(argv[i]);
 		std::cout << "\t" << global->inputFiles.back() << std::endl;
 	}
@@ -505,19 +505,42 @@ void cHDF5dataset::setChunkCacheSize(void){
 
 void* cHDF5dataset::checkAllocReadHyperslab(int ndims, hsize_t *slab_start, hsize_t *slab_size, hid_t h5_type_id, size_t targetsize){
     
+    // Allocate space into which data will be read
+    long nelements = 1;
+    for(int i = 0;i<ndims;i++)
+        nelements *= slab_size[i];
+    
+    void *databuffer = malloc(nelements*targetsize);
+    
+    if(!readHyperslab(ndims, slab_start, slab_size, h5_type_id, databuffer)) {
+        free(databuffer);
+        return NULL;
+    }
+    
+    // Return
+    return databuffer;
+}
+
+
+/*
+ *  Read a hyperslab into a buffer supplied by the caller
+ *  HDF5 converts from the type in the file to h5_type_id on the fly, so eg: uint16_t data can be read straight into a float array
+ */
+bool cHDF5dataset::readHyperslab(int ndims, hsize_t *slab_start, hsize_t *slab_size, hid_t h5_type_id, void *databuffer){
+    
     
     // Checks
     if(h5_ndims != ndims) {
-        std::cout << "\tcheckAllocReadHyperslab error: dimensions of data sets do not match requested dimensions (oops)\n";
+        std::cout << "\treadHyperslab error: dimensions of data sets do not match requested dimensions (oops)\n";
         std::cout << "\tndims=" << ndims << ", h5_ndims=" << h5_ndims << std::endl;
         std::cout << "\tIn field " << h5_fieldname << std::endl;
-        return NULL;
+        return false;
     }
     
     for(int i=0; i<h5_ndims; i++) {
         if(slab_start[i] < 0 || slab_start[i]+slab_size[i] > h5_dims[i]){
-            std::cout << "\tcheckAllocReadHyperslab error: One array dimension runs out of bounds (oops), dim=" << i << std::endl;
-            return NULL;
+            std::cout << "\treadHyperslab error: One array dimension runs out of bounds (oops), dim=" << i << std::endl;
+            return false;
         }
     }
     
@@ -541,14 +564,6 @@ void* cHDF5dataset::checkAllocReadHyperslab(int ndims, hsize_t *slab_start, hsiz
     H5Sselect_hyperslab(h5_dataspace_id, H5S_SELECT_SET, slab_start, NULL, count, slab_size);
     
     
-    // Allocate space into which data will be read
-    long nelements = 1;
-    for(int i = 0;i<ndims;i++)
-        nelements *= slab_size[i];
-    
-    void *databuffer = malloc(nelements*targetsize);;
-    
-    
     // Define how to map the hyperslab into memory
     // See https://support.hdfgroup.org/HDF5/doc/RM/RM_H5D.html#Dataset-Read
     hid_t        memspace_id;
@@ -564,14 +579,14 @@ void* cHDF5dataset::checkAllocReadHyperslab(int ndims, hsize_t *slab_start, hsiz
     /*
      * Read the data using the previously defined hyperslab.
      */
-    H5Dread(h5_dataset_id, h5_type_id, memspace_id, h5_dataspace_id, H5P_DEFAULT, databuffer);
+    herr_t status = H5Dread(h5_dataset_id, h5_type_id, memspace_id, h5_dataspace_id, H5P_DEFAULT, databuffer);
     
     
     // Cleanup
     H5Sclose(memspace_id);
     
     // Return
-    return databuffer;
+    return (status >= 0);
 }
 
 
@@ -62,6 +62,7 @@ public:
     void    open(char[],char[]);
     void    setChunkCacheSize(void);
     void*   checkAllocReadHyperslab(int, hsize_t*, hsize_t*, hid_t, size_t);
+    bool    readHyperslab(int, hsize_t*, hsize_t*, hid_t, void*);
     void    close(void);
     
 private:
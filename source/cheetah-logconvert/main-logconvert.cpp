@@ -0,0 +1,293 @@
+//
+//  cheetah-logconvert
+//
+//  Turns the binary logs written with binaryLogs=1 back into the text logs of a normal run:
+//	-	frames.bin	->	frames.txt, and with --run=<n> the class logs r0123-class<n>-log.txt
+//	-	peaks.bin	->	peaks.txt
+//  Lines are printed with the same formats as libcheetah, so the text logs are the ones the run would have written
+//  (in block order, which like the text logs of a multithreaded run is not strictly the frame order).
+//  Distributed under the GPLv3 license
+//
+//  Usage:
+//  > cheetah-logconvert [--run=123] [--output=<dir>] frames.bin peaks.bin
+//
+//  Class logs are only written for the classes that have frames.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "columnLog.h"
+
+
+// This is for parsing getopt_long()
+struct tCheetahLogconvertParams {
+	std::vector<std::string> inputs;
+	std::string outputDir;
+	long runNumber;
+} CheetahLogconvertParams;
+void parse_config(int, char *[], tCheetahLogconvertParams*);
+
+
+static std::string outputPath(std::string input, std::string name) {
+	std::string dir = CheetahLogconvertParams.outputDir;
+	if(dir.empty()) {
+		size_t	slash = input.rfind('/');
+		dir = (slash == std::string::npos) ? "." : input.substr(0, slash);
+	}
+	return dir + "/" + name;
+}
+
+static FILE *createText(std::string path) {
+	FILE	*fp = fopen(path.c_str(), "w");
+	if(fp == NULL)
+		printf("Error: Cannot create %s\n", path.c_str());
+	else
+		printf("Writing %s\n", path.c_str());
+	return fp;
+}
+
+
+/*
+ *	frames.bin (see writeLog() in log.cpp for the text formats)
+ */
+static int convertFrames(cColumnLogReader &log, std::string input) {
+	FILE	*fp = createText(outputPath(input, "frames.txt"));
+	if(fp == NULL)
+		return 1;
+
+	int	eventName = log.find("eventName");
+	int	filename = log.find("filename");
+	int	stackSlice = log.find("stackSlice");
+	int	frameNumber = log.find("frameNumber");
+	int	hit = log.find("hit");
+	int	powderClass = log.find("powderClass");
+	int	hitScore = log.find("hitScore");
+	int	photonEnergyeV = log.find("photonEnergyeV");
+	int	wavelengthA = log.find("wavelengthA");
+	int	detectorZ = log.find("detectorZ");
+	int	gmd1 = log.find("gmd1");
+	int	gmd2 = log.find("gmd2");
+	int	energySpectrumExist = log.find("energySpectrumExist");
+	int	nPeaks = log.find("nPeaks");
+	int	peakNpix = log.find("peakNpix");
+	int	peakTotal = log.find("peakTotal");
+	int	peakResolution = log.find("peakResolution");
+	int	peakDensity = log.find("peakDensity");
+	int	pumpLaserCode = log.find("pumpLaserCode");
+	int	pumpLaserDelay = log.find("pumpLaserDelay");
+	int	pumpLaserOn = log.find("pumpLaserOn");
+	int	exposureTime = log.find("exposureTime");
+	int	nGainStage0 = log.find("nGainStage0");		// EuXFEL only
+	int	nGainStage1 = log.find("nGainStage1");
+	int	nGainStage2 = log.find("nGainStage2");
+	int	nBadPixels = log.find("nBadPixels");
+
+	fprintf(fp,
+			"# eventData->eventName, eventData->filename, eventData->stackSlice, eventData->xtcFrameNumber, eventData->hit, eventData->powderClass, eventData->hitScore, eventData->photonEnergyeV, eventData->wavelengthA, eventData->gmd1, eventData->gmd2, eventData->detector[0].detectorZ, eventData->energySpectrumExist,  eventData->nPeaks, eventData->peakNpix, eventData->peakTotal, eventData->peakResolution, eventData->peakDensity, eventData->pumpLaserCode, eventData->pumpLaserDelay, eventData->pumpLaserOn%s\n",
+			nGainStage0 >= 0 ? ", nGainStage0, nGainStage1, nGainStage2, nBadPixels" : "");
+
+	long	runNumber = CheetahLogconvertParams.runNumber;
+	std::map<long, FILE*> classLogs;
+	long	n = 0;
+
+	while(log.nextBlock()) {
+		for(long r=0; r<log.nRows; r++) {
+			fprintf(fp, "%s, ", log.getString(eventName, r));
+			fprintf(fp, "%s, ", log.getString(filename, r));
+			fprintf(fp, "%ld, ", log.getLong(stackSlice, r));
+			fprintf(fp, "%li, ", log.getLong(frameNumber, r));
+			fprintf(fp, "%i, ", (int) log.getLong(hit, r));
+			fprintf(fp, "%g, ", log.getDouble(photonEnergyeV, r));
+			fprintf(fp, "%g, ", log.getDouble(wavelengthA, r));
+			fprintf(fp, "%g, ", log.getDouble(detectorZ, r));
+			fprintf(fp, "%d, ", (int) log.getLong(nPeaks, r));
+			fprintf(fp, "%g, ", log.getDouble(peakNpix, r));
+			fprintf(fp, "%g, ", log.getDouble(peakTotal, r));
+			fprintf(fp, "%g, ", log.getDouble(peakResolution, r));
+			fprintf(fp, "%g, ", log.getDouble(peakDensity, r));
+			if(nGainStage0 >= 0) {
+				fprintf(fp, "%lf, ", log.getDouble(exposureTime, r));
+				fprintf(fp, "%ld, ", log.getLong(nGainStage0, r));
+				fprintf(fp, "%ld, ", log.getLong(nGainStage1, r));
+				fprintf(fp, "%ld, ", log.getLong(nGainStage2, r));
+				fprintf(fp, "%ld\n ", log.getLong(nBadPixels, r));
+			}
+			else
+				fprintf(fp, "%lf\n ", log.getDouble(exposureTime, r));
+
+			if(runNumber <= 0)
+				continue;
+			long	cls = log.getLong(powderClass, r);
+			FILE	*cfp = classLogs[cls];
+			if(cfp == NULL) {
+				char	name[1024];
+				sprintf(name, "r%04li-class%ld-log.txt", runNumber, cls);
+				cfp = createText(outputPath(input, name));
+				if(cfp == NULL) {
+					fclose(fp);
+					return 1;
+				}
+				fprintf(cfp, "eventData->eventname, eventData->filename, eventData->stackSlice, eventData->xtcFrameNumber, eventData->hitScore, eventData->photonEnergyeV, eventData->wavelengthA, eventData->detector[0].detectorZ, eventData->gmd1, eventData->gmd2, eventData->energySpectrumExist, eventData->nPeaks, eventData->peakNpix, eventData->peakTotal, eventData->peakResolution, eventData->peakDensity, eventData->pumpLaserCode, eventData->pumpLaserDelay\n");
+				classLogs[cls] = cfp;
+			}
+			fprintf(cfp, "%s, ", log.getString(eventName, r));
+			fprintf(cfp, "%s, ", log.getString(filename, r));
+			fprintf(cfp, "%ld, ", log.getLong(stackSlice, r));
+			fprintf(cfp, "%li, ", log.getLong(frameNumber, r));
+			fprintf(cfp, "%g, ", log.getDouble(hitScore, r));
+			fprintf(cfp, "%g, ", log.getDouble(photonEnergyeV, r));
+			fprintf(cfp, "%g, ", log.getDouble(wavelengthA, r));
+			fprintf(cfp, "%g, ", log.getDouble(detectorZ, r));
+			fprintf(cfp, "%g, ", log.getDouble(gmd1, r));
+			fprintf(cfp, "%g, ", log.getDouble(gmd2, r));
+			fprintf(cfp, "%i, ", (int) log.getLong(energySpectrumExist, r));
+			fprintf(cfp, "%d, ", (int) log.getLong(nPeaks, r));
+			fprintf(cfp, "%g, ", log.getDouble(peakNpix, r));
+			fprintf(cfp, "%g, ", log.getDouble(peakTotal, r));
+			fprintf(cfp, "%g, ", log.getDouble(peakResolution, r));
+			fprintf(cfp, "%g, ", log.getDouble(peakDensity, r));
+			fprintf(cfp, "%d, ", (int) log.getLong(pumpLaserCode, r));
+			fprintf(cfp, "%g, ", log.getDouble(pumpLaserDelay, r));
+			fprintf(cfp, "%d\n", (int) log.getLong(pumpLaserOn, r));
+		}
+		n += log.nRows;
+	}
+
+	for(std::map<long, FILE*>::iterator it=classLogs.begin(); it!=classLogs.end(); it++)
+		fclose(it->second);
+	fclose(fp);
+	printf("\t%li frames\n", n);
+	return 0;
+}
+
+
+/*
+ *	peaks.bin (see writePeakFile() in saveFrame.cpp for the text format)
+ */
+static int convertPeaks(cColumnLogReader &log, std::string input) {
+	FILE	*fp = createText(outputPath(input, "peaks.txt"));
+	if(fp == NULL)
+		return 1;
+	fprintf(fp,
+			"# frameNumber, eventName, photonEnergyEv, wavelengthA, GMD, peak_index, peak_x_raw, peak_y_raw, peak_r_assembled, peak_q, peak_resA, nPixels, totalIntensity, maxIntensity, sigmaBG, SNR\n");
+
+	int	column[16];
+	const char	*names[16] = {"frameNumber", "eventName", "photonEnergyEv", "wavelengthA", "GMD", "peak_index", "peak_x_raw", "peak_y_raw",
+		"peak_r_assembled", "peak_q", "peak_resA", "nPixels", "totalIntensity", "maxIntensity", "sigmaBG", "SNR"};
+	for(int c=0; c<16; c++)
+		column[c] = log.find(names[c]);
+
+	long	n = 0;
+	while(log.nextBlock()) {
+		for(long r=0; r<log.nRows; r++) {
+			fprintf(fp, "%li, %s, %f, %f, %f, %li, %f, %f, %f, %f, %f, %li, %f, %f, %f, %f\n",
+					log.getLong(column[0], r),
+					log.getString(column[1], r),
+					log.getDouble(column[2], r),
+					log.getDouble(column[3], r),
+					log.getDouble(column[4], r),
+					log.getLong(column[5], r),
+					log.getDouble(column[6], r),
+					log.getDouble(column[7], r),
+					log.getDouble(column[8], r),
+					log.getDouble(column[9], r),
+					log.getDouble(column[10], r),
+					(long) floorf(log.getDouble(column[11], r)),
+					log.getDouble(column[12], r),
+					log.getDouble(column[13], r),
+					log.getDouble(column[14], r),
+					log.getDouble(column[15], r));
+		}
+		n += log.nRows;
+	}
+	fclose(fp);
+	printf("\t%li peaks\n", n);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	parse_config(argc, argv, &CheetahLogconvertParams);
+
+	int		nErrors = 0;
+	for(size_t i=0; i<CheetahLogconvertParams.inputs.size(); i++) {
+		std::string	input = CheetahLogconvertParams.inputs[i];
+		cColumnLogReader log;
+		if(log.open(input.c_str())) {
+			nErrors++;
+			continue;
+		}
+		printf("Converting %s\n", input.c_str());
+		if(log.find("peak_index") >= 0)
+			nErrors += convertPeaks(log, input);
+		else if(log.find("powderClass") >= 0)
+			nErrors += convertFrames(log, input);
+		else {
+			printf("Error: %s is neither a frame log nor a peak log\n", input.c_str());
+			nErrors++;
+		}
+	}
+
+	if(nErrors) {
+		printf("%i file(s) could not be converted\n", nErrors);
+		exit(1);
+	}
+	return 0;
+}
+
+
+void parse_config(int argc, char *argv[], tCheetahLogconvertParams *global) {
+
+	// Defaults
+	global->outputDir = "";
+	global->runNumber = 0;
+
+	// Add getopt-long options
+	// three legitimate values: no_argument, required_argument and optional_argument
+	const struct option longOpts[] = {
+		{ "output", required_argument, NULL, 'o' },
+		{ "run", required_argument, NULL, 'r' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, no_argument, NULL, 0 }
+	};
+	const char optString[] = "o:r:h?";
+
+	int opt;
+	int longIndex = 0;
+	while((opt = getopt_long(argc, argv, optString, longOpts, &longIndex)) != -1) {
+		switch(opt) {
+			case 'o':
+				global->outputDir = optarg;
+				break;
+
+			case 'r':
+				global->runNumber = atol(optarg);
+				break;
+
+			case 'h':
+			case '?':
+			default:
+				std::cout << "Usage: cheetah-logconvert [--run=<n>] [--output=<dir>] frames.bin peaks.bin" << std::endl;
+				std::cout << "\t-r, --run=<n>\t\tAlso write the class logs of run n from frames.bin" << std::endl;
+				std::cout << "\t-o, --output=<dir>\tDirectory for the text logs (default: next to each binary log)" << std::endl;
+				std::cout << "\t-h, --help\t\tThis message" << std::endl;
+				exit(1);
+		}
+	}
+
+	for(int i=optind; i<argc; i++)
+		global->inputs.push_back(argv[i]);
+	if(global->inputs.size() == 0) {
+		std::cout << "Usage: cheetah-logconvert [--run=<n>] [--output=<dir>] frames.bin peaks.bin" << std::endl;
+		exit(1);
+	}
+}
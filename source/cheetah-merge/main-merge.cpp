@@ -0,0 +1,675 @@
+//
+//  cheetah-merge
+//
+//  Combines the output directories of a run processed as several run shards (--shard=i/N) into the files of a
+//  single-process run:
+//	-	Powder sums (r0123-detector0-class1-sum.h5) are added up from the running sums each shard keeps in /partial,
+//		and the saved values (sum, average, sigma) recomputed with the same code as libcheetah.
+//	-	Histograms (r0123-detector0-histogram.h5) are added up.
+//	-	CXI and results files become master files with virtual datasets over the shard files, in shard order.
+//	-	Frame, peak and class logs are concatenated in shard order, with stack positions remapped to the master files.
+//		Binary logs (frames.bin, peaks.bin) are concatenated block by block in the same way.
+//  Distributed under the GPLv3 license
+//
+//  Usage:
+//  > cheetah-merge --output=r0123 r0123-shard0 r0123-shard1 r0123-shard2
+//
+//  Shards must be given in order (0/N, 1/N...), as the merged stacks and logs follow the order on the command line.
+//  The shard directories must stay in place, as the merged CXI files refer to the data in them.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <hdf5.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "cheetah.h"
+
+
+// This is for parsing getopt_long()
+struct tCheetahMergeParams {
+	std::vector<std::string> shardDirs;
+	std::string outputDir;
+} CheetahMergeParams;
+void parse_config(int, char *[], tCheetahMergeParams*);
+
+
+// Stack offset of each shard in each merged CXI file
+typedef std::map<std::string, std::vector<long> > tStackOffsets;
+
+
+static std::string shardPath(std::string dir, std::string name) {
+	return dir + "/" + name;
+}
+
+static bool fileExists(std::string path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+static bool endsWith(std::string s, std::string suffix) {
+	return s.size() >= suffix.size() && s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/*
+ *	Path of file relative to directory dir (both existing), so that merged output can be moved with the shards
+ */
+static std::string relativePath(std::string dir, std::string file) {
+	char	rdir[PATH_MAX];
+	char	rfile[PATH_MAX];
+	if(realpath(dir.c_str(), rdir) == NULL || realpath(file.c_str(), rfile) == NULL)
+		return file;
+
+	std::string	from = std::string(rdir) + "/";
+	std::string	to = rfile;
+	size_t	common = 0;
+	for(size_t i=0; i<from.size() && i<to.size() && from[i] == to[i]; i++)
+		if(from[i] == '/')
+			common = i+1;
+
+	std::string	rel;
+	for(size_t i=common; i<from.size(); i++)
+		if(from[i] == '/')
+			rel += "../";
+	return rel + to.substr(common);
+}
+
+/*
+ *	In-process CXI shards (name-sNN.cxi) are already covered by the shard's own master file
+ */
+static bool isCXIShardFile(std::string dir, std::string name) {
+	size_t	dot = name.rfind('.');
+	if(dot == std::string::npos || dot < 4)
+		return false;
+	std::string	stem = name.substr(0, dot);
+	size_t	s = stem.rfind("-s");
+	if(s == std::string::npos || s+2 == stem.size() || stem.find_first_not_of("0123456789", s+2) != std::string::npos)
+		return false;
+	return fileExists(shardPath(dir, stem.substr(0, s) + name.substr(dot)));
+}
+
+
+static hid_t openDatasetIfExists(hid_t file_id, const char *path) {
+	hid_t	dataset_id;
+	H5E_BEGIN_TRY {
+		dataset_id = H5Dopen(file_id, path, H5P_DEFAULT);
+	} H5E_END_TRY;
+	return dataset_id;
+}
+
+static long datasetSize(hid_t dataset_id) {
+	hid_t	dataspace_id = H5Dget_space(dataset_id);
+	long	n = H5Sget_simple_extent_npoints(dataspace_id);
+	H5Sclose(dataspace_id);
+	return n;
+}
+
+// Read a whole dataset, adding it to sum (of n elements), returns 1 if missing or of a different size
+static int addDataset(hid_t fh, const char *path, hid_t memtype, void *buffer, void *sum, long n) {
+	hid_t	dh = openDatasetIfExists(fh, path);
+	if(dh < 0)
+		return 1;
+	if(datasetSize(dh) != n || H5Dread(dh, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer) < 0) {
+		H5Dclose(dh);
+		return 1;
+	}
+	H5Dclose(dh);
+
+	if(H5Tequal(memtype, H5T_NATIVE_DOUBLE) > 0)
+		for(long i=0; i<n; i++) ((double*) sum)[i] += ((double*) buffer)[i];
+	else if(H5Tequal(memtype, H5T_NATIVE_LONG) > 0)
+		for(long i=0; i<n; i++) ((long*) sum)[i] += ((long*) buffer)[i];
+	else if(H5Tequal(memtype, H5T_NATIVE_UINT16) > 0)
+		for(long i=0; i<n; i++) ((uint16_t*) sum)[i] += ((uint16_t*) buffer)[i];
+	return 0;
+}
+
+static int writeDataset(hid_t fh, const char *path, hid_t memtype, void *buffer) {
+	hid_t	dh = openDatasetIfExists(fh, path);
+	if(dh < 0)
+		return 1;
+	H5Dwrite(dh, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer);
+	H5Dclose(dh);
+	return 0;
+}
+
+static herr_t listDatasets(hid_t group, const char *name, const H5L_info_t *info, void *op_data) {
+	(void) group;
+	(void) info;
+	((std::vector<std::string> *) op_data)->push_back(name);
+	return 0;
+}
+
+
+/*
+ *	Powder: the first shard's file is the template, every saved dataset is recomputed from the summed running sums
+ */
+static int mergePowder(std::string name, std::vector<std::string> &sources, std::string output) {
+
+	std::vector<hid_t> fh;
+	for(size_t k=0; k<sources.size(); k++) {
+		fh.push_back(H5Fopen(sources[k].c_str(), H5F_ACC_RDONLY, H5P_DEFAULT));
+		if(fh.back() < 0) {
+			printf("Error: Cannot open %s\n", sources[k].c_str());
+			return 1;
+		}
+	}
+
+	hid_t	ph = -1;
+	H5E_BEGIN_TRY {
+		ph = H5Gopen(fh[0], "partial", H5P_DEFAULT);
+	} H5E_END_TRY;
+	if(ph < 0) {
+		printf("Error: %s has no running sums (/partial), was it written with --shard?\n", sources[0].c_str());
+		return 1;
+	}
+	std::vector<std::string> partial;
+	H5Literate(ph, H5_INDEX_NAME, H5_ITER_INC, NULL, listDatasets, &partial);
+	H5Gclose(ph);
+
+	// Frame count
+	long	nframes = 0;
+	long	n;
+	for(size_t k=0; k<sources.size(); k++) {
+		if(addDataset(fh[k], "data/nframes", H5T_NATIVE_LONG, &n, &nframes, 1)) {
+			printf("Error: No frame count in %s\n", sources[k].c_str());
+			return 1;
+		}
+	}
+
+	// Same layout as the first shard, then overwrite the values
+	hid_t	out = H5Fcreate(output.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	if(out < 0) {
+		printf("Error: Cannot create %s\n", output.c_str());
+		return 1;
+	}
+	H5Ocopy(fh[0], "data", out, "data", H5P_DEFAULT, H5P_DEFAULT);
+	writeDataset(out, "data/nframes", H5T_NATIVE_LONG, &nframes);
+
+	int	status = 0;
+	for(size_t i=0; i<partial.size() && status == 0; i++) {
+		std::string	dname = partial[i];
+		if(endsWith(dname, "_squared") || endsWith(dname, "_counter"))
+			continue;
+		std::string	sumPath = "partial/" + dname;
+		std::string	squaredPath = sumPath + "_squared";
+		std::string	counterPath = sumPath + "_counter";
+
+		hid_t	dh = openDatasetIfExists(fh[0], sumPath.c_str());
+		long	pix_nn = datasetSize(dh);
+		H5Dclose(dh);
+		bool	masked = false;
+		dh = openDatasetIfExists(fh[0], counterPath.c_str());
+		if(dh >= 0) {
+			masked = true;
+			H5Dclose(dh);
+		}
+
+		double	*buffer = (double*) calloc(pix_nn, sizeof(double));
+		double	*sum = (double*) calloc(pix_nn, sizeof(double));
+		double	*squared = (double*) calloc(pix_nn, sizeof(double));
+		long	*counter = masked ? (long*) calloc(pix_nn, sizeof(long)) : NULL;
+		long	*counterBuffer = masked ? (long*) calloc(pix_nn, sizeof(long)) : NULL;
+		for(size_t k=0; k<sources.size(); k++) {
+			if(addDataset(fh[k], sumPath.c_str(), H5T_NATIVE_DOUBLE, buffer, sum, pix_nn)
+			   || addDataset(fh[k], squaredPath.c_str(), H5T_NATIVE_DOUBLE, buffer, squared, pix_nn)
+			   || (masked && addDataset(fh[k], counterPath.c_str(), H5T_NATIVE_LONG, counterBuffer, counter, pix_nn))) {
+				printf("Error: %s in %s is missing or of a different size\n", sumPath.c_str(), sources[k].c_str());
+				status = 1;
+				break;
+			}
+		}
+
+		if(status == 0) {
+			double	*value = (double*) calloc(pix_nn, sizeof(double));
+			double	*average = (double*) calloc(pix_nn, sizeof(double));
+			double	*sigma = (double*) calloc(pix_nn, sizeof(double));
+			powderStatistics(pix_nn, nframes, sum, squared, counter, value, average, sigma);
+			writeDataset(out, ("data/" + dname).c_str(), H5T_NATIVE_DOUBLE, value);
+			writeDataset(out, ("data/" + dname + "_average").c_str(), H5T_NATIVE_DOUBLE, average);
+			writeDataset(out, ("data/" + dname + "_sigma").c_str(), H5T_NATIVE_DOUBLE, sigma);
+			free(value);
+			free(average);
+			free(sigma);
+		}
+		free(buffer);
+		free(sum);
+		free(squared);
+		free(counter);
+		free(counterBuffer);
+	}
+
+	// Peak powder
+	hid_t	dh = openDatasetIfExists(fh[0], "data/peakpowder");
+	if(status == 0 && dh >= 0) {
+		long	pix_nn = datasetSize(dh);
+		double	*buffer = (double*) calloc(pix_nn, sizeof(double));
+		double	*sum = (double*) calloc(pix_nn, sizeof(double));
+		for(size_t k=0; k<sources.size() && status == 0; k++)
+			status = addDataset(fh[k], "data/peakpowder", H5T_NATIVE_DOUBLE, buffer, sum, pix_nn);
+		if(status == 0)
+			writeDataset(out, "data/peakpowder", H5T_NATIVE_DOUBLE, sum);
+		free(buffer);
+		free(sum);
+	}
+	if(dh >= 0)
+		H5Dclose(dh);
+
+	H5Fclose(out);
+	for(size_t k=0; k<fh.size(); k++)
+		H5Fclose(fh[k]);
+	if(status)
+		printf("Error: Could not merge %s\n", name.c_str());
+	return status;
+}
+
+
+/*
+ *	Histograms: counts and frame numbers add up, the rest of the file is recomputed by libcheetah
+ */
+static int mergeHistogram(std::string name, std::vector<std::string> &sources, std::string output) {
+
+	hid_t	fh = H5Fopen(sources[0].c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	if(fh < 0) {
+		printf("Error: Cannot open %s\n", sources[0].c_str());
+		return 1;
+	}
+	hid_t	dh = openDatasetIfExists(fh, "data/histogram");
+	if(dh < 0) {
+		printf("Error: No histogram in %s\n", sources[0].c_str());
+		H5Fclose(fh);
+		return 1;
+	}
+	hsize_t	dims[3];
+	hid_t	sh = H5Dget_space(dh);
+	int		ndims = H5Sget_simple_extent_ndims(sh);
+	H5Sget_simple_extent_dims(sh, dims, NULL);
+	H5Sclose(sh);
+	hid_t	dcpl = H5Dget_create_plist(dh);
+	int		h5compress = (H5Pget_nfilters(dcpl) > 0);
+	H5Pclose(dcpl);
+	H5Dclose(dh);
+	if(ndims != 3) {
+		printf("Error: Unexpected histogram layout in %s\n", sources[0].c_str());
+		H5Fclose(fh);
+		return 1;
+	}
+
+	long	hist_nss = dims[0];
+	long	hist_nfs = dims[1];
+	long	histNbins = dims[2];
+	long	hist_nn = hist_nss*hist_nfs;
+	long	histMin = 0;
+	float	histBinSize = 1;
+	float	*darkcal = (float*) calloc(hist_nn, sizeof(float));
+	long	n;
+	addDataset(fh, "data/histogramMin", H5T_NATIVE_LONG, &n, &histMin, 1);
+	dh = openDatasetIfExists(fh, "data/histogramBinsize");
+	if(dh >= 0) {
+		H5Dread(dh, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, &histBinSize);
+		H5Dclose(dh);
+	}
+	dh = openDatasetIfExists(fh, "data/offset");
+	if(dh >= 0) {
+		if(datasetSize(dh) == hist_nn)
+			H5Dread(dh, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, darkcal);
+		H5Dclose(dh);
+	}
+	H5Fclose(fh);
+
+	// Counts wrap around at 65536, as they do in a single process
+	long	hist_count = 0;
+	uint64_t	hist_nnn = (uint64_t) hist_nn*histNbins;
+	uint16_t	*histogram = (uint16_t*) calloc(hist_nnn, sizeof(uint16_t));
+	uint16_t	*buffer = (uint16_t*) calloc(hist_nnn, sizeof(uint16_t));
+	int		status = 0;
+	for(size_t k=0; k<sources.size() && status == 0; k++) {
+		fh = H5Fopen(sources[k].c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+		if(fh < 0 || addDataset(fh, "data/histogram", H5T_NATIVE_UINT16, buffer, histogram, hist_nnn)
+		   || addDataset(fh, "data/histogramCount", H5T_NATIVE_LONG, &n, &hist_count, 1)) {
+			printf("Error: %s is missing or has a different histogram layout\n", sources[k].c_str());
+			status = 1;
+		}
+		if(fh >= 0)
+			H5Fclose(fh);
+	}
+	free(buffer);
+
+	if(status == 0)
+		writeHistogramFile(output.c_str(), histogram, hist_count, hist_nss, hist_nfs, histNbins, histMin, histBinSize, darkcal, h5compress);
+	else
+		printf("Error: Could not merge %s\n", name.c_str());
+	free(histogram);
+	free(darkcal);
+	return status;
+}
+
+
+/*
+ *	CXI and results files: master file with virtual datasets over the shards
+ */
+static int mergeCXI(std::string name, std::vector<std::string> &sources, std::vector<long> &shardIndex, std::string output, long nShards, tStackOffsets &offsets) {
+
+	std::vector<std::string> links;
+	for(size_t k=0; k<sources.size(); k++)
+		links.push_back(relativePath(CheetahMergeParams.outputDir, sources[k]));
+
+	std::vector<long> nFrames;
+	if(writeCXIMaster(output.c_str(), sources, &links, &nFrames)) {
+		printf("Error: Could not merge %s\n", name.c_str());
+		return 1;
+	}
+
+	std::vector<long> offset(nShards, 0);
+	long	total = 0;
+	for(size_t k=0; k<sources.size(); k++) {
+		offset[shardIndex[k]] = total;
+		total += nFrames[k];
+	}
+	offsets[name] = offset;
+	return 0;
+}
+
+
+/*
+ *	Logs: header from the first shard, then the records of every shard in order.
+ *	Records refer to frames as <file>, <stack position> (or "<file> //<stack position>" in frame lists).
+ */
+static std::string remapFrame(std::string file, long &slice, long shard, tStackOffsets &offsets) {
+	// Files that were not merged (eg: in-process CXI shards) are referred to where they are
+	tStackOffsets::iterator it = offsets.find(file);
+	if(it == offsets.end()) {
+		std::string	path = shardPath(CheetahMergeParams.shardDirs[shard], file);
+		if(file.empty() || file[0] == '/' || !fileExists(path))
+			return file;
+		return relativePath(CheetahMergeParams.outputDir, path);
+	}
+	slice += it->second[shard];
+	return file;
+}
+
+static std::string remapRecord(std::string line, long shard, tStackOffsets &offsets, bool framelist) {
+	size_t	fileStart, fileEnd, sliceStart, sliceEnd;
+	if(framelist) {
+		fileStart = 0;
+		fileEnd = line.find(" //");
+		if(fileEnd == std::string::npos)
+			return line;
+		sliceStart = fileEnd + 3;
+		sliceEnd = line.find_first_not_of("-0123456789", sliceStart);
+	}
+	else {
+		fileStart = line.find(", ");
+		if(fileStart == std::string::npos)
+			return line;
+		fileStart += 2;
+		fileEnd = line.find(", ", fileStart);
+		if(fileEnd == std::string::npos)
+			return line;
+		sliceStart = fileEnd + 2;
+		sliceEnd = line.find(",", sliceStart);
+	}
+	if(sliceEnd == std::string::npos)
+		sliceEnd = line.size();
+
+	std::string	file = line.substr(fileStart, fileEnd-fileStart);
+	long	slice = atol(line.substr(sliceStart, sliceEnd-sliceStart).c_str());
+	long	merged = slice;
+	std::string	mergedFile = remapFrame(file, merged, shard, offsets);
+	if(mergedFile != file)
+		return line.substr(0, fileStart) + mergedFile + line.substr(fileEnd);
+	if(merged == slice)
+		return line;
+
+	char	text[32];
+	sprintf(text, "%li", merged);
+	return line.substr(0, sliceStart) + text + line.substr(sliceEnd);
+}
+
+static int mergeLog(std::vector<std::string> &sources, std::vector<long> &shardIndex, std::string output, tStackOffsets &offsets, bool header, int remap) {
+
+	FILE	*out = fopen(output.c_str(), "w");
+	if(out == NULL) {
+		printf("Error: Cannot create %s\n", output.c_str());
+		return 1;
+	}
+
+	std::vector<char> line(65536);
+	for(size_t k=0; k<sources.size(); k++) {
+		FILE	*fp = fopen(sources[k].c_str(), "r");
+		if(fp == NULL) {
+			printf("Error: Cannot open %s\n", sources[k].c_str());
+			continue;
+		}
+		bool	first = true;
+		while(fgets(&line[0], line.size(), fp) != NULL) {
+			if(first && header && k > 0) {
+				first = false;
+				continue;
+			}
+			std::string	record(&line[0]);
+			if(remap && !(first && header))
+				record = remapRecord(record, shardIndex[k], offsets, remap == 2);
+			fputs(record.c_str(), out);
+			first = false;
+		}
+		fclose(fp);
+	}
+	fclose(out);
+	return 0;
+}
+
+
+/*
+ *	Binary logs (binaryLogs=1): header from the first shard, then the blocks of every shard in order.
+ *	In frames.bin the filename and stackSlice columns are remapped as in frames.txt.
+ */
+static int mergeColumnLog(std::vector<std::string> &sources, std::vector<long> &shardIndex, std::string output, tStackOffsets &offsets, bool remap) {
+
+	FILE	*out = NULL;
+	int		nColumns = 0;
+	for(size_t k=0; k<sources.size(); k++) {
+		cColumnLogReader log;
+		if(log.open(sources[k].c_str()))
+			continue;
+		if(out == NULL) {
+			out = fopen(output.c_str(), "wb");
+			if(out == NULL) {
+				printf("Error: Cannot create %s\n", output.c_str());
+				return 1;
+			}
+			nColumns = log.nColumns;
+			writeColumnLogHeader(out, log.nColumns, &log.names[0], &log.types[0]);
+		}
+		else if(log.nColumns != nColumns) {
+			printf("Error: %s does not have the columns of the other shards\n", sources[k].c_str());
+			continue;
+		}
+
+		int		filename = remap ? log.find("filename") : -1;
+		int		stackSlice = remap ? log.find("stackSlice") : -1;
+		while(log.nextBlock()) {
+			std::vector<char>	files;
+			if(filename >= 0 && stackSlice >= 0 && log.types[stackSlice] == 'l') {
+				std::vector<std::string> merged(log.nRows);
+				uint32_t	width = 1;
+				for(long r=0; r<log.nRows; r++) {
+					long	slice = log.getLong(stackSlice, r);
+					merged[r] = remapFrame(log.getString(filename, r), slice, shardIndex[k], offsets);
+					*(int64_t *) &log.data[stackSlice][r*sizeof(int64_t)] = slice;
+					if(merged[r].size() + 1 > width)
+						width = merged[r].size() + 1;
+				}
+				files.assign(log.nRows*width, 0);
+				for(long r=0; r<log.nRows; r++)
+					memcpy(&files[r*width], merged[r].c_str(), merged[r].size());
+				log.data[filename].swap(files);
+				log.widths[filename] = width;
+			}
+
+			std::vector<char *>	data(log.nColumns);
+			for(int c=0; c<log.nColumns; c++)
+				data[c] = log.data[c].empty() ? NULL : &log.data[c][0];
+			writeColumnLogBlock(out, log.nColumns, log.nRows, &log.widths[0], &data[0]);
+		}
+	}
+	if(out == NULL)
+		return 1;
+	fclose(out);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	parse_config(argc, argv, &CheetahMergeParams);
+	std::vector<std::string> &shardDirs = CheetahMergeParams.shardDirs;
+	std::string	outputDir = CheetahMergeParams.outputDir;
+	long	nShards = shardDirs.size();
+
+	std::cout << "----------------" << std::endl;
+	std::cout << "Output directory: " << outputDir << std::endl;
+	std::cout << "Shards: " << std::endl;
+	for(long i=0; i<nShards; i++) {
+		std::cout << "\t " << shardDirs[i] << std::endl;
+	}
+	std::cout << "----------------" << std::endl;
+
+	mkdir(outputDir.c_str(), 0755);
+
+	// Everything found in any of the shards
+	std::set<std::string> names;
+	for(long i=0; i<nShards; i++) {
+		DIR	*dir = opendir(shardDirs[i].c_str());
+		if(dir == NULL) {
+			printf("Error: Cannot open directory %s\n", shardDirs[i].c_str());
+			exit(1);
+		}
+		struct dirent *entry;
+		while((entry = readdir(dir)) != NULL)
+			if(entry->d_name[0] != '.')
+				names.insert(entry->d_name);
+		closedir(dir);
+	}
+
+	// Shard files containing each name, in shard order
+	std::map<std::string, std::vector<std::string> > sources;
+	std::map<std::string, std::vector<long> > shardIndex;
+	for(std::set<std::string>::iterator it=names.begin(); it!=names.end(); it++) {
+		for(long i=0; i<nShards; i++) {
+			std::string path = shardPath(shardDirs[i], *it);
+			if(fileExists(path) && !isCXIShardFile(shardDirs[i], *it)) {
+				sources[*it].push_back(path);
+				shardIndex[*it].push_back(i);
+			}
+		}
+	}
+
+	// CXI first, logs need the stack offsets
+	tStackOffsets offsets;
+	int		nErrors = 0;
+	unsigned	run;
+	int		det, cls;
+	char	c;
+	for(std::map<std::string, std::vector<std::string> >::iterator it=sources.begin(); it!=sources.end(); it++) {
+		std::string name = it->first;
+		std::string	stem = name.substr(0, name.rfind('.'));
+		if(endsWith(name, ".cxi") || (endsWith(name, ".h5") && sources.count(stem + ".cxi"))) {
+			printf("Merging %s (%li shards)\n", name.c_str(), (long) it->second.size());
+			nErrors += mergeCXI(name, it->second, shardIndex[name], shardPath(outputDir, name), nShards, offsets);
+		}
+	}
+
+	for(std::map<std::string, std::vector<std::string> >::iterator it=sources.begin(); it!=sources.end(); it++) {
+		std::string name = it->first;
+		std::string	stem = name.substr(0, name.rfind('.'));
+		std::string	output = shardPath(outputDir, name);
+		if(endsWith(name, ".cxi") || (endsWith(name, ".h5") && sources.count(stem + ".cxi")))
+			continue;
+
+		if(sscanf(name.c_str(), "r%4u-detector%d-class%d-sum.h5%c", &run, &det, &cls, &c) == 3) {
+			printf("Merging %s\n", name.c_str());
+			nErrors += mergePowder(name, it->second, output);
+		}
+		else if(sscanf(name.c_str(), "r%4u-detector%d-histogram.h5%c", &run, &det, &c) == 2) {
+			printf("Merging %s\n", name.c_str());
+			nErrors += mergeHistogram(name, it->second, output);
+		}
+		else if(name == "frames.txt" || (sscanf(name.c_str(), "r%4u-class%d-log.txt%c", &run, &cls, &c) == 2)) {
+			printf("Merging %s\n", name.c_str());
+			nErrors += mergeLog(it->second, shardIndex[name], output, offsets, true, 1);
+		}
+		else if(sscanf(name.c_str(), "r%4u-class%d.lst%c", &run, &cls, &c) == 2) {
+			printf("Merging %s\n", name.c_str());
+			nErrors += mergeLog(it->second, shardIndex[name], output, offsets, false, 2);
+		}
+		else if(name == "cleaned.txt" || name == "peaks.txt") {
+			printf("Merging %s\n", name.c_str());
+			nErrors += mergeLog(it->second, shardIndex[name], output, offsets, true, 0);
+		}
+		else if(name == "frames.bin" || name == "peaks.bin") {
+			printf("Merging %s\n", name.c_str());
+			nErrors += mergeColumnLog(it->second, shardIndex[name], output, offsets, name == "frames.bin");
+		}
+		else {
+			printf("Not merged: %s\n", name.c_str());
+		}
+	}
+
+	if(nErrors) {
+		printf("%i file(s) could not be merged\n", nErrors);
+		exit(1);
+	}
+	std::cout << "Clean exit." << std::endl;
+	return 0;
+}
+
+
+void parse_config(int argc, char *argv[], tCheetahMergeParams *global) {
+
+	// Defaults
+	global->outputDir = ".";
+
+	// Add getopt-long options
+	// three legitimate values: no_argument, required_argument and optional_argument
+	const struct option longOpts[] = {
+		{ "output", required_argument, NULL, 'o' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, no_argument, NULL, 0 }
+	};
+	const char optString[] = "o:h?";
+
+	int opt;
+	int longIndex = 0;
+	while((opt = getopt_long(argc, argv, optString, longOpts, &longIndex)) != -1) {
+		switch(opt) {
+			case 'o':
+				global->outputDir = optarg;
+				break;
+
+			case 'h':
+			case '?':
+			default:
+				std::cout << "Usage: cheetah-merge [--output=<dir>] <shard 0 dir> <shard 1 dir> ..." << std::endl;
+				std::cout << "\t-o, --output=<dir>\tDirectory for the merged files (default: current directory)" << std::endl;
+				std::cout << "\t-h, --help\t\tThis message" << std::endl;
+				exit(1);
+		}
+	}
+
+	for(int i=optind; i<argc; i++)
+		global->shardDirs.push_back(argv[i]);
+	if(global->shardDirs.size() == 0) {
+		std::cout << "Usage: cheetah-merge [--output=<dir>] <shard 0 dir> <shard 1 dir> ..." << std::endl;
+		exit(1);
+	}
+}
@@ -33,8 +33,22 @@ int main(int argc, const char * argv[])
 	char	filename[1024];
 	char	cheetahini[1024];
 	// Take configuration from command line arguments
-	strcpy(filename,argv[1]);
-	strcpy(cheetahini,argv[2]);
+	// Optional: number of events read ahead of processing (3rd argument), --shard=i/N anywhere
+	const char	*args[3] = {NULL, NULL, NULL};
+	const char	*shard = NULL;
+	int		nargs = 0;
+	for(int i=1; i<argc; i++) {
+		if(strncmp(argv[i], "--shard=", 8) == 0)
+			shard = argv[i]+8;
+		else if(nargs < 3)
+			args[nargs++] = argv[i];
+	}
+	if(nargs < 2) {
+		printf("Usage: %s <file.h5> <cheetah.ini> [prefetch depth] [--shard=i/N]\n", argv[0]);
+		exit(1);
+	}
+	strcpy(filename,args[0]);
+	strcpy(cheetahini,args[1]);
     
 	// Hard code for testing
 	//strcpy(filename,"/data/scratch/sacla/141945_each.h5");
@@ -59,6 +73,8 @@ int main(int argc, const char * argv[])
 	static time_t startT = 0;
 	time(&startT);
     strcpy(cheetahGlobal.configFile, cheetahini);
+	if(shard != NULL && cheetahGlobal.setRunShard(shard) != 0)
+		exit(1);
 	cheetahInit(&cheetahGlobal);
 	
 	
@@ -74,18 +90,14 @@ int main(int argc, const char * argv[])
     
 	
     /*
-     * Create a buffer for holding the detector image data from all 8 panels
+     * Size of one MPCCD panel; the prefetcher keeps buffers for all panels of <prefetchDepth> events
      */
     long    fs_one = 512;
     long    ss_one = 1024;
     long    nn_one = fs_one*ss_one;
-    long    fs = fs_one;
-    long    ss = 8*ss_one;
-    long    nn = fs*ss;
-    float   *buffer = (float*) calloc(nn, sizeof(float));
-    hsize_t dims[2];
-    dims[0] = ss;
-    dims[1] = fs;
+    long    prefetchDepth = 4;
+    if(args[2] != NULL)
+        prefetchDepth = atol(args[2]);
     
     
     
@@ -98,11 +110,29 @@ int main(int argc, const char * argv[])
         SACLA_HDF5_Read2dDetectorFields(&SACLA_header, runID);
         SACLA_HDF5_ReadEventTags(&SACLA_header, runID);
         
+        // Multi-process runs: this process only handles its own range of tags
+        long    firstEvent, lastEvent;
+        cheetahGlobal.runShardRange(SACLA_header.nevents, &firstEvent, &lastEvent);
+        
+        // Replaying a hit list: events (tags) that are not listed are not read
+        std::vector<char> skip(SACLA_header.nevents, 0);
+        if(cheetahGlobal.useHitlist) {
+            for(long eventID=0; eventID<SACLA_header.nevents; eventID++)
+                skip[eventID] = !cheetahGlobal.hitlistContains(SACLA_header.event_name[eventID]);
+        }
+        
+        // Events are read ahead of processing on a background thread
+        SACLA_prefetch_t prefetch;
+        SACLA_HDF5_StartPrefetch(&prefetch, &SACLA_header, runID, nn_one, prefetchDepth, firstEvent, lastEvent, skip.empty() ? NULL : &skip[0]);
+        
         
         // Loop through all events found in this run
+        // (frame numbers count all events, so they are the same in every shard)
         for(long eventID=0; eventID<SACLA_header.nevents; eventID++) {
-            printf("Processing event: %s\n", SACLA_header.event_name[eventID]);
 			frameNumber++;
+            if(eventID < firstEvent || eventID >= lastEvent || skip[eventID])
+                continue;
+            printf("Processing event: %s\n", SACLA_header.event_name[eventID]);
             
 			
 			/*
@@ -133,6 +163,7 @@ int main(int argc, const char * argv[])
              *  Cheetah: Populate event structure with meta-data
              */
             eventData->frameNumber = frameNumber;
+            strcpy(eventData->eventname, SACLA_header.event_name[eventID]);
             eventData->runNumber = runNumber;
             eventData->nPeaks = 0;
             eventData->pumpLaserCode = 0;
@@ -144,25 +175,19 @@ int main(int argc, const char * argv[])
             
 			
 			/*
-			 *	SACLA: Read next image
+			 *	SACLA: Next image (already read by the prefetch thread)
+			 *  SACLA provides float data, which goes straight into data_raw without passing through data_raw16
 			 */
-            SACLA_HDF5_ReadImageRaw(&SACLA_header, runID, eventID, buffer, nn_one);
-            
-            
-            
-            /*
-             *  Cheetah: Copy image data into
-             *  Raw data is currently hard-coded as UINT16_t, SACLA provides as float, so we have to loose precision :-(
-             */
+            float   *buffer = SACLA_HDF5_NextImage(&prefetch);
             long    detID = 0;
             long    pix_nn = cheetahGlobal.detector[detID].pix_nn;
-            long    asic_nx = cheetahGlobal.detector[detID].asic_nx;
-            long    asic_ny = cheetahGlobal.detector[detID].asic_ny;
-            eventData->detector[detID].raw_data = (uint16_t*) calloc(pix_nn, sizeof(uint16_t));
-            
-            for(long ii=0; ii<pix_nn; ii++) {
-                eventData->detector[detID].raw_data[ii] = (uint16_t) lrint(buffer[ii]);
+            if(pix_nn > SACLA_header.ndetectors*nn_one) {
+                printf("ERROR: Detector has %li pixels, SACLA image only %li\n", pix_nn, SACLA_header.ndetectors*nn_one);
+                exit(1);
             }
+            memcpy(eventData->detector[detID].data_raw, buffer, pix_nn*sizeof(float));
+            eventData->detector[detID].data_raw_is_float = true;
+            SACLA_HDF5_ReleaseImage(&prefetch);
             
             
             
@@ -186,6 +211,7 @@ int main(int argc, const char * argv[])
 			*/
             
         }
+        SACLA_HDF5_StopPrefetch(&prefetch);
     }
     
     
@@ -12,6 +12,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 
 #include "sacla-hdf5-reader.h"
@@ -50,6 +54,12 @@ int SACLA_HDF5_ReadHeader(const char *filename, SACLA_h5_info_t *result) {
 	}
     result->file_id = file_id;
     strcpy(result->filename, filename);
+    result->open_run = -1;
+    result->detector_group = NULL;
+    result->ndetectors = 0;
+    
+    // Second descriptor on the same file for direct reads of contiguous datasets (-1 falls back to H5Dread)
+    result->fd = open(filename, O_RDONLY);
     
     
 	// Determine how many runs are contained in this HDF5 file
@@ -223,63 +233,270 @@ int SACLA_HDF5_ReadEventTags(SACLA_h5_info_t *result, long run_index) {
     return 1;
 }
 
+/*
+ *  Open the detector groups of a run once, rather than looking them up by full path for every event
+ *  (call after SACLA_HDF5_Read2dDetectorFields)
+ */
+int SACLA_HDF5_OpenRun(SACLA_h5_info_t *header, long runID) {
+    
+    char    h5group[1024];
+    
+    if(header->open_run == runID)
+        return 1;
+    SACLA_HDF5_CloseRun(header);
+    
+    header->detector_group = (hid_t*) calloc(header->ndetectors, sizeof(hid_t));
+    for(long moduleID=0; moduleID < header->ndetectors; moduleID++) {
+        sprintf(h5group, "%s/%s",header->run_string[runID],header->detector_name[moduleID]);
+        header->detector_group[moduleID] = H5Gopen(header->file_id, h5group, H5P_DEFAULT);
+        if(header->detector_group[moduleID] < 0)
+            printf("%s : could not open group\n", h5group);
+    }
+    header->open_run = runID;
+    
+    return 1;
+}
+
+int SACLA_HDF5_CloseRun(SACLA_h5_info_t *header) {
+    
+    if(header->detector_group != NULL) {
+        for(long moduleID=0; moduleID < header->ndetectors; moduleID++) {
+            if(header->detector_group[moduleID] >= 0)
+                H5Gclose(header->detector_group[moduleID]);
+        }
+        free(header->detector_group);
+    }
+    header->detector_group = NULL;
+    header->open_run = -1;
+    
+    return 1;
+}
+
+
+/*
+ *  One module of an event, read with pread() from its own thread
+ */
+typedef struct {
+    int     fd;
+    off_t   offset;
+    size_t  nbytes;
+    char    *dest;
+    int     ok;
+} SACLA_module_read_t;
+
+static void *SACLA_HDF5_ReadModuleThread(void *threadarg) {
+    SACLA_module_read_t *r = (SACLA_module_read_t*) threadarg;
+    
+    size_t  done = 0;
+    r->ok = 1;
+    while(done < r->nbytes) {
+        ssize_t n = pread(r->fd, r->dest + done, r->nbytes - done, r->offset + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            r->ok = 0;
+            break;
+        }
+        done += n;
+    }
+    return NULL;
+}
+
+
 /*
  *  Function for reading all <n> 2D detectors into one massive 2D array (for passing to Cheetah or CrystFEL)
+ *
+ *  HDF5 calls are serialised by the library, so only the dataset lookups go through HDF5.
+ *  Modules stored contiguously as native floats (the usual SACLA layout) are then read from the file directly,
+ *  all modules at once; anything else (chunked, compressed, other types) falls back to H5Dread.
+ *  Modules missing from this event are zeroed.
  */
 int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t *header, long runID, long eventID, float *buffer, long offset) {
     
     char    h5field[1024];
-    char    h5group[1024];
-	hid_t   group;
+    long    nmodules = header->ndetectors;
     
-    printf("Reading event: %s\n",header->event_name[eventID]);
+    SACLA_HDF5_OpenRun(header, runID);
+    sprintf(h5field, "%s/detector_data", header->event_name[eventID]);
     
+    hid_t   *dataset = (hid_t*) malloc(nmodules*sizeof(hid_t));
+    SACLA_module_read_t *direct = (SACLA_module_read_t*) calloc(nmodules, sizeof(SACLA_module_read_t));
+    pthread_t *threads = (pthread_t*) malloc(nmodules*sizeof(pthread_t));
+    int     *started = (int*) calloc(nmodules, sizeof(int));
     
-    for(long moduleID=0; moduleID < header->ndetectors; moduleID++) {
-        // Open the run group
-        sprintf(h5group, "%s/%s/%s",header->run_string[runID],header->detector_name[moduleID], header->event_name[eventID]);
-        group = H5Gopen( header->file_id, h5group, NULL );
-        
-        
-        // Name for this part of the data
-        sprintf(h5field, "detector_data");
-        
-        // Error check: does this group/field even exist (before we try to read it)?
-        herr_t herr;
-		herr = H5LTfind_dataset ( group, h5field );
-        if(herr!=1) {
-            printf("%s/%s : H5LTfind_dataset=false\n",h5group, h5field);
-            H5Gclose(group);
+    
+    // Locate each module (no error stack printout for modules missing from this event)
+    for(long moduleID=0; moduleID < nmodules; moduleID++) {
+        dataset[moduleID] = -1;
+        if(header->detector_group[moduleID] >= 0) {
+            H5E_BEGIN_TRY {
+                dataset[moduleID] = H5Dopen(header->detector_group[moduleID], h5field, H5P_DEFAULT);
+            } H5E_END_TRY;
+        }
+        if(dataset[moduleID] < 0) {
+            printf("%s/%s/%s : dataset not found\n",header->run_string[runID],header->detector_name[moduleID],h5field);
+            memset(buffer + offset*moduleID, 0, offset*sizeof(float));
             continue;
         }
         
+        if(header->fd < 0)
+            continue;
+        hid_t   dataspace = H5Dget_space(dataset[moduleID]);
+        hid_t   datatype = H5Dget_type(dataset[moduleID]);
+        hssize_t npoints = H5Sget_simple_extent_npoints(dataspace);
+        haddr_t address = H5Dget_offset(dataset[moduleID]);
+        if(address != HADDR_UNDEF && npoints == offset && H5Tequal(datatype, H5T_NATIVE_FLOAT) > 0) {
+            direct[moduleID].fd = header->fd;
+            direct[moduleID].offset = (off_t) address;
+            direct[moduleID].nbytes = offset*sizeof(float);
+            direct[moduleID].dest = (char*) (buffer + offset*moduleID);
+        }
+        H5Tclose(datatype);
+        H5Sclose(dataspace);
+    }
+    
+    
+    // Direct reads, all modules at once
+    for(long moduleID=0; moduleID < nmodules; moduleID++) {
+        if(direct[moduleID].nbytes == 0)
+            continue;
+        if(pthread_create(&threads[moduleID], NULL, SACLA_HDF5_ReadModuleThread, (void*) &direct[moduleID]) == 0)
+            started[moduleID] = 1;
+        else
+            SACLA_HDF5_ReadModuleThread((void*) &direct[moduleID]);
+    }
+    for(long moduleID=0; moduleID < nmodules; moduleID++) {
+        if(started[moduleID])
+            pthread_join(threads[moduleID], NULL);
+    }
+    
+    
+    // Everything else through HDF5
+    for(long moduleID=0; moduleID < nmodules; moduleID++) {
+        if(dataset[moduleID] < 0)
+            continue;
+        if(direct[moduleID].nbytes == 0 || !direct[moduleID].ok)
+            H5Dread(dataset[moduleID], H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer + offset*moduleID);
+        H5Dclose(dataset[moduleID]);
+    }
+    
+    free(dataset);
+    free(direct);
+    free(threads);
+    free(started);
+    
+    return 1;
+}
+
+
+/*
+ *  Prefetch thread: reads events of one run into a ring of <depth> buffers, ahead of the main loop
+ */
+static void *SACLA_HDF5_PrefetchThread(void *threadarg) {
+    SACLA_prefetch_t *pf = (SACLA_prefetch_t*) threadarg;
+    
+    long i = 0;
+    for(long eventID=pf->firstEvent; eventID < pf->lastEvent; eventID++) {
+        if(pf->skip != NULL && pf->skip[eventID])
+            continue;
+        pthread_mutex_lock(&pf->mutex);
+        while(i - pf->nConsumed >= pf->depth && !pf->stop)
+            pthread_cond_wait(&pf->readAhead, &pf->mutex);
+        int stop = pf->stop;
+        pthread_mutex_unlock(&pf->mutex);
+        if(stop)
+            break;
         
-        // Check dimensions of this data set
-        //int	nd;
-        //hsize_t         dims[3];
-        //H5T_class_t     h5_class;
-        //size_t          size;
-        //strcat(tempstr, "/detector_data");
-        //result = H5LTget_dataset_ndims( group, tempstr, &nd);
-        //result = H5LTget_dataset_info( group, tempstr, dims, &h5_class, &size);
-        //printf("ndims=%i\n", nd);
-        //for(long k=0; k<=nd; k++)
-        //    printf("%lli\t",dims[k]);
-        //printf("\n");
+        SACLA_HDF5_ReadImageRaw(pf->header, pf->runID, eventID, pf->buffer[i % pf->depth], pf->module_nn);
         
-        // Read the data set
-        H5LTread_dataset_float( group, h5field, buffer + offset*moduleID);
-        H5Gclose(group);
+        pthread_mutex_lock(&pf->mutex);
+        pf->nRead = i+1;
+        pthread_cond_signal(&pf->readDone);
+        pthread_mutex_unlock(&pf->mutex);
+        i++;
+    }
+    return NULL;
+}
+
+int SACLA_HDF5_StartPrefetch(SACLA_prefetch_t *pf, SACLA_h5_info_t *header, long runID, long module_nn, long depth, long firstEvent, long lastEvent, const char *skip) {
+    
+    pf->header = header;
+    pf->skip = skip;
+    pf->runID = runID;
+    pf->firstEvent = firstEvent < 0 ? 0 : firstEvent;
+    pf->lastEvent = lastEvent > header->nevents ? header->nevents : lastEvent;
+    if(pf->lastEvent < pf->firstEvent)
+        pf->lastEvent = pf->firstEvent;
+    pf->module_nn = module_nn;
+    pf->depth = depth < 1 ? 1 : depth;
+    pf->nRead = 0;
+    pf->nConsumed = 0;
+    pf->stop = 0;
+    pf->buffer = (float**) calloc(pf->depth, sizeof(float*));
+    for(long i=0; i<pf->depth; i++)
+        pf->buffer[i] = (float*) calloc(header->ndetectors*module_nn, sizeof(float));
+    
+    // Group handles are opened here, before the prefetch thread starts using them
+    SACLA_HDF5_OpenRun(header, runID);
+    
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->readAhead, NULL);
+    pthread_cond_init(&pf->readDone, NULL);
+    if(pthread_create(&pf->thread, NULL, SACLA_HDF5_PrefetchThread, (void*) pf) != 0) {
+        printf("ERROR: Could not start SACLA prefetch thread\n");
+        exit(1);
     }
     
     return 1;
 }
 
+/*
+ *  Next event of the range (in order, skipped events left out), valid until SACLA_HDF5_ReleaseImage()
+ */
+float* SACLA_HDF5_NextImage(SACLA_prefetch_t *pf) {
+    pthread_mutex_lock(&pf->mutex);
+    long eventID = pf->nConsumed;
+    while(pf->nRead <= eventID)
+        pthread_cond_wait(&pf->readDone, &pf->mutex);
+    pthread_mutex_unlock(&pf->mutex);
+    return pf->buffer[eventID % pf->depth];
+}
+
+void SACLA_HDF5_ReleaseImage(SACLA_prefetch_t *pf) {
+    pthread_mutex_lock(&pf->mutex);
+    pf->nConsumed++;
+    pthread_cond_signal(&pf->readAhead);
+    pthread_mutex_unlock(&pf->mutex);
+}
+
+int SACLA_HDF5_StopPrefetch(SACLA_prefetch_t *pf) {
+    pthread_mutex_lock(&pf->mutex);
+    pf->stop = 1;
+    pthread_cond_signal(&pf->readAhead);
+    pthread_mutex_unlock(&pf->mutex);
+    pthread_join(pf->thread, NULL);
+    
+    pthread_mutex_destroy(&pf->mutex);
+    pthread_cond_destroy(&pf->readAhead);
+    pthread_cond_destroy(&pf->readDone);
+    for(long i=0; i<pf->depth; i++)
+        free(pf->buffer[i]);
+    free(pf->buffer);
+    
+    SACLA_HDF5_CloseRun(pf->header);
+    
+    return 1;
+}
+
 /*
  *  Cleanup stale HDF5 references and close the file
  */
 int SACLA_HDF5_cleanup(SACLA_h5_info_t *header) {
     
+    SACLA_HDF5_CloseRun(header);
+    if(header->fd >= 0)
+        close(header->fd);
+    
     std::cout << "Cleaning up HDF5 links\n";
 	hid_t ids[256];
 	long n_ids = H5Fget_obj_ids(header->file_id, H5F_OBJ_ALL, 256, ids);
@@ -12,6 +12,7 @@
 #include <iostream>
 #include <hdf5.h>
 #include <hdf5_hl.h>
+#include <pthread.h>
 //#include <stdlib.h>
 //#include <string.h>
 //#include <stdio.h>
@@ -44,16 +45,54 @@ typedef struct {
     long    nevents;
     char    **event_name;
     
+    
+    // Handles kept open for the run being processed (SACLA_HDF5_OpenRun)
+    long    open_run;
+    hid_t   *detector_group;
+    
+    // Plain file descriptor, for reading contiguous detector_data directly (several modules at once)
+    int     fd;
+    
 } SACLA_h5_info_t;
 
 
+/*
+ *  Background reader keeping the next <depth> events of a run in memory
+ *  Events are handed out strictly in order, leaving out those flagged in skip[] (which are not read at all)
+ */
+typedef struct {
+    SACLA_h5_info_t *header;
+    long    runID;
+    long    module_nn;
+    long    depth;
+    float   **buffer;
+    long    firstEvent;     // Events [firstEvent, lastEvent) of the run are read
+    long    lastEvent;
+    const char *skip;       // skip[eventID] != 0: event is not read (NULL: read all)
+    
+    long    nRead;          // Events read into buffers so far
+    long    nConsumed;      // Events handed back with SACLA_HDF5_ReleaseImage()
+    int     stop;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  readAhead;
+    pthread_cond_t  readDone;
+} SACLA_prefetch_t;
+
+
 /*
  *  Prototypes for functions written to read SACLA HDF5 data
  */
 int SACLA_HDF5_ReadHeader(const char*, SACLA_h5_info_t*);
 int SACLA_HDF5_Read2dDetectorFields(SACLA_h5_info_t*, long);
 int SACLA_HDF5_ReadEventTags(SACLA_h5_info_t*, long);
+int SACLA_HDF5_OpenRun(SACLA_h5_info_t*, long);
+int SACLA_HDF5_CloseRun(SACLA_h5_info_t*);
 int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t*, long, long, float*, long);
+int SACLA_HDF5_StartPrefetch(SACLA_prefetch_t*, SACLA_h5_info_t*, long, long, long, long, long, const char*);
+float* SACLA_HDF5_NextImage(SACLA_prefetch_t*);
+void SACLA_HDF5_ReleaseImage(SACLA_prefetch_t*);
+int SACLA_HDF5_StopPrefetch(SACLA_prefetch_t*);
 int SACLA_HDF5_cleanup(SACLA_h5_info_t*);
 
 
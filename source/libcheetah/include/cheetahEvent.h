@@ -18,6 +18,7 @@
 
 // Need to announce this is included from elsewhere
 //typedef tPeakList;
+namespace CXI { class Node; }
 
 
 /*
@@ -34,6 +35,11 @@ public:
 	long        frameNumberIncludingSkipped;
 	long        frameNum;
 	long		stackSlice;
+	long		cxiShard;
+	// CXI and results file (and hitstats index) reserved for this frame by reserveCXI()
+	CXI::Node	*cxiFile;
+	CXI::Node	*cxiResults;
+	long		cxiEventIndex;
 	bool		writeFlag;
 	
 	char		eventname[1024];
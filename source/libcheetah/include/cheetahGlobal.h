@@ -11,6 +11,7 @@
 #define CHEETAHGLOBAL_H
 #include <algorithm>
 #include <map>
+#include <unordered_set>
 #include <string>
 #include <vector>
 #include <semaphore.h>
@@ -20,11 +21,17 @@
 #include "tofDetector.h"
 #include "peakDetect.h"
 #include "processRateMonitor.h"
+#include "hitPrescreen.h"
+#include "liveView.h"
+#include "columnLog.h"
+#include "streamWriter.h"
+#include "stackWriter.h"
 #define MAX_POWDER_CLASSES 16
 #define MAX_DETECTORS 5
 #define MAX_FILENAME_LENGTH 1024
 #define MAX_EPICS_PVS 100
 #define MAX_EPICS_PV_NAME_LENGTH 512
+#define MAX_CXI_SHARDS 64
 
 /** @brief Global variables.
  *
@@ -167,6 +174,10 @@ public:
 	 * and not angstrom. See hitfinderMinRes and hitfinderMaxRes for more details. 
 	 */
 	int      hitfinderResolutionUnitPixel;
+	/** @brief Rebuild the reciprocal space geometry (resolution limits, solid angle) when the wavelength changes by more than
+	 * this relative amount. 0 (default) only rebuilds it when the camera length changes.
+	 */
+	float    geometryWavelengthTolerance;
 	/** @brief Binary map of pixels excluded based on resolution. */
 	int     *hitfinderResMask;
 	/** @brief The minimum signal/noise ratio for peakfinding purposes. */
@@ -180,6 +191,28 @@ public:
 
 	int		hitfinderFastScan;
 
+	/** @brief Cascaded pre-screen on the binned detector-corrected frame, vetoes obvious blanks before background subtraction and peakfinding. */
+	int		hitfinderPrescreen;
+	/** @brief Pre-screen bin size in pixels (binning x binning blocks of the raw layout). */
+	long	hitfinderPrescreenBinning;
+	/** @brief Number of radial shells, each holding the same number of bins. */
+	long	hitfinderPrescreenShells;
+	/** @brief Stage 1 looks at every n-th row of bins only. */
+	long	hitfinderPrescreenSubsample;
+	/** @brief Bin threshold (maximum pixel value in a bin), defaults to hitfinderADC. */
+	float	hitfinderPrescreenADC;
+	/** @brief A shell counts bins above its blank baseline mean + nSigma * sigma. */
+	float	hitfinderPrescreenNsigma;
+	/** @brief Minimum number of excess bins to pass a frame, defaults to hitfinderNpeaks/2. */
+	long	hitfinderPrescreenMinBins;
+	/** @brief Number of blank frames (full hitfinder) needed before anything is vetoed. */
+	long	hitfinderPrescreenLearnFrames;
+	/** @brief Every n-th screened frame goes through the full path anyway, to measure agreement and keep learning (0 = never). */
+	long	hitfinderPrescreenAuditInterval;
+	/** @brief Vetoed blanks also skip assembly, powder sums and radial averages (unless saveBlanks is set). Off by default, in which case vetoed blanks still get the radial/local background subtraction. */
+	int		hitfinderPrescreenSkipBlankSums;
+	cHitPrescreen hitPrescreen;
+
         // Hitfinder 9 parameters
         float   sigmaFactorBiggestPixel;
         float   sigmaFactorPeakPixel;
@@ -194,12 +227,17 @@ public:
     char    pumpLaserScheme[MAX_FILENAME_LENGTH];
 	
 	/** @brief Path to the file with list of hits.
-	 * Used by hitfinderAlgorithm=11 as hit criterion.
-	 * The hits have to be in chronological order as they appear in the data stream!
+	 * Used by hitfinderAlgorithm=12 as hit criterion.
+	 * One event per line, either its name (eventName column of frames.txt) or 'trainID pulseID [cellID]' (EuXFEL).
+	 * Events can come in any order.
 	 */
 	char     hitlistFile[MAX_FILENAME_LENGTH];
-	/** @brief list of all hits as output string names. */
-	std::vector<std::string>	hitlist;
+	/** @brief Hits of the list by event name, and by (train, pulse, cell) packed with hitlistKey(). */
+	std::unordered_set<std::string>	hitlistNames;
+	std::unordered_set<uint64_t>	hitlistPulses;
+	std::unordered_set<uint64_t>	hitlistTrainPulses;
+	/** @brief A hit list is being replayed: frontends do not read events that are not listed. */
+	int      useHitlist;
 
 	/** @brief Indicate the presence of TOF data. */
 	int      TOFPresent;
@@ -237,10 +275,35 @@ public:
 	int      savePeakInfo;
 	/** @brief Toggle the writing of Bragg peak information into a text file. */
 	int      savePeakList;
+	/** @brief Write the frame and peak logs as binary column logs (frames.bin, peaks.bin) instead of frames.txt, peaks.txt and the class logs. */
+	int      binaryLogs;
+	/** @brief Write a CrystFEL stream with the peaks of every hit (see streamWriter.h). */
+	int      saveStream;
+	/** @brief Name of the stream (default r<run>.stream). */
+	char     streamFile[MAX_FILENAME_LENGTH];
+	/** @brief CrystFEL geometry giving the panels of the stream (default: one panel per ASIC). */
+	char     streamGeometry[MAX_FILENAME_LENGTH];
+	cStreamWriter streamWriter;
 
 	/** @brief The number of radial profiles per data file. */
 	long     radialStackSize;
 
+	/** @brief Publish recent hits and powder snapshots to a shared memory live view (see liveView.h). */
+	int      useLiveView;
+	/** @brief Name of the POSIX shared memory segment (with the shard index appended, e.g. /cheetah-live-2, when running as a --shard process). */
+	char     liveViewName[MAX_FILENAME_LENGTH];
+	/** @brief Number of most recent hits kept in the live view. */
+	long     liveViewSlots;
+	/** @brief Maximum number of peaks stored per hit. */
+	long     liveViewMaxPeaks;
+	/** @brief Binning of the assembled image for live view thumbnails. */
+	long     liveViewBinning;
+	/** @brief Refresh the live view powder snapshot every n processed frames. */
+	long     liveViewPowderInterval;
+	/** @brief Detector shown in the live view (the hitfinder detector). */
+	long     liveViewDetIndex;
+	cLiveView liveView;
+
 	/** @brief Toggle the writing of radial intensity profile data. */
 	//int      saveRadialAverage;
 	int      saveRadialStacks;
@@ -312,6 +375,20 @@ public:
 	 */
 	int cxiFlushPeriod;
 
+	/** @brief Split each CXI (and results) file into \p cxiShards shard files, each written by one thread at a time.
+	    A master file with the usual name exposes the stacks of all shards as virtual datasets when the files are closed.
+	    The default is 1 (no sharding).
+	 */
+	long cxiShards;
+	/** @brief Comma separated list of directories the shard files are spread over (default: current directory). */
+	char cxiShardDirs[MAX_FILENAME_LENGTH];
+
+	/** @brief Multi-process runs: this process handles run shard \p runShard of \p nRunShards (set by the frontend with --shard=i/N).
+	    Each shard takes a contiguous range of the run (tags, files...) and writes partial sums which cheetah-merge combines.
+	 */
+	long runShard;
+	long nRunShards;
+
 	/** @brief  Only one thread during calibration */
 	int useSingleThreadCalibration;
 
@@ -342,6 +419,8 @@ public:
 	FILE    *framefp;
 	FILE    *cleanedfp;
 	FILE    *peaksfp;
+	cColumnLog frameLog;
+	cColumnLog peakLog;
 	
 	/*
 	 *	Subdir management
@@ -382,6 +461,7 @@ public:
 	//pthread_mutex_t  hitVector_mutex;
 	pthread_mutex_t  gmd_mutex;
 	pthread_mutex_t  swmr_mutex;
+	pthread_mutex_t  cxiShard_mutex[MAX_CXI_SHARDS];
 	sem_t availableCheetahThreads;
 
 	/*
@@ -423,9 +503,7 @@ public:
 	int		useFEEspectrum;
 	long	FEEspectrumStackSize;
 	long	FEEspectrumWidth;
-	long	FEEspectrumStackCounter[MAX_POWDER_CLASSES];
-	float   *FEEspectrumStack[MAX_POWDER_CLASSES];
-	pthread_mutex_t FEEspectrumStack_mutex[MAX_POWDER_CLASSES];
+	cStackBuffer FEEspectrumStack[MAX_POWDER_CLASSES];
 	FILE    *FEElogfp[MAX_POWDER_CLASSES];
 
 	
@@ -433,9 +511,7 @@ public:
 	int		useTimeTool;
 	long	TimeToolStackSize;
 	long	TimeToolStackWidth;
-	long	TimeToolStackCounter[MAX_POWDER_CLASSES];
-	float   *TimeToolStack[MAX_POWDER_CLASSES];
-	pthread_mutex_t TimeToolStack_mutex[MAX_POWDER_CLASSES];
+	cStackBuffer TimeToolStack[MAX_POWDER_CLASSES];
 	FILE    *TimeToolLogfp[MAX_POWDER_CLASSES];
 
 	
@@ -445,9 +521,15 @@ public:
 	double  *espectrumDarkcal;
 	double  *espectrumScale;
 	long	espectrumStackSize;
-	long	espectrumStackCounter[MAX_POWDER_CLASSES];
-	float   *espectrumStack[MAX_POWDER_CLASSES];
-	pthread_mutex_t espectrumStack_mutex[MAX_POWDER_CLASSES];
+	cStackBuffer espectrumStack[MAX_POWDER_CLASSES];
+	// Spectrometer camera pixel -> spectrum bin for the tilt angle (-1: off the spectrum), and dark summed per bin
+	long	espectrumProjectionWidth;
+	long	espectrumProjectionHeight;
+	int		*espectrumProjection;
+	double  *espectrumProjectedDark;
+
+	// Background writer for the FEE, CXI spectrometer and time tool stacks (see stackWriter.h)
+	cStackWriter stackWriter;
 	
 	// time keeping
 	time_t   tstart, tend;
@@ -487,6 +569,11 @@ public:
 	void waitForThreadsToFinish(void);
 	
     void readHits(char *filename);
+	bool hitlistContains(const char *eventName);
+	bool hitlistContains(uint64_t trainID, uint64_t pulseID, long cellID);
+	int  setRunShard(const char *spec);
+	void runShardRange(long nUnits, long *first, long *last);
+	bool inRunShard(long unit, long nUnits);
 
     
     cTimingProfiler timeProfile;
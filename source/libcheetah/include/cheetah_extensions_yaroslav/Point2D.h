@@ -173,8 +173,8 @@ public:
 
     void round()
     {
-		data[0] = 0;//boost::math::round(data[0]);
-		data[1] = 0;//boost::math::round(data[1]);
+        data[0] = std::round(data[0]); //same as boost::math::round(), halfway cases away from zero
+        data[1] = std::round(data[1]);
     }
 
     Point2D getRounded() const
@@ -25,6 +25,13 @@ typedef struct {
     std::vector< Point2D< uint_fast8_t > > detektorsToCorrectIndices; //must be a subset of detektorsToConsiderIndices
 
     float rank; //between 0 and 1
+
+    uint_fast8_t threadCount; //bins are split between this many threads (0 or 1: only the calling thread)
+
+    //0: exact rank (nth_element). >0: rank value taken from a histogram of the bin with buckets of this width.
+    //The result is exact for integer data with a width of 1, otherwise it is within one bucket width below the exact rank value.
+    //Bins whose value range needs too many buckets fall back to the exact rank.
+    float histogramRankResolution;
 } radialRankFilter_accuracyConstants_t;
 
 typedef struct {
@@ -39,6 +46,14 @@ typedef struct {
     std::vector< float > binRadii;
 
     std::vector< float > intraBinInterpolationConstant;
+
+    //flat (CSR) bin layout: the data of bin i goes to [binDataOffsets[i], binDataOffsets[i+1]) of one buffer,
+    //read from the pixels linearDataIndicesByBin[binDataOffsets[i]...]
+    std::vector< uint32_t > binDataOffsets;
+    std::vector< uint32_t > linearDataIndicesByBin;
+
+    //bins [threadFirstBins[t], threadFirstBins[t+1]) are handled by thread t, with about the same amount of data for each thread
+    std::vector< uint16_t > threadFirstBins;
 } radialRankFilter_precomputedConstants_t;
 
 void precomputeRadialRankFilterConstants(radialRankFilter_precomputedConstants_t& precomputedConstants, const uint8_t* mask_linear,
@@ -28,6 +28,8 @@ typedef struct {
     std::vector< uint_fast8_t > linesToCheck; //slow scan lines to check
     std::vector< Point2D< uint_fast8_t > > streakDetektorsIndices; //Point (x,y) in the way the detector is positioned in the rawImage (top left detector is (0,0), it's right neighbor is (1,0) )
     std::vector< ImageRectangle< uint16_t > > backgroundEstimationRegionsInDetector;
+
+    uint_fast8_t threadCount; //streak detectors are split between this many threads (0 or 1: only the calling thread)
 } streakFinder_accuracyConstants_t;
 
 typedef struct {
@@ -43,6 +45,9 @@ typedef struct {
 
     float detectorPositionsHash; //used to check, whether the precomputed constants are computed with the same detector positions as they are used with (especially important, if they are loaded from a file)
 
+    void* mappedCacheFile; //if loaded from a cache file: start of the memory mapping radialFilterContributors points into, otherwise NULL
+    size_t mappedCacheFileSize;
+
 public:
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 } streakFinder_precomputedConstants_t;
@@ -54,6 +59,13 @@ void precomputeStreakFinderConstants(const streakFinder_accuracyConstants_t& str
         streakFinder_precomputedConstants_t& streakFinder_precomputedConstants);
 void freePrecomputedStreakFinderConstants(streakFinder_precomputedConstants_t& streakFinder_precomputedConstants);
 
+bool saveStreakFinderConstantsToFile(const char* filename, uint64_t key, const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants,
+        const detectorRawSize_cheetah_t& detectorRawSize_cheetah, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants);
+bool loadStreakFinderConstantsFromFile(const char* filename, uint64_t key, const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants,
+        const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
+        const std::vector< std::vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
+        streakFinder_precomputedConstants_t& streakFinder_precomputedConstants);
+
 void streakFinder(float* data_linear, const streakFinder_accuracyConstants_t& accuracyConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
         const std::vector< std::vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
         const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants);
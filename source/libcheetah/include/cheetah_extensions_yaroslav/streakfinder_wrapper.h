@@ -15,7 +15,8 @@
 streakFinder_constantArguments_t *precomputeStreakFinderConstantArguments(uint_fast8_t filterLength, uint_fast8_t minFilterLength, float filterStep,
         float sigmaFactor, uint_fast8_t streakElongationMinStepsCount, float streakElongationRadiusFactor, uint_fast8_t streakPixelMaskRadius,
         uint_fast8_t numLinesToCheck, detectorCategory_t detectorCategory, int background_region_preset, int background_region_dist_from_edge, long asic_nx,
-        long asic_ny, long nasics_x, long nasics_y, float *pixel_map_x, float *pixel_map_y, uint8_t *input_mask, char* background_region_mask);
+        long asic_ny, long nasics_x, long nasics_y, float *pixel_map_x, float *pixel_map_y, uint8_t *input_mask, char* background_region_mask,
+        const char* cacheDir = NULL, uint_fast8_t threadCount = 1);
 
 void freePrecomputedStreakFinderConstantArguments(streakFinder_constantArguments_t *streakfinder_constant_arguments);
 
@@ -18,6 +18,8 @@ void *worker(void *);
 void initDetectorCorrection(cEventData *eventData, cGlobal *global);
 void initRaw(cEventData *eventData, cGlobal *global);
 void initPixelmask(cEventData *eventData, cGlobal *global);
+void acquireEventMask(cEventData*, cGlobal*, long, uint16_t, tEventMask*);
+void releaseEventMask(cGlobal*, long, tEventMask*);
 void subtractDarkcal(cEventData*, cGlobal*);
 void applyGainCorrection(cEventData*, cGlobal*);
 void applyPolarizationCorrection(cEventData*, cGlobal*);
@@ -56,14 +58,17 @@ void pnccdOffsetCorrection(float*, uint16_t*);
 void pnccdOffsetCorrection(float*);
 void pnccdFixWiringError(float*);
 
+// commonMode.cpp
+void commonModeSubtract(cEventData*, cGlobal*);
+
 // backgroundCorrection.cpp
 void initPhotonCorrection(cEventData *eventData, cGlobal *global);
 void subtractLocalBackground(cEventData*, cGlobal*);
 void subtractRadialBackground(cEventData*, cGlobal*);
 void checkSaturatedPixels(cEventData*, cGlobal*);
-void checkSaturatedPixels(uint16_t*, uint16_t*, long, long, long, long);
-void checkSaturatedPixels(float*, uint16_t*, long, long, long, long);
-void checkSaturatedPixelsPnccd(uint16_t*, uint16_t*);
+void checkSaturatedPixels(uint16_t*, uint16_t*, long, long, long, long, cPixelDetectorEvent*);
+void checkSaturatedPixels(float*, uint16_t*, long, long, long, long, cPixelDetectorEvent*);
+void checkSaturatedPixelsPnccd(uint16_t*, uint16_t*, cPixelDetectorEvent*);
 void updateBackgroundBuffer(cEventData*, cGlobal*, int);
 void subtractPersistentBackground(cEventData*, cGlobal*);
 void subtractLocalBackground(float*, long, long, long, long, long);
@@ -81,11 +86,13 @@ void writeSimpleHDF5(const char*, const void*, long, long, hid_t, const char*,lo
 void writeSpectrumInfoHDF5(const char*, const void*, const void*, int, int, const void*, int, int);
 
 // saveCXI.cpp
+void reserveCXI(cEventData*, cGlobal*);
 void writeCXI(cEventData*, cGlobal*);
 void writeCXIHitstats(cEventData*, cGlobal*);
 void writeAccumulatedCXI(cGlobal*);
 void closeCXIFiles(cGlobal*);
 void flushCXIFiles(cGlobal*);
+int writeCXIMaster(const char*, std::vector<std::string>&, std::vector<std::string>*, std::vector<long>*);
 herr_t cheetahHDF5ErrorHandler(hid_t,void*);
 
 // assemble2DImage.cpp
@@ -115,6 +122,8 @@ void downsamplePowder(cGlobal*);
 // hitfinders.cpp
 int  hitfinder(cEventData*, cGlobal*);
 long hitfinderFastScan(cEventData*, cGlobal*);
+int  hitfinderPrescreen(cEventData*, cGlobal*, tHitPrescreenResult*);
+void hitfinderPrescreenOutcome(cGlobal*, tHitPrescreenResult*, int);
 void sortPowderClass(cEventData*, cGlobal*);
 
 // peakfinders.cpp
@@ -129,10 +138,12 @@ int peakfinder8old(tPeakList*, float*, char*, float*, long, long, long, long, fl
 
 
 // spectrum.cpp
+void setStackOutput(cGlobal*, long);
 void addFEEspectrumToStack(cEventData*, cGlobal*, int);
 void saveFEEspectrumStack(cGlobal*, int);
 void saveSpectrumStacks(cGlobal*);
 void integrateSpectrum(cEventData*, cGlobal*);
+void setupSpectrumProjection(cGlobal*);
 void integrateSpectrum(cEventData*, cGlobal*, int, int);
 void addToSpectrumStack(cEventData*, cGlobal*, int);
 void saveEspectrumStacks(cGlobal*);
@@ -155,12 +166,18 @@ void saveRunningSums(cGlobal*);
 void saveDarkcal(cGlobal*, int);
 void saveGaincal(cGlobal*, int);
 void savePowderPattern(cGlobal*, int, int);
+void powderStatistics(long, long, double*, double*, long*, double*, double*, double*);
 void writePowderData(char*, void*, int, int, void*, void*, long, long, int);
 
+// liveView.cpp
+void publishLiveViewHit(cEventData*, cGlobal*);
+void publishLiveViewPowder(cGlobal*);
+
 // histogram.cpp
 void addToHistogram(cEventData*, cGlobal*, int);
 void saveHistograms(cGlobal*);
 void saveHistogram(cGlobal*, int);
+void writeHistogramFile(const char*, uint16_t*, long, long, long, long, long, float, float*, int);
 void calculateHistogramScale(long histMin, long histNBins, float histBinSize, float * scaleTarget);
 
 // RadialAverage.cpp
@@ -198,3 +215,5 @@ void updateAvgGmd(cEventData *eventData, cGlobal *global);
 
 // log.cpp
 void writeLog(cEventData * eventData, cGlobal * global);
+void writePeakLog(cEventData * eventData, cGlobal * global);
+int openColumnLogs(cGlobal * global);
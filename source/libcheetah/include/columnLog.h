@@ -0,0 +1,129 @@
+/*
+ *  columnLog.h
+ *  cheetah
+ *
+ *  Binary columnar logs (frames.bin, peaks.bin), replacing the per-event fprintf of frames.txt and peaks.txt.
+ *  Workers append fixed-layout rows to a batch taken from a pool, without formatting anything and without holding
+ *  a lock while they fill it. Full batches are transposed into columns and appended to the file as one block.
+ *  cheetah-logconvert turns the files back into the legacy text logs.
+ *
+ */
+
+#ifndef COLUMNLOG_H
+#define COLUMNLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define COLUMNLOG_MAGIC			"CHTLOG01"
+#define COLUMNLOG_BLOCK_MAGIC	0x4B4C4243		// "CBLK"
+#define COLUMNLOG_BATCH_ROWS	4096
+
+
+/*
+ *	File layout (host byte order)
+ *
+ *	char		magic[8]			COLUMNLOG_MAGIC
+ *	uint32_t	nColumns
+ *	nColumns times:
+ *		char		type			'i' int32, 'l' int64, 'f' float, 'd' double, 's' string
+ *		uint8_t		nameLength
+ *		char		name[nameLength]
+ *	Blocks until the end of the file:
+ *		uint32_t	magic			COLUMNLOG_BLOCK_MAGIC
+ *		uint32_t	nRows
+ *		nColumns times:
+ *			uint32_t	width		Bytes per row: the size of the type, or for strings the longest string of the block + 1
+ *			char		data[nRows][width]		(strings are NUL padded)
+ *
+ *	Rows within a block are in the order they were appended, rows appended together by one event stay together.
+ *	Blocks are in the order they were written, which (as for the text logs) is not the frame order.
+ */
+typedef struct {
+	const char	*name;
+	char		type;
+	size_t		offset;			// Offset of the value in the row (for strings: a uint32_t offset in the batch string buffer)
+} tColumnLogColumn;
+
+typedef struct tColumnLogBatch {
+	long		nRows;
+	char		*rows;
+	char		*strings;
+	size_t		stringsUsed;
+	size_t		stringsSize;
+	struct tColumnLogBatch	*next;
+} tColumnLogBatch;
+
+
+int columnLogTypeSize(char type);
+int writeColumnLogHeader(FILE *fp, int nColumns, const std::string *names, const char *types);
+int writeColumnLogBlock(FILE *fp, int nColumns, long nRows, const uint32_t *widths, char * const *data);
+
+
+/*
+ *	Writer
+ */
+class cColumnLog {
+
+public:
+	cColumnLog();
+	~cColumnLog();
+	int open(const char *filename, const tColumnLogColumn *columns, int nColumns, size_t rowSize);
+	int isOpen(void) { return fp != NULL; }
+	tColumnLogBatch *acquire(void);
+	void *appendRow(tColumnLogBatch *batch);
+	void setString(tColumnLogBatch *batch, void *row, size_t offset, const char *s);
+	void release(tColumnLogBatch *batch);
+	void flush(void);
+	void close(void);
+
+public:
+	long	nRows;				// Rows written to the file so far
+	long	nBlocks;
+
+private:
+	FILE					*fp;
+	const tColumnLogColumn	*columns;
+	int						nColumns;
+	size_t					rowSize;
+	tColumnLogBatch			*idle;
+	pthread_mutex_t			poolMutex;
+	pthread_mutex_t			fileMutex;
+
+	void writeBatch(tColumnLogBatch *batch);
+};
+
+
+/*
+ *	Reader (for cheetah-logconvert and cheetah-merge)
+ */
+class cColumnLogReader {
+
+public:
+	cColumnLogReader();
+	~cColumnLogReader();
+	int open(const char *filename);
+	void close(void);
+	int nextBlock(void);
+	int find(const char *name);
+	long getLong(int column, long row);
+	double getDouble(int column, long row);
+	const char *getString(int column, long row);
+
+public:
+	int							nColumns;
+	std::vector<std::string>	names;
+	std::vector<char>			types;
+	long						nRows;			// Rows in the current block
+	std::vector<uint32_t>		widths;			// Of the current block
+	std::vector< std::vector<char> >	data;
+
+private:
+	FILE	*fp;
+};
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ *  commonMode.h
+ *  cheetah
+ *
+ *  Common mode subtraction for any detector made of nasics_x*nasics_y ASICs of asic_nx*asic_ny pixels.
+ *  Each ASIC is cut into regions (the whole ASIC, single rows or columns, or banks of bankWidth columns),
+ *  one offset is estimated per region from the selected pixels and subtracted from every pixel of the region.
+ *
+ *  Pixels are selected from their mask bits: a pixel takes part if it has any of includeMask (or includeMask is 0)
+ *  and none of excludeMask. Estimators:
+ *	-	median:		value at fraction floor of the sorted selected pixels (floor = 0.5 is the median)
+ *	-	histogram:	position of the maximum of an integer ADU histogram over [-histogramSpan, histogramSpan)
+ *	-	mean:		mean of the selected pixels
+ *	-	unbonded:	mean of the CSPAD unbonded pixels (row = column, every 10th row of the ASIC)
+ *  Reference pixels behind wires are the median estimator with includeMask = PIXEL_IS_SHADOWED.
+ *  A region without selected pixels is left alone.
+ *
+ *  Regions are split between nThreads threads. Their sort buffers and histograms come from a pool shared
+ *  by all detectors and events, so nothing is allocated once the pool has warmed up.
+ *
+ */
+
+#ifndef COMMONMODE_H
+#define COMMONMODE_H
+
+#include <stdint.h>
+
+enum {
+	CM_REGION_ASIC = 0,
+	CM_REGION_ROW,
+	CM_REGION_COLUMN,
+	CM_REGION_BANK
+};
+
+enum {
+	CM_ESTIMATOR_NONE = 0,
+	CM_ESTIMATOR_MEDIAN,
+	CM_ESTIMATOR_HISTOGRAM,
+	CM_ESTIMATOR_MEAN,
+	CM_ESTIMATOR_UNBONDED
+};
+
+
+typedef struct {
+	int			region;
+	int			estimator;
+	long		bankWidth;			// Columns per bank (CM_REGION_BANK)
+	float		floor;				// Fraction of the sorted values (CM_ESTIMATOR_MEDIAN)
+	long		histogramSpan;		// Histogram covers [-histogramSpan, histogramSpan) ADU (CM_ESTIMATOR_HISTOGRAM)
+	uint16_t	includeMask;
+	uint16_t	excludeMask;
+	int			nThreads;
+} tCommonModeParams;
+
+
+void commonModeDefaults(tCommonModeParams *params);
+int commonModeRegion(const char *name);
+int commonModeEstimator(const char *name);
+void commonModeSubtract(float *data, uint16_t *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, tCommonModeParams *params);
+
+#endif
@@ -19,6 +19,9 @@
 #include <stdint.h>
 #include "dataVersion.h"
 #include "frameBuffer.h"
+#include "maskCache.h"
+#include "commonMode.h"
+#include "geometrySnapshot.h"
 
 #include "cheetah_extensions_yaroslav/streakfinder_wrapper.h"
 #include "cheetah_extensions_yaroslav/cheetahConversion.h"
@@ -189,10 +192,6 @@ public:
     float *pix_y;
     float *pix_z;
 
-    // Reciprocal space pixel coordinates (inverse A, no factor of 2*pi)
-    float *pix_kx;
-    float *pix_ky;
-    float *pix_kz;
     float pixelSize;
 
     // Assembled image size
@@ -222,8 +221,6 @@ public:
     float radial_max;
     long radial_nn;
     float *pix_r;
-    float *pix_kr;
-    float *pix_res;
 
     // Detector position
     char detectorZpvname[MAX_FILENAME_LENGTH];
@@ -240,8 +237,9 @@ public:
     double beamCenterPixX;
     double beamCenterPixY;
 
-    // Solid angle
-    double solidAngleConst; // constant term of the solid angle for each pixel
+    // Reciprocal space geometry and solid angle for the current camera length and wavelength
+    // (events use the snapshot they were handed, cPixelDetectorEvent::geometry)
+    cGeometrySnapshots geometry;
 
     /*
      *  Flags for detector processing options
@@ -261,6 +259,14 @@ public:
     int cmStop;          // pnCCD: intensity (ADU) at which the peakfinding should stop in the histogram
     float cmThreshold;     // pnCCD: noise threshold intensity (ADU) over which the peakfinding should consider as true peaks in the histogram
     float cmRange; // pnCCD: number of standard deviations from the mean of the insensitive pixels at which the peakfinding should accept the found zero-photon peak
+    // Generic common mode, any detector (see commonMode.h)
+    int cmRegion;          // CM_REGION_ASIC, _ROW, _COLUMN or _BANK
+    int cmEstimator;       // CM_ESTIMATOR_NONE (off), _MEDIAN (at cmFloor), _HISTOGRAM, _MEAN or _UNBONDED
+    long cmBankWidth;      // columns per bank
+    long cmHistogramSpan;  // histogram estimator covers [-cmHistogramSpan, cmHistogramSpan) ADU
+    uint16_t cmIncludeMask; // only pixels with any of these mask bits (0 = all pixels)...
+    uint16_t cmExcludeMask; // ...and none of these go into the estimate
+    int cmThreads;         // regions are split between this many threads
     // Gain calibration
     int useGaincal;
     int invertGain;
@@ -350,6 +356,10 @@ public:
     int streak_num_lines_to_check;
     int streak_background_region_preset;
     int streak_background_region_dist_from_edge;
+    // Streak detector panels are searched by this many threads per frame (default 1: only the calling thread)
+    int streak_thread_count;
+    // Directory for cached precomputed constants (empty = always recompute)
+    char streak_cache_dir[MAX_FILENAME_LENGTH];
 
     streakFinder_constantArguments_t *streakfinderConstants;
 
@@ -386,6 +396,15 @@ public:
 
     int savePixelmask;
 
+    // Sparse frame storage (per-frame pixel index + value lists instead of / next to the dense data stack)
+    int saveSparse;
+    // Skip the dense non-assembled data stack when sparse frames are saved
+    int saveSparseOnly;
+    // Pixels above this value are stored (threshold mode)
+    float sparseThreshold;
+    // If > 0 store all pixels within this radius (in pixels) around each found peak instead (peak mode)
+    long sparseHaloRadius;
+
     // Powder saving options
     // Data versions
     int savePowderDetectorRaw;
@@ -421,6 +440,9 @@ public:
     pthread_mutex_t pixelmask_shared_mutex;
     pthread_mutex_t pixelmask_shared_min_mutex;
     pthread_mutex_t pixelmask_shared_max_mutex;
+    // Incremented whenever pixelmask_shared is rewritten, derived masks are rebuilt when it changes
+    volatile long pixelmask_shared_epoch;
+    cDerivedMaskCache pixelmask_derived;
     // Powder data (accumulated sums and sums of squared values)
     long nPowderClasses;
     long nPowderFrames[MAX_POWDER_CLASSES];
@@ -498,7 +520,8 @@ public:
     void freeMemory();
     void unlockMutexes();
     void readDetectorGeometry(char *);
-    void updateKspace(cGlobal*, float);
+    void buildGeometry(cGlobal*, tGeometrySnapshot*);
+    void applyGeometry(tGeometrySnapshot*);
     void readDarkcal(char *);
     void readGaincal(char *);
     void readPeakmask(cGlobal*, char *);
@@ -536,6 +559,19 @@ public:
     float *data_forPersistentBackgroundBuffer;
     // Pixelmask
     uint16_t *pixelmask;
+    // Pixels where pixelmask differs from pixelmask_shared (epoch pixelmaskEpoch), listed where the bits are changed.
+    // More than maxPixelmaskChanges means the list overflowed and the whole mask has to be compared (see acquireEventMask)
+    long *pixelmaskChanges;
+    long nPixelmaskChanges;
+    long maxPixelmaskChanges;
+    long pixelmaskEpoch;
+    void markPixelmask(long i) {
+        if (nPixelmaskChanges < maxPixelmaskChanges)
+            pixelmaskChanges[nPixelmaskChanges] = i;
+        nPixelmaskChanges++;
+    }
+    // Geometry this event is processed with (reference held until the event is destroyed)
+    tGeometrySnapshot *geometry;
     /* DATA ASSEMBLED */
 
     // Raw data as read from the XTC file but converted to float
@@ -564,6 +600,9 @@ public:
     //float     *radialAverageCounter;
     double detectorZ;
     float sum;
+    // Pixels in each digital gain stage and bad pixels, filled in by readers of gain switching detectors (AGIPD)
+    long nPixelsInGainStage[3];
+    long nBadPixels;
 };
 
 #endif
@@ -0,0 +1,89 @@
+/*
+ *  geometrySnapshot.h
+ *  cheetah
+ *
+ *  Reciprocal space geometry of a detector for one (detectorZ, wavelength) pair, as immutable reference counted snapshots.
+ *  Each event takes the current snapshot when it is handed to a worker and keeps it until the event is destroyed.
+ *  When the camera length (or the wavelength, see geometryWavelengthTolerance) changes, the new snapshot is built in the
+ *  background and only becomes current once it is complete. Workers never have to be drained or wait for a geometry
+ *  update: events handed the older snapshot carry on with it, events handed out after the swap use the new one.
+ *  Only the very first geometry is built in the calling thread, so that no event is processed without one.
+ *
+ */
+
+#ifndef GEOMETRYSNAPSHOT_H
+#define GEOMETRYSNAPSHOT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+class cGlobal;
+class cPixelDetectorCommon;
+
+
+/*
+ *	One geometry, never modified once built
+ */
+typedef struct tGeometrySnapshot {
+	long		refcount;
+	long		serial;				// 1 for the first geometry requested, 2 for the next...
+	double		detectorZ;			// Camera length (mm) and wavelength (A) this geometry was built for
+	float		wavelengthA;
+	long		pix_nn;
+
+	// Reciprocal space pixel coordinates (inverse A, no factor of 2*pi) and resolution (A)
+	float		*pix_kx;
+	float		*pix_ky;
+	float		*pix_kz;
+	float		*pix_kr;
+	float		*pix_res;
+
+	// PIXEL_IS_OUT_OF_RESOLUTION_LIMITS for pixels outside the hitfinder resolution limits, 0 otherwise
+	uint16_t	*resolutionBits;
+
+	// Constant term of the solid angle (pixelSize^2/detectorZ^2)
+	double		solidAngleConst;
+
+	struct tGeometrySnapshot	*next;		// Build queue
+} tGeometrySnapshot;
+
+
+class cGeometrySnapshots {
+
+public:
+	cGeometrySnapshots();
+	~cGeometrySnapshots();
+	void setup(cPixelDetectorCommon *detector);
+	void request(cGlobal *global, double detectorZ, float wavelengthA);
+	tGeometrySnapshot *acquire();
+	void release(tGeometrySnapshot *snapshot);
+	void finish();
+
+public:
+	long	nBuilds;
+
+private:
+	cPixelDetectorCommon	*detector;
+	cGlobal					*global;
+	tGeometrySnapshot		*current;		// Last geometry built
+	pthread_mutex_t			mutex;
+
+	// Last geometry requested (may still be queued or being built)
+	int			requested;
+	double		requestedZ;
+	float		requestedWavelengthA;
+
+	// Background builder (at most one, it works through the queue in request order)
+	tGeometrySnapshot	*queueHead;
+	tGeometrySnapshot	*queueTail;
+	int			building;
+	int			joinable;
+	pthread_t	builder;
+
+private:
+	static void *builderThread(void *);
+	void build(tGeometrySnapshot *snapshot, cGlobal *global);
+	void destroy(tGeometrySnapshot *snapshot);
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ *  hitPrescreen.h
+ *  cheetah
+ *
+ *  Cascaded hit pre-screen: cheap statistics on a binned view of the detector-corrected frame,
+ *  compared against baselines learned from blank frames, used to veto obvious blanks before
+ *  background subtraction and peakfinding.
+ *
+ */
+
+#ifndef HITPRESCREEN_H
+#define HITPRESCREEN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_PRESCREEN_SHELLS 64
+
+
+/*
+ *	Outcome of screening one frame (kept by the worker until the full path has run)
+ */
+typedef struct {
+	int		screened;			// Pre-screen was run on this frame
+	int		decision;			// cHitPrescreen::PASS, VETO_SUBSAMPLED or VETO_BINNED
+	int		audit;				// Frame goes through the full path regardless of the decision
+	int		learning;			// Baselines not learned yet (decision is not meaningful)
+	float	score;				// Excess number of bins above baseline
+	long	nShells;
+	long	countsSubsampled[MAX_PRESCREEN_SHELLS];
+	long	countsBinned[MAX_PRESCREEN_SHELLS];
+} tHitPrescreenResult;
+
+
+/*
+ *	Per radial shell count of bins above threshold
+ *	Bins are binning x binning blocks of the raw (non-assembled) layout, so no geometry beyond pix_r is needed.
+ *	Shells hold equal numbers of bins, sorted by radius.
+ *	Stage 1 looks at every subsample'th row of bins only, stage 2 completes the binned view.
+ *	Baselines (mean and variance per shell) are learned from frames the full hitfinder classified as blank.
+ */
+class cHitPrescreen {
+
+public:
+	enum {
+		PASS = 0,
+		VETO_SUBSAMPLED,
+		VETO_BINNED
+	};
+
+	cHitPrescreen();
+	~cHitPrescreen();
+	void setup(long pix_nx, long pix_ny, float *pix_r, long binning, long nShells, long subsample, long learnFrames, long auditInterval);
+	void screen(float *data, uint16_t *pixelmask, float adcThreshold, float nSigma, long minBins, tHitPrescreenResult *result);
+	void recordOutcome(tHitPrescreenResult *result, int fullPathHit);
+	void report(FILE *fp);
+
+public:
+	long	nShells;
+	long	binning;
+	long	subsample;
+	long	learnFrames;
+	long	auditInterval;
+
+private:
+	long	pix_nx;
+	long	pix_ny;
+	long	nbx;
+	long	nby;
+	int		*binShell;			// Shell index of each bin (-1 for bins without pixels)
+
+	// Learned blank baselines, for the subsampled (stage 1) and complete (stage 2) binned view
+	double	baselineN;
+	double	baselineMean[2][MAX_PRESCREEN_SHELLS];
+	double	baselineVar[2][MAX_PRESCREEN_SHELLS];
+
+	// Statistics
+	long	nScreened;
+	long	nVetoSubsampled;
+	long	nVetoBinned;
+	long	nPassed;
+	long	nPassedHits;
+	long	nLearning;
+	long	nAudited;
+	long	nAuditVetoHit;		// Would have been vetoed, full path says hit (false veto)
+	long	nAuditVetoBlank;
+	long	nAuditPassHit;
+	long	nAuditPassBlank;
+
+	pthread_mutex_t	mutex;
+
+private:
+	void	countBinRow(float *data, uint16_t *pixelmask, float adcThreshold, long by, long *counts, float *binmax);
+	float	excess(int view, long *counts, float nSigma);
+};
+
+#endif
@@ -10,6 +10,6 @@ int hitfinder4(cGlobal *global, cEventData *eventData, long detID);
 int hitfinder9(cGlobal *global, cEventData *eventData);
 int hitfinderTOF(cGlobal *global, cEventData *eventData);
 int hitfinderProtonsandPhotons(cGlobal *global, cEventData *eventData, long detID);
-bool containsEvent(std::string event, cGlobal *global);
+bool containsEvent(cEventData *eventData, cGlobal *global);
 
 #endif
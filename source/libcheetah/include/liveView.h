@@ -0,0 +1,174 @@
+/*
+ *  liveView.h
+ *  cheetah
+ *
+ *  Live view of the most recent hits and of the running powder sums in POSIX shared memory,
+ *  so that local viewers can attach read-only instead of polling files written every saveInterval.
+ *
+ */
+
+#ifndef LIVEVIEW_H
+#define LIVEVIEW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "peakfinders.h"
+
+#define LIVEVIEW_MAGIC				"CHTLIVE1"
+#define LIVEVIEW_VERSION			1
+#define LIVEVIEW_EVENTNAME_LENGTH	256
+#define LIVEVIEW_MAX_POWDER_CLASSES	16
+
+
+/*
+ *	Shared memory layout
+ *	All offsets are in bytes from the start of the segment, all values in host byte order.
+ *
+ *	offset 0				tLiveViewHeader
+ *	slotOffset				nSlots hit slots of slotSize bytes each:
+ *								tLiveViewSlot
+ *								float	thumbnail[thumb_ny][thumb_nx]		(at slot + sizeof(tLiveViewSlot))
+ *								tLiveViewPeak	peaks[maxPeaks]				(after the thumbnail, 8 byte aligned)
+ *	powderOffset			float	powder[nPowderClasses][thumb_ny][thumb_nx]
+ *	radialOffset			float	radial[nPowderClasses][radial_nn]
+ *
+ *	Thumbnails are the assembled image (nearest pixel) binned by binning x binning, mean of the pixels in each bin.
+ *	Powder thumbnails and radial profiles hold the running sums, divide by powderFrames[class] for a mean.
+ *
+ *	Lock-free protocol (sequence locks, the writer never waits for a reader):
+ *	-	A slot's sequence is odd while the slot is being written and even when it is complete.
+ *		A reader takes sequence, skips the slot if it is odd, reads (or copies) the slot, then takes sequence again:
+ *		the data is consistent only if both values are equal. Otherwise retry.
+ *	-	powderSequence protects the powder and radial arrays (and powderFrames, nProcessed, nHits) the same way.
+ *	-	nPublished counts completed hit slots. The most recent hit is the slot with the largest hitIndex.
+ *	-	magic is written last when the segment is created, state is set to LIVEVIEW_STATE_FINISHED at the end of the run
+ *		(the segment is unlinked at exit, viewers already attached keep their mapping).
+ */
+enum {
+	LIVEVIEW_STATE_RUNNING = 1,
+	LIVEVIEW_STATE_FINISHED = 2
+};
+
+typedef struct {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	headerSize;
+	uint64_t	segmentSize;
+
+	uint32_t	nSlots;
+	uint32_t	maxPeaks;
+	uint64_t	slotSize;
+	uint64_t	slotOffset;
+
+	uint32_t	thumb_nx;
+	uint32_t	thumb_ny;
+	uint32_t	binning;
+	uint32_t	nPowderClasses;
+	uint32_t	radial_nn;
+	uint32_t	detectorIndex;
+	uint64_t	powderOffset;
+	uint64_t	radialOffset;
+
+	int64_t		pid;
+	volatile int64_t	runNumber;
+	volatile uint32_t	state;
+	uint32_t	reserved;
+
+	volatile uint64_t	nPublished;
+	volatile uint64_t	nDropped;			// Hits not published because their slot was still being written
+
+	volatile uint64_t	powderSequence;
+	int64_t		powderFrames[LIVEVIEW_MAX_POWDER_CLASSES];
+	int64_t		nProcessed;
+	int64_t		nHits;
+} tLiveViewHeader;
+
+
+typedef struct {
+	volatile uint64_t	sequence;
+	uint64_t	hitIndex;					// 1 for the first hit published, 2 for the second...
+	int64_t		frameNumber;
+	int64_t		runNumber;
+	uint64_t	trainID;
+	uint64_t	pulseID;
+	int64_t		cellID;
+	double		photonEnergyeV;
+	double		wavelengthA;
+	double		detectorZ;
+	float		hitScore;
+	int32_t		powderClass;
+	int32_t		nPeaks;						// Peaks found
+	int32_t		nPeaksStored;				// Peaks in this slot (at most maxPeaks)
+	char		eventname[LIVEVIEW_EVENTNAME_LENGTH];
+} tLiveViewSlot;
+
+
+typedef struct {
+	float		fs;							// Centre of mass in the raw layout
+	float		ss;
+	float		x;							// Centre of mass in the assembled layout
+	float		y;
+	float		totalIntensity;
+	float		maxIntensity;
+	float		snr;
+	float		npix;
+} tLiveViewPeak;
+
+
+/*
+ *	Metadata of one hit (filled in by the caller)
+ */
+typedef struct {
+	long		frameNumber;
+	long		runNumber;
+	uint64_t	trainID;
+	uint64_t	pulseID;
+	long		cellID;
+	double		photonEnergyeV;
+	double		wavelengthA;
+	double		detectorZ;
+	float		hitScore;
+	int			powderClass;
+	const char	*eventname;
+} tLiveViewHitInfo;
+
+
+class cLiveView {
+
+public:
+	cLiveView();
+	~cLiveView();
+	int setup(const char *name, long nSlots, long maxPeaks, long binning, long detectorIndex,
+			  long pix_nn, float *pix_x, float *pix_y, float *pix_r, long image_nx, long image_ny, long radial_nn, long nPowderClasses);
+	void publishHit(tLiveViewHitInfo *info, float *data, tPeakList *peaklist);
+	int beginPowderUpdate();
+	void publishPowderClass(long powderClass, double *powder, long nFrames);
+	void endPowderUpdate(long runNumber, long nProcessed, long nHits);
+	void close();
+
+public:
+	int		enabled;
+	char	name[1024];
+
+private:
+	tLiveViewHeader	*header;
+	char	*segment;
+	size_t	segmentSize;
+	long	pix_nn;
+	long	thumb_nn;
+	long	radial_nn;
+	long	*thumbIndex;		// Thumbnail bin of each pixel (-1 if outside)
+	float	*thumbWeight;		// 1/number of pixels in each thumbnail bin
+	long	*radialIndex;		// Radial bin of each pixel (-1 if outside)
+	float	*radialWeight;
+	uint64_t	nClaimed;
+	pthread_mutex_t	powderMutex;
+
+private:
+	tLiveViewSlot	*slot(long i);
+	void	binPixels(float *thumb, float *data);
+};
+
+#endif
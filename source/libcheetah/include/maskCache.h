@@ -0,0 +1,93 @@
+/*
+ *  maskCache.h
+ *  cheetah
+ *
+ *  Char masks (1 = use pixel, 0 = ignore) derived from pixelmask_shared, one per combination of mask bits.
+ *  Derived masks are only rebuilt when the epoch of pixelmask_shared changes (hot/noisy pixel recalculation,
+ *  resolution limits...). Per-event bits such as saturation or jet streaks are recorded as a list of changed pixels
+ *  where they are set, and patched into a pooled copy of the derived mask at those pixels only.
+ *
+ */
+
+#ifndef MASKCACHE_H
+#define MASKCACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_DERIVED_MASKS 16
+
+// At most pix_nn/MASK_CHANGES_FRACTION changed pixels are listed per event, beyond that the whole mask is compared
+#define MASK_CHANGES_FRACTION 16
+#define MAX_MASK_CHANGES(pix_nn) ((pix_nn)/MASK_CHANGES_FRACTION + 1)
+
+
+/*
+ *	One derived mask, immutable once built
+ *	Entries are reference counted so that a rebuild never pulls a mask from under a worker still using it
+ */
+typedef struct {
+	uint16_t	bits;			// Mask bits that exclude a pixel
+	long		epoch;			// Epoch of pixelmask_shared this mask was derived from
+	long		serial;			// Unique per build, identifies the contents of a pooled overlay buffer
+	bool		consistent;		// pixelmask_shared did not change while the mask was derived
+	long		refcount;
+	char		*mask;			// isNoneOfBitOptionsSet(pixelmask_shared, bits)
+	uint16_t	*snapshot;		// pixelmask_shared & bits at the time the mask was derived
+} tDerivedMask;
+
+
+/*
+ *	Private copy of a derived mask with one event's changes patched in
+ *	Buffers are pooled; the pixels patched last time are restored from the derived mask on reuse, so a buffer
+ *	is only copied in full when it last mirrored a different derived mask (new epoch or other bits)
+ */
+typedef struct tOverlayBuffer {
+	char		*mask;
+	long		source;			// Serial of the derived mask the buffer mirrors (-1: none)
+	long		*patched;		// Pixels that differ from the derived mask
+	long		nPatched;		// -1: unknown, copy in full
+	struct tOverlayBuffer *next;
+} tOverlayBuffer;
+
+
+class cDerivedMaskCache {
+
+public:
+	cDerivedMaskCache();
+	~cDerivedMaskCache();
+	void setup(long pix_nn);
+	tDerivedMask *acquire(uint16_t *pixelmask_shared, volatile long *epoch, uint16_t bits);
+	void release(tDerivedMask *entry);
+	tOverlayBuffer *acquireOverlay(tDerivedMask *entry);
+	void releaseOverlay(tOverlayBuffer *buffer);
+
+public:
+	long	pix_nn;
+	long	nRebuilds;
+
+private:
+	tDerivedMask	*current[MAX_DERIVED_MASKS];
+	long			nCurrent;
+	tOverlayBuffer	*freeOverlays;
+	pthread_mutex_t	mutex;
+
+private:
+	tDerivedMask	*build(uint16_t *pixelmask_shared, volatile long *epoch, uint16_t bits);
+	void			destroy(tDerivedMask *entry);
+};
+
+
+/*
+ *	Derived mask as seen by one event
+ *	mask points either at the shared cached mask (no per-event differences) or at a pooled overlay buffer.
+ *	Either way it must be treated as read-only and handed back with releaseEventMask().
+ */
+typedef struct {
+	char			*mask;
+	tDerivedMask	*entry;
+	tOverlayBuffer	*overlay;
+	long			nOverlay;		// Pixels where the event mask differs from the cached mask
+} tEventMask;
+
+#endif
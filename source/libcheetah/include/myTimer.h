@@ -10,6 +10,8 @@
 #define myTimer_h
 
 #include <string>
+#include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 
 
@@ -43,6 +45,42 @@ private:
 
 
 
+/*
+ *  Log-linear latency histogram (HDR histogram style)
+ *  Values are binned in nanoseconds with 32 linear sub-bins per power of 2, ie: ~3% relative resolution from 1 ns to ~70 min
+ *  Not thread-safe by itself, see cTimingProfiler for locking
+ */
+class cLatencyHistogram {
+
+public:
+    cLatencyHistogram();
+
+    void reset(void);
+    void record(double seconds);
+    void add(const cLatencyHistogram &);
+    double percentile(double) const;
+
+    long    count;
+    double  total;
+    double  maxValue;
+
+private:
+    enum {
+        SUB_BITS = 5,
+        SUB_COUNT = 1 << SUB_BITS,
+        MAX_EXPONENT = 42,
+        NBINS = SUB_COUNT * (MAX_EXPONENT - SUB_BITS + 2)
+    };
+    static long binIndex(uint64_t);
+    static uint64_t binUpperValue(long);
+
+    long    bins[NBINS];
+};
+
+
+class cStageTimer;
+
+
 /*
  *  Housekeeper for keeping track of how long spent in different parts of code
  */
@@ -74,17 +112,93 @@ private:
     };
 
 
+public:
+    // Stages of the worker() pipeline, each one gets its own latency histogram
+    enum {
+        STAGE_INIT=0,
+        STAGE_DARK,
+        STAGE_COMMONMODE,
+        STAGE_HOTPIXELS,
+        STAGE_BACKGROUND,
+        STAGE_PRESCREEN,
+        STAGE_STREAKFINDER,
+        STAGE_RADIALBACKGROUND,
+        STAGE_LOCALBACKGROUND,
+        STAGE_HITFINDER,
+        STAGE_ASSEMBLE,
+        STAGE_POWDER,
+        STAGE_RADIAL,
+        STAGE_WRITE,
+        STAGE_TOTAL,
+        STAGE_NTYPES
+    };
+
+private:
+    std::string stageMessage[STAGE_NTYPES] = {
+        "Initialisation",
+        "Darkcal",
+        "Common mode",
+        "Gain, bad and hot pixels",
+        "Photon background",
+        "Hit pre-screen",
+        "Streak finder",
+        "Radial background",
+        "Local background",
+        "Hitfinder",
+        "Assemble",
+        "Powder",
+        "Radial average",
+        "Write",
+        "Worker total"
+    };
+
+    // Histograms are striped over several locks so that concurrent workers rarely contend for the same one
+    // (workers are one thread per event, so the stripe comes from the event number), stripes are merged for reporting
+    enum { NSTRIPES = 8 };
+
+
 public:
     cTimingProfiler();
     
     void addToTimer(double, int);
+    void addStageTimes(const cStageTimer &, long);
     void reportTimers(void);
+    void reportStages(FILE *);
     void resetTimers(void);
 
 private:
     double   elapsed_time[TIMER_NTYPES];
     pthread_mutex_t counter_mutex;
+
+    cLatencyHistogram stageHistogram[NSTRIPES][STAGE_NTYPES];
+    pthread_mutex_t stripe_mutex[NSTRIPES];
+    double   stage_tstart;
     
 };
 
+
+
+/*
+ *  Per-frame stage timer for the worker pipeline
+ *  lap() books the time since the previous start()/lap() to a stage, finish() the time since construction.
+ *  The whole set is handed to cTimingProfiler::addStageTimes() at the end of the frame
+ */
+class cStageTimer {
+
+public:
+    cStageTimer();
+
+    void start(void);
+    void lap(int);
+    void finish(int);
+
+    double  elapsed[cTimingProfiler::STAGE_NTYPES];
+    bool    used[cTimingProfiler::STAGE_NTYPES];
+
+private:
+    double  first;
+    double  last;
+    double  now(void);
+};
+
 #endif /* myTimer_h */
@@ -0,0 +1,89 @@
+/*
+ *  stackWriter.h
+ *  cheetah
+ *
+ *  Double-buffered stacks of 1D traces (FEE spectrometer, CXI spectrometer, time tool) with a background writer.
+ *  A full stack is handed to the writer thread and the spare buffer takes over at once, so workers adding a row
+ *  never wait for an HDF5 write (unless the writer is a whole stack behind).
+ *
+ *  Stack files are <prefix>-stack<n>.h5 with n = 1 for the first stackSize rows, 2 for the next...
+ *  A partial stack (periodic and final saves) goes to the file its rows will be in once the stack is full.
+ *  The prefix and index log are those of the current run (setOutput() is called again at each new run,
+ *  after the writer has been drained since it flushes the index log of the stacks it writes).
+ *
+ */
+
+#ifndef STACKWRITER_H
+#define STACKWRITER_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+class cStackBuffer;
+
+
+typedef struct tStackJob {
+	char			filename[1024];
+	float			*data;
+	long			width;
+	long			nRows;
+	FILE			*indexfp;		// Index log to flush once the stack is on disk
+	cStackBuffer	*owner;			// Give data back to owner as its spare buffer (full stacks), or free it (partial copies)
+	struct tStackJob	*next;
+} tStackJob;
+
+
+class cStackWriter {
+
+public:
+	cStackWriter();
+	~cStackWriter();
+	void queue(tStackJob *job);
+	void drain(void);
+	void finish(void);
+
+private:
+	tStackJob		*queueHead;
+	tStackJob		*queueTail;
+	int				busy;
+	int				running;
+	int				done;
+	pthread_t		writer;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	queued;
+	pthread_cond_t	idle;
+
+	static void *writerThread(void *);
+};
+
+
+class cStackBuffer {
+
+public:
+	cStackBuffer();
+	~cStackBuffer();
+	void setup(cStackWriter *writer, long width, long stackSize);
+	void setOutput(const char *prefix, FILE *indexfp);
+	float *beginRow(long *stackCounter);
+	void endRow(void);
+	void save(void);
+	void recycle(float *buffer);
+
+public:
+	long	width;
+	long	stackSize;
+	long	counter;
+
+private:
+	cStackWriter	*writer;
+	char			prefix[1024];
+	FILE			*indexfp;
+	float			*filling;
+	float			*spare;			// NULL while the previous full stack is being written
+	pthread_mutex_t	mutex;
+	pthread_cond_t	spareReturned;
+
+	tStackJob *newJob(float *data, long nRows, long stackNum, cStackBuffer *owner);
+};
+
+#endif
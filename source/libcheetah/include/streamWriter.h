@@ -0,0 +1,88 @@
+/*
+ *  streamWriter.h
+ *  cheetah
+ *
+ *  CrystFEL stream (format 2.3) written straight from the pipeline: one chunk per hit with the image location,
+ *  photon energy, camera length and the peak list in panel coordinates, so that the peaks found by Cheetah can be
+ *  used without a second pass over the images.
+ *  Workers only copy the peaks into a queue, a background thread formats and writes the chunks.
+ *
+ *  Panels are those of the CrystFEL geometry given with streamGeometry (copied into the stream header).
+ *  Without one, every ASIC of the hitfinder detector is a panel and a matching geometry is generated from the pixel map.
+ *
+ */
+
+#ifndef STREAMWRITER_H
+#define STREAMWRITER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define STREAM_MAX_QUEUED_CHUNKS	1024
+
+class cGlobal;
+class cEventData;
+class cPixelDetectorCommon;
+
+
+typedef struct {
+	std::string	name;
+	long		min_fs;
+	long		max_fs;
+	long		min_ss;
+	long		max_ss;
+} tStreamPanel;
+
+typedef struct tStreamChunk {
+	std::string	filename;
+	long		stackSlice;
+	double		photonEnergyeV;
+	double		cameraLength;		// m
+	long		nPeaks;
+	float		*fs;				// Raw layout, Cheetah convention (pixel centres on integers)
+	float		*ss;
+	float		*resA;
+	float		*intensity;
+	struct tStreamChunk	*next;
+} tStreamChunk;
+
+
+class cStreamWriter {
+
+public:
+	cStreamWriter();
+	~cStreamWriter();
+	int setup(const char *filename, const char *geometryFile, cPixelDetectorCommon *detector);
+	void addHit(cEventData *eventData, cGlobal *global, long detIndex);
+	void close(void);
+
+public:
+	long	nChunks;
+
+private:
+	FILE						*fp;
+	std::vector<tStreamPanel>	panels;
+	long						pix_nx;
+	long						pix_ny;
+
+	// Queue of chunks for the writer thread
+	tStreamChunk	*queueHead;
+	tStreamChunk	*queueTail;
+	long			nQueued;
+	int				done;
+	int				running;
+	pthread_t		writer;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	queued;
+	pthread_cond_t	space;
+
+	int readGeometry(const char *geometryFile, std::string &text);
+	void generateGeometry(cPixelDetectorCommon *detector, std::string &text);
+	long findPanel(float fs, float ss);
+	void writeChunk(tStreamChunk *chunk);
+	static void *writerThread(void *);
+};
+
+#endif
@@ -145,14 +145,13 @@ void subtractRadialBackground(cEventData *eventData, cGlobal *global){
 			float		sigmaThresh = 5;
 			
 			//	Masks for bad regions  (mask=0 to ignore regions)
-			char		*mask = (char*) calloc(pix_nn, sizeof(char));
+			tEventMask	eventMask;
 			uint16_t	combined_pixel_options = PIXEL_IS_IN_PEAKMASK|PIXEL_IS_BAD|PIXEL_IS_HOT|PIXEL_IS_BAD|PIXEL_IS_SATURATED;
-			for(long i=0;i<pix_nn; i++)
-				mask[i] = isNoneOfBitOptionsSet(eventData->detector[detIndex].pixelmask[i], combined_pixel_options);
+			acquireEventMask(eventData, global, detIndex, combined_pixel_options, &eventMask);
 			
-			subtractRadialBackground(data, pix_r, mask, pix_nn, sigmaThresh);
+			subtractRadialBackground(data, pix_r, eventMask.mask, pix_nn, sigmaThresh);
 			
-			free(mask);
+			releaseEventMask(global, detIndex, &eventMask);
 		}
 	}
 }
@@ -167,6 +167,7 @@ int main()
 //    streakFinder_accuracyConstants.streakElongationMinStepsCount = 10;
 //    streakFinder_accuracyConstants.streakElongationRadiusFactor = 0.08;
 //    streakFinder_accuracyConstants.streakPixelMaskRadius = 2;
+//    streakFinder_accuracyConstants.threadCount = 4;
 //    streakFinder_accuracyConstants.linesToCheck.push_back(1);
 //    streakFinder_accuracyConstants.linesToCheck.push_back(3);
 ////    streakFinder_accuracyConstants.linesToCheck.push_back(5);
@@ -250,6 +251,8 @@ int main()
 //    radialRankFilter_accuracyConstants.minBinWidth = 3;
 //    radialRankFilter_accuracyConstants.maxConsideredValuesPerBin = 500;
 //    radialRankFilter_accuracyConstants.rank = 0.5;
+//    radialRankFilter_accuracyConstants.threadCount = 1;
+//    radialRankFilter_accuracyConstants.histogramRankResolution = 0;
 //    for (int i = 0; i < 8; ++i) {
 //        for (int j = 0; j < 8; ++j) {
 //            radialRankFilter_accuracyConstants.detektorsToConsiderIndices.push_back(Point2D < uint_fast8_t > (i, j));
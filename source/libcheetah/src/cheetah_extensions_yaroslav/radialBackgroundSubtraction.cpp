@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <thread>
 #include "matlabLikeFunctions.h"
 #include "sortingByOtherValues.h"
 
@@ -41,10 +42,16 @@ static void computeIntraBinInterpolationConstant(radialRankFilter_precomputedCon
         const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
         const std::vector< std::vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions);
 
-static void gatherBinsData(std::vector< std::vector< float > >& binsWithData, const float* data_linear,
-        const radialRankFilter_precomputedConstants_t& precomputedConstants);
-static void computeBinValues(std::vector< float >& binValues, std::vector< std::vector< float > >& binsWithData,
-        const radialRankFilter_precomputedConstants_t& precomputedConstants, const radialRankFilter_accuracyConstants_t& accuracyConstants);
+static void computeBinDataLayout(radialRankFilter_precomputedConstants_t& precomputedConstants,
+        const radialRankFilter_accuracyConstants_t& accuracyConstants);
+
+static void computeBinValues(float* binValues, float* binData, std::vector< uint32_t >* histogram, const float* data_linear,
+        uint16_t firstBin, uint16_t endBin, const radialRankFilter_precomputedConstants_t& precomputedConstants,
+        const radialRankFilter_accuracyConstants_t& accuracyConstants);
+static float rankFromHistogram(const float* binData, uint32_t count, uint32_t intRank, float resolution,
+        std::vector< uint32_t >& histogram, bool& found);
+
+static const uint32_t maxHistogramBucketsPerValue = 4;     //histogram only if it has no more buckets than this many times the values of the bin
 
 void precomputeRadialRankFilterConstants(radialRankFilter_precomputedConstants_t& precomputedConstants, const uint8_t* mask_linear,
         const float* detectorGeometryRadiusMatrix_linear,
@@ -87,17 +94,51 @@ void precomputeRadialRankFilterConstants(radialRankFilter_precomputedConstants_t
 
     computeIntraBinInterpolationConstant(precomputedConstants, mask_linear, detectorGeometryRadiusMatrix_linear, accuracyConstants, detectorRawSize_cheetah,
             detectorPositions);
+
+    computeBinDataLayout(precomputedConstants, accuracyConstants);
 }
 
 void applyRadialRankFilter(float* data_linear, const radialRankFilter_accuracyConstants_t& accuracyConstants,
         const radialRankFilter_precomputedConstants_t& precomputedConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
         const std::vector< std::vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions)
 {
-    std::vector < std::vector< float > > binsWithData;
-    gatherBinsData(binsWithData, data_linear, precomputedConstants);
+    //buffers of the calling thread, reused from frame to frame
+    static thread_local std::vector< float > binData;
+    static thread_local std::vector< float > binValues;
+    static thread_local std::vector< std::vector< uint32_t > > histograms;
+
+    uint32_t threadCount = precomputedConstants.threadFirstBins.size() - 1;
+    binData.resize(precomputedConstants.linearDataIndicesByBin.size());
+    binValues.resize(precomputedConstants.binCount);
+    if (histograms.size() < threadCount) {
+        histograms.resize(threadCount);
+    }
+
+    std::vector< std::thread > threads;
+    if (threadCount > 1) {
+        threads.reserve(threadCount - 1);
+        for (uint32_t t = 1; t < threadCount; ++t) {
+            threads.push_back(
+                    std::thread(computeBinValues, binValues.data(), binData.data(), &histograms[t], data_linear, precomputedConstants.threadFirstBins[t],
+                            precomputedConstants.threadFirstBins[t + 1], std::cref(precomputedConstants), std::cref(accuracyConstants)));
+        }
+    }
+    computeBinValues(binValues.data(), binData.data(), &histograms[0], data_linear, precomputedConstants.threadFirstBins[0],
+            precomputedConstants.threadFirstBins[1], precomputedConstants, accuracyConstants);
+    for (uint32_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
 
-    std::vector< float > binValues;
-    computeBinValues(binValues, binsWithData, precomputedConstants, accuracyConstants);
+    binValues[0] = binValues[1]
+            + (binValues[1] - binValues[2]) /
+                    (precomputedConstants.binRadii[2] - precomputedConstants.binRadii[1]) *
+                    (precomputedConstants.binRadii[1] - precomputedConstants.binRadii[0]);
+
+    uint32_t lastIndex = binValues.size() - 1;
+    binValues[lastIndex] = binValues[lastIndex - 1] +
+            (binValues[lastIndex - 1] - binValues[lastIndex - 2]) /
+                    (precomputedConstants.binRadii[lastIndex - 1] - precomputedConstants.binRadii[lastIndex - 2]) *
+                    (precomputedConstants.binRadii[lastIndex] - precomputedConstants.binRadii[lastIndex - 1]);
 
     //*******debug
 //    for (uint32_t i=0; i < detectorRawSize_cheetah.pix_nn; ++i) {
@@ -126,39 +167,70 @@ void applyRadialRankFilter(float* data_linear, const radialRankFilter_accuracyCo
     }
 }
 
-static void gatherBinsData(std::vector< std::vector< float > >& binsWithData, const float* data_linear,
-        const radialRankFilter_precomputedConstants_t& precomputedConstants)
+//gathers the data of bins [firstBin, endBin) into their part of the flat bin buffer and selects the rank value of each
+static void computeBinValues(float* binValues, float* binData, std::vector< uint32_t >* histogram, const float* data_linear,
+        uint16_t firstBin, uint16_t endBin, const radialRankFilter_precomputedConstants_t& precomputedConstants,
+        const radialRankFilter_accuracyConstants_t& accuracyConstants)
 {
-    binsWithData.resize(precomputedConstants.binCount);
-    for (uint32_t i = 1; i < binsWithData.size() - 1; ++i) {
-        binsWithData[i].reserve(precomputedConstants.dataCountPerBin[i]);
-    }
+    const uint32_t* binDataOffsets = precomputedConstants.binDataOffsets.data();
+    const uint32_t* linearDataIndicesByBin = precomputedConstants.linearDataIndicesByBin.data();
+
+    for (uint32_t i = firstBin; i < endBin; ++i) {
+        float* currentBinData = binData + binDataOffsets[i];
+        uint32_t count = binDataOffsets[i + 1] - binDataOffsets[i];
+        for (uint32_t j = 0; j < count; ++j) {
+            currentBinData[j] = data_linear[linearDataIndicesByBin[binDataOffsets[i] + j]];
+        }
+
+        uint32_t intRank = std::max((uint32_t)(accuracyConstants.rank * count), (uint32_t) 1) - 1;
 
-    for (uint32_t i = 0; i < precomputedConstants.sparseLinearDataToConsiderIndices.size(); ++i) {
-        binsWithData[precomputedConstants.sparseBinIndices[i]].push_back(data_linear[precomputedConstants.sparseLinearDataToConsiderIndices[i]]);
+        bool found = false;
+        if (accuracyConstants.histogramRankResolution > 0) {
+            binValues[i] = rankFromHistogram(currentBinData, count, intRank, accuracyConstants.histogramRankResolution, *histogram, found);
+        }
+        if (!found) {
+            std::nth_element(currentBinData, currentBinData + intRank, currentBinData + count);
+            binValues[i] = currentBinData[intRank];
+        }
     }
 }
 
-static void computeBinValues(std::vector< float >& binValues, std::vector< std::vector< float > >& binsWithData,
-        const radialRankFilter_precomputedConstants_t& precomputedConstants, const radialRankFilter_accuracyConstants_t& accuracyConstants)
+//value of rank intRank, to within one bucket below it; found is false if the value range of the bin is too wide for a histogram
+static float rankFromHistogram(const float* binData, uint32_t count, uint32_t intRank, float resolution,
+        std::vector< uint32_t >& histogram, bool& found)
 {
-    binValues.resize(binsWithData.size());
-    for (uint32_t i = 1; i < binsWithData.size() - 1; ++i) {
-        uint32_t intRank = std::max((uint32_t)(accuracyConstants.rank * binsWithData[i].size()), (uint32_t) 1) - 1;
-        std::nth_element(binsWithData[i].begin(), binsWithData[i].begin() + intRank, binsWithData[i].end());
-        binValues[i] = binsWithData[i][intRank];
+    found = false;
+    if (count == 0) {
+        return 0;
     }
 
-    binValues[0] = binValues[1]
-            + (binValues[1] - binValues[2]) /
-                    (precomputedConstants.binRadii[2] - precomputedConstants.binRadii[1]) *
-                    (precomputedConstants.binRadii[1] - precomputedConstants.binRadii[0]);
+    float minValue = binData[0];
+    float maxValue = binData[0];
+    for (uint32_t j = 1; j < count; ++j) {
+        minValue = std::min(minValue, binData[j]);
+        maxValue = std::max(maxValue, binData[j]);
+    }
+    float bucketCount_float = (maxValue - minValue) / resolution + 1;
+    if (!std::isfinite(bucketCount_float) || bucketCount_float > (float) count * maxHistogramBucketsPerValue) {
+        return 0;
+    }
 
-    uint32_t lastIndex = binValues.size() - 1;
-    binValues[lastIndex] = binValues[lastIndex - 1] +
-            (binValues[lastIndex - 1] - binValues[lastIndex - 2]) /
-                    (precomputedConstants.binRadii[lastIndex - 1] - precomputedConstants.binRadii[lastIndex - 2]) *
-                    (precomputedConstants.binRadii[lastIndex] - precomputedConstants.binRadii[lastIndex - 1]);
+    uint32_t bucketCount = (uint32_t) bucketCount_float;
+    histogram.assign(bucketCount, 0);
+    for (uint32_t j = 0; j < count; ++j) {
+        uint32_t bucket = std::min((uint32_t) ((binData[j] - minValue) / resolution), bucketCount - 1);
+        ++histogram[bucket];
+    }
+
+    uint32_t cumulativeCount = 0;
+    for (uint32_t bucket = 0; bucket < bucketCount; ++bucket) {
+        cumulativeCount += histogram[bucket];
+        if (cumulativeCount > intRank) {
+            found = true;
+            return minValue + bucket * resolution;
+        }
+    }
+    return 0;
 }
 
 static void gatherAvailableRadii(std::vector< float > &availableRadii, std::vector< Point2D< uint16_t > > &radiiMatrixIndices,
@@ -391,3 +463,42 @@ static void computeIntraBinInterpolationConstant(radialRankFilter_precomputedCon
         }
     }
 }
+
+static void computeBinDataLayout(radialRankFilter_precomputedConstants_t& precomputedConstants,
+        const radialRankFilter_accuracyConstants_t& accuracyConstants)
+{
+    uint32_t binCount = precomputedConstants.binCount;
+    uint32_t dataCount = precomputedConstants.sparseLinearDataToConsiderIndices.size();
+
+    precomputedConstants.binDataOffsets.assign(binCount + 1, 0);
+    for (uint32_t i = 0; i < dataCount; ++i) {
+        ++precomputedConstants.binDataOffsets[precomputedConstants.sparseBinIndices[i] + 1];
+    }
+    for (uint32_t i = 0; i < binCount; ++i) {
+        precomputedConstants.binDataOffsets[i + 1] += precomputedConstants.binDataOffsets[i];
+    }
+
+    //pixels stay in ascending order within each bin
+    std::vector< uint32_t > fillPosition(precomputedConstants.binDataOffsets.begin(), precomputedConstants.binDataOffsets.end() - 1);
+    precomputedConstants.linearDataIndicesByBin.resize(dataCount);
+    for (uint32_t i = 0; i < dataCount; ++i) {
+        precomputedConstants.linearDataIndicesByBin[fillPosition[precomputedConstants.sparseBinIndices[i]]++] =
+                precomputedConstants.sparseLinearDataToConsiderIndices[i];
+    }
+
+    //first and last bin are only used for interpolation
+    uint32_t threadCount = std::max((uint32_t) accuracyConstants.threadCount, (uint32_t) 1);
+    uint32_t firstBin = 1;
+    uint32_t endBin = binCount - 1;
+    precomputedConstants.threadFirstBins.assign(1, firstBin);
+    uint32_t bin = firstBin;
+    for (uint32_t t = 1; t < threadCount; ++t) {
+        uint64_t targetOffset = precomputedConstants.binDataOffsets[firstBin]
+                + (uint64_t) (precomputedConstants.binDataOffsets[endBin] - precomputedConstants.binDataOffsets[firstBin]) * t / threadCount;
+        while (bin < endBin && precomputedConstants.binDataOffsets[bin] < targetOffset) {
+            ++bin;
+        }
+        precomputedConstants.threadFirstBins.push_back(bin);
+    }
+    precomputedConstants.threadFirstBins.push_back(endBin);
+}
@@ -13,6 +13,13 @@
 #include <boost/algorithm/cxx11/iota.hpp>
 #include <boost/phoenix/phoenix.hpp>
 #include "sortingByOtherValues.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 
 #include <boost/foreach.hpp>
 #ifdef __CDT_PARSER__
@@ -28,6 +35,22 @@ typedef struct {
     uint32_t numberOfPixelsToMask;
 } streakPixelsShort_t;
 
+typedef struct {
+    bool valid;
+    float mean;
+    float sigma;
+} backgroundEstimationRegionStatistics_t;
+
+typedef struct {
+    float* values;
+    uint32_t* frameNumbers; //a value is valid if its frame number is the current one
+    uint32_t frameNumber;
+} radialFilterResponses_t;
+
+static const int maxRegionsCount = 50;
+static const uint_fast8_t radialFilterLanesCount = 8; //radial filter responses computed at once, one pixel per SIMD lane
+typedef Array< float, radialFilterLanesCount, 1 > radialFilterLanes_t;
+
 static inline void precomputeFilterDirectionVectors(const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants,
         const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
         const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
@@ -46,39 +69,181 @@ static inline void getValidPixelCoordinates(const vector< Point2D< int16_t > >&
 static inline void getLinearValidCoordinatesInRadius(uint16_t x_middle, uint16_t y_middle, uint8_t radius,
         const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
         const detectorPosition_t& detectorPosition, const uint8_t* mask_linear, vector< uint32_t >& linearValidPixelCoordinates);
-static inline float computeStreakThreshold(const float* data_linear, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
+static inline void estimateBackgroundInStreakDetektors(uint8_t firstStreakDetektorNumber, uint8_t endStreakDetektorNumber, const float* data_linear,
+        const radialFilterResponses_t& filterResponses, backgroundEstimationRegionStatistics_t* regionsStatistics,
         const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
-        const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions);
-static inline float computeRadialFilter(uint16_t x, uint16_t y, const float* data_linear, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
+        const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
+        const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants);
+static inline void findAndMaskStreaks(uint8_t firstStreakDetektorNumber, uint8_t endStreakDetektorNumber, float threshold, float* data_linear,
+        const radialFilterResponses_t& filterResponses, vector< vector< streakPixelsShort_t > >& streaksPixelsShort,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
+        const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
+        const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants);
+static inline float computeStreakThreshold(const backgroundEstimationRegionStatistics_t* regionsStatistics, size_t regionsCount,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants);
+static inline void computeRadialFilterResponses(const uint32_t* pixelIndices, uint_fast8_t pixelsCount, const float* data_linear,
+        const radialFilterResponses_t& filterResponses, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants);
+static inline bool setEmptyRadialFilterResponse(uint32_t pixelIndex, const radialFilterResponses_t& filterResponses,
         const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants, const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants);
+static inline void fillRadialFilterResponsesInRow(uint32_t firstPixelIndex, uint32_t pixelsCount, const float* data_linear,
+        const radialFilterResponses_t& filterResponses, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants);
+static inline float getRadialFilterResponseOnStreak(const Vector2f& pointOnStreak, const Vector2f& filterDirectionVector_normalized,
+        const detectorPosition_t& detectorPosition, const float* data_linear, const radialFilterResponses_t& filterResponses,
+        const detectorRawSize_cheetah_t& detectorRawSize_cheetah, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants);
 static inline float computeDetectorPositionsHash(
         const std::vector< std::vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
         const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants);
 
+/*
+ * Responses of the radial filter are memoised per frame in a map over the raw image, so that every pixel is filtered at most
+ * once, however many streak candidates pass over it. Entries are stamped with a frame number instead of being cleared.
+ * The streak detectors are independent (filter contributors and pixels to mask never leave their detector), so they are
+ * split between threads; only the threshold, estimated from the background regions of all of them, needs a join.
+ */
 void streakFinder(float* data_linear, const streakFinder_accuracyConstants_t& accuracyConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
         const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
         const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants)
 {
     assert(streakFinder_precomputedConstants.detectorPositionsHash == computeDetectorPositionsHash(detectorPositions, accuracyConstants));
 
-    streakFinder_precomputedConstants.filterDirectionVectors.size();
-    vector< streakPixelsShort_t > streaksPixelsShort;
-    streaksPixelsShort.reserve(streakFinder_precomputedConstants.filterDirectionVectors.size()); //does not need to be dynamic! can be preallocated and passed as parameter!
+    //buffers of the calling thread, reused from frame to frame
+    static thread_local vector< float > filterResponseValues;
+    static thread_local vector< uint32_t > filterResponseFrameNumbers;
+    static thread_local uint32_t frameNumber = 0;
+    static thread_local vector< vector< streakPixelsShort_t > > streaksPixelsShort;
+
+    const uint8_t streakDetektorsCount = accuracyConstants.streakDetektorsIndices.size();
+    filterResponseValues.resize(detectorRawSize_cheetah.pix_nn);
+    filterResponseFrameNumbers.resize(detectorRawSize_cheetah.pix_nn, 0);
+    streaksPixelsShort.resize(streakDetektorsCount);
+
+    frameNumber++;
+    if (frameNumber == 0) {
+        fill(filterResponseFrameNumbers.begin(), filterResponseFrameNumbers.end(), 0);
+        frameNumber = 1;
+    }
+    radialFilterResponses_t filterResponses;
+    filterResponses.values = filterResponseValues.data();
+    filterResponses.frameNumbers = filterResponseFrameNumbers.data();
+    filterResponses.frameNumber = frameNumber;
+
+    const size_t regionsCount = accuracyConstants.backgroundEstimationRegionsInDetector.size() * streakDetektorsCount;
+    assert(regionsCount <= maxRegionsCount);
+    backgroundEstimationRegionStatistics_t regionsStatistics[maxRegionsCount];
+
+    uint32_t threadCount = min(max((uint32_t) accuracyConstants.threadCount, (uint32_t) 1), max((uint32_t) streakDetektorsCount, (uint32_t) 1));
+    vector< uint8_t > firstStreakDetektorNumbers(threadCount + 1);
+    for (uint32_t t = 0; t <= threadCount; ++t) {
+        firstStreakDetektorNumbers[t] = streakDetektorsCount * t / threadCount;
+    }
+
+    vector< thread > threads;
+    threads.reserve(threadCount - 1);
+    for (uint32_t t = 1; t < threadCount; ++t) {
+        threads.push_back(
+                thread(estimateBackgroundInStreakDetektors, firstStreakDetektorNumbers[t], firstStreakDetektorNumbers[t + 1], data_linear,
+                        cref(filterResponses), regionsStatistics, cref(accuracyConstants), cref(detectorRawSize_cheetah), cref(detectorPositions),
+                        cref(streakFinder_precomputedConstants)));
+    }
+    estimateBackgroundInStreakDetektors(firstStreakDetektorNumbers[0], firstStreakDetektorNumbers[1], data_linear, filterResponses, regionsStatistics,
+            accuracyConstants, detectorRawSize_cheetah, detectorPositions, streakFinder_precomputedConstants);
+    for (uint32_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    threads.clear();
+
+    float threshold = computeStreakThreshold(regionsStatistics, regionsCount, accuracyConstants);
+
+    for (uint32_t t = 1; t < threadCount; ++t) {
+        threads.push_back(
+                thread(findAndMaskStreaks, firstStreakDetektorNumbers[t], firstStreakDetektorNumbers[t + 1], threshold, data_linear, cref(filterResponses),
+                        ref(streaksPixelsShort), cref(accuracyConstants), cref(detectorRawSize_cheetah), cref(detectorPositions),
+                        cref(streakFinder_precomputedConstants)));
+    }
+    findAndMaskStreaks(firstStreakDetektorNumbers[0], firstStreakDetektorNumbers[1], threshold, data_linear, filterResponses, streaksPixelsShort,
+            accuracyConstants, detectorRawSize_cheetah, detectorPositions, streakFinder_precomputedConstants);
+    for (uint32_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+}
+
+static inline void estimateBackgroundInStreakDetektors(uint8_t firstStreakDetektorNumber, uint8_t endStreakDetektorNumber, const float* data_linear,
+        const radialFilterResponses_t& filterResponses, backgroundEstimationRegionStatistics_t* regionsStatistics,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
+        const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
+        const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants)
+{
+    const size_t regionsInDetectorCount = streakFinder_accuracyConstants.backgroundEstimationRegionsInDetector.size();
+
+    for (uint8_t streakDetektorNumber = firstStreakDetektorNumber; streakDetektorNumber < endStreakDetektorNumber; ++streakDetektorNumber) {
+        Point2D < uint_fast8_t > streakDetektorIndex = streakFinder_accuracyConstants.streakDetektorsIndices[streakDetektorNumber];
+        const detectorPosition_t &streakDetektorPosition = detectorPositions[streakDetektorIndex.getY()][streakDetektorIndex.getX()];
+        const uint16_t x_upperLeft = streakDetektorPosition.rawCoordinates_uint16.getUpperLeftCorner().getX();
+        const uint16_t y_upperLeft = streakDetektorPosition.rawCoordinates_uint16.getUpperLeftCorner().getY();
+
+        for (size_t regionNumber = 0; regionNumber < regionsInDetectorCount; ++regionNumber) {
+            const ImageRectangle< uint16_t > &backgroundEstimationRegion =
+                    streakFinder_accuracyConstants.backgroundEstimationRegionsInDetector[regionNumber];
+            const uint16_t x_first = x_upperLeft + backgroundEstimationRegion.getUpperLeftCorner().getX();
+            const uint16_t x_last = x_upperLeft + backgroundEstimationRegion.getLowerRightCorner().getX();
+
+            uint_fast32_t validValuesCount = 0;
+            double sum = 0, sumOfSquares = 0;
+
+            for (uint16_t y = y_upperLeft + backgroundEstimationRegion.getUpperLeftCorner().getY();
+                    y <= y_upperLeft + backgroundEstimationRegion.getLowerRightCorner().getY(); ++y) {
+                const uint32_t firstPixelIndex = y * detectorRawSize_cheetah.pix_nx + x_first;
+                fillRadialFilterResponsesInRow(firstPixelIndex, x_last - x_first + 1, data_linear, filterResponses, streakFinder_precomputedConstants,
+                        streakFinder_accuracyConstants);
 
-    float threshold = computeStreakThreshold(data_linear, streakFinder_precomputedConstants, accuracyConstants, detectorRawSize_cheetah,
-            detectorPositions);
+                for (uint32_t pixelIndex = firstPixelIndex; pixelIndex <= firstPixelIndex + (x_last - x_first); ++pixelIndex) {
+                    float filterValue = filterResponses.values[pixelIndex];
+                    if (filterValue != -INFINITY) {
+                        sumOfSquares += filterValue * filterValue;
+                        sum += filterValue;
+                        validValuesCount++;
+                    }
+                }
+            }
 
-    for (uint8_t streakDetektorNumber = 0; streakDetektorNumber < accuracyConstants.streakDetektorsIndices.size(); ++streakDetektorNumber) {
+            backgroundEstimationRegionStatistics_t &regionStatistics = regionsStatistics[streakDetektorNumber * regionsInDetectorCount + regionNumber];
+            regionStatistics.valid = validValuesCount > 0;
+            if (regionStatistics.valid) {
+                regionStatistics.mean = (float) sum / validValuesCount;
+                regionStatistics.sigma = sqrt(
+                        ((float) sumOfSquares - regionStatistics.mean * regionStatistics.mean * validValuesCount) / (float) (validValuesCount - 1));
+            }
+        }
+    }
+}
+
+static inline void findAndMaskStreaks(uint8_t firstStreakDetektorNumber, uint8_t endStreakDetektorNumber, float threshold, float* data_linear,
+        const radialFilterResponses_t& filterResponses, vector< vector< streakPixelsShort_t > >& streaksPixelsShort,
+        const streakFinder_accuracyConstants_t& accuracyConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
+        const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
+        const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants)
+{
+    for (uint8_t streakDetektorNumber = firstStreakDetektorNumber; streakDetektorNumber < endStreakDetektorNumber; ++streakDetektorNumber) {
         Point2D < uint_fast8_t > detectorToCheckIndex = accuracyConstants.streakDetektorsIndices[streakDetektorNumber];
-        const detectorPosition_t detectorPosition = detectorPositions[detectorToCheckIndex.getY()][detectorToCheckIndex.getX()];
+        const detectorPosition_t &detectorPosition = detectorPositions[detectorToCheckIndex.getY()][detectorToCheckIndex.getX()];
+        vector< streakPixelsShort_t > &streaksPixelsShortInDetector = streaksPixelsShort[streakDetektorNumber];
+        streaksPixelsShortInDetector.clear();
 
         for (uint8_t lineToCheckNumber = 0; lineToCheckNumber < accuracyConstants.linesToCheck.size(); ++lineToCheckNumber) {
             float y_streakStart = detectorPosition.rawCoordinates_uint16.getLowerRightCorner().getY() - accuracyConstants.linesToCheck[lineToCheckNumber];
+            const uint32_t lineStartPixelIndex = (uint32_t) y_streakStart * detectorRawSize_cheetah.pix_nx
+                    + detectorPosition.rawCoordinates_uint16.getUpperLeftCorner().getX() + 1;
+
+            fillRadialFilterResponsesInRow(lineStartPixelIndex,
+                    detectorPosition.rawCoordinates_uint16.getLowerRightCorner().getX() - detectorPosition.rawCoordinates_uint16.getUpperLeftCorner().getX() - 1,
+                    data_linear, filterResponses, streakFinder_precomputedConstants, accuracyConstants);
 
             for (uint16_t x_streakStart = detectorPosition.rawCoordinates_uint16.getUpperLeftCorner().getX() + 1, posOnLineToCheck = 0;
                     x_streakStart <= detectorPosition.rawCoordinates_uint16.getLowerRightCorner().getX() - 1; ++x_streakStart, ++posOnLineToCheck) {
-                float filterValue = computeRadialFilter(x_streakStart, y_streakStart, data_linear, detectorRawSize_cheetah, streakFinder_precomputedConstants,
-                        accuracyConstants);
+                float filterValue = filterResponses.values[lineStartPixelIndex + posOnLineToCheck];
 
                 if (filterValue > threshold) {
                     int_fast16_t streakLength = 0;
@@ -96,10 +261,8 @@ void streakFinder(float* data_linear, const streakFinder_accuracyConstants_t& ac
                             && detectorPosition.rawCoordinates_float.contains(Point2D< float >(pointOnStreak))) {
                         streakLength++;
 
-                        float filterValue = computeRadialFilter(boost::math::round((float) pointOnStreak(0)), boost::math::round((float) pointOnStreak(1)),
-                                data_linear,
-                                detectorRawSize_cheetah,
-                                streakFinder_precomputedConstants, accuracyConstants);
+                        float filterValue = getRadialFilterResponseOnStreak(pointOnStreak, filterDirectionVector_normalized, detectorPosition, data_linear,
+                                filterResponses, detectorRawSize_cheetah, streakFinder_precomputedConstants, accuracyConstants);
                         if (filterValue > threshold) {
                             stepsWithoutStreakPixel = 0;
                             currentRadius = (detectorPosition.virtualZeroPositionRaw - pointOnStreak).norm();
@@ -119,17 +282,18 @@ void streakFinder(float* data_linear, const streakFinder_accuracyConstants_t& ac
                     streakPixelsShort_t tmp;
                     tmp.pixelsToMaskIndices = (uint32_t*) &pixelsToMaskIndices[0];
                     tmp.numberOfPixelsToMask = numberOfPixelsToMask;
-                    streaksPixelsShort.push_back(tmp);
+                    streaksPixelsShortInDetector.push_back(tmp);
                 }
             }
         }
-    }
 
-    BOOST_FOREACH (const streakPixelsShort_t & streakPixelsShort , streaksPixelsShort)
-    {
-        for (uint32_t* nextPixelToMaskIndex = streakPixelsShort.pixelsToMaskIndices;
-                nextPixelToMaskIndex < streakPixelsShort.pixelsToMaskIndices + streakPixelsShort.numberOfPixelsToMask; nextPixelToMaskIndex++) {
-            data_linear[*nextPixelToMaskIndex] = -INFINITY;
+        //the filter has to see unmasked data, so masking waits until the whole detector is searched
+        BOOST_FOREACH (const streakPixelsShort_t & streakPixelsShort , streaksPixelsShortInDetector)
+        {
+            for (uint32_t* nextPixelToMaskIndex = streakPixelsShort.pixelsToMaskIndices;
+                    nextPixelToMaskIndex < streakPixelsShort.pixelsToMaskIndices + streakPixelsShort.numberOfPixelsToMask; nextPixelToMaskIndex++) {
+                data_linear[*nextPixelToMaskIndex] = -INFINITY;
+            }
         }
     }
 }
@@ -148,6 +312,8 @@ void precomputeStreakFinderConstants(const streakFinder_accuracyConstants_t& str
 
     streakFinder_precomputedConstants.detectorPositionsHash = computeDetectorPositionsHash(detectorPositions, streakFinder_accuracyConstants);
 
+    streakFinder_precomputedConstants.mappedCacheFile = NULL;
+    streakFinder_precomputedConstants.mappedCacheFileSize = 0;
 }
 
 static inline void precomputeFilterDirectionVectors(const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants,
@@ -399,120 +565,371 @@ static inline void getLinearValidCoordinatesInRadius(uint16_t x_middle, uint16_t
     getValidPixelCoordinates(pixelCoordinatesInRadius, detectorRawSize_cheetah, detectorPosition, mask_linear, linearValidPixelCoordinates);
 }
 
-static inline float computeStreakThreshold(const float* data_linear, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
-        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
-        const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions)
+static inline float computeStreakThreshold(const backgroundEstimationRegionStatistics_t* regionsStatistics, size_t regionsCount,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants)
 {
-    const int maxRegionsCount = 50;
+    float means[maxRegionsCount];
+    float sigmas[maxRegionsCount];
+    uint_fast8_t validRegionsEstimated = 0;
 
-    const size_t regionsCount = streakFinder_accuracyConstants.backgroundEstimationRegionsInDetector.size()
-            * streakFinder_accuracyConstants.streakDetektorsIndices.size();
-    assert(regionsCount <= maxRegionsCount);
+    for (size_t regionNumber = 0; regionNumber < regionsCount; ++regionNumber) {
+        if (regionsStatistics[regionNumber].valid) {
+            means[validRegionsEstimated] = regionsStatistics[regionNumber].mean;
+            sigmas[validRegionsEstimated] = regionsStatistics[regionNumber].sigma;
+            validRegionsEstimated++;
+        }
+    }
 
-    float means[maxRegionsCount]; //using #define instead of pix_nx gives a tiny performance boost
-    float sigmas[maxRegionsCount]; //using #define instead of pix_nx gives a tiny performance boost
-    uint_fast8_t validRegionsEstimated = 0;
+    uint8_t indices[regionsCount];
+    boost::algorithm::iota(indices, indices + validRegionsEstimated, 0);
+    nthElementTwoArraysByFirstArray(sigmas, indices, 1, validRegionsEstimated); //compute index of second-largest element
 
-    typedef Point2D< uint_fast8_t > streakDetektorIndex_t;
-    BOOST_FOREACH (const streakDetektorIndex_t & streakDetektorIndex , streakFinder_accuracyConstants.streakDetektorsIndices)
-    {
-        const detectorPosition_t &streakDetektorPosition = detectorPositions[streakDetektorIndex.getY()][streakDetektorIndex.getX()];
-        typedef ImageRectangle< uint16_t > backgroundEstimationRegion_t;
-        BOOST_FOREACH (const backgroundEstimationRegion_t & backgroundEstimationRegion , streakFinder_accuracyConstants.backgroundEstimationRegionsInDetector)
-        {
-            uint_fast32_t validValuesCount = 0;
-            double sum = 0, sumOfSquares = 0;
+    float threshold = means[indices[1]] + streakFinder_accuracyConstants.sigmaFactor * sigmas[indices[1]];
+    return threshold;
+}
 
-//            vector< float > debug;
+/*
+ * Radial filter (mean of the lower half of the contributors, median included) of up to radialFilterLanesCount pixels at once.
+ * The contributors of the i-th pixel are in lane i, padded with +INFINITY, and sorted by an odd-even transposition network
+ * of packet min/max operations; median and lower half are then summed per lane, median first as the scalar filter did.
+ * Only pixels with contributors (see setEmptyRadialFilterResponse()) are passed.
+ */
+static inline void computeRadialFilterResponses(const uint32_t* pixelIndices, uint_fast8_t pixelsCount, const float* data_linear,
+        const radialFilterResponses_t& filterResponses, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants)
+{
+    const uint_fast8_t filterLength = streakFinder_accuracyConstants.filterLength;
+    radialFilterLanes_t contributors[UINT8_MAX];
+    uint_fast8_t contributorsCounts[radialFilterLanesCount];
 
-            for (uint16_t y = streakDetektorPosition.rawCoordinates_uint16.getUpperLeftCorner().getY()
-                    + backgroundEstimationRegion.getUpperLeftCorner().getY();
-                    y <= streakDetektorPosition.rawCoordinates_uint16.getUpperLeftCorner().getY() + backgroundEstimationRegion.getLowerRightCorner().getY();
-                    ++y) {
-                for (uint16_t x = streakDetektorPosition.rawCoordinates_uint16.getUpperLeftCorner().getX()
-                        + backgroundEstimationRegion.getUpperLeftCorner().getX();
-                        x
-                                <= streakDetektorPosition.rawCoordinates_uint16.getUpperLeftCorner().getX()
-                                        + backgroundEstimationRegion.getLowerRightCorner().getX();
-                        ++x) {
+    for (uint_fast8_t i = 0; i < filterLength; ++i) {
+        contributors[i].setConstant(INFINITY);
+    }
+    for (uint_fast8_t lane = 0; lane < pixelsCount; ++lane) {
+        const int32_t* nextContributorIndex = streakFinder_precomputedConstants.radialFilterContributors
+                + (size_t) pixelIndices[lane] * (filterLength + 1);
+        uint_fast8_t contributorsCount = 0;
+        while (*nextContributorIndex >= 0) {
+            contributors[contributorsCount](lane) = data_linear[*nextContributorIndex];
+            contributorsCount++;
+            nextContributorIndex++;
+        }
+        contributorsCounts[lane] = contributorsCount;
+    }
 
-                    float filterValue = computeRadialFilter(x, y, data_linear, detectorRawSize_cheetah, streakFinder_precomputedConstants,
-                            streakFinder_accuracyConstants);
+    for (uint_fast8_t pass = 0; pass < filterLength; ++pass) {
+        for (uint_fast8_t i = pass % 2; i + 1 < filterLength; i += 2) {
+            radialFilterLanes_t lower = contributors[i].min(contributors[i + 1]);
+            contributors[i + 1] = contributors[i].max(contributors[i + 1]);
+            contributors[i] = lower;
+        }
+    }
 
-//                    debug.push_back(filterValue);
+    for (uint_fast8_t lane = 0; lane < pixelsCount; ++lane) {
+        const uint32_t pixelIndex = pixelIndices[lane];
+        const uint_fast8_t medianPosition = contributorsCounts[lane] / 2;
+        float sum = contributors[medianPosition](lane);
+        for (uint_fast8_t i = 0; i < medianPosition; ++i) {
+            sum += contributors[i](lane);
+        }
+        filterResponses.values[pixelIndex] = sum / (medianPosition + 1);
+        filterResponses.frameNumbers[pixelIndex] = filterResponses.frameNumber;
+    }
+}
 
-                    if (filterValue != -INFINITY) {
-                        sumOfSquares += filterValue * filterValue;
-                        sum += filterValue;
-                        validValuesCount++;
-                    }
-                }
+//pixels without contributors (too close to masked pixels or the detector edge) do not take a lane
+static inline bool setEmptyRadialFilterResponse(uint32_t pixelIndex, const radialFilterResponses_t& filterResponses,
+        const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants, const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants)
+{
+    if (streakFinder_precomputedConstants.radialFilterContributors[(size_t) pixelIndex * (streakFinder_accuracyConstants.filterLength + 1)] >= 0) {
+        return false;
+    }
+    filterResponses.values[pixelIndex] = -INFINITY;
+    filterResponses.frameNumbers[pixelIndex] = filterResponses.frameNumber;
+    return true;
+}
+
+static inline void fillRadialFilterResponsesInRow(uint32_t firstPixelIndex, uint32_t pixelsCount, const float* data_linear,
+        const radialFilterResponses_t& filterResponses, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants)
+{
+    uint32_t pixelIndices[radialFilterLanesCount];
+    uint_fast8_t pixelsInLanes = 0;
+
+    for (uint32_t pixelIndex = firstPixelIndex; pixelIndex < firstPixelIndex + pixelsCount; ++pixelIndex) {
+        if (filterResponses.frameNumbers[pixelIndex] != filterResponses.frameNumber && !setEmptyRadialFilterResponse(pixelIndex, filterResponses,
+                streakFinder_precomputedConstants, streakFinder_accuracyConstants)) {
+            pixelIndices[pixelsInLanes++] = pixelIndex;
+            if (pixelsInLanes == radialFilterLanesCount) {
+                computeRadialFilterResponses(pixelIndices, pixelsInLanes, data_linear, filterResponses, streakFinder_precomputedConstants,
+                        streakFinder_accuracyConstants);
+                pixelsInLanes = 0;
             }
+        }
+    }
+    if (pixelsInLanes > 0) {
+        computeRadialFilterResponses(pixelIndices, pixelsInLanes, data_linear, filterResponses, streakFinder_precomputedConstants,
+                streakFinder_accuracyConstants);
+    }
+}
 
-            if (validValuesCount > 0) {
-                float currentMean = (float) sum / validValuesCount;
-                means[validRegionsEstimated] = currentMean;
-//                sigmas[validRegionsEstimated] = sqrt(
-//                        (float) sumOfSquares / (validValuesCount - 1) - (currentMean) * (currentMean) * validValuesCount / (float) (validValuesCount - 1));
-                sigmas[validRegionsEstimated] = sqrt(
-                        ((float) sumOfSquares - currentMean * currentMean * validValuesCount) / (float) (validValuesCount - 1));
-                validRegionsEstimated++;
+/*
+ * Response at the current point of a streak. If it is not known yet, the next points of the streak are computed with it:
+ * the elongation goes on for at least streakElongationMinStepsCount points, and neighbouring streaks may reuse the rest.
+ */
+static inline float getRadialFilterResponseOnStreak(const Vector2f& pointOnStreak, const Vector2f& filterDirectionVector_normalized,
+        const detectorPosition_t& detectorPosition, const float* data_linear, const radialFilterResponses_t& filterResponses,
+        const detectorRawSize_cheetah_t& detectorRawSize_cheetah, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
+        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants)
+{
+    const uint32_t pixelIndex = (uint16_t) boost::math::round((float) pointOnStreak(1)) * detectorRawSize_cheetah.pix_nx
+            + (uint16_t) boost::math::round((float) pointOnStreak(0));
+
+    if (filterResponses.frameNumbers[pixelIndex] != filterResponses.frameNumber
+            && !setEmptyRadialFilterResponse(pixelIndex, filterResponses, streakFinder_precomputedConstants, streakFinder_accuracyConstants)) {
+        uint32_t pixelIndices[radialFilterLanesCount];
+        uint_fast8_t pixelsInLanes = 0;
+        pixelIndices[pixelsInLanes++] = pixelIndex;
+
+        Vector2f nextPointOnStreak = pointOnStreak + filterDirectionVector_normalized;
+        while (pixelsInLanes < radialFilterLanesCount && detectorPosition.rawCoordinates_float.contains(Point2D< float >(nextPointOnStreak))) {
+            const uint32_t nextPixelIndex = (uint16_t) boost::math::round((float) nextPointOnStreak(1)) * detectorRawSize_cheetah.pix_nx
+                    + (uint16_t) boost::math::round((float) nextPointOnStreak(0));
+            if (filterResponses.frameNumbers[nextPixelIndex] != filterResponses.frameNumber
+                    && !setEmptyRadialFilterResponse(nextPixelIndex, filterResponses, streakFinder_precomputedConstants, streakFinder_accuracyConstants)) {
+                pixelIndices[pixelsInLanes++] = nextPixelIndex;
             }
+            nextPointOnStreak += filterDirectionVector_normalized;
         }
+
+        computeRadialFilterResponses(pixelIndices, pixelsInLanes, data_linear, filterResponses, streakFinder_precomputedConstants,
+                streakFinder_accuracyConstants);
     }
 
-    uint8_t indices[regionsCount];
-    boost::algorithm::iota(indices, indices + validRegionsEstimated, 0);
-//    nth_element(indices, indices + 1, indices + validRegionsEstimated,
-//            *(sigmas + boost::phoenix::placeholders::arg1) < *(sigmas + boost::phoenix::placeholders::arg2)); //compute index of second-largest element
-//    struct CompareClass {
-//        float *m_values;
-//        bool operator()(uint32_t i, uint32_t j)
-//        {
-//            return (m_values[i] < m_values[j]);
-//        }
-//    } compareObject;
-//    compareObject.m_values = sigmas;
-//    nth_element(indices, indices + 1, indices + validRegionsEstimated, compareObject); //compute index of second-largest element
-    nthElementTwoArraysByFirstArray(sigmas, indices, 1, validRegionsEstimated);
-//    nth_element(indices, indices + 1, indices + validRegionsEstimated, [&](size_t a, size_t b) {return sigmas[a] < sigmas[b];}); //compute index of second-largest element
+    return filterResponses.values[pixelIndex];
+}
 
-    float threshold = means[indices[1]] + streakFinder_accuracyConstants.sigmaFactor * sigmas[indices[1]];
-    return threshold;
+void freePrecomputedStreakFinderConstants(streakFinder_precomputedConstants_t& streakFinder_precomputedConstants)
+{
+    if (streakFinder_precomputedConstants.mappedCacheFile != NULL) {
+        munmap(streakFinder_precomputedConstants.mappedCacheFile, streakFinder_precomputedConstants.mappedCacheFileSize);
+        streakFinder_precomputedConstants.mappedCacheFile = NULL;
+    } else {
+        delete[] streakFinder_precomputedConstants.radialFilterContributors;
+    }
 }
 
-static inline float computeRadialFilter(uint16_t x, uint16_t y, const float* data_linear, const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
-        const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants,
-        const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants)
+/*
+ * On-disk cache of the precomputed constants
+ *
+ * Layout (native byte order, every section starts on a 64 byte boundary):
+ *   header
+ *   radialFilterContributors   int32[pix_nn * (filterLength + 1)]  - memory-mapped, not copied
+ *   filterDirectionVectors     float[nDetectors * nLines * nPositions * 2]
+ *   streaksPixels sizes        uint64[nDetectors * nLines * nPositions * 2]  (pixelsToMaskIndices, numberOfPixelsToMaskForStreakLength)
+ *   streaksPixels contents     uint32[...] both vectors of each position, one after the other
+ *
+ * The key is computed by the caller from everything the constants depend on (pixel maps, mask, streak finder parameters).
+ */
+static const char streakFinderCacheMagic[8] = { 'C', 'H', 'T', 'S', 'T', 'R', 'K', '2' };
+
+typedef struct {
+    char magic[8];
+    uint64_t key;
+    uint64_t pix_nn;
+    uint64_t filterLength;
+    uint64_t nDetectors;
+    uint64_t nLines;
+    uint64_t nPositions;
+    uint64_t radialFilterContributorsOffset;
+    uint64_t filterDirectionVectorsOffset;
+    uint64_t streaksPixelsSizesOffset;
+    uint64_t streaksPixelsOffset;
+    uint64_t fileSize;
+} streakFinderCacheHeader_t;
+
+static inline uint64_t alignCacheOffset(uint64_t offset)
 {
+    return (offset + 63) & ~((uint64_t) 63);
+}
 
-    int32_t (*radialFilterContributors)[detectorRawSize_cheetah.pix_nx][streakFinder_accuracyConstants.filterLength + 1] =
-            (int32_t (*)[detectorRawSize_cheetah.pix_nx][streakFinder_accuracyConstants.filterLength + 1]) streakFinder_precomputedConstants.radialFilterContributors;
+static bool writeCachePadding(FILE* fp, uint64_t& offset)
+{
+    static const char zeros[64] = { 0 };
+    uint64_t aligned = alignCacheOffset(offset);
+    if (aligned > offset && fwrite(zeros, 1, aligned - offset, fp) != aligned - offset)
+        return false;
+    offset = aligned;
+    return true;
+}
+
+bool saveStreakFinderConstantsToFile(const char* filename, uint64_t key, const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants,
+        const detectorRawSize_cheetah_t& detectorRawSize_cheetah, const streakFinder_precomputedConstants_t& streakFinder_precomputedConstants)
+{
+    streakFinderCacheHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, streakFinderCacheMagic, sizeof(header.magic));
+    header.key = key;
+    header.pix_nn = detectorRawSize_cheetah.pix_nn;
+    header.filterLength = streakFinder_accuracyConstants.filterLength;
+    header.nDetectors = streakFinder_accuracyConstants.streakDetektorsIndices.size();
+    header.nLines = streakFinder_accuracyConstants.linesToCheck.size();
+    header.nPositions = detectorRawSize_cheetah.asic_nx - 2;
+
+    const uint64_t nStreakPositions = header.nDetectors * header.nLines * header.nPositions;
+    const uint64_t nContributors = header.pix_nn * (header.filterLength + 1);
+
+    // Section offsets
+    uint64_t streaksPixelsCount = 0;
+    vector< uint64_t > sizes;
+    sizes.reserve(2 * nStreakPositions);
+    for (uint64_t d = 0; d < header.nDetectors; ++d) {
+        for (uint64_t l = 0; l < header.nLines; ++l) {
+            for (uint64_t p = 0; p < header.nPositions; ++p) {
+                const streakPixels_t& streakPixels = streakFinder_precomputedConstants.streaksPixels[d][l][p];
+                sizes.push_back(streakPixels.pixelsToMaskIndices.size());
+                sizes.push_back(streakPixels.numberOfPixelsToMaskForStreakLength.size());
+                streaksPixelsCount += streakPixels.pixelsToMaskIndices.size() + streakPixels.numberOfPixelsToMaskForStreakLength.size();
+            }
+        }
+    }
+    header.radialFilterContributorsOffset = alignCacheOffset(sizeof(header));
+    header.filterDirectionVectorsOffset = alignCacheOffset(header.radialFilterContributorsOffset + nContributors * sizeof(int32_t));
+    header.streaksPixelsSizesOffset = alignCacheOffset(header.filterDirectionVectorsOffset + nStreakPositions * 2 * sizeof(float));
+    header.streaksPixelsOffset = alignCacheOffset(header.streaksPixelsSizesOffset + sizes.size() * sizeof(uint64_t));
+    header.fileSize = header.streaksPixelsOffset + streaksPixelsCount * sizeof(uint32_t);
+
+    // Write to a temporary file and rename, so concurrent jobs never see a partial cache file
+    char tmpname[4096];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp%d", filename, (int) getpid());
+    FILE* fp = fopen(tmpname, "wb");
+    if (fp == NULL)
+        return false;
+
+    bool ok = true;
+    uint64_t offset = 0;
+    ok = ok && fwrite(&header, sizeof(header), 1, fp) == 1;
+    offset += sizeof(header);
+    ok = ok && writeCachePadding(fp, offset);
+    ok = ok && fwrite(streakFinder_precomputedConstants.radialFilterContributors, sizeof(int32_t), nContributors, fp) == nContributors;
+    offset += nContributors * sizeof(int32_t);
+    ok = ok && writeCachePadding(fp, offset);
+    for (uint64_t d = 0; ok && d < header.nDetectors; ++d) {
+        for (uint64_t l = 0; ok && l < header.nLines; ++l) {
+            for (uint64_t p = 0; ok && p < header.nPositions; ++p) {
+                const Vector2f& v = streakFinder_precomputedConstants.filterDirectionVectors[d][l][p];
+                float xy[2] = { v(0), v(1) };
+                ok = ok && fwrite(xy, sizeof(float), 2, fp) == 2;
+            }
+        }
+    }
+    offset += nStreakPositions * 2 * sizeof(float);
+    ok = ok && writeCachePadding(fp, offset);
+    ok = ok && (sizes.empty() || fwrite(&sizes[0], sizeof(uint64_t), sizes.size(), fp) == sizes.size());
+    offset += sizes.size() * sizeof(uint64_t);
+    ok = ok && writeCachePadding(fp, offset);
+    for (uint64_t d = 0; ok && d < header.nDetectors; ++d) {
+        for (uint64_t l = 0; ok && l < header.nLines; ++l) {
+            for (uint64_t p = 0; ok && p < header.nPositions; ++p) {
+                const streakPixels_t& streakPixels = streakFinder_precomputedConstants.streaksPixels[d][l][p];
+                const vector< uint32_t >& a = streakPixels.pixelsToMaskIndices;
+                const vector< uint32_t >& b = streakPixels.numberOfPixelsToMaskForStreakLength;
+                ok = ok && (a.empty() || fwrite(&a[0], sizeof(uint32_t), a.size(), fp) == a.size());
+                ok = ok && (b.empty() || fwrite(&b[0], sizeof(uint32_t), b.size(), fp) == b.size());
+            }
+        }
+    }
 
-    float filterContributors[streakFinder_accuracyConstants.filterLength]; //using #define instead of pix_nx gives a tiny performance boost
-    float* nextFilterContributor = filterContributors;
+    ok = (fclose(fp) == 0) && ok;
+    if (ok)
+        ok = (rename(tmpname, filename) == 0);
+    if (!ok)
+        unlink(tmpname);
+    return ok;
+}
 
-    int32_t* nextContributorIndex = &radialFilterContributors[y][x][0];
-    if (*nextContributorIndex < 0) {
-        return -INFINITY;
+bool loadStreakFinderConstantsFromFile(const char* filename, uint64_t key, const streakFinder_accuracyConstants_t& streakFinder_accuracyConstants,
+        const detectorRawSize_cheetah_t& detectorRawSize_cheetah,
+        const vector< vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >& detectorPositions,
+        streakFinder_precomputedConstants_t& streakFinder_precomputedConstants)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < sizeof(streakFinderCacheHeader_t)) {
+        close(fd);
+        return false;
     }
 
-    while (*nextContributorIndex >= 0) {
-        *nextFilterContributor = data_linear[*nextContributorIndex];
-        nextFilterContributor++;
-        nextContributorIndex++;
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    const char* base = (const char*) mapping;
+    streakFinderCacheHeader_t header;
+    memcpy(&header, base, sizeof(header));
+
+    // Anything unexpected means the file belongs to different inputs (or a different build): recompute instead
+    if (memcmp(header.magic, streakFinderCacheMagic, sizeof(header.magic)) != 0 || header.key != key
+            || header.fileSize != (uint64_t) st.st_size
+            || header.pix_nn != detectorRawSize_cheetah.pix_nn
+            || header.filterLength != streakFinder_accuracyConstants.filterLength
+            || header.nDetectors != streakFinder_accuracyConstants.streakDetektorsIndices.size()
+            || header.nLines != streakFinder_accuracyConstants.linesToCheck.size()
+            || header.nPositions != (uint64_t) (detectorRawSize_cheetah.asic_nx - 2)
+            || header.radialFilterContributorsOffset + header.pix_nn * (header.filterLength + 1) * sizeof(int32_t) > header.fileSize
+            || header.streaksPixelsSizesOffset + 2 * header.nDetectors * header.nLines * header.nPositions * sizeof(uint64_t) > header.fileSize) {
+        munmap(mapping, st.st_size);
+        return false;
     }
 
-    float* median = filterContributors + (nextFilterContributor - filterContributors) / 2;
-    nth_element(filterContributors, median, nextFilterContributor);
-    float filterValue = accumulate(filterContributors, median, *median) / (median - filterContributors + 1);
+    // Sizes of the streak pixel lists, checked against the file size before anything is copied
+    const uint64_t* sizes = (const uint64_t*) (base + header.streaksPixelsSizesOffset);
+    const uint64_t nStreakPositions = header.nDetectors * header.nLines * header.nPositions;
+    uint64_t streaksPixelsCount = 0;
+    for (uint64_t i = 0; i < 2 * nStreakPositions; ++i)
+        streaksPixelsCount += sizes[i];
+    if (header.streaksPixelsOffset + streaksPixelsCount * sizeof(uint32_t) != header.fileSize) {
+        munmap(mapping, st.st_size);
+        return false;
+    }
 
-    return filterValue;
-}
+    // The big table is used straight from the page cache
+    streakFinder_precomputedConstants.radialFilterContributors = (int32_t*) (base + header.radialFilterContributorsOffset);
+    streakFinder_precomputedConstants.mappedCacheFile = mapping;
+    streakFinder_precomputedConstants.mappedCacheFileSize = st.st_size;
+
+    const float* directions = (const float*) (base + header.filterDirectionVectorsOffset);
+    const uint32_t* streaksPixels = (const uint32_t*) (base + header.streaksPixelsOffset);
+
+    streakFinder_precomputedConstants.filterDirectionVectors.resize(header.nDetectors);
+    streakFinder_precomputedConstants.streaksPixels.resize(header.nDetectors);
+    for (uint64_t d = 0; d < header.nDetectors; ++d) {
+        streakFinder_precomputedConstants.filterDirectionVectors[d].resize(header.nLines);
+        streakFinder_precomputedConstants.streaksPixels[d].resize(header.nLines);
+        for (uint64_t l = 0; l < header.nLines; ++l) {
+            streakFinder_precomputedConstants.filterDirectionVectors[d][l].resize(header.nPositions);
+            streakFinder_precomputedConstants.streaksPixels[d][l].resize(header.nPositions);
+            for (uint64_t p = 0; p < header.nPositions; ++p) {
+                streakFinder_precomputedConstants.filterDirectionVectors[d][l][p] = Vector2f(directions[0], directions[1]);
+                directions += 2;
+
+                streakPixels_t& streakPixels = streakFinder_precomputedConstants.streaksPixels[d][l][p];
+                uint64_t nPixels = *sizes++;
+                uint64_t nLengths = *sizes++;
+                streakPixels.pixelsToMaskIndices.assign(streaksPixels, streaksPixels + nPixels);
+                streaksPixels += nPixels;
+                streakPixels.numberOfPixelsToMaskForStreakLength.assign(streaksPixels, streaksPixels + nLengths);
+                streaksPixels += nLengths;
+            }
+        }
+    }
 
-void freePrecomputedStreakFinderConstants(streakFinder_precomputedConstants_t& streakFinder_precomputedConstants)
-{
-    delete[] streakFinder_precomputedConstants.radialFilterContributors;
+    streakFinder_precomputedConstants.detectorPositionsHash = computeDetectorPositionsHash(detectorPositions, streakFinder_accuracyConstants);
+    return true;
 }
 
 static float computeDetectorPositionsHash(
@@ -10,12 +10,60 @@
 #include "pythonWrapperConversions.h"
 #include "mask.h"
 #include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+ * 64 bit FNV-1a hash, used as key of the on-disk cache of precomputed constants
+ */
+static uint64_t streakFinderCacheHash(uint64_t hash, const void* data, size_t n)
+{
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < n; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t computeStreakFinderCacheKey(uint_fast8_t filterLength, uint_fast8_t minFilterLength, float filterStep,
+        uint_fast8_t streakElongationMinStepsCount, float streakElongationRadiusFactor, uint_fast8_t streakPixelMaskRadius,
+        uint_fast8_t numLinesToCheck, detectorCategory_t detectorCategory, int background_region_preset, int background_region_dist_from_edge, long asic_nx,
+        long asic_ny, long nasics_x, long nasics_y, float *pixel_map_x, float *pixel_map_y, uint8_t *input_mask)
+{
+    // Only parameters that enter the precomputation (sigmaFactor is applied per frame)
+    int32_t params[11] = { filterLength, minFilterLength, streakElongationMinStepsCount, streakPixelMaskRadius, numLinesToCheck, detectorCategory,
+            background_region_preset, background_region_dist_from_edge, (int32_t) asic_nx, (int32_t) asic_ny, (int32_t) (nasics_x * 1000 + nasics_y) };
+    float fparams[2] = { filterStep, streakElongationRadiusFactor };
+    long pix_nn = asic_nx * nasics_x * asic_ny * nasics_y;
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = streakFinderCacheHash(hash, params, sizeof(params));
+    hash = streakFinderCacheHash(hash, fparams, sizeof(fparams));
+    hash = streakFinderCacheHash(hash, pixel_map_x, pix_nn * sizeof(float));
+    hash = streakFinderCacheHash(hash, pixel_map_y, pix_nn * sizeof(float));
+    hash = streakFinderCacheHash(hash, input_mask, pix_nn * sizeof(uint8_t));
+    return hash;
+}
 
 streakFinder_constantArguments_t *precomputeStreakFinderConstantArguments(uint_fast8_t filterLength, uint_fast8_t minFilterLength, float filterStep,
         float sigmaFactor, uint_fast8_t streakElongationMinStepsCount, float streakElongationRadiusFactor, uint_fast8_t streakPixelMaskRadius,
         uint_fast8_t numLinesToCheck, detectorCategory_t detectorCategory, int background_region_preset, int background_region_dist_from_edge, long asic_nx,
-        long asic_ny, long nasics_x, long nasics_y, float *pixel_map_x, float *pixel_map_y, uint8_t *input_mask, char* background_region_mask)
+        long asic_ny, long nasics_x, long nasics_y, float *pixel_map_x, float *pixel_map_y, uint8_t *input_mask, char* background_region_mask,
+        const char* cacheDir, uint_fast8_t threadCount)
 {
+    // Cache file for the precomputed constants (keyed by everything they depend on)
+    char cacheFile[4096] = "";
+    uint64_t cacheKey = 0;
+    if (cacheDir != NULL && cacheDir[0] != 0) {
+        cacheKey = computeStreakFinderCacheKey(filterLength, minFilterLength, filterStep, streakElongationMinStepsCount, streakElongationRadiusFactor,
+                streakPixelMaskRadius, numLinesToCheck, detectorCategory, background_region_preset, background_region_dist_from_edge, asic_nx, asic_ny,
+                nasics_x, nasics_y, pixel_map_x, pixel_map_y, input_mask);
+        snprintf(cacheFile, sizeof(cacheFile), "%s/streakfinder-%016llx.bin", cacheDir, (unsigned long long) cacheKey);
+    }
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+
     detectorRawSize_cheetah_t *detector_raw_size_cheetah = new detectorRawSize_cheetah_t;
     detector_raw_size_cheetah->asic_nx = asic_nx;
     detector_raw_size_cheetah->asic_ny = asic_ny;
@@ -34,6 +82,7 @@ streakFinder_constantArguments_t *precomputeStreakFinderConstantArguments(uint_f
     streakFinder_accuracyConstants->streakElongationMinStepsCount = streakElongationMinStepsCount;
     streakFinder_accuracyConstants->streakElongationRadiusFactor = streakElongationRadiusFactor;
     streakFinder_accuracyConstants->streakPixelMaskRadius = streakPixelMaskRadius;
+    streakFinder_accuracyConstants->threadCount = threadCount;
 
     setStreakDetectorIndices(*streakFinder_accuracyConstants, detectorCategory);
 
@@ -43,6 +92,8 @@ streakFinder_constantArguments_t *precomputeStreakFinderConstantArguments(uint_f
             new std::vector< std::vector< detectorPosition_t, Eigen::aligned_allocator< detectorPosition_t > > >;
 
     streakFinder_precomputedConstants_t *streakFinder_precomputedConstants = new streakFinder_precomputedConstants_t;
+    streakFinder_precomputedConstants->mappedCacheFile = NULL;
+    streakFinder_precomputedConstants->mappedCacheFileSize = 0;
 
     if (detectorCategory == detectorCategory_pnCCD) {
         streakFinder_accuracyConstants->linesToCheck.push_back(1);
@@ -64,11 +115,14 @@ streakFinder_constantArguments_t *precomputeStreakFinderConstantArguments(uint_f
 
         rearrangePnCcdGeometryForStreakFinder(*detector_positions, detector_positions_tmp);
 
-        uint8_t *mask_rearranged = new uint8_t[detector_raw_size_cheetah->pix_nn];
-        rearrangePnCcdMaskForStreakFinder(mask_rearranged, input_mask);
-        precomputeStreakFinderConstants(*streakFinder_accuracyConstants, *detector_raw_size_cheetah, *detector_positions, mask_rearranged,
-                *streakFinder_precomputedConstants);
-        delete[] mask_rearranged;
+        if (cacheFile[0] == 0 || !loadStreakFinderConstantsFromFile(cacheFile, cacheKey, *streakFinder_accuracyConstants, *detector_raw_size_cheetah,
+                *detector_positions, *streakFinder_precomputedConstants)) {
+            uint8_t *mask_rearranged = new uint8_t[detector_raw_size_cheetah->pix_nn];
+            rearrangePnCcdMaskForStreakFinder(mask_rearranged, input_mask);
+            precomputeStreakFinderConstants(*streakFinder_accuracyConstants, *detector_raw_size_cheetah, *detector_positions, mask_rearranged,
+                    *streakFinder_precomputedConstants);
+            delete[] mask_rearranged;
+        }
     } else {
         for (uint_fast8_t line_idx = 1; line_idx <= numLinesToCheck; ++line_idx) {
             streakFinder_accuracyConstants->linesToCheck.push_back(line_idx);
@@ -83,8 +137,26 @@ streakFinder_constantArguments_t *precomputeStreakFinderConstantArguments(uint_f
                 background_region_dist_from_edge,
                 background_region_mask);
 
-        precomputeStreakFinderConstants(*streakFinder_accuracyConstants, *detector_raw_size_cheetah, *detector_positions, input_mask,
-                *streakFinder_precomputedConstants);
+        if (cacheFile[0] == 0 || !loadStreakFinderConstantsFromFile(cacheFile, cacheKey, *streakFinder_accuracyConstants, *detector_raw_size_cheetah,
+                *detector_positions, *streakFinder_precomputedConstants)) {
+            precomputeStreakFinderConstants(*streakFinder_accuracyConstants, *detector_raw_size_cheetah, *detector_positions, input_mask,
+                    *streakFinder_precomputedConstants);
+        }
+    }
+
+    gettimeofday(&t1, NULL);
+    double seconds = (t1.tv_sec - t0.tv_sec) + 1e-6 * (t1.tv_usec - t0.tv_usec);
+    if (streakFinder_precomputedConstants->mappedCacheFile != NULL) {
+        printf("Streak finder constants loaded from %s (%.2f s)\n", cacheFile, seconds);
+    } else {
+        printf("Streak finder constants computed (%.2f s)\n", seconds);
+        if (cacheFile[0] != 0) {
+            if (saveStreakFinderConstantsToFile(cacheFile, cacheKey, *streakFinder_accuracyConstants, *detector_raw_size_cheetah,
+                    *streakFinder_precomputedConstants))
+                printf("Streak finder constants saved to %s\n", cacheFile);
+            else
+                printf("Warning: Could not write streak finder cache file %s\n", cacheFile);
+        }
     }
     streakFinder_constantArguments_t *streakFinderConstantArguments = new streakFinder_constantArguments_t();
 
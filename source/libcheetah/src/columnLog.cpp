@@ -0,0 +1,380 @@
+/*
+ *  columnLog.cpp
+ *  cheetah
+ *
+ *  Binary columnar logs (see columnLog.h for the file layout)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "columnLog.h"
+
+
+int columnLogTypeSize(char type) {
+	switch(type) {
+		case 'i': return sizeof(int32_t);
+		case 'l': return sizeof(int64_t);
+		case 'f': return sizeof(float);
+		case 'd': return sizeof(double);
+		case 's': return sizeof(uint32_t);
+		default: return 0;
+	}
+}
+
+int writeColumnLogHeader(FILE *fp, int nColumns, const std::string *names, const char *types) {
+	uint32_t	n = nColumns;
+	fwrite(COLUMNLOG_MAGIC, 1, 8, fp);
+	fwrite(&n, sizeof(n), 1, fp);
+	for(int c=0; c<nColumns; c++) {
+		uint8_t	length = names[c].size() < 255 ? names[c].size() : 255;
+		fwrite(&types[c], 1, 1, fp);
+		fwrite(&length, 1, 1, fp);
+		fwrite(names[c].c_str(), 1, length, fp);
+	}
+	return ferror(fp) ? 1 : 0;
+}
+
+int writeColumnLogBlock(FILE *fp, int nColumns, long nRows, const uint32_t *widths, char * const *data) {
+	uint32_t	header[2] = {COLUMNLOG_BLOCK_MAGIC, (uint32_t) nRows};
+	fwrite(header, sizeof(uint32_t), 2, fp);
+	for(int c=0; c<nColumns; c++) {
+		fwrite(&widths[c], sizeof(uint32_t), 1, fp);
+		fwrite(data[c], widths[c], nRows, fp);
+	}
+	return ferror(fp) ? 1 : 0;
+}
+
+
+/*
+ *	Writer
+ */
+cColumnLog::cColumnLog() {
+	fp = NULL;
+	columns = NULL;
+	nColumns = 0;
+	rowSize = 0;
+	idle = NULL;
+	nRows = 0;
+	nBlocks = 0;
+	pthread_mutex_init(&poolMutex, NULL);
+	pthread_mutex_init(&fileMutex, NULL);
+}
+
+cColumnLog::~cColumnLog() {
+	close();
+	pthread_mutex_destroy(&poolMutex);
+	pthread_mutex_destroy(&fileMutex);
+}
+
+
+int cColumnLog::open(const char *filename, const tColumnLogColumn *columns0, int nColumns0, size_t rowSize0) {
+	close();
+	fp = fopen(filename, "wb");
+	if(fp == NULL) {
+		printf("Error: Can not open %s for writing\n", filename);
+		return 1;
+	}
+	columns = columns0;
+	nColumns = nColumns0;
+	rowSize = rowSize0;
+	nRows = 0;
+	nBlocks = 0;
+
+	std::vector<std::string> names(nColumns);
+	std::vector<char> types(nColumns);
+	for(int c=0; c<nColumns; c++) {
+		names[c] = columns[c].name;
+		types[c] = columns[c].type;
+	}
+	return writeColumnLogHeader(fp, nColumns, &names[0], &types[0]);
+}
+
+
+/*
+ *	A batch for the calling worker alone, until it is handed back with release()
+ */
+tColumnLogBatch *cColumnLog::acquire(void) {
+	pthread_mutex_lock(&poolMutex);
+	tColumnLogBatch *batch = idle;
+	if(batch != NULL)
+		idle = batch->next;
+	pthread_mutex_unlock(&poolMutex);
+
+	if(batch == NULL) {
+		batch = (tColumnLogBatch *) calloc(1, sizeof(tColumnLogBatch));
+		batch->rows = (char *) malloc(COLUMNLOG_BATCH_ROWS*rowSize);
+		batch->stringsSize = 65536;
+		batch->strings = (char *) malloc(batch->stringsSize);
+	}
+	batch->next = NULL;
+	return batch;
+}
+
+void *cColumnLog::appendRow(tColumnLogBatch *batch) {
+	if(batch->nRows == COLUMNLOG_BATCH_ROWS)
+		writeBatch(batch);
+	char	*row = batch->rows + batch->nRows*rowSize;
+	memset(row, 0, rowSize);
+	batch->nRows++;
+	return row;
+}
+
+void cColumnLog::setString(tColumnLogBatch *batch, void *row, size_t offset, const char *s) {
+	size_t	length = strlen(s) + 1;
+	if(batch->stringsUsed + length > batch->stringsSize) {
+		while(batch->stringsUsed + length > batch->stringsSize)
+			batch->stringsSize *= 2;
+		batch->strings = (char *) realloc(batch->strings, batch->stringsSize);
+	}
+	memcpy(batch->strings + batch->stringsUsed, s, length);
+	*(uint32_t *) ((char *) row + offset) = (uint32_t) batch->stringsUsed;
+	batch->stringsUsed += length;
+}
+
+/*
+ *	Back to the pool, written out first if it is full
+ */
+void cColumnLog::release(tColumnLogBatch *batch) {
+	if(batch == NULL)
+		return;
+	if(batch->nRows == COLUMNLOG_BATCH_ROWS)
+		writeBatch(batch);
+	pthread_mutex_lock(&poolMutex);
+	batch->next = idle;
+	idle = batch;
+	pthread_mutex_unlock(&poolMutex);
+}
+
+
+/*
+ *	Transpose the rows of a batch into columns and append them to the file as one block
+ */
+void cColumnLog::writeBatch(tColumnLogBatch *batch) {
+	long	n = batch->nRows;
+	if(n == 0)
+		return;
+
+	std::vector<uint32_t>	widths(nColumns);
+	std::vector<char *>		data(nColumns);
+	for(int c=0; c<nColumns; c++) {
+		size_t	offset = columns[c].offset;
+		if(columns[c].type == 's') {
+			uint32_t	width = 1;
+			for(long r=0; r<n; r++) {
+				uint32_t	length = strlen(batch->strings + *(uint32_t *) (batch->rows + r*rowSize + offset)) + 1;
+				if(length > width)
+					width = length;
+			}
+			widths[c] = width;
+			data[c] = (char *) calloc(n, width);
+			for(long r=0; r<n; r++)
+				strcpy(data[c] + r*width, batch->strings + *(uint32_t *) (batch->rows + r*rowSize + offset));
+		}
+		else {
+			uint32_t	width = columnLogTypeSize(columns[c].type);
+			widths[c] = width;
+			data[c] = (char *) malloc(n*width);
+			for(long r=0; r<n; r++)
+				memcpy(data[c] + r*width, batch->rows + r*rowSize + offset, width);
+		}
+	}
+
+	pthread_mutex_lock(&fileMutex);
+	if(fp != NULL) {
+		writeColumnLogBlock(fp, nColumns, n, &widths[0], &data[0]);
+		nRows += n;
+		nBlocks++;
+	}
+	pthread_mutex_unlock(&fileMutex);
+
+	for(int c=0; c<nColumns; c++)
+		free(data[c]);
+	batch->nRows = 0;
+	batch->stringsUsed = 0;
+}
+
+
+/*
+ *	Write out whatever is in the batches not held by a worker
+ */
+void cColumnLog::flush(void) {
+	pthread_mutex_lock(&poolMutex);
+	tColumnLogBatch *batches = idle;
+	idle = NULL;
+	pthread_mutex_unlock(&poolMutex);
+
+	tColumnLogBatch *last = NULL;
+	for(tColumnLogBatch *batch = batches; batch != NULL; batch = batch->next) {
+		writeBatch(batch);
+		last = batch;
+	}
+
+	pthread_mutex_lock(&poolMutex);
+	if(last != NULL) {
+		last->next = idle;
+		idle = batches;
+	}
+	pthread_mutex_unlock(&poolMutex);
+
+	pthread_mutex_lock(&fileMutex);
+	if(fp != NULL)
+		fflush(fp);
+	pthread_mutex_unlock(&fileMutex);
+}
+
+/*
+ *	Only once the workers are done with their batches
+ */
+void cColumnLog::close(void) {
+	if(fp != NULL)
+		flush();
+
+	while(idle != NULL) {
+		tColumnLogBatch *batch = idle;
+		idle = batch->next;
+		free(batch->rows);
+		free(batch->strings);
+		free(batch);
+	}
+	if(fp != NULL) {
+		fclose(fp);
+		fp = NULL;
+	}
+}
+
+
+/*
+ *	Reader
+ */
+cColumnLogReader::cColumnLogReader() {
+	fp = NULL;
+	nColumns = 0;
+	nRows = 0;
+}
+
+cColumnLogReader::~cColumnLogReader() {
+	close();
+}
+
+int cColumnLogReader::open(const char *filename) {
+	close();
+	fp = fopen(filename, "rb");
+	if(fp == NULL) {
+		printf("Error: Can not open %s\n", filename);
+		return 1;
+	}
+
+	char		magic[8];
+	uint32_t	n;
+	if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, COLUMNLOG_MAGIC, 8) != 0 || fread(&n, sizeof(n), 1, fp) != 1) {
+		printf("Error: %s is not a cheetah column log\n", filename);
+		close();
+		return 1;
+	}
+	nColumns = n;
+	names.resize(nColumns);
+	types.resize(nColumns);
+	for(int c=0; c<nColumns; c++) {
+		char	type;
+		uint8_t	length;
+		char	name[256];
+		if(fread(&type, 1, 1, fp) != 1 || fread(&length, 1, 1, fp) != 1 || fread(name, 1, length, fp) != length || columnLogTypeSize(type) == 0) {
+			printf("Error: %s has a damaged header\n", filename);
+			close();
+			return 1;
+		}
+		name[length] = 0;
+		names[c] = name;
+		types[c] = type;
+	}
+	widths.resize(nColumns);
+	data.resize(nColumns);
+	nRows = 0;
+	return 0;
+}
+
+void cColumnLogReader::close(void) {
+	if(fp != NULL)
+		fclose(fp);
+	fp = NULL;
+	nRows = 0;
+}
+
+
+/*
+ *	Read the next block, returns 0 at the end of the file
+ *	(a block cut short by a crash is dropped with a warning)
+ */
+int cColumnLogReader::nextBlock(void) {
+	nRows = 0;
+	if(fp == NULL)
+		return 0;
+
+	uint32_t	header[2];
+	if(fread(header, sizeof(uint32_t), 2, fp) != 2)
+		return 0;
+	if(header[0] != COLUMNLOG_BLOCK_MAGIC) {
+		printf("Warning: damaged block in column log, ignoring the rest of the file\n");
+		return 0;
+	}
+
+	long	n = header[1];
+	for(int c=0; c<nColumns; c++) {
+		uint32_t	width;
+		if(fread(&width, sizeof(width), 1, fp) != 1)
+			goto truncated;
+		widths[c] = width;
+		data[c].resize(n*width);
+		if(n > 0 && fread(&data[c][0], width, n, fp) != (size_t) n)
+			goto truncated;
+	}
+	nRows = n;
+	return 1;
+
+truncated:
+	printf("Warning: last block of column log is incomplete, ignoring it\n");
+	return 0;
+}
+
+int cColumnLogReader::find(const char *name) {
+	for(int c=0; c<nColumns; c++)
+		if(names[c] == name)
+			return c;
+	return -1;
+}
+
+long cColumnLogReader::getLong(int column, long row) {
+	if(column < 0)
+		return 0;
+	const char	*p = &data[column][row*widths[column]];
+	switch(types[column]) {
+		case 'i': return *(int32_t *) p;
+		case 'l': return *(int64_t *) p;
+		case 'f': return (long) *(float *) p;
+		case 'd': return (long) *(double *) p;
+		default: return 0;
+	}
+}
+
+double cColumnLogReader::getDouble(int column, long row) {
+	if(column < 0)
+		return 0;
+	const char	*p = &data[column][row*widths[column]];
+	switch(types[column]) {
+		case 'i': return *(int32_t *) p;
+		case 'l': return *(int64_t *) p;
+		case 'f': return *(float *) p;
+		case 'd': return *(double *) p;
+		default: return 0;
+	}
+}
+
+const char *cColumnLogReader::getString(int column, long row) {
+	if(column < 0 || types[column] != 's')
+		return "";
+	return &data[column][row*widths[column]];
+}
@@ -0,0 +1,344 @@
+/*
+ *  commonMode.cpp
+ *  cheetah
+ *
+ *  Common mode subtraction by region and estimator (see commonMode.h)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "cheetah.h"
+#include "median.h"
+#include "commonMode.h"
+
+
+/*
+ *	Sort buffers and histograms, handed out to one region thread at a time
+ *	Histograms are all zero whenever they are in the pool (only the bins used are cleared after each region)
+ */
+typedef struct tCommonModeScratch {
+	float		*values;
+	long		nValues;
+	long		*histogram;
+	long		nHistogram;
+	struct tCommonModeScratch	*next;
+} tCommonModeScratch;
+
+static tCommonModeScratch	*scratchPool = NULL;
+static pthread_mutex_t		scratchMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static tCommonModeScratch *acquireScratch(long nValues, long nHistogram) {
+	pthread_mutex_lock(&scratchMutex);
+	tCommonModeScratch	*scratch = scratchPool;
+	if(scratch != NULL)
+		scratchPool = scratch->next;
+	pthread_mutex_unlock(&scratchMutex);
+
+	if(scratch == NULL)
+		scratch = (tCommonModeScratch *) calloc(1, sizeof(tCommonModeScratch));
+	if(scratch->nValues < nValues) {
+		free(scratch->values);
+		scratch->values = (float *) malloc(nValues*sizeof(float));
+		scratch->nValues = nValues;
+	}
+	if(scratch->nHistogram < nHistogram) {
+		free(scratch->histogram);
+		scratch->histogram = (long *) calloc(nHistogram, sizeof(long));
+		scratch->nHistogram = nHistogram;
+	}
+	return scratch;
+}
+
+static void releaseScratch(tCommonModeScratch *scratch) {
+	pthread_mutex_lock(&scratchMutex);
+	scratch->next = scratchPool;
+	scratchPool = scratch;
+	pthread_mutex_unlock(&scratchMutex);
+}
+
+
+void commonModeDefaults(tCommonModeParams *params) {
+	params->region = CM_REGION_ASIC;
+	params->estimator = CM_ESTIMATOR_NONE;
+	params->bankWidth = 64;
+	params->floor = 0.5;
+	params->histogramSpan = 16384;
+	params->includeMask = 0;
+	params->excludeMask = PIXEL_IS_BAD;
+	params->nThreads = 1;
+}
+
+/*
+ *	Config keyword values, -1 if unknown
+ */
+int commonModeRegion(const char *name) {
+	if(strcasecmp(name, "asic") == 0) return CM_REGION_ASIC;
+	if(strcasecmp(name, "row") == 0) return CM_REGION_ROW;
+	if(strcasecmp(name, "column") == 0) return CM_REGION_COLUMN;
+	if(strcasecmp(name, "bank") == 0) return CM_REGION_BANK;
+	return -1;
+}
+
+int commonModeEstimator(const char *name) {
+	if(strcasecmp(name, "none") == 0) return CM_ESTIMATOR_NONE;
+	if(strcasecmp(name, "median") == 0) return CM_ESTIMATOR_MEDIAN;
+	if(strcasecmp(name, "histogram") == 0) return CM_ESTIMATOR_HISTOGRAM;
+	if(strcasecmp(name, "mean") == 0) return CM_ESTIMATOR_MEAN;
+	if(strcasecmp(name, "unbonded") == 0) return CM_ESTIMATOR_UNBONDED;
+	return -1;
+}
+
+
+/*
+ *	One thread's share of the regions
+ */
+typedef struct {
+	float				*data;
+	uint16_t			*mask;
+	long				asic_nx;
+	long				asic_ny;
+	long				nasics_x;
+	long				regionsPerAsic;
+	long				firstRegion;
+	long				lastRegion;		// One past the end
+	tCommonModeParams	*params;
+} tCommonModeTask;
+
+
+static int pixelSelected(uint16_t *mask, long p, tCommonModeParams *params) {
+	if(mask == NULL)
+		return 1;
+	if(params->includeMask && isNoneOfBitOptionsSet(mask[p], params->includeMask))
+		return 0;
+	return isNoneOfBitOptionsSet(mask[p], params->excludeMask);
+}
+
+
+/*
+ *	Offset of the region [x0,x1)x[y0,y1) of ASIC (mi,mj), 0 if no pixel is selected
+ */
+static float regionOffset(tCommonModeTask *task, tCommonModeScratch *scratch, long mi, long mj, long x0, long x1, long y0, long y1) {
+	tCommonModeParams	*params = task->params;
+	float		*data = task->data;
+	uint16_t	*mask = task->mask;
+	long		stride = task->asic_nx*task->nasics_x;
+	long		origin = mj*task->asic_ny*stride + mi*task->asic_nx;
+	long		counter = 0;
+
+	switch(params->estimator) {
+
+		case CM_ESTIMATOR_MEDIAN: {
+			float	*buffer = scratch->values;
+			for(long j=y0; j<y1; j++) {
+				long	p = origin + j*stride;
+				for(long i=x0; i<x1; i++)
+					if(pixelSelected(mask, p+i, params))
+						buffer[counter++] = data[p+i];
+			}
+			if(counter == 0)
+				return 0;
+			long	mval = lrint(counter*params->floor);
+			if(mval < 0) mval = 0;
+			if(mval > counter-1) mval = counter-1;
+			return kth_smallest(buffer, counter, mval);
+		}
+
+		case CM_ESTIMATOR_HISTOGRAM: {
+			// Only the bins between lo and hi have been touched: search and clear just those
+			long	*histogram = scratch->histogram;
+			long	span = params->histogramSpan;
+			long	lo = 2*span;
+			long	hi = -1;
+			for(long j=y0; j<y1; j++) {
+				long	p = origin + j*stride;
+				for(long i=x0; i<x1; i++) {
+					if(!pixelSelected(mask, p+i, params))
+						continue;
+					long	bin = lrint(data[p+i]) + span;
+					if(bin >= 0 && bin < 2*span) {
+						histogram[bin] += 1;
+						if(bin < lo) lo = bin;
+						if(bin > hi) hi = bin;
+					}
+				}
+			}
+			if(hi < 0)
+				return 0;
+			long	maxPosition = lo;
+			for(long b=lo; b<=hi; b++)
+				if(histogram[b] > histogram[maxPosition])
+					maxPosition = b;
+			memset(histogram+lo, 0, (hi-lo+1)*sizeof(long));
+			return (float) (maxPosition - span);
+		}
+
+		case CM_ESTIMATOR_MEAN: {
+			double	sum = 0;
+			for(long j=y0; j<y1; j++) {
+				long	p = origin + j*stride;
+				for(long i=x0; i<x1; i++)
+					if(pixelSelected(mask, p+i, params)) {
+						sum += data[p+i];
+						counter++;
+					}
+			}
+			return counter ? (float) (sum/counter) : 0;
+		}
+
+		case CM_ESTIMATOR_UNBONDED: {
+			double	sum = 0;
+			for(long j=0; j<task->asic_ny-1; j+=10) {
+				if(j < y0 || j >= y1 || j < x0 || j >= x1)
+					continue;
+				long	p = origin + j*stride + j;
+				if(pixelSelected(mask, p, params)) {
+					sum += data[p];
+					counter++;
+				}
+			}
+			return counter ? (float) (sum/counter) : 0;
+		}
+	}
+	return 0;
+}
+
+
+static void *commonModeTask(void *arg) {
+	tCommonModeTask		*task = (tCommonModeTask *) arg;
+	tCommonModeParams	*params = task->params;
+	long		asic_nx = task->asic_nx;
+	long		asic_ny = task->asic_ny;
+	long		stride = asic_nx*task->nasics_x;
+	long		nHistogram = (params->estimator == CM_ESTIMATOR_HISTOGRAM) ? 2*params->histogramSpan : 0;
+	tCommonModeScratch	*scratch = acquireScratch(asic_nx*asic_ny, nHistogram);
+
+	for(long r=task->firstRegion; r<task->lastRegion; r++) {
+		long	asic = r / task->regionsPerAsic;
+		long	k = r % task->regionsPerAsic;
+		long	mi = asic % task->nasics_x;
+		long	mj = asic / task->nasics_x;
+		long	x0 = 0, x1 = asic_nx, y0 = 0, y1 = asic_ny;
+
+		switch(params->region) {
+			case CM_REGION_ROW:
+				y0 = k;
+				y1 = k+1;
+				break;
+			case CM_REGION_COLUMN:
+				x0 = k;
+				x1 = k+1;
+				break;
+			case CM_REGION_BANK:
+				x0 = k*params->bankWidth;
+				x1 = x0 + params->bankWidth;
+				if(x1 > asic_nx) x1 = asic_nx;
+				break;
+		}
+
+		float	offset = regionOffset(task, scratch, mi, mj, x0, x1, y0, y1);
+		if(offset == 0)
+			continue;
+
+		long	origin = mj*asic_ny*stride + mi*asic_nx;
+		for(long j=y0; j<y1; j++) {
+			float	*row = task->data + origin + j*stride;
+			for(long i=x0; i<x1; i++)
+				row[i] -= offset;
+		}
+	}
+
+	releaseScratch(scratch);
+	return NULL;
+}
+
+
+/*
+ *	Subtract the common mode of every region, regions split between params->nThreads threads
+ *	(the calling thread takes the first share)
+ */
+void commonModeSubtract(float *data, uint16_t *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, tCommonModeParams *params) {
+
+	if(params->estimator == CM_ESTIMATOR_NONE)
+		return;
+
+	long	regionsPerAsic = 1;
+	if(params->region == CM_REGION_ROW)
+		regionsPerAsic = asic_ny;
+	else if(params->region == CM_REGION_COLUMN)
+		regionsPerAsic = asic_nx;
+	else if(params->region == CM_REGION_BANK) {
+		if(params->bankWidth <= 0)
+			params->bankWidth = asic_nx;
+		regionsPerAsic = (asic_nx + params->bankWidth - 1) / params->bankWidth;
+	}
+	long	nRegions = regionsPerAsic*nasics_x*nasics_y;
+
+	long	nThreads = params->nThreads;
+	if(nThreads < 1) nThreads = 1;
+	if(nThreads > nRegions) nThreads = nRegions;
+
+	tCommonModeTask	*tasks = (tCommonModeTask *) calloc(nThreads, sizeof(tCommonModeTask));
+	pthread_t		*threads = (pthread_t *) calloc(nThreads, sizeof(pthread_t));
+	for(long t=0; t<nThreads; t++) {
+		tasks[t].data = data;
+		tasks[t].mask = mask;
+		tasks[t].asic_nx = asic_nx;
+		tasks[t].asic_ny = asic_ny;
+		tasks[t].nasics_x = nasics_x;
+		tasks[t].regionsPerAsic = regionsPerAsic;
+		tasks[t].firstRegion = (nRegions*t)/nThreads;
+		tasks[t].lastRegion = (nRegions*(t+1))/nThreads;
+		tasks[t].params = params;
+	}
+
+	// Thread creation failures fall back on the calling thread
+	long	*started = (long *) calloc(nThreads, sizeof(long));
+	for(long t=1; t<nThreads; t++)
+		started[t] = (pthread_create(&threads[t], NULL, commonModeTask, (void *) &tasks[t]) == 0);
+	commonModeTask((void *) &tasks[0]);
+	for(long t=1; t<nThreads; t++) {
+		if(started[t])
+			pthread_join(threads[t], NULL);
+		else
+			commonModeTask((void *) &tasks[t]);
+	}
+
+	free(started);
+	free(threads);
+	free(tasks);
+}
+
+
+/*
+ *	Generic common mode (cmEstimator), for any detector type
+ */
+void commonModeSubtract(cEventData *eventData, cGlobal *global) {
+
+	DETECTOR_LOOP {
+		cPixelDetectorCommon	*detector = &global->detector[detIndex];
+		if(detector->cmEstimator == CM_ESTIMATOR_NONE)
+			continue;
+		DEBUG3("Common mode subtraction. (detectorID=%ld)", detector->detectorID);
+
+		tCommonModeParams	params;
+		commonModeDefaults(&params);
+		params.region = detector->cmRegion;
+		params.estimator = detector->cmEstimator;
+		params.bankWidth = detector->cmBankWidth;
+		params.floor = detector->cmFloor;
+		params.histogramSpan = detector->cmHistogramSpan;
+		params.includeMask = detector->cmIncludeMask;
+		params.excludeMask = detector->cmExcludeMask;
+		params.nThreads = detector->cmThreads;
+
+		commonModeSubtract(eventData->detector[detIndex].data_detCorr, eventData->detector[detIndex].pixelmask,
+						   detector->asic_nx, detector->asic_ny, detector->nasics_x, detector->nasics_y, &params);
+	}
+}
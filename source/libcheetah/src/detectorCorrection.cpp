@@ -204,59 +204,11 @@ void cspadModuleSubtract(cEventData *eventData, cGlobal *global, int flag){
  *	Subtract the median value on each ASIC
  */
 void cspadModuleSubtractMedian(float *data, uint16_t *mask, float threshold, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	
-	long		e;
-	long		mval;
-	long		counter;
-	float		median;
-					  
-	// Create median buffer
-	float	*buffer; 
-	buffer = (float*) calloc(asic_nx*asic_ny, sizeof(float));
-	
-	
-	// Loop over modules (8x8 array)
-	for(long mi=0; mi<nasics_x; mi++){
-		for(long mj=0; mj<nasics_y; mj++){
-			
-			// Zero array
-			for(long i=0; i<asic_nx*asic_ny; i++)
-				buffer[i] = 0;
-			
-			// Loop over pixels within a module
-            counter = 0;
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					if( isBitOptionUnset(mask[e],PIXEL_IS_BAD) ) {
-						buffer[counter++] = data[e];
-					}
-				}
-			}
-			
-            // Calculate background using median value 
-			//median = kth_smallest(buffer, global->asic_nx*global->asic_ny, mval);
-			if(counter>0) {
-				mval = lrint(counter*threshold);
-                if(mval < 0) 
-                    mval = 1;
-				median = kth_smallest(buffer, counter, mval);
-			}
-			else 
-				median = 0;
-
-			// Subtract median value
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					data[e] -= median;
-				}
-			}
-		}
-	}
-	free(buffer);
+	tCommonModeParams	params;
+	commonModeDefaults(&params);
+	params.estimator = CM_ESTIMATOR_MEDIAN;
+	params.floor = threshold;
+	commonModeSubtract(data, mask, asic_nx, asic_ny, nasics_x, nasics_y, &params);
 }
 
 
@@ -265,67 +217,11 @@ void cspadModuleSubtractMedian(float *data, uint16_t *mask, float threshold, lon
  *	(the LCLS/psana apporach)
  */
 void cspadModuleSubtractHistogram(float *data, uint16_t *mask, long hist_span, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	long		e;
-	long		counter;
-	
-	
-	// Create histogram array
-	long	hist_offset = hist_span;
-	long	hist_index;
-	long	*histogram = (long*) calloc(2*hist_span, sizeof(long));
-	
-	
-	// Loop over modules (8x8 array)
-	for(long mi=0; mi<nasics_x; mi++){
-		for(long mj=0; mj<nasics_y; mj++){
-			
-			// Zero histogram array
-			for(long i=0; i<2*hist_span; i++)
-				histogram[i] = 0;
-			
-			// Loop over pixels within a module and populate the histogram
-			// Ignoring bad pixels avoids being dominated by those pixels being set to 0
-			// Remember to do an array bounds check
-			counter = 0;
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					if( isBitOptionUnset(mask[e],PIXEL_IS_BAD) ) {
-						hist_index = lrint(data[e]) + hist_offset;
-						if(hist_index >= 0 && hist_index < 2*hist_span)
-							histogram[hist_index] += 1;
-					}
-				}
-			}
-			
-			// Maximum of the histogram is the common mode offset
-			long	hist_max_value = -1;
-			long	hist_max_position = -1;
-			
-			for(long i=0; i<2*hist_span; i++) {
-				if(histogram[i] > hist_max_value) {
-					hist_max_value = histogram[i];
-					hist_max_position = i;
-				}
-			}
-			if(hist_max_position != -1)
-				hist_max_position -= hist_offset;
-			else
-				hist_max_position = 0;
-			
-			
-			// Subtract median value
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					data[e] -= hist_max_position;
-				}
-			}
-		}
-	}
-	free(histogram);
+	tCommonModeParams	params;
+	commonModeDefaults(&params);
+	params.estimator = CM_ESTIMATOR_HISTOGRAM;
+	params.histogramSpan = hist_span;
+	commonModeSubtract(data, mask, asic_nx, asic_ny, nasics_x, nasics_y, &params);
 }
 
 
@@ -355,40 +251,10 @@ void cspadSubtractUnbondedPixels(cEventData *eventData, cGlobal *global){
 }
 
 void cspadSubtractUnbondedPixels(float *data, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	
-	long		e;
-	float		counter;
-	float		background;
-	
-	// Loop over modules (8x8 array)
-	for(long mi=0; mi<nasics_x; mi++){
-		for(long mj=0; mj<nasics_y; mj++){
-			
-			
-			// Loop over unbonded pixels within each ASIC
-			background = 0.0;
-			counter = 0.0;
-			for(long j=0; j<asic_ny-1; j+=10){
-				long i=j;
-				e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-				e += i + mi*asic_nx;
-				background += data[e];
-				counter += 1;
-			}
-			background /= counter;
-			
-			
-			// Subtract background from entire ASIC
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					data[e] -= background;
-					
-				}
-			}
-		}
-	}
+	tCommonModeParams	params;
+	commonModeDefaults(&params);
+	params.estimator = CM_ESTIMATOR_UNBONDED;
+	commonModeSubtract(data, NULL, asic_nx, asic_ny, nasics_x, nasics_y, &params);
 }
 
 
@@ -418,54 +284,13 @@ void cspadSubtractBehindWires(cEventData *eventData, cGlobal *global){
 }
 
 void cspadSubtractBehindWires(float *data, uint16_t *mask, float threshold, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	
-	long		p;
-	long		counter;
-	long		mval;
-	float		median;
-	
-	// Create median buffer
-	float	*buffer; 
-	buffer = (float*) calloc(asic_ny*asic_nx, sizeof(float));
-	
-	// Loop over modules (8x8 array)
-	for(long mi=0; mi<nasics_y; mi++){
-		for(long mj=0; mj<nasics_x; mj++){
-			
-			
-			// Loop over pixels within a module, remembering signal behind wires
-			counter = 0;
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					p = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					p += i + mi*asic_nx;
-					if( isBitOptionSet(mask[p],PIXEL_IS_SHADOWED) ){
-						buffer[counter] = data[p];
-						counter++;
-					}
-				}
-			}
-			
-			// Median value of pixels behind wires
-			if(counter>0) {
-				mval = lrint(counter*threshold);
-				median = kth_smallest(buffer, counter, mval);
-			}
-			else 
-				median = 0;
-			
-			
-			// Subtract median value
-			for(long i=0; i<asic_nx; i++){
-				for(long j=0; j<asic_ny; j++){
-					p = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					p += i + mi*asic_nx;
-					data[p] -= median;
-				}
-			}
-		}
-	}
-	free(buffer);
+	tCommonModeParams	params;
+	commonModeDefaults(&params);
+	params.estimator = CM_ESTIMATOR_MEDIAN;
+	params.floor = threshold;
+	params.includeMask = PIXEL_IS_SHADOWED;
+	params.excludeMask = 0;
+	commonModeSubtract(data, mask, asic_nx, asic_ny, nasics_x, nasics_y, &params);
 }
 
 /*
@@ -550,6 +375,7 @@ void updateHotPixelBuffer(cEventData *eventData, cGlobal *global) {
 						nHot++;				
 					}		
 				}
+				global->detector[detIndex].pixelmask_shared_epoch++;
 				if (threadSafetyLevel > 1) pthread_mutex_unlock(&global->detector[detIndex].pixelmask_shared_mutex);
 				free(absAboveThreshold);
 				global->detector[detIndex].nHot = nHot;
@@ -581,7 +407,7 @@ void applyPolarizationCorrection(cEventData *eventData, cGlobal *global) {
             float   *pix_z = global->detector[detIndex].pix_z;
 			long	pix_nn = global->detector[detIndex].pix_nn;
             float   pixelSize = global->detector[detIndex].pixelSize;
-            double  detectorZ = global->detector[detIndex].detectorZ;
+            double  detectorZ = eventData->detector[detIndex].detectorZ;
             float   cameraLengthScale = global->detector[detIndex].cameraLengthScale;
             double  horizontalFraction = global->detector[detIndex].horizontalFractionOfPolarization;
             
@@ -618,9 +444,14 @@ void applySolidAngleCorrection(cEventData *eventData, cGlobal *global) {
             float   *pix_z = global->detector[detIndex].pix_z;
             long	pix_nn = global->detector[detIndex].pix_nn;
             float   pixelSize = global->detector[detIndex].pixelSize;
-            double  detectorZ = global->detector[detIndex].detectorZ;
             float   cameraLengthScale = global->detector[detIndex].cameraLengthScale;
-            double  solidAngleConst = global->detector[detIndex].solidAngleConst;
+
+            // Camera length of the geometry this event was handed (no geometry yet means no camera length either)
+            tGeometrySnapshot *geometry = eventData->detector[detIndex].geometry;
+            if (geometry == NULL)
+                continue;
+            double  detectorZ = geometry->detectorZ;
+            double  solidAngleConst = geometry->solidAngleConst;
             
             if (global->detector[detIndex].solidAngleAlgorithm == 1) {
                 applyAzimuthallySymmetricSolidAngleCorrection(data, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, solidAngleConst, pix_nn);
@@ -743,6 +574,12 @@ void pnccdModuleSubtract(float *data, uint16_t *mask, int start, int stop, float
     // histogram length
     int nhist = stop - start + 1;
     
+    // intensity histogram of a line, x-scale is the same for every line
+    uint16_t *line_histogram = (uint16_t*) calloc(nhist, sizeof(uint16_t));
+    int *line_histogram_x = (int*) calloc(nhist, sizeof(int));
+    for (x = 0; x < nhist; x++)
+        line_histogram_x[x] = start + x;
+    
     // loop over quadrants
     for (my = 0; my < nasics_y; my++) {
         
@@ -750,13 +587,7 @@ void pnccdModuleSubtract(float *data, uint16_t *mask, int start, int stop, float
             q = mx + my*nasics_x;
             
             for (y = 0; y < asic_ny; y++) {
-                // allocate intensity histogram of line
-                uint16_t *line_histogram = (uint16_t*) calloc(nhist, sizeof(uint16_t));
-                int *line_histogram_x = (int*) calloc(nhist, sizeof(int));
-                
-                // set x-scale
-                for (x = 0; x < nhist; x++)
-                    line_histogram_x[x] = start + x;
+                memset(line_histogram, 0, nhist*sizeof(uint16_t));
                 
                 // fill intensity histogram with data for line
                 min_border = 65536;
@@ -850,12 +681,11 @@ void pnccdModuleSubtract(float *data, uint16_t *mask, int start, int stop, float
                         printf("Common-mode[%d][%d]: %f (mean)\n", q, y, m);
                     }
                 }
-                
-                free(line_histogram);
-                free(line_histogram_x);
             }
         }
     }
+    free(line_histogram);
+    free(line_histogram_x);
 }
 
 
@@ -1015,6 +845,8 @@ void pnccdLineMasking(cEventData *eventData,cGlobal *global){
 					i = nx*y+x;
 					i0 = nx*y+x-1;
 					i1 = nx*y+x+1;
+					if (isNoneOfBitOptionsSet(mask[i], PIXEL_IS_BAD))
+						eventData->detector[detIndex].markPixelmask(i);
 					mask[i] |= PIXEL_IS_BAD;
 					if (global->detector[detIndex].usePnccdLineInterpolation == 1){
 						mask[i] |= PIXEL_IS_ARTIFACT_CORRECTED;
@@ -100,6 +100,13 @@ cPixelDetectorCommon::cPixelDetectorCommon()
     cmRange = 1.0;
     cspadSubtractUnbondedPixels = 0;
     cspadSubtractBehindWires = 0;
+    cmRegion = CM_REGION_ASIC;
+    cmEstimator = CM_ESTIMATOR_NONE;
+    cmBankWidth = 64;
+    cmHistogramSpan = 16384;
+    cmIncludeMask = 0;
+    cmExcludeMask = PIXEL_IS_BAD;
+    cmThreads = 1;
 
     // Gain calibration correction
     useGaincal = 0;
@@ -139,6 +146,8 @@ cPixelDetectorCommon::cPixelDetectorCommon()
     streak_num_lines_to_check = 3;
     streak_background_region_preset = 1;
     streak_background_region_dist_from_edge = 10;
+    streak_thread_count = 1;
+    strcpy(streak_cache_dir, "");
 
     // Local background subtraction
     useLocalBackgroundSubtraction = 0;
@@ -208,6 +217,12 @@ cPixelDetectorCommon::cPixelDetectorCommon()
     saveThumbnail = 0;
     saveDownsampled = 0;
 
+    // Sparse frame storage
+    saveSparse = 0;
+    saveSparseOnly = 0;
+    sparseThreshold = 0;
+    sparseHaloRadius = 0;
+
     // Powder saving options
     savePowderDetectorRaw = 1;
     savePowderDetectorCorrected = 1;
@@ -471,6 +486,22 @@ void cPixelDetectorCommon::configure(cGlobal * global) {
     } else {
         printf("\t\tNon-assembled: NO \n");
     }
+    if (saveSparseOnly) {
+        saveSparse = 1;
+    }
+    if (saveSparse) {
+        if (!saveNonAssembled || global->saveModular) {
+            fprintf(stderr,"Error: saveSparse = 1 requires saveNonAssembled = 1 and saveModular = 0.\n");
+            fprintf(stderr,"Please edit your ini file and try again.\n");
+            exit(1);
+        }
+        if (sparseHaloRadius > 0)
+            printf("\t\tSparse: YES (peaks + halo of %li pixels%s)\n", sparseHaloRadius, saveSparseOnly ? ", sparse only" : "");
+        else
+            printf("\t\tSparse: YES (pixels > %g%s)\n", sparseThreshold, saveSparseOnly ? ", sparse only" : "");
+    } else {
+        printf("\t\tSparse: NO \n");
+    }
     if (saveAssembled) {
         saveFormat = (cDataVersion::dataFormat_t)(saveFormat | cDataVersion::DATA_FORMAT_ASSEMBLED);
         dataFormatMain = cDataVersion::DATA_FORMAT_ASSEMBLED;
@@ -635,6 +666,18 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "saveradialaverage")) {
         saveRadialAverage = atoi(value);
     }
+    else if (!strcmp(tag, "savesparse")) {
+        saveSparse = atoi(value);
+    }
+    else if (!strcmp(tag, "savesparseonly")) {
+        saveSparseOnly = atoi(value);
+    }
+    else if (!strcmp(tag, "sparsethreshold")) {
+        sparseThreshold = atof(value);
+    }
+    else if (!strcmp(tag, "sparsehaloradius")) {
+        sparseHaloRadius = atoi(value);
+    }
     else if (!strcmp(tag, "photoncount")) {
         photonCount = atoi(value);
     }
@@ -783,6 +826,12 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "streak_background_region_dist_from_edge")) {
         streak_background_region_dist_from_edge = atoi(value);
     }
+    else if (!strcmp(tag, "streak_thread_count")) {
+        streak_thread_count = atoi(value);
+    }
+    else if (!strcmp(tag, "streak_cache_dir")) {
+        strcpy(streak_cache_dir, value);
+    }
     else if (!strcmp(tag, "commonmodecorrection")) {
         strcpy(commonModeCorrection, value);
     }
@@ -804,6 +853,37 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "cmrange")) {
         cmRange = atof(value);
     }
+    else if (!strcmp(tag, "cmregion")) {
+        cmRegion = commonModeRegion(value);
+        if (cmRegion < 0) {
+            printf("Error: Unknown common mode region: %s\n"
+                    "Valid options are {asic, row, column, bank}\n", value);
+            fail = 1;
+        }
+    }
+    else if (!strcmp(tag, "cmestimator")) {
+        cmEstimator = commonModeEstimator(value);
+        if (cmEstimator < 0) {
+            printf("Error: Unknown common mode estimator: %s\n"
+                    "Valid options are {none, median, histogram, mean, unbonded}\n", value);
+            fail = 1;
+        }
+    }
+    else if (!strcmp(tag, "cmbankwidth")) {
+        cmBankWidth = atol(value);
+    }
+    else if (!strcmp(tag, "cmhistogramspan")) {
+        cmHistogramSpan = atol(value);
+    }
+    else if (!strcmp(tag, "cmincludemask")) {
+        cmIncludeMask = (uint16_t) strtol(value, NULL, 0);
+    }
+    else if (!strcmp(tag, "cmexcludemask")) {
+        cmExcludeMask = (uint16_t) strtol(value, NULL, 0);
+    }
+    else if (!strcmp(tag, "cmthreads")) {
+        cmThreads = atoi(value);
+    }
     // Local background subtraction
     else if (!strcmp(tag, "uselocalbackgroundsubtraction")) {
         useLocalBackgroundSubtraction = atoi(value);
@@ -979,6 +1059,9 @@ void cPixelDetectorCommon::allocateMemory()
     for (long j = 0; j < pix_nn; j++) {
         pixelmask_shared_min[j] = PIXEL_IS_ALL;
     }
+    pixelmask_shared_epoch = 0;
+    pixelmask_derived.setup(pix_nn);
+    geometry.setup(this);
 
     // Hot pixel map
     pthread_mutex_init(&hotPix_update_mutex, NULL);
@@ -1251,11 +1334,6 @@ void cPixelDetectorCommon::readDetectorGeometry(char* filename)
     pix_x = (float *) calloc(nn, sizeof(float));
     pix_y = (float *) calloc(nn, sizeof(float));
     pix_z = (float *) calloc(nn, sizeof(float));
-    pix_kx = (float *) calloc(nn, sizeof(float));
-    pix_ky = (float *) calloc(nn, sizeof(float));
-    pix_kz = (float *) calloc(nn, sizeof(float));
-    pix_kr = (float *) calloc(nn, sizeof(float));
-    pix_res = (float *) calloc(nn, sizeof(float));
     //hitfinderResMask = (int *) calloc(nn, sizeof(int)); // is there a better place for this?
     //for (i=0;i<nn;i++) hitfinderResMask[i]=1;
     printf("\tPixel map is %li x %li pixel array\n", nx, ny);
@@ -1349,11 +1427,14 @@ void cPixelDetectorCommon::readDetectorGeometry(char* filename)
 }
 
 /*
- *  Update K-space variables
- *  (called whenever detector has moved)
+ *  Fill in the K-space geometry for the camera length and wavelength of a new snapshot
+ *  (called from the cGeometrySnapshots builder whenever the detector has moved)
+ *  Only reads the real space pixel map, so it can run while workers are using the previous geometry
  */
-void cPixelDetectorCommon::updateKspace(cGlobal *global, float wavelengthA)
+void cPixelDetectorCommon::buildGeometry(cGlobal *global, tGeometrySnapshot *geometry)
 {
+    double detectorZ = geometry->detectorZ;
+    float wavelengthA = geometry->wavelengthA;
     double x, y, z, r;
     double kx, ky, kz, kr;
     double res, minres, maxres;
@@ -1363,7 +1444,15 @@ void cPixelDetectorCommon::updateKspace(cGlobal *global, float wavelengthA)
     minres_pix = 0;
     maxres_pix = 1000000;
 
-    printf("Recalculating K-space coordinates\n");
+    geometry->pix_nn = pix_nn;
+    geometry->pix_kx = (float *) malloc(pix_nn * sizeof(float));
+    geometry->pix_ky = (float *) malloc(pix_nn * sizeof(float));
+    geometry->pix_kz = (float *) malloc(pix_nn * sizeof(float));
+    geometry->pix_kr = (float *) malloc(pix_nn * sizeof(float));
+    geometry->pix_res = (float *) malloc(pix_nn * sizeof(float));
+    geometry->resolutionBits = (uint16_t *) malloc(pix_nn * sizeof(uint16_t));
+
+    printf("Recalculating K-space coordinates (%gmm, %gA)\n", detectorZ, wavelengthA);
 
     for (long i = 0; i < pix_nn; i++) {
         x = pix_x[i] * pixelSize;
@@ -1377,11 +1466,11 @@ void cPixelDetectorCommon::updateKspace(cGlobal *global, float wavelengthA)
         kr = sqrt(kx * kx + ky * ky + kz * kz);
         res = 1.0 / kr;
 
-        pix_kx[i] = kx;
-        pix_ky[i] = ky;
-        pix_kz[i] = kz;
-        pix_kr[i] = kr;
-        pix_res[i] = res;
+        geometry->pix_kx[i] = kx;
+        geometry->pix_ky[i] = ky;
+        geometry->pix_kz[i] = kz;
+        geometry->pix_kr[i] = kr;
+        geometry->pix_res[i] = res;
 
         if (res > minres) {
             minres = res;
@@ -1396,17 +1485,17 @@ void cPixelDetectorCommon::updateKspace(cGlobal *global, float wavelengthA)
         // Generate resolution limit mask
         if (!global->hitfinderResolutionUnitPixel) {
             // (resolution in Angstrom (!!!))
-            if (pix_res[i] < global->hitfinderMaxRes && pix_res[i] > global->hitfinderMinRes)
-                pixelmask_shared[i] &= ~PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
+            if (geometry->pix_res[i] < global->hitfinderMaxRes && geometry->pix_res[i] > global->hitfinderMinRes)
+                geometry->resolutionBits[i] = 0;
             else
-                pixelmask_shared[i] |= PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
+                geometry->resolutionBits[i] = PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
         }
         else {
             // (resolution in pixel (!!!))
             if (pix_r[i] < global->hitfinderMaxRes && pix_r[i] > global->hitfinderMinRes)
-                pixelmask_shared[i] &= ~PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
+                geometry->resolutionBits[i] = 0;
             else
-                pixelmask_shared[i] |= PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
+                geometry->resolutionBits[i] = PIXEL_IS_OUT_OF_RESOLUTION_LIMITS;
         }
     }
 
@@ -1419,8 +1508,21 @@ void cPixelDetectorCommon::updateKspace(cGlobal *global, float wavelengthA)
     }
 
     // also update constant term of solid angle when detector has moved
-    solidAngleConst = pixelSize * pixelSize / (detectorZ * cameraLengthScale * detectorZ * cameraLengthScale);
+    geometry->solidAngleConst = pixelSize * pixelSize / (detectorZ * cameraLengthScale * detectorZ * cameraLengthScale);
+}
 
+
+/*
+ *  Copy the resolution limits of a new geometry into pixelmask_shared
+ *  Events that started with the previous geometry keep their own limits (applied in initPixelmask)
+ */
+void cPixelDetectorCommon::applyGeometry(tGeometrySnapshot *geometry)
+{
+    pthread_mutex_lock(&pixelmask_shared_mutex);
+    for (long i = 0; i < pix_nn; i++)
+        pixelmask_shared[i] = (pixelmask_shared[i] & ~PIXEL_IS_OUT_OF_RESOLUTION_LIMITS) | geometry->resolutionBits[i];
+    pixelmask_shared_epoch++;
+    pthread_mutex_unlock(&pixelmask_shared_mutex);
 }
 
 /*
@@ -1602,6 +1704,7 @@ void cPixelDetectorCommon::readPeakmask(cGlobal *global, char *filename)
             pixelmask_shared[i] &= ~PIXEL_IS_IN_PEAKMASK;
         }
     }
+    pixelmask_shared_epoch++;
 }
 
 /*
@@ -1659,6 +1762,7 @@ void cPixelDetectorCommon::readInitialPixelmask(char *filename)
             }
         }
     }
+    pixelmask_shared_epoch++;
 }
 
 /*
@@ -1713,6 +1817,7 @@ void cPixelDetectorCommon::readBaddataMask(char *filename)
             pixelmask_shared[i] &= ~PIXEL_IS_TO_BE_IGNORED;
         }
     }
+    pixelmask_shared_epoch++;
 }
 
 /*
@@ -1768,6 +1873,7 @@ void cPixelDetectorCommon::readWireMask(char *filename)
             pixelmask_shared[i] &= ~PIXEL_IS_SHADOWED;
         }
     }
+    pixelmask_shared_epoch++;
 
 }
 
@@ -36,6 +36,13 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 	eventData->peakNpix=0.;
 	eventData->peakTotal=0.;
 	eventData->stackSlice=-1;
+	eventData->cxiShard=0;
+	eventData->cxiFile=NULL;
+	eventData->cxiResults=NULL;
+	eventData->cxiEventIndex=0;
+	eventData->trainID=0;
+	eventData->pulseID=0;
+	eventData->cellID=0;
 
 	//long		pix_nn1 = global->detector[0].pix_nn;
 	//long		asic_nx = global->detector[0].asic_nx;
@@ -52,12 +59,17 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 		long	radial_nn = global->detector[detIndex].radial_nn;
 
 		eventData->detector[detIndex].data_raw_is_float = false;
+		eventData->detector[detIndex].geometry = NULL;
 		eventData->detector[detIndex].data_raw16 = (uint16_t*) malloc(pix_nn*sizeof(uint16_t));
 		eventData->detector[detIndex].data_raw = (float*) malloc(pix_nn*sizeof(float));
 		eventData->detector[detIndex].data_detCorr = (float*) calloc(pix_nn,sizeof(float));
 		eventData->detector[detIndex].data_detPhotCorr = (float*) calloc(pix_nn,sizeof(float));
 		eventData->detector[detIndex].data_forPersistentBackgroundBuffer = (float*) calloc(pix_nn,sizeof(float));
 		eventData->detector[detIndex].pixelmask = (uint16_t*) calloc(pix_nn,sizeof(uint16_t));
+		eventData->detector[detIndex].maxPixelmaskChanges = MAX_MASK_CHANGES(pix_nn);
+		eventData->detector[detIndex].pixelmaskChanges = (long*) malloc(MAX_MASK_CHANGES(pix_nn)*sizeof(long));
+		eventData->detector[detIndex].nPixelmaskChanges = 0;
+		eventData->detector[detIndex].pixelmaskEpoch = -1;
 
 		eventData->detector[detIndex].image_raw = (float*) calloc(image_nn,sizeof(float));
 		eventData->detector[detIndex].image_detCorr = (float*) calloc(image_nn,sizeof(float));
@@ -76,6 +88,9 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 
 		eventData->detector[detIndex].pedSubtracted=0;
 		eventData->detector[detIndex].sum=0.;
+		for(int g=0; g<3; g++)
+			eventData->detector[detIndex].nPixelsInGainStage[g] = 0;
+		eventData->detector[detIndex].nBadPixels = 0;
 	}
 
 	
@@ -137,6 +152,9 @@ void cheetahDestroyEvent(cEventData *eventData) {
 		free(eventData->detector[detIndex].data_detPhotCorr);
 		free(eventData->detector[detIndex].data_forPersistentBackgroundBuffer);
 		free(eventData->detector[detIndex].pixelmask);
+		free(eventData->detector[detIndex].pixelmaskChanges);
+		global->detector[detIndex].geometry.release(eventData->detector[detIndex].geometry);
+		eventData->detector[detIndex].geometry = NULL;
 
 		free(eventData->detector[detIndex].image_raw);
 		free(eventData->detector[detIndex].image_detCorr);
@@ -0,0 +1,189 @@
+/*
+ *  geometrySnapshot.cpp
+ *  cheetah
+ *
+ *  Reference counted reciprocal space geometry, built in the background (see geometrySnapshot.h)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "cheetahGlobal.h"
+#include "detectorObject.h"
+#include "geometrySnapshot.h"
+
+
+cGeometrySnapshots::cGeometrySnapshots() {
+	detector = NULL;
+	global = NULL;
+	current = NULL;
+	nBuilds = 0;
+	requested = 0;
+	requestedZ = 0;
+	requestedWavelengthA = 0;
+	queueHead = NULL;
+	queueTail = NULL;
+	building = 0;
+	joinable = 0;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+cGeometrySnapshots::~cGeometrySnapshots() {
+	finish();
+	if(current != NULL && current->refcount == 1)
+		destroy(current);
+	pthread_mutex_destroy(&mutex);
+}
+
+void cGeometrySnapshots::setup(cPixelDetectorCommon *detector0) {
+	detector = detector0;
+}
+
+
+/*
+ *	Ask for the geometry of this camera length and wavelength
+ *	Nothing happens if it is the last geometry requested. A wavelength change alone only counts when it is larger
+ *	than geometryWavelengthTolerance (relative). Otherwise the new geometry is queued for the background builder
+ *	and the current one stays in use until it has been built.
+ */
+void cGeometrySnapshots::request(cGlobal *global0, double detectorZ, float wavelengthA) {
+	pthread_mutex_lock(&mutex);
+	global = global0;
+	if(requested && detectorZ == requestedZ) {
+		float tolerance = global->geometryWavelengthTolerance;
+		if(tolerance <= 0 || isnan(wavelengthA) || fabs(wavelengthA - requestedWavelengthA) <= tolerance*fabs(requestedWavelengthA)) {
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+	}
+	requested = 1;
+	requestedZ = detectorZ;
+	requestedWavelengthA = wavelengthA;
+
+	tGeometrySnapshot *snapshot = (tGeometrySnapshot *) calloc(1, sizeof(tGeometrySnapshot));
+	snapshot->refcount = 1;				// Handed on to current once built
+	snapshot->serial = ++nBuilds;
+	snapshot->detectorZ = detectorZ;
+	snapshot->wavelengthA = wavelengthA;
+	snapshot->next = NULL;
+
+	// Nothing to fall back on for the first geometry, build it right here before any event is handed out
+	if(current == NULL && !building) {
+		pthread_mutex_unlock(&mutex);
+		build(snapshot, global0);
+		return;
+	}
+
+	if(queueTail != NULL)
+		queueTail->next = snapshot;
+	else
+		queueHead = snapshot;
+	queueTail = snapshot;
+
+	if(!building) {
+		if(joinable) {
+			pthread_join(builder, NULL);
+			joinable = 0;
+		}
+		building = 1;
+		if(pthread_create(&builder, NULL, builderThread, (void *) this) == 0) {
+			joinable = 1;
+		}
+		else {
+			printf("Error: could not start geometry builder thread\n");
+			exit(1);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void *cGeometrySnapshots::builderThread(void *arg) {
+	cGeometrySnapshots *self = (cGeometrySnapshots *) arg;
+
+	while(true) {
+		pthread_mutex_lock(&self->mutex);
+		tGeometrySnapshot *snapshot = self->queueHead;
+		if(snapshot == NULL) {
+			self->building = 0;
+			pthread_mutex_unlock(&self->mutex);
+			break;
+		}
+		self->queueHead = snapshot->next;
+		if(self->queueHead == NULL)
+			self->queueTail = NULL;
+		cGlobal	*global = self->global;
+		pthread_mutex_unlock(&self->mutex);
+
+		self->build(snapshot, global);
+	}
+	return NULL;
+}
+
+
+/*
+ *	Fill in a snapshot and make it current
+ *	The resolution limits go into pixelmask_shared first (events still on the previous geometry use their own
+ *	limits, see initPixelmask). Workers only hold pixelmask_shared_mutex for short copies and never wait on a
+ *	geometry while holding it, so the builder can take it.
+ */
+void cGeometrySnapshots::build(tGeometrySnapshot *snapshot, cGlobal *global) {
+	detector->buildGeometry(global, snapshot);
+	detector->applyGeometry(snapshot);
+
+	__sync_synchronize();
+	pthread_mutex_lock(&mutex);
+	tGeometrySnapshot *previous = current;
+	current = snapshot;
+	pthread_mutex_unlock(&mutex);
+
+	release(previous);
+}
+
+
+/*
+ *	Current geometry (always complete), or NULL if none has been requested yet
+ *	Must be handed back with release()
+ */
+tGeometrySnapshot *cGeometrySnapshots::acquire() {
+	pthread_mutex_lock(&mutex);
+	tGeometrySnapshot *snapshot = current;
+	if(snapshot != NULL)
+		__sync_add_and_fetch(&snapshot->refcount, 1);
+	pthread_mutex_unlock(&mutex);
+	return snapshot;
+}
+
+void cGeometrySnapshots::release(tGeometrySnapshot *snapshot) {
+	if(snapshot == NULL)
+		return;
+	if(__sync_sub_and_fetch(&snapshot->refcount, 1) == 0)
+		destroy(snapshot);
+}
+
+
+/*
+ *	Wait for the background builder to empty its queue
+ */
+void cGeometrySnapshots::finish() {
+	pthread_mutex_lock(&mutex);
+	int wait = joinable;
+	joinable = 0;
+	pthread_mutex_unlock(&mutex);
+	if(wait)
+		pthread_join(builder, NULL);
+}
+
+
+void cGeometrySnapshots::destroy(tGeometrySnapshot *snapshot) {
+	free(snapshot->pix_kx);
+	free(snapshot->pix_ky);
+	free(snapshot->pix_kz);
+	free(snapshot->pix_kr);
+	free(snapshot->pix_res);
+	free(snapshot->resolutionBits);
+	free(snapshot);
+}
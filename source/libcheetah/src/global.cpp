@@ -114,6 +114,7 @@ cGlobal::cGlobal(void)
     hitfinderNpeaksMax = 100000;
     saveHitsMinNPeaks = 0;
     hitfinderAlgorithm = 8;
+    useHitlist = 0;
     hitfinderMinPixCount = 3;
     // hitfinderMaxPixCount is a new feature. For backwards compatibility it should be neutral by default, therefore hitfinderMaxPixCount = 0
     hitfinderMaxPixCount = 0;
@@ -130,11 +131,31 @@ cGlobal::cGlobal(void)
     hitfinderMinRes = 0;
     hitfinderMaxRes = 1e6;
     hitfinderResolutionUnitPixel = 1;
+    geometryWavelengthTolerance = 0;
     hitfinderMinSNR = 40;
     hitfinderIgnoreNoisyPixels = 0;
     hitfinderDownsampling = 0;
     hitfinderOnDetectorCorrectedData = 0;
     hitfinderFastScan = 0;
+    hitfinderPrescreen = 0;
+    hitfinderPrescreenBinning = 4;
+    hitfinderPrescreenShells = 8;
+    hitfinderPrescreenSubsample = 4;
+    hitfinderPrescreenADC = -1;
+    hitfinderPrescreenNsigma = 3;
+    hitfinderPrescreenMinBins = -1;
+    hitfinderPrescreenLearnFrames = 100;
+    hitfinderPrescreenAuditInterval = 50;
+    hitfinderPrescreenSkipBlankSums = 0;
+
+    // Shared memory live view
+    useLiveView = 0;
+    strcpy(liveViewName, "/cheetah-live");
+    liveViewSlots = 16;
+    liveViewMaxPeaks = 1024;
+    liveViewBinning = 4;
+    liveViewPowderInterval = 100;
+    liveViewDetIndex = 0;
 
     // peakfinder 9
 
@@ -171,6 +192,10 @@ cGlobal::cGlobal(void)
     // CXI downstream energy spectrum default configuration
     espectrum = 0;
     espectrum1D = 0;
+    espectrumProjectionWidth = 0;
+    espectrumProjectionHeight = 0;
+    espectrumProjection = NULL;
+    espectrumProjectedDark = NULL;
     espectrumTiltAng = 0;
     espectrumLength = 1080;
     espectrumWidth = 900;
@@ -212,6 +237,14 @@ cGlobal::cGlobal(void)
     // Flush after every image by default
     cxiFlushPeriod = 1;
 
+    // One file per powder class (and chunk), no shards
+    cxiShards = 1;
+    strcpy(cxiShardDirs, "");
+
+    // The whole run in this process
+    runShard = 0;
+    nRunShards = 1;
+
     // Save data in modular stack (see CXI version 1.4)
     saveModular = 0;
 
@@ -234,6 +267,10 @@ cGlobal::cGlobal(void)
 
     // Peak lists
     savePeakList = 1;
+    binaryLogs = 0;
+    saveStream = 0;
+    streamFile[0] = 0;
+    streamGeometry[0] = 0;
 
     // Verbosity
     // !!! Why such a high verbosity by default? /Max
@@ -408,6 +445,24 @@ void cGlobal::setup()
                 (hitfinderAlgorithm == 14))
             savePeakInfo = 1;
         savePeakList = 1;
+
+        // Pre-screen needs a pixel detector to look at
+        if (hitfinderPrescreen && hitfinderDetIndex == -1) {
+            printf("hitfinderPrescreen needs hitfinderDetectorID to be a pixel detector, turning it off\n");
+            hitfinderPrescreen = 0;
+        }
+        if (hitfinderPrescreen) {
+            if (hitfinderPrescreenADC < 0)
+                hitfinderPrescreenADC = hitfinderADC;
+            if (hitfinderPrescreenMinBins < 0)
+                hitfinderPrescreenMinBins = std::max(1, hitfinderNpeaks/2);
+            cPixelDetectorCommon *det = &detector[hitfinderDetIndex];
+            hitPrescreen.setup(det->pix_nx, det->pix_ny, det->pix_r, hitfinderPrescreenBinning, hitfinderPrescreenShells,
+                               hitfinderPrescreenSubsample, hitfinderPrescreenLearnFrames, hitfinderPrescreenAuditInterval);
+        }
+    }
+    else {
+        hitfinderPrescreen = 0;
     }
 
     /*
@@ -438,6 +493,8 @@ void cGlobal::setup()
 
     pthread_mutex_init(&gmd_mutex, NULL);
     pthread_mutex_init(&swmr_mutex, NULL);
+    for(long i=0; i<MAX_CXI_SHARDS; i++)
+        pthread_mutex_init(&cxiShard_mutex[i], NULL);
 
     threadID = (pthread_t*) calloc(nThreads, sizeof(pthread_t));
 
@@ -475,6 +532,7 @@ void cGlobal::setup()
         hdf5dump = 0;
         nInitFrames = 0;
         hitfinderFastScan = 0;
+        hitfinderPrescreen = 0;
         writeRunningSumsFiles = 1;
         powderSumHits = 0;
         powderSumBlanks = 0;
@@ -483,6 +541,7 @@ void cGlobal::setup()
             detector[i].useDarkcalSubtraction = 0;
             detector[i].useGaincal = 0;
             detector[i].cmModule = 0;
+            detector[i].cmEstimator = CM_ESTIMATOR_NONE;
             detector[i].usePolarizationCorrection = 0;
             detector[i].useSolidAngleCorrection = 0;
             detector[i].cspadSubtractUnbondedPixels = 0;
@@ -513,6 +572,7 @@ void cGlobal::setup()
 
         hitfinder = 0;
         hitfinderFastScan = 0;
+        hitfinderPrescreen = 0;
         saveHits = 0;
         saveBlanks = 0;
         hdf5dump = 0;
@@ -523,6 +583,7 @@ void cGlobal::setup()
         powderthresh = -30000;
         for (long i = 0; i < nDetectors; i++) {
             detector[i].cmModule = 0;
+            detector[i].cmEstimator = CM_ESTIMATOR_NONE;
             detector[i].cspadSubtractUnbondedPixels = 0;
             detector[i].useDarkcalSubtraction = 1;
             detector[i].useAutoHotPixel = 0;
@@ -602,30 +663,21 @@ void cGlobal::setup()
         int spectrumLength = espectrumLength;
 
         for (long i = 0; i < nPowderClasses; i++) {
-            espectrumStackCounter[i] = 0;
-            espectrumStack[i] = (float *) calloc(espectrumStackSize * spectrumLength, sizeof(float));
-            for (long j = 0; j < espectrumStackSize * spectrumLength; j++) {
-                espectrumStack[i][j] = 0;
-            }
-            pthread_mutex_init(&espectrumStack_mutex[i], NULL);
+            espectrumStack[i].setup(&stackWriter, spectrumLength, espectrumStackSize);
         }
         printf("Spectral stack allocated\n");
+        setupSpectrumProjection(self);
     }
     if (useFEEspectrum) {
         printf("Allocating FEE spectrum stacks of width %lix%li\n", FEEspectrumWidth, FEEspectrumStackSize);
         for (long i = 0; i < nPowderClasses; i++) {
-            FEEspectrumStackCounter[i] = 0;
-            FEEspectrumStack[i] = (float *) calloc(FEEspectrumStackSize * FEEspectrumWidth, sizeof(float));
-            pthread_mutex_init(&FEEspectrumStack_mutex[i], NULL);
+            FEEspectrumStack[i].setup(&stackWriter, FEEspectrumWidth, FEEspectrumStackSize);
         }
     }
     if (useTimeTool) {
         printf("Allocating TimeTool stacks\n");
         for (long i = 0; i < nPowderClasses; i++) {
-            TimeToolStackCounter[i] = 0;
-            //TimeToolStack[i] = (float *) calloc(TimeToolStackSize*TimeToolStackWidth, sizeof(float));
-            TimeToolStack[i] = (float *) malloc(TimeToolStackSize * TimeToolStackWidth * sizeof(float));
-            pthread_mutex_init(&TimeToolStack_mutex[i], NULL);
+            TimeToolStack[i].setup(&stackWriter, TimeToolStackWidth, TimeToolStackSize);
         }
     }
 
@@ -642,7 +694,8 @@ void cGlobal::setup()
         TimeToolLogfp[i] = NULL;
         if (runNumber > 0) {
             sprintf(filename, "r%04u-class%ld-log.txt", runNumber, i);
-            powderlogfp[i] = fopen(filename, "w");
+            if (!binaryLogs)
+                powderlogfp[i] = fopen(filename, "w");
             sprintf(filename, "r%04u-class%ld.lst", runNumber, i);
             framelist[i] = fopen(filename, "w");
             sprintf(filename, "r%04u-FEEspectrum-class%ld-index.txt", runNumber, i);
@@ -650,9 +703,52 @@ void cGlobal::setup()
             sprintf(filename, "r%04u-TimeTool-class%ld-index.txt", runNumber, i);
             TimeToolLogfp[i] = fopen(filename, "w");
         }
+        setStackOutput(self, i);
     }
     pthread_mutex_unlock(&powderfp_mutex);
 
+    /*
+     *  Shared memory live view (of the hitfinder detector)
+     */
+    if (useLiveView) {
+        // Each shard of a multi-process run publishes its own segment instead of truncating the others'
+        if (nRunShards > 1) {
+            char shardSuffix[32];
+            snprintf(shardSuffix, sizeof(shardSuffix), "-%ld", runShard);
+            strncat(liveViewName, shardSuffix, MAX_FILENAME_LENGTH - strlen(liveViewName) - 1);
+        }
+        liveViewDetIndex = (hitfinderDetIndex >= 0) ? hitfinderDetIndex : 0;
+        cPixelDetectorCommon *det = &detector[liveViewDetIndex];
+        if (liveView.setup(liveViewName, liveViewSlots, liveViewMaxPeaks, liveViewBinning, liveViewDetIndex, det->pix_nn,
+                           det->pix_x, det->pix_y, det->pix_r, det->image_nx, det->image_ny, det->radial_nn, nPowderClasses) != 0)
+            useLiveView = 0;
+    }
+
+    /*
+     *  CrystFEL stream of the peaks found by the hitfinder
+     */
+    if (saveStream) {
+        if (hitfinderDetIndex < 0) {
+            printf("saveStream needs hitfinderDetectorID to be a pixel detector, turning it off\n");
+            saveStream = 0;
+        }
+        else if (hitfinderAlgorithm != 3 && hitfinderAlgorithm != 6 && hitfinderAlgorithm != 8 && hitfinderAlgorithm != 14) {
+            printf("saveStream needs a peakfinding hitfinderAlgorithm (3, 6, 8 or 14), turning it off\n");
+            saveStream = 0;
+        }
+        else {
+            if (streamFile[0] == 0) {
+                if (runNumber > 0)
+                    sprintf(streamFile, "r%04u.stream", runNumber);
+                else
+                    strcpy(streamFile, "cheetah.stream");
+            }
+            if (streamWriter.setup(streamFile, streamGeometry, &detector[hitfinderDetIndex]) != 0) {
+                printf("Aborting...\n");
+                exit(1);
+            }
+        }
+    }
 }
 
 void cGlobal::unlockMutexes(void)
@@ -683,12 +779,6 @@ void cGlobal::unlockMutexes(void)
 
     nCXIEvents = 0;
     nCXIHits = 0;
-    for (long i = 0; i < nPowderClasses; i++) {
-        pthread_mutex_unlock (&espectrumStack_mutex[i]);
-        pthread_mutex_unlock (&FEEspectrumStack_mutex[i]);
-        pthread_mutex_unlock (&TimeToolStack_mutex[i]);
-    }
-
     nActiveCheetahThreads = 0;
 }
 
@@ -1216,6 +1306,18 @@ int cGlobal::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "powdersumblanks")) {
         powderSumBlanks = atoi(value);
     }
+    else if (!strcmp(tag, "binarylogs")) {
+        binaryLogs = atoi(value);
+    }
+    else if (!strcmp(tag, "savestream")) {
+        saveStream = atoi(value);
+    }
+    else if (!strcmp(tag, "streamfile")) {
+        strcpy(streamFile, value);
+    }
+    else if (!strcmp(tag, "streamgeometry")) {
+        strcpy(streamGeometry, value);
+    }
     else if (!strcmp(tag, "powdersumwithbackgroundsubtraction")) {
         printf("The keyword powdersumwithbackgroundsubtraction is deprecated.\n"
                 "Please use respective keywords in the detector section (e.g. savepowderdatadetectorandphotoncorrected=1).\n"
@@ -1284,6 +1386,9 @@ int cGlobal::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "hitfinderresolutionunitpixel")) {
         hitfinderResolutionUnitPixel = atoi(value);
     }
+    else if (!strcmp(tag, "geometrywavelengthtolerance")) {
+        geometryWavelengthTolerance = atof(value);
+    }
     else if (!strcmp(tag, "hitfinderminsnr")) {
         hitfinderMinSNR = atof(value);
     }
@@ -1293,6 +1398,54 @@ int cGlobal::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "hitfinderfastscan")) {
         hitfinderFastScan = atoi(value);
     }
+    else if (!strcmp(tag, "hitfinderprescreen")) {
+        hitfinderPrescreen = atoi(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreenbinning")) {
+        hitfinderPrescreenBinning = atol(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreenshells")) {
+        hitfinderPrescreenShells = atol(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreensubsample")) {
+        hitfinderPrescreenSubsample = atol(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreenadc")) {
+        hitfinderPrescreenADC = atof(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreennsigma")) {
+        hitfinderPrescreenNsigma = atof(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreenminbins")) {
+        hitfinderPrescreenMinBins = atol(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreenlearnframes")) {
+        hitfinderPrescreenLearnFrames = atol(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreenauditinterval")) {
+        hitfinderPrescreenAuditInterval = atol(value);
+    }
+    else if (!strcmp(tag, "hitfinderprescreenskipblanksums")) {
+        hitfinderPrescreenSkipBlankSums = atoi(value);
+    }
+    else if (!strcmp(tag, "liveview")) {
+        useLiveView = atoi(value);
+    }
+    else if (!strcmp(tag, "liveviewname")) {
+        strcpy(liveViewName, value);
+    }
+    else if (!strcmp(tag, "liveviewslots")) {
+        liveViewSlots = atol(value);
+    }
+    else if (!strcmp(tag, "liveviewmaxpeaks")) {
+        liveViewMaxPeaks = atol(value);
+    }
+    else if (!strcmp(tag, "liveviewbinning")) {
+        liveViewBinning = atol(value);
+    }
+    else if (!strcmp(tag, "liveviewpowderinterval")) {
+        liveViewPowderInterval = atol(value);
+    }
     else if (!strcmp(tag, "selfdarkmemory")) {
         printf("The keyword selfDarkMemory has been changed.  It is\n"
                 "now known as bgMemory.\n"
@@ -1329,6 +1482,16 @@ int cGlobal::parseConfigTag(char *tag, char *value)
         cxiFlushPeriod = atoi(value);
     } else if (!strcmp(tag, "cxiswmr")) {
         cxiSWMR = atoi(value);
+    } else if (!strcmp(tag, "cxishards")) {
+        cxiShards = atoi(value);
+        if(cxiShards < 1)
+            cxiShards = 1;
+        if(cxiShards > MAX_CXI_SHARDS) {
+            printf("cxiShards=%li is more than the maximum of %i, using %i\n", cxiShards, MAX_CXI_SHARDS, MAX_CXI_SHARDS);
+            cxiShards = MAX_CXI_SHARDS;
+        }
+    } else if (!strcmp(tag, "cxisharddirs")) {
+        strcpy(cxiShardDirs, value);
     } else if (!strcmp(tag, "ignoreconversionoverflow")) {
         ignoreConversionOverflow = atoi(value);
     } else if (!strcmp(tag, "ignoreconversiontruncate")) {
@@ -1437,13 +1600,34 @@ void cGlobal::writeConfigurationLog(void)
     fprintf(fp, "hitfinderMinRes=%f\n", hitfinderMinRes);
     fprintf(fp, "hitfinderMaxRes=%f\n", hitfinderMaxRes);
     fprintf(fp, "hitfinderResolutionUnitPixel=%i\n", hitfinderResolutionUnitPixel);
+    fprintf(fp, "geometryWavelengthTolerance=%f\n", geometryWavelengthTolerance);
     fprintf(fp, "hitfinderMinSNR=%f\n", hitfinderMinSNR);
+    fprintf(fp, "hitfinderPrescreen=%d\n", hitfinderPrescreen);
+    fprintf(fp, "hitfinderPrescreenBinning=%ld\n", hitfinderPrescreenBinning);
+    fprintf(fp, "hitfinderPrescreenShells=%ld\n", hitfinderPrescreenShells);
+    fprintf(fp, "hitfinderPrescreenSubsample=%ld\n", hitfinderPrescreenSubsample);
+    fprintf(fp, "hitfinderPrescreenADC=%f\n", hitfinderPrescreenADC);
+    fprintf(fp, "hitfinderPrescreenNsigma=%f\n", hitfinderPrescreenNsigma);
+    fprintf(fp, "hitfinderPrescreenMinBins=%ld\n", hitfinderPrescreenMinBins);
+    fprintf(fp, "hitfinderPrescreenLearnFrames=%ld\n", hitfinderPrescreenLearnFrames);
+    fprintf(fp, "hitfinderPrescreenAuditInterval=%ld\n", hitfinderPrescreenAuditInterval);
+    fprintf(fp, "hitfinderPrescreenSkipBlankSums=%d\n", hitfinderPrescreenSkipBlankSums);
+    fprintf(fp, "liveView=%d\n", useLiveView);
+    fprintf(fp, "liveViewName=%s\n", liveViewName);
+    fprintf(fp, "liveViewSlots=%ld\n", liveViewSlots);
+    fprintf(fp, "liveViewMaxPeaks=%ld\n", liveViewMaxPeaks);
+    fprintf(fp, "liveViewBinning=%ld\n", liveViewBinning);
+    fprintf(fp, "liveViewPowderInterval=%ld\n", liveViewPowderInterval);
     fprintf(fp, "hitlist=%s\n", hitlistFile);
     fprintf(fp, "peakmask=%s\n", peaksearchFile);
     fprintf(fp, "powderThresh=%f\n", powderthresh);
     fprintf(fp, "powderSumHits=%d\n", powderSumHits);
     fprintf(fp, "powderSumBlanks=%d\n", powderSumBlanks);
     fprintf(fp, "saveInterval=%d\n", saveInterval);
+    fprintf(fp, "binaryLogs=%d\n", binaryLogs);
+    fprintf(fp, "saveStream=%d\n", saveStream);
+    fprintf(fp, "streamFile=%s\n", streamFile);
+    fprintf(fp, "streamGeometry=%s\n", streamGeometry);
     fprintf(fp, "saveRadialStacks=%d\n", saveRadialStacks);
     fprintf(fp, "radialStackSize=%ld\n", radialStackSize);
     fprintf(fp, "saveHits=%d\n", saveHits);
@@ -1507,6 +1691,13 @@ void cGlobal::writeConfigurationLog(void)
         fprintf(fp, "cmStop=%d\n", detector[i].cmStop);
         fprintf(fp, "cmThreshold=%f\n", detector[i].cmThreshold);
         fprintf(fp, "cmRange=%f\n", detector[i].cmRange);
+        fprintf(fp, "cmRegion=%d\n", detector[i].cmRegion);
+        fprintf(fp, "cmEstimator=%d\n", detector[i].cmEstimator);
+        fprintf(fp, "cmBankWidth=%ld\n", detector[i].cmBankWidth);
+        fprintf(fp, "cmHistogramSpan=%ld\n", detector[i].cmHistogramSpan);
+        fprintf(fp, "cmIncludeMask=%d\n", detector[i].cmIncludeMask);
+        fprintf(fp, "cmExcludeMask=%d\n", detector[i].cmExcludeMask);
+        fprintf(fp, "cmThreads=%d\n", detector[i].cmThreads);
         fprintf(fp, "subtractBehindWires=%d\n", detector[i].cspadSubtractBehindWires);
         fprintf(fp, "subtractUnbondedPixels=%d\n", detector[i].cspadSubtractUnbondedPixels);
         fprintf(fp, "gaincal=%s\n", detector[i].gaincalFile);
@@ -1600,19 +1791,30 @@ void cGlobal::writeInitialLog(void)
     fprintf(fp, ">-------- Start of job --------<\n");
     fclose(fp);
 
-    // Open a new frame file at the same time
-    pthread_mutex_lock (&framefp_mutex);
-
-    sprintf(framefile, "frames.txt");
-    framefp = fopen(framefile, "w");
-    if (framefp == NULL) {
-        printf("Error: Can not open %s for writing\n", framefile);
+    // Frame and peak logs in binary form instead (see log.cpp), cleaned.txt stays text
+    framefp = NULL;
+    peaksfp = NULL;
+    if (binaryLogs && openColumnLogs(this)) {
         printf("Aborting...");
         exit(1);
     }
 
-    fprintf(framefp,
-            "# eventData->eventName, eventData->filename, eventData->stackSlice, eventData->xtcFrameNumber, eventData->hit, eventData->powderClass, eventData->hitScore, eventData->photonEnergyeV, eventData->wavelengthA, eventData->gmd1, eventData->gmd2, eventData->detector[0].detectorZ, eventData->energySpectrumExist,  eventData->nPeaks, eventData->peakNpix, eventData->peakTotal, eventData->peakResolution, eventData->peakDensity, eventData->pumpLaserCode, eventData->pumpLaserDelay, eventData->pumpLaserOn\n");
+    // Open a new frame file at the same time
+    pthread_mutex_lock (&framefp_mutex);
+
+    if (!binaryLogs) {
+        sprintf(framefile, "frames.txt");
+        framefp = fopen(framefile, "w");
+        if (framefp == NULL) {
+            printf("Error: Can not open %s for writing\n", framefile);
+            printf("Aborting...");
+            exit(1);
+        }
+
+        fprintf(framefp,
+                "# eventData->eventName, eventData->filename, eventData->stackSlice, eventData->xtcFrameNumber, eventData->hit, eventData->powderClass, eventData->hitScore, eventData->photonEnergyeV, eventData->wavelengthA, eventData->gmd1, eventData->gmd2, eventData->detector[0].detectorZ, eventData->energySpectrumExist,  eventData->nPeaks, eventData->peakNpix, eventData->peakTotal, eventData->peakResolution, eventData->peakDensity, eventData->pumpLaserCode, eventData->pumpLaserDelay, eventData->pumpLaserOn%s\n",
+                strcmp(facility, "EuXFEL") == 0 ? ", nGainStage0, nGainStage1, nGainStage2, nBadPixels" : "");
+    }
 
     sprintf(cleanedfile, "cleaned.txt");
     cleanedfp = fopen(cleanedfile, "w");
@@ -1624,17 +1826,19 @@ void cGlobal::writeInitialLog(void)
     fprintf(cleanedfp, "# Filename, frameNumber, nPeaks, nPixels, totalIntensity, peakResolution, peakResolutionA, peakDensity\n");
     pthread_mutex_unlock(&framefp_mutex);
 
-    pthread_mutex_lock (&peaksfp_mutex);
-    sprintf(peaksfile, "peaks.txt");
-    peaksfp = fopen(peaksfile, "w");
-    if (peaksfp == NULL) {
-        printf("Error: Can not open %s for writing\n", peaksfile);
-        printf("Aborting...");
-        exit(1);
+    if (!binaryLogs) {
+        pthread_mutex_lock (&peaksfp_mutex);
+        sprintf(peaksfile, "peaks.txt");
+        peaksfp = fopen(peaksfile, "w");
+        if (peaksfp == NULL) {
+            printf("Error: Can not open %s for writing\n", peaksfile);
+            printf("Aborting...");
+            exit(1);
+        }
+        fprintf(peaksfp,
+                "# frameNumber, eventName, photonEnergyEv, wavelengthA, GMD, peak_index, peak_x_raw, peak_y_raw, peak_r_assembled, peak_q, peak_resA, nPixels, totalIntensity, maxIntensity, sigmaBG, SNR\n");
+        pthread_mutex_unlock(&peaksfp_mutex);
     }
-    fprintf(peaksfp,
-            "# frameNumber, eventName, photonEnergyEv, wavelengthA, GMD, peak_index, peak_x_raw, peak_y_raw, peak_r_assembled, peak_q, peak_resA, nPixels, totalIntensity, maxIntensity, sigmaBG, SNR\n");
-    pthread_mutex_unlock(&peaksfp_mutex);
 
 }
 
@@ -1684,9 +1888,13 @@ void cGlobal::updateLogfile(void)
 
     printf("Flushing file buffers\n");
     fflush (stdout);
-    fflush (framefp);
+    if (framefp != NULL)
+        fflush (framefp);
     fflush (cleanedfp);
-    fflush (peaksfp);
+    if (peaksfp != NULL)
+        fflush (peaksfp);
+    frameLog.flush();
+    peakLog.flush();
     
     
     // Report on overall timing
@@ -1734,6 +1942,9 @@ void cGlobal::writeStatus(const char* message)
     fprintf(fp, "Status: %s\n", message);
     fprintf(fp, "Frames processed: %li\n", nprocessedframes);
     fprintf(fp, "Number of hits: %li\n", nhits);
+    timeProfile.reportStages(fp);
+    if (hitfinderPrescreen)
+        hitPrescreen.report(fp);
     fclose(fp);
 }
 
@@ -1803,6 +2014,9 @@ void cGlobal::writeFinalLog(void)
     fprintf(fp, "Average data rate: %2.2f MB/sec\n", mbs);
     fprintf(fp, "Average photon energy: %7.2f	eV\n", meanPhotonEnergyeV);
     fprintf(fp, "Photon energy sigma: %5.2f eV\n", photonEnergyeVSigma);
+    timeProfile.reportStages(fp);
+    if (hitfinderPrescreen)
+        hitPrescreen.report(fp);
     fprintf(fp, "Cheetah clean exit\n");
     fprintf(fp, ">-------- Cheetah exit --------<\n");
     fclose(fp);
@@ -1814,6 +2028,8 @@ void cGlobal::writeFinalLog(void)
         fclose (cleanedfp);
     if (peaksfp != NULL)
         fclose (peaksfp);
+    frameLog.close();
+    peakLog.close();
 
     for (long i = 0; i < nPowderClasses; i++) {
         if (powderlogfp[i] != NULL)
@@ -1830,7 +2046,14 @@ void cGlobal::writeFinalLog(void)
 
 /*
  *	Read in list of hits from text file
+ *	Lines of 2 or 3 integers are trainID, pulseID and cellID (any cell if not given), anything else is an event name
  */
+static uint64_t hitlistKey(uint64_t trainID, uint64_t pulseID, long cellID)
+{
+    uint64_t cell = (cellID < 0) ? 0xFFF : (cellID & 0xFFF);
+    return (trainID << 24) | ((pulseID & 0xFFF) << 12) | cell;
+}
+
 void cGlobal::readHits(char *filename)
 {
 
@@ -1847,17 +2070,61 @@ void cGlobal::readHits(char *filename)
         return;
     }
 
+    hitlistNames.clear();
+    hitlistPulses.clear();
+    hitlistTrainPulses.clear();
+
     std::string line;
     while (true) {
         std::getline(infile, line);
         if (infile.fail())
             break;
-        if (line[0] != '#') {
-            hitlist.push_back(line);
+        if (line.size() > 0 && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::string ids = line;
+        std::replace(ids.begin(), ids.end(), ',', ' ');
+        unsigned long long train, pulse;
+        long cell;
+        int n = -1;
+        bool isPulse = (sscanf(ids.c_str(), "%llu %llu %ld %n", &train, &pulse, &cell, &n) == 3 && n == (int) ids.size());
+        if (!isPulse) {
+            cell = -1;
+            n = -1;
+            isPulse = (sscanf(ids.c_str(), "%llu %llu %n", &train, &pulse, &n) == 2 && n == (int) ids.size());
+        }
+        if (isPulse) {
+            hitlistPulses.insert(hitlistKey(train, pulse, cell));
+            hitlistTrainPulses.insert(hitlistKey(train, pulse, -1));
+        }
+        else {
+            hitlistNames.insert(line);
         }
     }
 
-    std::cout << "\tList contained " << hitlist.size() << " hits." << std::endl;
+    useHitlist = 1;
+    std::cout << "\tList contained " << hitlistNames.size() + hitlistPulses.size() << " hits." << std::endl;
+}
+
+/*
+ *	Is this event in the hit list?
+ */
+bool cGlobal::hitlistContains(const char *eventName)
+{
+    return hitlistNames.count(eventName) > 0;
+}
+
+/*
+ *	cellID < 0 matches any cell (for frontends that check before reading the frame)
+ */
+bool cGlobal::hitlistContains(uint64_t trainID, uint64_t pulseID, long cellID)
+{
+    if (cellID < 0)
+        return hitlistTrainPulses.count(hitlistKey(trainID, pulseID, -1)) > 0;
+    return hitlistPulses.count(hitlistKey(trainID, pulseID, cellID)) > 0 ||
+           hitlistPulses.count(hitlistKey(trainID, pulseID, -1)) > 0;
 }
 
 template< typename T > void cGlobal::splitList(char * values, std::vector< T > & elems)
@@ -1891,5 +2158,45 @@ void cGlobal::freeMemory()
     pthread_mutex_destroy (&saveCXI_mutex);
     pthread_mutex_destroy (&saveinterval_mutex);
     pthread_mutex_destroy (&saveSynchronisation_mutex);
+    for(long i=0; i<MAX_CXI_SHARDS; i++)
+        pthread_mutex_destroy (&cxiShard_mutex[i]);
+
+}
+
 
+/*
+ *	Multi-process runs: parse a shard specification "i/N" (0 <= i < N)
+ */
+int cGlobal::setRunShard(const char *spec)
+{
+    long    i, n;
+    if(sscanf(spec, "%ld/%ld", &i, &n) != 2 || n < 1 || i < 0 || i >= n) {
+        printf("Invalid shard specification: %s (expected i/N with 0 <= i < N)\n", spec);
+        return 1;
+    }
+    runShard = i;
+    nRunShards = n;
+    printf("Processing shard %li of %li\n", runShard, nRunShards);
+    return 0;
+}
+
+/*
+ *	Units (tags, files...) [first, last) of a run of nUnits handled by our shard
+ *	Shard i takes the contiguous range [i*nUnits/N, (i+1)*nUnits/N), so the shards in order cover the run in order.
+ */
+void cGlobal::runShardRange(long nUnits, long *first, long *last)
+{
+    *first = 0;
+    *last = nUnits;
+    if(nRunShards > 1) {
+        *first = (runShard*nUnits) / nRunShards;
+        *last = ((runShard+1)*nUnits) / nRunShards;
+    }
+}
+
+bool cGlobal::inRunShard(long unit, long nUnits)
+{
+    long    first, last;
+    runShardRange(nUnits, &first, &last);
+    return (unit >= first && unit < last);
 }
@@ -132,7 +132,6 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	float		histBinSize = global->detector[detIndex].histogramBinSize;
 	long		hist_nfs = global->detector[detIndex].histogram_nfs;
 	long		hist_nss = global->detector[detIndex].histogram_nss;
-	long		hist_nn = global->detector[detIndex].histogram_nn;
 	uint64_t	hist_nnn = global->detector[detIndex].histogram_nnn;
 	uint16_t	*histData = global->detector[detIndex].histogramData;
 	float		*darkcal = global->detector[detIndex].darkcal;
@@ -160,11 +159,27 @@ void saveHistogram(cGlobal *global, int detIndex) {
     
 	
 
+	char	filename[1024];
+	sprintf(filename,"r%04u-detector%d-histogram.h5", global->runNumber, detIndex);
+	printf("Writing histogram data to file: %s\n",filename);
+	writeHistogramFile(filename, histogramBuffer, hist_count, hist_nss, hist_nfs, histNbins, histMin, histBinSize, darkcal, global->h5compress);
+
+    free(histogramBuffer);
+}
+
+
+/*
+ *	Write histograms and per-pixel statistics to file
+ *	(also used by cheetah-merge to write the sum of histograms from several run shards)
+ */
+void writeHistogramFile(const char *filename, uint16_t *histogramBuffer, long hist_count, long hist_nss, long hist_nfs, long histNbins, long histMin, float histBinSize, float *darkcal, int h5compress) {
+
+	long		hist_nn = hist_nss*hist_nfs;
+
     /*
 	 *	Mess of stuff for writing the HDF5 file
      *  (OK to open HDF5 file outside the mutex lock)
 	 */
-	char	filename[1024];
 	hid_t fh, gh, sh, dh;	/* File, group, dataspace and data handles */
 	hsize_t		size[3];
 	hsize_t		max_size[3];
@@ -172,8 +187,6 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	hid_t		h5compression;
 
     
-	sprintf(filename,"r%04u-detector%d-histogram.h5", global->runNumber, detIndex);
-	printf("Writing histogram data to file: %s\n",filename);
 	
 	fh = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
 	if ( fh < 0 ) {
@@ -185,7 +198,7 @@ void saveHistogram(cGlobal *global, int detIndex) {
 		H5Fclose(fh);
 	}
 	
-	if (global->h5compress) {
+	if (h5compress) {
 		h5compression = H5Pcreate(H5P_DATASET_CREATE);
 		//H5Pset_chunk(h5compression, 2, chunksize);
 		//H5Pset_deflate(h5compression, 3);		// Compression levels are 0 (none) to 9 (max)
@@ -210,7 +223,7 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	chunk[0] = 1;
 	chunk[1] = hist_nfs;
 	chunk[2] = histNbins;
-	if (global->h5compress) {
+	if (h5compress) {
 		H5Pset_chunk(h5compression, 3, chunk);
 		//H5Pset_shuffle(h5compression);			// De-interlace bytes
 		H5Pset_deflate(h5compression, 1);		// Compression levels are 0 (none) to 9 (max)
@@ -323,7 +336,7 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	max_size[1] = hist_nfs;
 	sh = H5Screate_simple(2, size, max_size);
 
-	if (global->h5compress) {
+	if (h5compress) {
 		H5Pset_chunk(h5compression, 2, size);
 		//H5Pset_shuffle(h5compression);			// De-interlace bytes
 		H5Pset_deflate(h5compression, 3);		// Compression levels are 0 (none) to 9 (max)
@@ -412,7 +425,6 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	/*
 	 *	Release memory (very important because the histogram array is big!)
 	 */
-    free(histogramBuffer);
 	free(mean_arr);
 	free(var_arr);
 	free(rVar_arr);
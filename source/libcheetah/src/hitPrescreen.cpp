@@ -0,0 +1,301 @@
+/*
+ *  hitPrescreen.cpp
+ *  cheetah
+ *
+ *  Cascaded hit pre-screen (see hitPrescreen.h)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+
+#include "detectorObject.h"
+#include "hitPrescreen.h"
+
+
+// Pixels that never count towards a bin
+static const uint16_t PRESCREEN_IGNORED_PIXELS = PIXEL_IS_INVALID | PIXEL_IS_SATURATED | PIXEL_IS_HOT | PIXEL_IS_BAD
+	| PIXEL_IS_OUT_OF_RESOLUTION_LIMITS | PIXEL_IS_MISSING;
+
+
+static bool compareRadius(const std::pair<float,long> &a, const std::pair<float,long> &b) {
+	return a.first < b.first;
+}
+
+
+cHitPrescreen::cHitPrescreen() {
+	nShells = 0;
+	binning = 4;
+	subsample = 4;
+	learnFrames = 100;
+	auditInterval = 50;
+	pix_nx = 0;
+	pix_ny = 0;
+	nbx = 0;
+	nby = 0;
+	binShell = NULL;
+
+	baselineN = 0;
+	memset(baselineMean, 0, sizeof(baselineMean));
+	memset(baselineVar, 0, sizeof(baselineVar));
+
+	nScreened = 0;
+	nVetoSubsampled = 0;
+	nVetoBinned = 0;
+	nPassed = 0;
+	nPassedHits = 0;
+	nLearning = 0;
+	nAudited = 0;
+	nAuditVetoHit = 0;
+	nAuditVetoBlank = 0;
+	nAuditPassHit = 0;
+	nAuditPassBlank = 0;
+
+	pthread_mutex_init(&mutex, NULL);
+}
+
+cHitPrescreen::~cHitPrescreen() {
+	free(binShell);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+/*
+ *	Assign bins to radial shells
+ *	Shells are quantiles of the bin radius, so every shell holds the same number of bins whatever the detector geometry
+ */
+void cHitPrescreen::setup(long pix_nx0, long pix_ny0, float *pix_r, long binning0, long nShells0, long subsample0, long learnFrames0, long auditInterval0) {
+	pix_nx = pix_nx0;
+	pix_ny = pix_ny0;
+	binning = std::max(binning0, 1L);
+	nShells = std::min(std::max(nShells0, 1L), (long) MAX_PRESCREEN_SHELLS);
+	subsample = std::max(subsample0, 1L);
+	learnFrames = std::max(learnFrames0, 1L);
+	auditInterval = std::max(auditInterval0, 0L);
+
+	nbx = (pix_nx + binning - 1) / binning;
+	nby = (pix_ny + binning - 1) / binning;
+	long nBins = nbx*nby;
+
+	// Mean radius of each bin
+	std::vector<double> rsum(nBins, 0);
+	std::vector<long> rcount(nBins, 0);
+	for(long y=0; y<pix_ny; y++) {
+		for(long x=0; x<pix_nx; x++) {
+			long b = (y/binning)*nbx + x/binning;
+			rsum[b] += pix_r[y*pix_nx + x];
+			rcount[b]++;
+		}
+	}
+	std::vector< std::pair<float,long> > radius;
+	for(long b=0; b<nBins; b++) {
+		if(rcount[b] > 0)
+			radius.push_back(std::make_pair((float) (rsum[b]/rcount[b]), b));
+	}
+	std::sort(radius.begin(), radius.end(), compareRadius);
+
+	free(binShell);
+	binShell = (int*) malloc(nBins*sizeof(int));
+	for(long b=0; b<nBins; b++)
+		binShell[b] = -1;
+	long n = radius.size();
+	for(long i=0; i<n; i++)
+		binShell[radius[i].second] = (int) (i*nShells/n);
+
+	printf("Hit pre-screen: %li x %li bins of %li x %li pixels in %li radial shells, stage 1 uses every %li%s row of bins\n",
+		   nbx, nby, binning, binning, nShells, subsample, subsample == 1 ? "st" : "th");
+}
+
+
+/*
+ *	Maximum of each bin along one row of bins, then count bins above threshold per shell
+ *	(the bin maximum keeps Bragg peaks visible where a bin mean would dilute them)
+ */
+void cHitPrescreen::countBinRow(float *data, uint16_t *pixelmask, float adcThreshold, long by, long *counts, float *binmax) {
+	for(long bx=0; bx<nbx; bx++)
+		binmax[bx] = -1e30f;
+
+	long y1 = std::min((by+1)*binning, pix_ny);
+	for(long y=by*binning; y<y1; y++) {
+		float		*row = data + y*pix_nx;
+		uint16_t	*mrow = pixelmask + y*pix_nx;
+		for(long x=0; x<pix_nx; x++) {
+			if(mrow[x] & PRESCREEN_IGNORED_PIXELS)
+				continue;
+			long bx = x/binning;
+			if(row[x] > binmax[bx])
+				binmax[bx] = row[x];
+		}
+	}
+
+	int	*shell = binShell + by*nbx;
+	for(long bx=0; bx<nbx; bx++) {
+		if(shell[bx] >= 0 && binmax[bx] > adcThreshold)
+			counts[shell[bx]]++;
+	}
+}
+
+
+/*
+ *	Number of bins above the learned blank baseline, summed over shells
+ */
+float cHitPrescreen::excess(int view, long *counts, float nSigma) {
+	float	result = 0;
+	for(long s=0; s<nShells; s++) {
+		double sigma = sqrt(baselineVar[view][s]);
+		if(sigma < 1)
+			sigma = 1;
+		double e = counts[s] - (baselineMean[view][s] + nSigma*sigma);
+		if(e > 0)
+			result += e;
+	}
+	return result;
+}
+
+
+/*
+ *	Screen one frame
+ *	Until enough blanks have been learned, and for every auditInterval'th frame afterwards, the decision is only
+ *	recorded and the frame still goes through the full path (result->audit), so agreement can be measured.
+ */
+void cHitPrescreen::screen(float *data, uint16_t *pixelmask, float adcThreshold, float nSigma, long minBins, tHitPrescreenResult *result) {
+
+	result->screened = 1;
+	result->decision = PASS;
+	result->audit = 0;
+	result->learning = 0;
+	result->score = 0;
+	result->nShells = nShells;
+	memset(result->countsSubsampled, 0, sizeof(result->countsSubsampled));
+	memset(result->countsBinned, 0, sizeof(result->countsBinned));
+
+	pthread_mutex_lock(&mutex);
+	long	frame = nScreened++;
+	bool	trained = (baselineN >= learnFrames);
+	if(!trained || (auditInterval > 0 && (frame % auditInterval) == 0))
+		result->audit = 1;
+	if(!trained)
+		result->learning = 1;
+	pthread_mutex_unlock(&mutex);
+
+	float	*binmax = (float*) malloc(nbx*sizeof(float));
+
+	// Stage 1: subsampled rows of bins
+	for(long by=0; by<nby; by+=subsample)
+		countBinRow(data, pixelmask, adcThreshold, by, result->countsSubsampled, binmax);
+
+	pthread_mutex_lock(&mutex);
+	float e1 = excess(0, result->countsSubsampled, nSigma);
+	pthread_mutex_unlock(&mutex);
+	result->score = e1*subsample;
+
+	// Skip stage 2 only when the decision is going to be applied (audited frames need the full binned counts to learn from)
+	if(trained && result->score < 0.5*minBins) {
+		result->decision = VETO_SUBSAMPLED;
+		if(!result->audit) {
+			free(binmax);
+			pthread_mutex_lock(&mutex);
+			nVetoSubsampled++;
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+	}
+
+	// Stage 2: complete the binned view
+	for(long s=0; s<nShells; s++)
+		result->countsBinned[s] = result->countsSubsampled[s];
+	for(long by=0; by<nby; by++) {
+		if(by % subsample != 0)
+			countBinRow(data, pixelmask, adcThreshold, by, result->countsBinned, binmax);
+	}
+	free(binmax);
+
+	if(result->decision == PASS) {
+		pthread_mutex_lock(&mutex);
+		float e2 = excess(1, result->countsBinned, nSigma);
+		pthread_mutex_unlock(&mutex);
+		result->score = e2;
+		if(trained && e2 < minBins)
+			result->decision = VETO_BINNED;
+	}
+
+	if(result->decision == VETO_BINNED && !result->audit) {
+		pthread_mutex_lock(&mutex);
+		nVetoBinned++;
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+
+/*
+ *	Book the full-path result of a frame that was not vetoed (passed or audited)
+ *	Blanks among audited frames update the baselines: audits are an unbiased sample, passed frames are not
+ */
+void cHitPrescreen::recordOutcome(tHitPrescreenResult *result, int fullPathHit) {
+	if(!result->screened)
+		return;
+
+	pthread_mutex_lock(&mutex);
+	if(result->audit) {
+		if(result->learning) {
+			nLearning++;
+		}
+		else {
+			nAudited++;
+			if(result->decision != PASS) {
+				if(fullPathHit) nAuditVetoHit++;
+				else nAuditVetoBlank++;
+			}
+			else {
+				if(fullPathHit) nAuditPassHit++;
+				else nAuditPassBlank++;
+			}
+		}
+
+		if(!fullPathHit) {
+			// Running mean and variance, exponentially weighted once learnFrames blanks have been seen
+			baselineN += 1;
+			double w = 1.0/std::min(baselineN, (double) learnFrames);
+			for(long s=0; s<nShells; s++) {
+				for(int view=0; view<2; view++) {
+					double	x = (view == 0) ? result->countsSubsampled[s] : result->countsBinned[s];
+					double	d = x - baselineMean[view][s];
+					baselineMean[view][s] += w*d;
+					baselineVar[view][s] = (1-w)*(baselineVar[view][s] + w*d*d);
+				}
+			}
+			if(baselineN == learnFrames)
+				printf("Hit pre-screen: blank baseline learned from %li frames, vetoing from now on\n", learnFrames);
+		}
+	}
+	else {
+		nPassed++;
+		if(fullPathHit)
+			nPassedHits++;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void cHitPrescreen::report(FILE *fp) {
+	pthread_mutex_lock(&mutex);
+	long	nVetoed = nVetoSubsampled + nVetoBinned;
+	long	nAuditHits = nAuditVetoHit + nAuditPassHit;
+	fprintf(fp, "Hit pre-screen: \n");
+	fprintf(fp, "\tScreened frames: %li (%li used for learning the blank baseline)\n", nScreened, nLearning);
+	fprintf(fp, "\tVetoed: %li (%0.1f%%), %li after stage 1 (subsampled), %li after stage 2 (binned)\n",
+			nVetoed, nScreened ? 100.*nVetoed/nScreened : 0., nVetoSubsampled, nVetoBinned);
+	fprintf(fp, "\tPassed to full path: %li (%li hits)\n", nPassed, nPassedHits);
+	fprintf(fp, "\tAudited (full path regardless of pre-screen): %li (%li hits)\n", nAudited, nAuditHits);
+	if(nAudited > 0) {
+		fprintf(fp, "\tAgreement with full path: %0.2f%%\n", 100.*(nAuditVetoBlank + nAuditPassHit)/nAudited);
+		fprintf(fp, "\tFalse veto rate: %0.2f%% (%li of %li audited hits would have been vetoed)\n",
+				nAuditHits ? 100.*nAuditVetoHit/nAuditHits : 0., nAuditVetoHit, nAuditHits);
+	}
+	pthread_mutex_unlock(&mutex);
+}
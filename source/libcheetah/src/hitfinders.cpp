@@ -113,7 +113,7 @@ int hitfinder(cEventData *eventData, cGlobal *global)
             // standard conversion (4.7/4 from the C++ Standard):
             // (bool containsEvent()) ? 1 : 0
             // http://stackoverflow.com/questions/5369770/bool-to-int-conversion
-            hit = (int) containsEvent((std::string) eventData->eventname, global);
+            hit = (int) containsEvent(eventData, global);
             break;
 
         case 13: // Combine hitfinderTOF and hitfinder 1 (using both protons and photons)
@@ -285,7 +285,7 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global)
     /*
      *	Is this a potential hit?
      */
-    int hit;
+    int hit = 0;
     eventData->nPeaks = nPeaks;
     if (nPeaks >= global->hitfinderNpeaks / 2 && nPeaks <= global->hitfinderNpeaksMax / 2) {
 
@@ -302,6 +302,50 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global)
     return hit;
 }
 
+/*
+ *	Cascaded hit pre-screen (detector independent, unlike hitfinderFastScan)
+ *	Counts bins above threshold per radial shell on a binned view of data_detCorr and compares against blank baselines.
+ *	Returns 1 if the frame is vetoed as a blank, in which case the hit counters are updated here
+ *	and the worker skips background subtraction, peakfinding and (optionally) powder sums.
+ */
+int hitfinderPrescreen(cEventData *eventData, cGlobal *global, tHitPrescreenResult *result)
+{
+    result->screened = 0;
+    if (!global->hitfinderPrescreen)
+        return 0;
+
+    long detIndex = global->hitfinderDetIndex;
+    global->hitPrescreen.screen(eventData->detector[detIndex].data_detCorr, eventData->detector[detIndex].pixelmask,
+            global->hitfinderPrescreenADC, global->hitfinderPrescreenNsigma, global->hitfinderPrescreenMinBins, result);
+
+    if (result->decision == cHitPrescreen::PASS || result->audit)
+        return 0;
+
+    // Vetoed: book as a blank, as hitfinder() would
+    eventData->nPeaks = 0;
+    eventData->hitScore = result->score;
+    eventData->peakNpix = 0;
+    eventData->peakTotal = 0;
+    eventData->peakResolution = 0;
+    eventData->peakDensity = 0;
+    eventData->powderClass = 0;
+
+    pthread_mutex_lock(&global->nhits_mutex);
+    global->nhitsandblanks++;
+    pthread_mutex_unlock(&global->nhits_mutex);
+
+    return 1;
+}
+
+/*
+ *	Feed the full hitfinder result back to the pre-screen (agreement statistics and baseline learning)
+ */
+void hitfinderPrescreenOutcome(cGlobal *global, tHitPrescreenResult *result, int hit)
+{
+    if (global->hitfinderPrescreen && result->screened)
+        global->hitPrescreen.recordOutcome(result, hit);
+}
+
 /*
  *	Start of calculations for hitfinders
  */
@@ -582,13 +626,13 @@ int hitfinderProtonsandPhotons(cGlobal *global, cEventData *eventData, long detI
 }
 
 /*
- *	Check if the list of hits contains the current event
+ *	Check if the list of hits contains the current event (by name, or by train, pulse and cell for EuXFEL)
  */
-bool containsEvent(std::string event, cGlobal *global)
+bool containsEvent(cEventData *eventData, cGlobal *global)
 {
-    if (global->nhits < (long) global->hitlist.size()) {
-        return (event == global->hitlist[global->nhits]);
-    } else {
-        return false;
-    }
+    if (global->hitlistContains(eventData->eventname))
+        return true;
+    if (eventData->trainID != 0)
+        return global->hitlistContains(eventData->trainID, eventData->pulseID, eventData->cellID);
+    return false;
 }
@@ -158,6 +158,9 @@ void cheetahNewRun(cGlobal *global) {
 		usleep(500000);
 	}
     
+	// Stacks still being written flush the index logs of the old run
+	global->stackWriter.drain();
+
 	// Reset the powder log files
     pthread_mutex_lock(&global->powderfp_mutex);
 
@@ -168,8 +171,12 @@ void cheetahNewRun(cGlobal *global) {
 			sprintf(filename,"r%04u-class%ld-log.txt",global->runNumber,i);
             if(global->powderlogfp[i] != NULL)
                 fclose(global->powderlogfp[i]);
-			global->powderlogfp[i] = fopen(filename, "w");
-			fprintf(global->powderlogfp[i], "eventData->eventname, eventData->filename, eventData->stackSlice, eventData->xtcFrameNumber, eventData->hitScore, eventData->photonEnergyeV, eventData->wavelengthA, eventData->detector[0].detectorZ, eventData->gmd1, eventData->gmd2, eventData->energySpectrumExist, eventData->nPeaks, eventData->peakNpix, eventData->peakTotal, eventData->peakResolution, eventData->peakDensity, eventData->pumpLaserCode, eventData->pumpLaserDelay\n");
+			global->powderlogfp[i] = NULL;
+			// Class logs are generated from frames.bin by cheetah-logconvert
+			if(!global->binaryLogs) {
+				global->powderlogfp[i] = fopen(filename, "w");
+				fprintf(global->powderlogfp[i], "eventData->eventname, eventData->filename, eventData->stackSlice, eventData->xtcFrameNumber, eventData->hitScore, eventData->photonEnergyeV, eventData->wavelengthA, eventData->detector[0].detectorZ, eventData->gmd1, eventData->gmd2, eventData->energySpectrumExist, eventData->nPeaks, eventData->peakNpix, eventData->peakTotal, eventData->peakResolution, eventData->peakDensity, eventData->pumpLaserCode, eventData->pumpLaserDelay\n");
+			}
 
 			sprintf(filename,"r%04u-class%ld.lst",global->runNumber,i);
 			if(global->framelist[i] != NULL)
@@ -191,6 +198,7 @@ void cheetahNewRun(cGlobal *global) {
 				global->TimeToolLogfp[i] = fopen(filename, "w");
 				fprintf(global->TimeToolLogfp[i], "Stack element, eventData->frameNumber, eventDaya->stackSlice, eventData->eventname\n");
 			}
+			setStackOutput(global, i);
 		}
     }
     pthread_mutex_unlock(&global->powderfp_mutex);
@@ -282,19 +290,18 @@ void cheetahUpdateGlobal(cGlobal *global, cEventData *eventData){
          * Recalculate reciprocal space geometry if the camera length has changed, 
          */
         if ( update_camera_length && ( global->detector[detIndex].detectorZprevious != global->detector[detIndex].detectorZ ) ) {
-            // don't tinker with cheetahGlobal geometry while there are active threads...
-            while (global->nActiveCheetahThreads > 0) 
-                usleep(10000);
-            
+            // Workers keep the geometry they started with, the new one is built in the background and used by later events
             printf("Camera length changed from %gmm to %gmm.\n", global->detector[detIndex].detectorZprevious,global->detector[detIndex].detectorZ);
             if ( isnan(eventData->wavelengthA ) ) {
                 printf("MESSAGE: Bad wavelength data (NaN). Consider using defaultPhotonEnergyeV keyword.\n");
             }	
             global->detector[detIndex].detectorZprevious = global->detector[detIndex].detectorZ;
-            for(long i=0; i<global->nDetectors; i++) 
-                global->detector[detIndex].updateKspace(global, eventData->wavelengthA);
-            
-        }	
+            global->detector[detIndex].geometry.request(global, global->detector[detIndex].detectorZ, eventData->wavelengthA);
+        }
+        else if ( global->geometryWavelengthTolerance > 0 && global->detector[detIndex].detectorZprevious != 0 ) {
+            // Follow the photon energy (only rebuilds if the wavelength moved by more than the tolerance)
+            global->detector[detIndex].geometry.request(global, global->detector[detIndex].detectorZ, eventData->wavelengthA);
+        }
     }
     
     
@@ -318,7 +325,8 @@ void cheetahUpdateGlobal(cGlobal *global, cEventData *eventData){
      */
     DETECTOR_LOOP {
         eventData->detector[detIndex].detectorZ = global->detector[detIndex].detectorZ;        
-        
+        if ( eventData->detector[detIndex].geometry == NULL )
+            eventData->detector[detIndex].geometry = global->detector[detIndex].geometry.acquire();
     }
 }
 
@@ -467,6 +475,10 @@ void cheetahExit(cGlobal *global) {
      *	Sometimes the program hangs here, so wait no more than 10 minutes before exiting anyway
      */
 	global->waitForThreadsToFinish(5*60);
+	DETECTOR_LOOP
+		global->detector[detIndex].geometry.finish();
+	if(global->saveStream)
+		global->streamWriter.close();
 	
 	//time_t	tstart, tnow;
 	//time(&tstart);
@@ -490,6 +502,14 @@ void cheetahExit(cGlobal *global) {
     global->photonEnergyeVSigma = sqrt(global->summedPhotonEnergyeVSquared/global->nhitsandblanks - global->meanPhotonEnergyeV * global->meanPhotonEnergyeV);
     printf("Mean photon energy: %f eV\n", global->meanPhotonEnergyeV);
     printf("Sigma of photon energy: %f eV\n", global->photonEnergyeVSigma);
+    if(global->hitfinderPrescreen)
+        global->hitPrescreen.report(stdout);
+
+    // Final live view powder snapshot, then release the shared memory
+    if(global->useLiveView) {
+        publishLiveViewPowder(global);
+        global->liveView.close();
+    }
     
 	
     // Save powder patterns and other stuff
@@ -505,6 +525,7 @@ void cheetahExit(cGlobal *global) {
 		saveRadialStacks(global);
 	if(global->espectrum)
 		saveEspectrumStacks(global);
+	global->stackWriter.finish();
 	
 	
     global->writeFinalLog();
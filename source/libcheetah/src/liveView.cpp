@@ -0,0 +1,357 @@
+/*
+ *  liveView.cpp
+ *  cheetah
+ *
+ *  Shared memory live view (see liveView.h for the layout and protocol)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "cheetah.h"
+#include "cheetahmodules.h"
+#include "liveView.h"
+
+
+static size_t align64(size_t n) {
+	return (n + 63) & ~((size_t) 63);
+}
+
+
+cLiveView::cLiveView() {
+	enabled = 0;
+	name[0] = 0;
+	header = NULL;
+	segment = NULL;
+	segmentSize = 0;
+	pix_nn = 0;
+	thumb_nn = 0;
+	radial_nn = 0;
+	thumbIndex = NULL;
+	thumbWeight = NULL;
+	radialIndex = NULL;
+	radialWeight = NULL;
+	nClaimed = 0;
+	pthread_mutex_init(&powderMutex, NULL);
+}
+
+cLiveView::~cLiveView() {
+	close();
+	pthread_mutex_destroy(&powderMutex);
+}
+
+
+/*
+ *	Create the shared memory segment and the pixel -> thumbnail / radial bin tables
+ *	Returns 0 on success; on failure the live view stays disabled and processing carries on without it
+ */
+int cLiveView::setup(const char *name0, long nSlots, long maxPeaks, long binning, long detectorIndex,
+					 long pix_nn0, float *pix_x, float *pix_y, float *pix_r, long image_nx, long image_ny, long radial_nn0, long nPowderClasses) {
+
+	strncpy(name, name0, sizeof(name)-1);
+	pix_nn = pix_nn0;
+	radial_nn = radial_nn0;
+	if(nSlots < 1) nSlots = 1;
+	if(maxPeaks < 0) maxPeaks = 0;
+	if(binning < 1) binning = 1;
+	if(nPowderClasses > LIVEVIEW_MAX_POWDER_CLASSES) nPowderClasses = LIVEVIEW_MAX_POWDER_CLASSES;
+
+	long	thumb_nx = (image_nx + binning - 1)/binning;
+	long	thumb_ny = (image_ny + binning - 1)/binning;
+	thumb_nn = thumb_nx*thumb_ny;
+
+	// Pixel -> thumbnail bin (nearest pixel of the assembled image, as assemble2DImage), pixel -> radial bin
+	thumbIndex = (long*) malloc(pix_nn*sizeof(long));
+	thumbWeight = (float*) calloc(thumb_nn, sizeof(float));
+	radialIndex = (long*) malloc(pix_nn*sizeof(long));
+	radialWeight = (float*) calloc(radial_nn, sizeof(float));
+	for(long i=0; i<pix_nn; i++) {
+		long ix = (long) (pix_x[i] + image_nx/2. + 0.5);
+		long iy = (long) (pix_y[i] + image_nx/2. + 0.5);
+		thumbIndex[i] = -1;
+		if(ix >= 0 && ix < image_nx && iy >= 0 && iy < image_ny) {
+			thumbIndex[i] = (iy/binning)*thumb_nx + ix/binning;
+			thumbWeight[thumbIndex[i]] += 1;
+		}
+		long rbin = lrint(pix_r[i]);
+		radialIndex[i] = (rbin >= 0 && rbin < radial_nn) ? rbin : -1;
+		if(radialIndex[i] >= 0)
+			radialWeight[rbin] += 1;
+	}
+	for(long i=0; i<thumb_nn; i++)
+		thumbWeight[i] = thumbWeight[i] > 0 ? 1/thumbWeight[i] : 0;
+	for(long i=0; i<radial_nn; i++)
+		radialWeight[i] = radialWeight[i] > 0 ? 1/radialWeight[i] : 0;
+
+	// Layout
+	size_t	slotSize = align64(align64(sizeof(tLiveViewSlot)) + align64(thumb_nn*sizeof(float)) + maxPeaks*sizeof(tLiveViewPeak));
+	size_t	slotOffset = align64(sizeof(tLiveViewHeader));
+	size_t	powderOffset = slotOffset + nSlots*slotSize;
+	size_t	radialOffset = powderOffset + align64(nPowderClasses*thumb_nn*sizeof(float));
+	segmentSize = radialOffset + align64(nPowderClasses*radial_nn*sizeof(float));
+
+	// Create (or recreate) the segment
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if(fd < 0) {
+		printf("Live view: could not create shared memory %s (%s), live view disabled\n", name, strerror(errno));
+		return 1;
+	}
+	if(ftruncate(fd, 0) != 0 || ftruncate(fd, segmentSize) != 0) {
+		printf("Live view: could not size shared memory %s (%s), live view disabled\n", name, strerror(errno));
+		::close(fd);
+		shm_unlink(name);
+		return 1;
+	}
+	segment = (char*) mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(segment == MAP_FAILED) {
+		printf("Live view: could not map shared memory %s (%s), live view disabled\n", name, strerror(errno));
+		segment = NULL;
+		shm_unlink(name);
+		return 1;
+	}
+
+	header = (tLiveViewHeader*) segment;
+	header->version = LIVEVIEW_VERSION;
+	header->headerSize = sizeof(tLiveViewHeader);
+	header->segmentSize = segmentSize;
+	header->nSlots = nSlots;
+	header->maxPeaks = maxPeaks;
+	header->slotSize = slotSize;
+	header->slotOffset = slotOffset;
+	header->thumb_nx = thumb_nx;
+	header->thumb_ny = thumb_ny;
+	header->binning = binning;
+	header->nPowderClasses = nPowderClasses;
+	header->radial_nn = radial_nn;
+	header->detectorIndex = detectorIndex;
+	header->powderOffset = powderOffset;
+	header->radialOffset = radialOffset;
+	header->pid = getpid();
+	header->runNumber = 0;
+	header->state = LIVEVIEW_STATE_RUNNING;
+	__sync_synchronize();
+	memcpy(header->magic, LIVEVIEW_MAGIC, 8);
+
+	enabled = 1;
+	printf("Live view: %s, %li hit slots, %li x %li thumbnails (binning %li), %.1f MB\n",
+		   name, nSlots, thumb_nx, thumb_ny, binning, segmentSize/(1024.*1024.));
+	return 0;
+}
+
+
+tLiveViewSlot *cLiveView::slot(long i) {
+	return (tLiveViewSlot*) (segment + header->slotOffset + i*header->slotSize);
+}
+
+
+/*
+ *	Mean of the pixels in each thumbnail bin
+ */
+void cLiveView::binPixels(float *thumb, float *data) {
+	memset(thumb, 0, thumb_nn*sizeof(float));
+	for(long i=0; i<pix_nn; i++) {
+		long t = thumbIndex[i];
+		if(t >= 0)
+			thumb[t] += data[i];
+	}
+	for(long i=0; i<thumb_nn; i++)
+		thumb[i] *= thumbWeight[i];
+}
+
+
+/*
+ *	Write one hit into the next slot of the ring
+ *	Called from worker threads; a slot still being written by another worker is skipped (the hit is dropped)
+ */
+void cLiveView::publishHit(tLiveViewHitInfo *info, float *data, tPeakList *peaklist) {
+	if(!enabled)
+		return;
+
+	uint64_t	hitIndex = __sync_add_and_fetch(&nClaimed, 1);
+	tLiveViewSlot	*s = slot((hitIndex-1) % header->nSlots);
+
+	uint64_t	seq = s->sequence;
+	if((seq & 1) || !__sync_bool_compare_and_swap(&s->sequence, seq, seq+1)) {
+		__sync_fetch_and_add(&header->nDropped, 1);
+		return;
+	}
+	__sync_synchronize();
+
+	s->hitIndex = hitIndex;
+	s->frameNumber = info->frameNumber;
+	s->runNumber = info->runNumber;
+	s->trainID = info->trainID;
+	s->pulseID = info->pulseID;
+	s->cellID = info->cellID;
+	s->photonEnergyeV = info->photonEnergyeV;
+	s->wavelengthA = info->wavelengthA;
+	s->detectorZ = info->detectorZ;
+	s->hitScore = info->hitScore;
+	s->powderClass = info->powderClass;
+	strncpy(s->eventname, info->eventname, LIVEVIEW_EVENTNAME_LENGTH-1);
+	s->eventname[LIVEVIEW_EVENTNAME_LENGTH-1] = 0;
+
+	float	*thumb = (float*) ((char*) s + align64(sizeof(tLiveViewSlot)));
+	binPixels(thumb, data);
+
+	tLiveViewPeak	*peaks = (tLiveViewPeak*) ((char*) thumb + align64(thumb_nn*sizeof(float)));
+	long	nPeaks = peaklist->nPeaks;
+	long	nStored = nPeaks < (long) header->maxPeaks ? nPeaks : header->maxPeaks;
+	if(nStored > peaklist->nPeaks_max) nStored = peaklist->nPeaks_max;
+	for(long k=0; k<nStored; k++) {
+		peaks[k].fs = peaklist->peak_com_x[k];
+		peaks[k].ss = peaklist->peak_com_y[k];
+		peaks[k].x = peaklist->peak_com_x_assembled[k];
+		peaks[k].y = peaklist->peak_com_y_assembled[k];
+		peaks[k].totalIntensity = peaklist->peak_totalintensity[k];
+		peaks[k].maxIntensity = peaklist->peak_maxintensity[k];
+		peaks[k].snr = peaklist->peak_snr[k];
+		peaks[k].npix = peaklist->peak_npix[k];
+	}
+	s->nPeaks = nPeaks;
+	s->nPeaksStored = nStored;
+	header->runNumber = info->runNumber;
+
+	__sync_synchronize();
+	s->sequence = seq+2;
+	__sync_fetch_and_add(&header->nPublished, 1);
+}
+
+
+/*
+ *	Powder snapshot: beginPowderUpdate(), publishPowderClass() for each class, endPowderUpdate()
+ *	Only one worker updates the snapshot at a time, the others skip it (beginPowderUpdate returns 0)
+ */
+int cLiveView::beginPowderUpdate() {
+	if(!enabled)
+		return 0;
+	if(pthread_mutex_trylock(&powderMutex) != 0)
+		return 0;
+	header->powderSequence++;
+	__sync_synchronize();
+	return 1;
+}
+
+void cLiveView::publishPowderClass(long powderClass, double *powder, long nFrames) {
+	if(powderClass >= (long) header->nPowderClasses)
+		return;
+	float	*thumb = (float*) (segment + header->powderOffset) + powderClass*thumb_nn;
+	float	*radial = (float*) (segment + header->radialOffset) + powderClass*radial_nn;
+
+	memset(thumb, 0, thumb_nn*sizeof(float));
+	memset(radial, 0, radial_nn*sizeof(float));
+	for(long i=0; i<pix_nn; i++) {
+		if(thumbIndex[i] >= 0)
+			thumb[thumbIndex[i]] += powder[i];
+		if(radialIndex[i] >= 0)
+			radial[radialIndex[i]] += powder[i];
+	}
+	for(long i=0; i<thumb_nn; i++)
+		thumb[i] *= thumbWeight[i];
+	for(long i=0; i<radial_nn; i++)
+		radial[i] *= radialWeight[i];
+	header->powderFrames[powderClass] = nFrames;
+}
+
+void cLiveView::endPowderUpdate(long runNumber, long nProcessed, long nHits) {
+	header->runNumber = runNumber;
+	header->nProcessed = nProcessed;
+	header->nHits = nHits;
+	__sync_synchronize();
+	header->powderSequence++;
+	pthread_mutex_unlock(&powderMutex);
+}
+
+
+/*
+ *	Mark the run as finished and remove the segment name (attached viewers keep their mapping)
+ */
+void cLiveView::close() {
+	if(segment != NULL) {
+		header->state = LIVEVIEW_STATE_FINISHED;
+		__sync_synchronize();
+		munmap(segment, segmentSize);
+		shm_unlink(name);
+		printf("Live view: %s closed\n", name);
+	}
+	segment = NULL;
+	header = NULL;
+	enabled = 0;
+	free(thumbIndex);
+	free(thumbWeight);
+	free(radialIndex);
+	free(radialWeight);
+	thumbIndex = NULL;
+	thumbWeight = NULL;
+	radialIndex = NULL;
+	radialWeight = NULL;
+}
+
+
+/*
+ *	Publish a hit from the worker
+ */
+void publishLiveViewHit(cEventData *eventData, cGlobal *global) {
+	cLiveView	*liveView = &global->liveView;
+	if(!global->useLiveView || !liveView->enabled)
+		return;
+
+	long	detIndex = global->liveViewDetIndex;
+	tLiveViewHitInfo info;
+	info.frameNumber = eventData->frameNumber;
+	info.runNumber = global->runNumber;
+	info.trainID = eventData->trainID;
+	info.pulseID = eventData->pulseID;
+	info.cellID = eventData->cellID;
+	info.photonEnergyeV = eventData->photonEnergyeV;
+	info.wavelengthA = eventData->wavelengthA;
+	info.detectorZ = eventData->detector[detIndex].detectorZ;
+	info.hitScore = eventData->hitScore;
+	info.powderClass = eventData->powderClass;
+	info.eventname = eventData->eventname;
+	liveView->publishHit(&info, eventData->detector[detIndex].data_detPhotCorr, &eventData->peaklist);
+}
+
+
+/*
+ *	Refresh the powder snapshot from the running sums
+ *	(non-assembled powder, most corrected of the versions being summed)
+ */
+void publishLiveViewPowder(cGlobal *global) {
+	if(!global->useLiveView)
+		return;
+	long	detIndex = global->liveViewDetIndex;
+	cPixelDetectorCommon	*detector = &global->detector[detIndex];
+	if(!isBitOptionSet(detector->powderFormat, cDataVersion::DATA_FORMAT_NON_ASSEMBLED))
+		return;
+
+	cLiveView	*liveView = &global->liveView;
+	if(!liveView->beginPowderUpdate())
+		return;
+
+	for(long powderClass=0; powderClass<global->nPowderClasses; powderClass++) {
+		cDataVersion dataV(NULL, detector, detector->powderVersion, cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
+		double	*powder = NULL;
+		pthread_mutex_t *mutex = NULL;
+		while(dataV.next()) {
+			powder = dataV.getPowder(powderClass);
+			mutex = dataV.getPowderMutex(powderClass);
+		}
+		if(powder == NULL)
+			continue;
+		pthread_mutex_lock(mutex);
+		liveView->publishPowderClass(powderClass, powder, detector->nPowderFrames[powderClass]);
+		pthread_mutex_unlock(mutex);
+	}
+	liveView->endPowderUpdate(global->runNumber, global->nprocessedframes, global->nhits);
+}
@@ -5,10 +5,202 @@
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
 
 #include "cheetah.h"
 
+
+/*
+ *	Binary frame and peak logs (binaryLogs=1)
+ *	Rows hold the same values as frames.txt, the class logs and peaks.txt, in the same types, so that
+ *	cheetah-logconvert prints them exactly as the text logs would have.
+ */
+typedef struct {
+	uint32_t	eventname;
+	uint32_t	filename;
+	int64_t		stackSlice;
+	int64_t		frameNumber;
+	int32_t		hit;
+	int32_t		powderClass;
+	float		hitScore;
+	double		photonEnergyeV;
+	double		wavelengthA;
+	double		detectorZ;
+	double		gmd1;
+	double		gmd2;
+	int32_t		energySpectrumExist;
+	int32_t		nPeaks;
+	float		peakNpix;
+	float		peakTotal;
+	float		peakResolution;
+	float		peakDensity;
+	int32_t		pumpLaserCode;
+	double		pumpLaserDelay;
+	int32_t		pumpLaserOn;
+	double		exposureTime;
+	int64_t		nGainStage0;
+	int64_t		nGainStage1;
+	int64_t		nGainStage2;
+	int64_t		nBadPixels;
+} tFrameLogRow;
+
+static const tColumnLogColumn frameLogColumns[] = {
+	{"eventName", 's', offsetof(tFrameLogRow, eventname)},
+	{"filename", 's', offsetof(tFrameLogRow, filename)},
+	{"stackSlice", 'l', offsetof(tFrameLogRow, stackSlice)},
+	{"frameNumber", 'l', offsetof(tFrameLogRow, frameNumber)},
+	{"hit", 'i', offsetof(tFrameLogRow, hit)},
+	{"powderClass", 'i', offsetof(tFrameLogRow, powderClass)},
+	{"hitScore", 'f', offsetof(tFrameLogRow, hitScore)},
+	{"photonEnergyeV", 'd', offsetof(tFrameLogRow, photonEnergyeV)},
+	{"wavelengthA", 'd', offsetof(tFrameLogRow, wavelengthA)},
+	{"detectorZ", 'd', offsetof(tFrameLogRow, detectorZ)},
+	{"gmd1", 'd', offsetof(tFrameLogRow, gmd1)},
+	{"gmd2", 'd', offsetof(tFrameLogRow, gmd2)},
+	{"energySpectrumExist", 'i', offsetof(tFrameLogRow, energySpectrumExist)},
+	{"nPeaks", 'i', offsetof(tFrameLogRow, nPeaks)},
+	{"peakNpix", 'f', offsetof(tFrameLogRow, peakNpix)},
+	{"peakTotal", 'f', offsetof(tFrameLogRow, peakTotal)},
+	{"peakResolution", 'f', offsetof(tFrameLogRow, peakResolution)},
+	{"peakDensity", 'f', offsetof(tFrameLogRow, peakDensity)},
+	{"pumpLaserCode", 'i', offsetof(tFrameLogRow, pumpLaserCode)},
+	{"pumpLaserDelay", 'd', offsetof(tFrameLogRow, pumpLaserDelay)},
+	{"pumpLaserOn", 'i', offsetof(tFrameLogRow, pumpLaserOn)},
+	{"exposureTime", 'd', offsetof(tFrameLogRow, exposureTime)},
+	// AGIPD gain stage and bad pixel counts, only logged for EuXFEL (must stay last)
+	{"nGainStage0", 'l', offsetof(tFrameLogRow, nGainStage0)},
+	{"nGainStage1", 'l', offsetof(tFrameLogRow, nGainStage1)},
+	{"nGainStage2", 'l', offsetof(tFrameLogRow, nGainStage2)},
+	{"nBadPixels", 'l', offsetof(tFrameLogRow, nBadPixels)}
+};
+static const int nGainLogColumns = 4;
+
+typedef struct {
+	int64_t		frameNumber;
+	uint32_t	eventname;
+	double		photonEnergyeV;
+	double		wavelengthA;
+	float		gmd;
+	int64_t		peakIndex;
+	float		x;
+	float		y;
+	float		rAssembled;
+	float		q;
+	float		resA;
+	float		nPixels;
+	float		totalIntensity;
+	float		maxIntensity;
+	float		sigmaBG;
+	float		snr;
+} tPeakLogRow;
+
+static const tColumnLogColumn peakLogColumns[] = {
+	{"frameNumber", 'l', offsetof(tPeakLogRow, frameNumber)},
+	{"eventName", 's', offsetof(tPeakLogRow, eventname)},
+	{"photonEnergyEv", 'd', offsetof(tPeakLogRow, photonEnergyeV)},
+	{"wavelengthA", 'd', offsetof(tPeakLogRow, wavelengthA)},
+	{"GMD", 'f', offsetof(tPeakLogRow, gmd)},
+	{"peak_index", 'l', offsetof(tPeakLogRow, peakIndex)},
+	{"peak_x_raw", 'f', offsetof(tPeakLogRow, x)},
+	{"peak_y_raw", 'f', offsetof(tPeakLogRow, y)},
+	{"peak_r_assembled", 'f', offsetof(tPeakLogRow, rAssembled)},
+	{"peak_q", 'f', offsetof(tPeakLogRow, q)},
+	{"peak_resA", 'f', offsetof(tPeakLogRow, resA)},
+	{"nPixels", 'f', offsetof(tPeakLogRow, nPixels)},
+	{"totalIntensity", 'f', offsetof(tPeakLogRow, totalIntensity)},
+	{"maxIntensity", 'f', offsetof(tPeakLogRow, maxIntensity)},
+	{"sigmaBG", 'f', offsetof(tPeakLogRow, sigmaBG)},
+	{"SNR", 'f', offsetof(tPeakLogRow, snr)}
+};
+
+
+int openColumnLogs(cGlobal *global) {
+	int nFrameLogColumns = sizeof(frameLogColumns)/sizeof(frameLogColumns[0]);
+	if(strcmp(global->facility, "EuXFEL") != 0)
+		nFrameLogColumns -= nGainLogColumns;
+	if(global->frameLog.open("frames.bin", frameLogColumns, nFrameLogColumns, sizeof(tFrameLogRow)))
+		return 1;
+	if(global->peakLog.open("peaks.bin", peakLogColumns, sizeof(peakLogColumns)/sizeof(peakLogColumns[0]), sizeof(tPeakLogRow)))
+		return 1;
+	return 0;
+}
+
+
+static void appendFrameLog(cEventData *eventData, cGlobal *global) {
+	cColumnLog *log = &global->frameLog;
+	tColumnLogBatch *batch = log->acquire();
+	tFrameLogRow *row = (tFrameLogRow *) log->appendRow(batch);
+	log->setString(batch, row, offsetof(tFrameLogRow, eventname), eventData->eventname);
+	log->setString(batch, row, offsetof(tFrameLogRow, filename), eventData->filename);
+	row->stackSlice = eventData->stackSlice;
+	row->frameNumber = eventData->frameNumber;
+	row->hit = eventData->hit;
+	row->powderClass = eventData->powderClass;
+	row->hitScore = eventData->hitScore;
+	row->photonEnergyeV = eventData->photonEnergyeV;
+	row->wavelengthA = eventData->wavelengthA;
+	row->detectorZ = eventData->detector[0].detectorZ;
+	row->gmd1 = eventData->gmd1;
+	row->gmd2 = eventData->gmd2;
+	row->energySpectrumExist = eventData->energySpectrumExist;
+	row->nPeaks = eventData->nPeaks;
+	row->peakNpix = eventData->peakNpix;
+	row->peakTotal = eventData->peakTotal;
+	row->peakResolution = eventData->peakResolution;
+	row->peakDensity = eventData->peakDensity;
+	row->pumpLaserCode = eventData->pumpLaserCode;
+	row->pumpLaserDelay = eventData->pumpLaserDelay;
+	row->pumpLaserOn = eventData->pumpLaserOn;
+	row->exposureTime = eventData->exposureTime;
+	row->nGainStage0 = eventData->detector[0].nPixelsInGainStage[0];
+	row->nGainStage1 = eventData->detector[0].nPixelsInGainStage[1];
+	row->nGainStage2 = eventData->detector[0].nPixelsInGainStage[2];
+	row->nBadPixels = eventData->detector[0].nBadPixels;
+	log->release(batch);
+}
+
+
+/*
+ *	Peaks of one event, kept together in the same batch
+ */
+void writePeakLog(cEventData *eventData, cGlobal *global) {
+	cColumnLog *log = &global->peakLog;
+	tColumnLogBatch *batch = log->acquire();
+	for(long i=0; i<eventData->nPeaks; i++) {
+		tPeakLogRow *row = (tPeakLogRow *) log->appendRow(batch);
+		log->setString(batch, row, offsetof(tPeakLogRow, eventname), eventData->eventname);
+		row->frameNumber = eventData->frameNumber;
+		row->photonEnergyeV = eventData->photonEnergyeV;
+		row->wavelengthA = eventData->wavelengthA;
+		row->gmd = (float)(eventData->gmd21+eventData->gmd21)/2;
+		row->peakIndex = eventData->peaklist.peak_com_index[i];
+		row->x = eventData->peaklist.peak_com_x[i];
+		row->y = eventData->peaklist.peak_com_y[i];
+		row->rAssembled = eventData->peaklist.peak_com_r_assembled[i];
+		row->q = eventData->peaklist.peak_com_q[i];
+		row->resA = eventData->peaklist.peak_com_res[i];
+		row->nPixels = eventData->peaklist.peak_npix[i];
+		row->totalIntensity = eventData->peaklist.peak_totalintensity[i];
+		row->maxIntensity = eventData->peaklist.peak_maxintensity[i];
+		row->sigmaBG = eventData->peaklist.peak_sigma[i];
+		row->snr = eventData->peaklist.peak_snr[i];
+	}
+	log->release(batch);
+}
+
+
 void writeLog(cEventData *eventData, cGlobal * global) {
+	long powderClass = eventData->powderClass;
+
+	if(global->binaryLogs) {
+		appendFrameLog(eventData, global);
+		if(global->framelist[powderClass] != NULL)
+			fprintf(global->framelist[powderClass], "%s //%li\n", eventData->filename, eventData->stackSlice);
+		return;
+	}
+
 	// Write out information on each frame to a log file
 	pthread_mutex_lock(&global->framefp_mutex);
     fprintf(global->framefp, "%s, ", eventData->eventname);
@@ -32,11 +224,18 @@ void writeLog(cEventData *eventData, cGlobal * global) {
 //	fprintf(global->framefp, "%d, ", eventData->pumpLaserCode);
 //	fprintf(global->framefp, "%g, ", eventData->pumpLaserDelay);
 //   fprintf(global->framefp, "%d\n", eventData->pumpLaserOn);
-	fprintf(global->framefp, "%lf\n ", eventData->exposureTime);
+	if(strcmp(global->facility, "EuXFEL") == 0) {
+		fprintf(global->framefp, "%lf, ", eventData->exposureTime);
+		fprintf(global->framefp, "%ld, ", eventData->detector[0].nPixelsInGainStage[0]);
+		fprintf(global->framefp, "%ld, ", eventData->detector[0].nPixelsInGainStage[1]);
+		fprintf(global->framefp, "%ld, ", eventData->detector[0].nPixelsInGainStage[2]);
+		fprintf(global->framefp, "%ld\n ", eventData->detector[0].nBadPixels);
+	}
+	else
+		fprintf(global->framefp, "%lf\n ", eventData->exposureTime);
 	pthread_mutex_unlock(&global->framefp_mutex);
 
 	// Keep track of what has gone into each image class
-	long powderClass = eventData->powderClass;
     if(global->powderlogfp[powderClass] != NULL) {
 		pthread_mutex_lock(&global->powderfp_mutex);
         fprintf(global->powderlogfp[powderClass], "%s, ", eventData->eventname);
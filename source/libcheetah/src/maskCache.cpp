@@ -0,0 +1,169 @@
+/*
+ *  maskCache.cpp
+ *  cheetah
+ *
+ *  Derived char masks cached per pixelmask_shared epoch (see maskCache.h)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "maskCache.h"
+
+
+cDerivedMaskCache::cDerivedMaskCache() {
+	pix_nn = 0;
+	nRebuilds = 0;
+	nCurrent = 0;
+	freeOverlays = NULL;
+	for(long i=0; i<MAX_DERIVED_MASKS; i++)
+		current[i] = NULL;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+cDerivedMaskCache::~cDerivedMaskCache() {
+	for(long i=0; i<nCurrent; i++) {
+		if(current[i]->refcount == 0)
+			destroy(current[i]);
+	}
+	while(freeOverlays != NULL) {
+		tOverlayBuffer *next = freeOverlays->next;
+		free(freeOverlays->mask);
+		free(freeOverlays->patched);
+		free(freeOverlays);
+		freeOverlays = next;
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+void cDerivedMaskCache::setup(long pix_nn0) {
+	pix_nn = pix_nn0;
+}
+
+
+/*
+ *	Derive a mask from the current contents of pixelmask_shared
+ *	Each value is read exactly once, so mask and snapshot are consistent even if pixelmask_shared is being updated
+ *	(in which case the mask is flagged as not consistent with its epoch, and events compare against the snapshot)
+ */
+tDerivedMask *cDerivedMaskCache::build(uint16_t *pixelmask_shared, volatile long *epoch, uint16_t bits) {
+	tDerivedMask *entry = (tDerivedMask*) malloc(sizeof(tDerivedMask));
+	entry->bits = bits;
+	entry->epoch = *epoch;
+	entry->refcount = 0;
+	entry->mask = (char*) malloc(pix_nn*sizeof(char));
+	entry->snapshot = (uint16_t*) malloc(pix_nn*sizeof(uint16_t));
+	for(long i=0; i<pix_nn; i++) {
+		uint16_t s = pixelmask_shared[i] & bits;
+		entry->snapshot[i] = s;
+		entry->mask[i] = (s == 0);
+	}
+	entry->consistent = (*epoch == entry->epoch);
+	nRebuilds++;
+	entry->serial = nRebuilds;
+	return entry;
+}
+
+void cDerivedMaskCache::destroy(tDerivedMask *entry) {
+	free(entry->mask);
+	free(entry->snapshot);
+	free(entry);
+}
+
+
+/*
+ *	Return the mask for this bit combination, rebuilding it if pixelmask_shared has moved on since it was derived
+ *	Stale entries stay alive until the last worker using them calls release()
+ */
+tDerivedMask *cDerivedMaskCache::acquire(uint16_t *pixelmask_shared, volatile long *epochp, uint16_t bits) {
+	pthread_mutex_lock(&mutex);
+	long epoch = *epochp;
+
+	long slot = -1;
+	for(long i=0; i<nCurrent; i++) {
+		if(current[i]->bits == bits) {
+			slot = i;
+			break;
+		}
+	}
+
+	if(slot == -1) {
+		if(nCurrent == MAX_DERIVED_MASKS) {
+			printf("Error: More than %i different derived pixel masks requested\n", MAX_DERIVED_MASKS);
+			exit(1);
+		}
+		slot = nCurrent++;
+		current[slot] = build(pixelmask_shared, epochp, bits);
+	}
+	else if(current[slot]->epoch != epoch) {
+		tDerivedMask *old = current[slot];
+		current[slot] = build(pixelmask_shared, epochp, bits);
+		if(old->refcount == 0)
+			destroy(old);
+		else
+			old->epoch = -1;		// Orphaned, freed by the last release()
+	}
+
+	tDerivedMask *entry = current[slot];
+	entry->refcount++;
+	pthread_mutex_unlock(&mutex);
+	return entry;
+}
+
+
+void cDerivedMaskCache::release(tDerivedMask *entry) {
+	if(entry == NULL)
+		return;
+	pthread_mutex_lock(&mutex);
+	entry->refcount--;
+	if(entry->refcount == 0 && entry->epoch == -1)
+		destroy(entry);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+ *	Pooled buffer holding a copy of the derived mask, with the pixels patched by its previous user restored
+ */
+tOverlayBuffer *cDerivedMaskCache::acquireOverlay(tDerivedMask *entry) {
+	pthread_mutex_lock(&mutex);
+	tOverlayBuffer *buffer = freeOverlays;
+	if(buffer != NULL)
+		freeOverlays = buffer->next;
+	pthread_mutex_unlock(&mutex);
+
+	if(buffer == NULL) {
+		buffer = (tOverlayBuffer*) malloc(sizeof(tOverlayBuffer));
+		buffer->mask = (char*) malloc(pix_nn*sizeof(char));
+		buffer->patched = (long*) malloc(MAX_MASK_CHANGES(pix_nn)*sizeof(long));
+		buffer->source = -1;
+		buffer->nPatched = -1;
+	}
+	buffer->next = NULL;
+
+	if(buffer->source != entry->serial || buffer->nPatched < 0) {
+		memcpy(buffer->mask, entry->mask, pix_nn*sizeof(char));
+	}
+	else {
+		for(long k=0; k<buffer->nPatched; k++) {
+			long i = buffer->patched[k];
+			buffer->mask[i] = entry->mask[i];
+		}
+	}
+	buffer->source = entry->serial;
+	buffer->nPatched = 0;
+	return buffer;
+}
+
+
+void cDerivedMaskCache::releaseOverlay(tOverlayBuffer *buffer) {
+	if(buffer == NULL)
+		return;
+	pthread_mutex_lock(&mutex);
+	buffer->next = freeOverlays;
+	freeOverlays = buffer;
+	pthread_mutex_unlock(&mutex);
+}
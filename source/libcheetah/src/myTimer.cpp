@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "myTimer.h"
 
@@ -128,11 +129,130 @@ void cMyTimer::resume(void){
 
 
 
+/*
+ *  Log-linear latency histogram
+ *  Values below SUB_COUNT ns go into linear bins, above that each power of 2 is split into SUB_COUNT linear bins
+ */
+cLatencyHistogram::cLatencyHistogram() {
+    reset();
+}
+
+void cLatencyHistogram::reset(void) {
+    count = 0;
+    total = 0;
+    maxValue = 0;
+    for(long i=0; i<NBINS; i++) {
+        bins[i] = 0;
+    }
+}
+
+long cLatencyHistogram::binIndex(uint64_t v) {
+    if(v < (uint64_t) SUB_COUNT)
+        return (long) v;
+
+    long e = 63 - __builtin_clzll(v);
+    if(e > MAX_EXPONENT)
+        return NBINS-1;
+    return (e - SUB_BITS + 1)*SUB_COUNT + (long)(v >> (e - SUB_BITS)) - SUB_COUNT;
+}
+
+// Largest value that falls into bin i
+uint64_t cLatencyHistogram::binUpperValue(long i) {
+    if(i < SUB_COUNT)
+        return (uint64_t) i;
+
+    long e = i/SUB_COUNT + SUB_BITS - 1;
+    uint64_t sub = i%SUB_COUNT + SUB_COUNT;
+    return ((sub+1) << (e - SUB_BITS)) - 1;
+}
+
+void cLatencyHistogram::record(double seconds) {
+    if(seconds < 0)
+        seconds = 0;
+    bins[binIndex((uint64_t) (seconds*1e9))] += 1;
+    count += 1;
+    total += seconds;
+    if(seconds > maxValue)
+        maxValue = seconds;
+}
+
+void cLatencyHistogram::add(const cLatencyHistogram &h) {
+    for(long i=0; i<NBINS; i++) {
+        bins[i] += h.bins[i];
+    }
+    count += h.count;
+    total += h.total;
+    if(h.maxValue > maxValue)
+        maxValue = h.maxValue;
+}
+
+// Value (in seconds) below which the given percentage of recorded values fall
+double cLatencyHistogram::percentile(double percent) const {
+    if(count == 0)
+        return 0;
+
+    long target = (long) ceil(percent/100. * count);
+    if(target < 1)
+        target = 1;
+
+    long cumulative = 0;
+    for(long i=0; i<NBINS; i++) {
+        cumulative += bins[i];
+        if(cumulative >= target) {
+            double value = binUpperValue(i)*1e-9;
+            return value < maxValue ? value : maxValue;
+        }
+    }
+    return maxValue;
+}
+
+
+
+/*
+ *  Per-frame stage timer
+ *  Uses the monotonic clock, stages can be much shorter than the gettimeofday() resolution
+ */
+cStageTimer::cStageTimer() {
+    for(long i=0; i<cTimingProfiler::STAGE_NTYPES; i++) {
+        elapsed[i] = 0;
+        used[i] = false;
+    }
+    first = now();
+    last = first;
+}
+
+double cStageTimer::now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void cStageTimer::start(void) {
+    last = now();
+}
+
+void cStageTimer::lap(int stage) {
+    double t = now();
+    elapsed[stage] += t - last;
+    used[stage] = true;
+    last = t;
+}
+
+void cStageTimer::finish(int stage) {
+    elapsed[stage] = now() - first;
+    used[stage] = true;
+}
+
+
+
 /*
  *  Keep track of time spent in different parts of code
  */
 cTimingProfiler::cTimingProfiler() {
     pthread_mutex_init(&counter_mutex, NULL);
+    for(long i=0; i<NSTRIPES; i++) {
+        pthread_mutex_init(&stripe_mutex[i], NULL);
+    }
     resetTimers();
 }
 
@@ -141,6 +261,16 @@ void cTimingProfiler::resetTimers(void) {
     for(long i=0; i<TIMER_NTYPES; i++) {
         elapsed_time[i] = 0;
     }
+    for(long s=0; s<NSTRIPES; s++) {
+        pthread_mutex_lock(&stripe_mutex[s]);
+        for(long i=0; i<STAGE_NTYPES; i++) {
+            stageHistogram[s][i].reset();
+        }
+        pthread_mutex_unlock(&stripe_mutex[s]);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stage_tstart = ts.tv_sec + ts.tv_nsec*1e-9;
 }
 
 
@@ -151,6 +281,53 @@ void cTimingProfiler::addToTimer(double time, int field) {
     pthread_mutex_unlock(&counter_mutex);
 }
 
+// Add the stage times of one frame (thread-safe)
+// Striped locks: consecutive events (eventNum) book into different stripes, so concurrent workers mostly take different locks
+void cTimingProfiler::addStageTimes(const cStageTimer &timer, long eventNum) {
+    long s = eventNum % NSTRIPES;
+    if(s < 0)
+        s = -s;
+    pthread_mutex_lock(&stripe_mutex[s]);
+    for(long i=0; i<STAGE_NTYPES; i++) {
+        if(timer.used[i])
+            stageHistogram[s][i].record(timer.elapsed[i]);
+    }
+    pthread_mutex_unlock(&stripe_mutex[s]);
+}
+
+// Merge the striped histograms and print p50/p99/max per stage
+// Rate is the single-thread capacity of a stage (frames per second of stage time), throughput is frames per wall time
+void cTimingProfiler::reportStages(FILE *fp){
+
+    cLatencyHistogram merged[STAGE_NTYPES];
+    for(long s=0; s<NSTRIPES; s++) {
+        pthread_mutex_lock(&stripe_mutex[s]);
+        for(long i=0; i<STAGE_NTYPES; i++) {
+            merged[i].add(stageHistogram[s][i]);
+        }
+        pthread_mutex_unlock(&stripe_mutex[s]);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double walltime = ts.tv_sec + ts.tv_nsec*1e-9 - stage_tstart;
+    double throughput = 0;
+    if(walltime > 0)
+        throughput = merged[STAGE_TOTAL].count / walltime;
+
+    fprintf(fp, "Worker stage latency (ms): \n");
+    fprintf(fp, "\t%-26s %10s %10s %10s %10s %10s %12s\n", "stage", "frames", "mean", "p50", "p99", "max", "rate (fps)");
+    for(long i=0; i<STAGE_NTYPES; i++) {
+        cLatencyHistogram &h = merged[i];
+        if(h.count == 0)
+            continue;
+        double mean = h.total / h.count;
+        fprintf(fp, "\t%-26s %10li %10.3lf %10.3lf %10.3lf %10.3lf %12.1lf\n", stageMessage[i].c_str(), h.count,
+                1e3*mean, 1e3*h.percentile(50), 1e3*h.percentile(99), 1e3*h.maxValue, mean > 0 ? 1/mean : 0);
+    }
+    fprintf(fp, "\tThroughput: %0.2lf fps over %0.1lf sec\n", throughput, walltime);
+}
+
 // Report on timer status
 void cTimingProfiler::reportTimers(void){
     
@@ -167,6 +344,5 @@ void cTimingProfiler::reportTimers(void){
         percent = 100*elapsed_time[i] / total;
         printf("\t%s %0.2lf sec (%0.2lf %%)\n",message[i].c_str(), elapsed_time[i], percent);
     }
+    reportStages(stdout);
 }
-
-
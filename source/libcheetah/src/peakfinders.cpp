@@ -25,6 +25,69 @@
 int box_snr(float*, char*, int, int, int, int, float*, float*, float*);
 
 
+/*
+ *	Scratch buffers for the connected pixel searches in peakfinder3 and peakfinder6
+ *	Worker threads only live for one event, so buffers are kept in a pool (at most one per concurrent worker)
+ *	rather than allocated on every call. pixelStamp is never cleared: a pixel has been claimed by a peak
+ *	in the current call only if its stamp equals the stamp taken when the buffer was acquired.
+ */
+typedef struct tPeakfinderScratch {
+	long		pix_nn;
+	uint32_t	stamp;
+	uint32_t	*pixelStamp;
+	long		*queue_x;		// Pixels of the peak being grown, in the order they were accepted
+	long		*queue_y;
+	struct tPeakfinderScratch	*next;
+} tPeakfinderScratch;
+
+static tPeakfinderScratch *peakfinderScratchPool = NULL;
+static pthread_mutex_t peakfinderScratchMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static tPeakfinderScratch *acquirePeakfinderScratch(long pix_nn)
+{
+	pthread_mutex_lock(&peakfinderScratchMutex);
+	tPeakfinderScratch *scratch = peakfinderScratchPool;
+	if (scratch != NULL)
+		peakfinderScratchPool = scratch->next;
+	pthread_mutex_unlock(&peakfinderScratchMutex);
+
+	// Buffers are sized for one detector, another detector gets new ones
+	if (scratch != NULL && scratch->pix_nn != pix_nn) {
+		free(scratch->pixelStamp);
+		free(scratch->queue_x);
+		free(scratch->queue_y);
+		free(scratch);
+		scratch = NULL;
+	}
+	if (scratch == NULL) {
+		scratch = (tPeakfinderScratch *) calloc(1, sizeof(tPeakfinderScratch));
+		scratch->pix_nn = pix_nn;
+		scratch->stamp = 0;
+		scratch->pixelStamp = (uint32_t *) calloc(pix_nn, sizeof(uint32_t));
+		scratch->queue_x = (long *) malloc((pix_nn + 1) * sizeof(long));
+		scratch->queue_y = (long *) malloc((pix_nn + 1) * sizeof(long));
+	}
+
+	scratch->stamp++;
+	if (scratch->stamp == 0) {
+		memset(scratch->pixelStamp, 0, pix_nn * sizeof(uint32_t));
+		scratch->stamp = 1;
+	}
+	scratch->next = NULL;
+	return scratch;
+}
+
+
+static void releasePeakfinderScratch(tPeakfinderScratch *scratch)
+{
+	pthread_mutex_lock(&peakfinderScratchMutex);
+	scratch->next = peakfinderScratchPool;
+	peakfinderScratchPool = scratch;
+	pthread_mutex_unlock(&peakfinderScratchMutex);
+}
+
+
 /*
  *  Allocation of peak lists moved into peakfinder8.cpp
  *  (to improve portability)
@@ -50,7 +113,6 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
     long nPeaks;
 
     // Geometry
-    long pix_nn = global->detector[detIndex].pix_nn;
     long asic_nx = global->detector[detIndex].asic_nx;
     long asic_ny = global->detector[detIndex].asic_ny;
     long nasics_x = global->detector[detIndex].nasics_x;
@@ -78,10 +140,11 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
     tPeakList *peaklist = &eventData->peaklist;
 
     //	Masks for bad regions  (mask=0 to ignore regions)
-    char *mask = (char*) calloc(pix_nn, sizeof(char));
+    //	Derived from the cached shared mask plus this event's own bits, read-only for the peakfinders
+    tEventMask eventMask;
     uint16_t combined_pixel_options = PIXEL_IS_IN_PEAKMASK | PIXEL_IS_HOT | PIXEL_IS_BAD | PIXEL_IS_OUT_OF_RESOLUTION_LIMITS | PIXEL_IS_IN_JET;
-    for (long i = 0; i < pix_nn; i++)
-        mask[i] = isNoneOfBitOptionsSet(eventData->detector[detIndex].pixelmask[i], combined_pixel_options);
+    acquireEventMask(eventData, global, detIndex, combined_pixel_options, &eventMask);
+    char *mask = eventMask.mask;
 
     /*
      *	Call the appropriate peak finding algorithm
@@ -169,8 +232,8 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
     //		The variable "sintheta" is actually sin(2 theta).
     //		For small theta, sin(2 theta) is close to 2 sin(theta), so the error is not very big.
 
-    float z = global->detector[0].detectorZ * 1e-3;
-    float dx = global->detector[0].pixelSize;
+    float z = eventData->detector[detIndex].detectorZ * 1e-3;
+    float dx = global->detector[detIndex].pixelSize;
     double r = sqrt(z * z + dx * dx * resolution * resolution);
     //double sintheta = dx*resolution/r;
     double twotheta = asin(dx * resolution / r);
@@ -198,7 +261,7 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
     }
 
     // Release memory
-    free(mask);
+    releaseEventMask(global, detIndex, &eventMask);
 
     // Return number of peaks
     return nPeaks;
@@ -299,16 +362,17 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 
     // Variables for this hitfinder
     long nat = 0;
-    long lastnat = 0;
     long counter = 0;
     float total;
     int search_x[] = { 0, -1, 0, 1, -1, 1, -1, 0, 1 };
     int search_y[] = { 0, -1, -1, -1, 0, 0, 1, 1, 1 };
     int search_n = 9;
     long e;
-    long *inx = (long *) calloc(pix_nn, sizeof(long));
-    long *iny = (long *) calloc(pix_nn, sizeof(long));
-    char *peakpixel = (char *) calloc(pix_nn, sizeof(long));
+    tPeakfinderScratch *scratch = acquirePeakfinderScratch(pix_nn);
+    long *inx = scratch->queue_x;
+    long *iny = scratch->queue_y;
+    uint32_t *peakpixel = scratch->pixelStamp;
+    uint32_t inpeak = scratch->stamp;
     float totI;
     float maxI;
     float snr;
@@ -326,20 +390,10 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
     maxI = 0;
 
     /*
-     *	Create a buffer for image data so we don't nuke the main image by mistake
+     *	The mask is applied on the fly (data*mask, 0 to ignore regions - this makes data below threshold for peak finding)
+     *	rather than on a copy of the frame. Pixels already assigned to a peak are stamped in peakpixel, so the data is never modified.
      */
-    float *temp = (float*) calloc(pix_nn, sizeof(float));
-    memcpy(temp, data, pix_nn * sizeof(float));
-
-    /*
-     *	Apply mask (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
-     */
-    for (long i = 0; i < pix_nn; i++) {
-        temp[i] *= mask[i];
-    }
-    for (long i = 0; i < pix_nn; i++) {
-        peakpixel[i] = 0;
-    }
+    float thisI;
 
     // Loop over modules (8x8 array)
     for (long mj = 0; mj < nasics_y; mj++) {
@@ -358,7 +412,7 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
                         exit(1);
                     }
 
-                    if (temp[e] > ADCthresh && peakpixel[e] == 0) {
+                    if (data[e] * mask[e] > ADCthresh && peakpixel[e] != inpeak) {
                         // This might be the start of a new peak - start searching
                         inx[0] = i;
                         iny[0] = j;
@@ -368,54 +422,51 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
                         peak_com_x = 0;
                         peak_com_y = 0;
 
-                        // Keep looping until the pixel count within this peak does not change
-                        do {
-
-                            lastnat = nat;
-                            // Loop through points known to be within this peak
-                            for (long p = 0; p < nat; p++) {
-                                // Loop through search pattern
-                                for (long k = 0; k < search_n; k++) {
-                                    // Array bounds check
-                                    if ((inx[p] + search_x[k]) < 0)
-                                        continue;
-                                    if ((inx[p] + search_x[k]) >= asic_nx)
-                                        continue;
-                                    if ((iny[p] + search_y[k]) < 0)
-                                        continue;
-                                    if ((iny[p] + search_y[k]) >= asic_ny)
-                                        continue;
-
-                                    // Neighbour point in big array
-                                    thisx = inx[p] + search_x[k] + mi * asic_nx;
-                                    thisy = iny[p] + search_y[k] + mj * asic_ny;
-                                    e = thisx + thisy * pix_nx;
-
-                                    //if(e < 0 || e >= pix_nn){
-                                    //	printf("Array bounds error: e=%i\n",e);
-                                    //	continue;
-                                    //}
+                        // Grow the peak from the queue of accepted pixels: pixels appended while looping are searched
+                        // in the same pass, so one pass finds the whole peak and each pixel is visited once
+                        for (long p = 0; p < nat; p++) {
+                            // Loop through search pattern
+                            for (long k = 0; k < search_n; k++) {
+                                // Array bounds check
+                                if ((inx[p] + search_x[k]) < 0)
+                                    continue;
+                                if ((inx[p] + search_x[k]) >= asic_nx)
+                                    continue;
+                                if ((iny[p] + search_y[k]) < 0)
+                                    continue;
+                                if ((iny[p] + search_y[k]) >= asic_ny)
+                                    continue;
 
-                                    // Above threshold?
-                                    if (temp[e] > ADCthresh && peakpixel[e] == 0) {
-                                        //if(nat < 0 || nat >= global->pix_nn) {
-                                        //	printf("Array bounds error: nat=%i\n",nat);
-                                        //	break
-                                        //}
-                                        if (temp[e] > maxI)
-                                            maxI = temp[e];
-                                        totI += temp[e]; // add to integrated intensity
-                                        peak_com_x += temp[e] * ((float) thisx); // for center of mass x
-                                        peak_com_y += temp[e] * ((float) thisy); // for center of mass y
-                                        temp[e] = 0; // zero out this intensity so that we don't count it again
-                                        inx[nat] = inx[p] + search_x[k];
-                                        iny[nat] = iny[p] + search_y[k];
-                                        nat++;
-                                        peakpixel[e] = 1;
-                                    }
+                                // Neighbour point in big array
+                                thisx = inx[p] + search_x[k] + mi * asic_nx;
+                                thisy = iny[p] + search_y[k] + mj * asic_ny;
+                                e = thisx + thisy * pix_nx;
+
+                                //if(e < 0 || e >= pix_nn){
+                                //	printf("Array bounds error: e=%i\n",e);
+                                //	continue;
+                                //}
+
+                                // Above threshold?
+                                thisI = data[e] * mask[e];
+                                if (thisI > ADCthresh && peakpixel[e] != inpeak) {
+                                    //if(nat < 0 || nat >= global->pix_nn) {
+                                    //	printf("Array bounds error: nat=%i\n",nat);
+                                    //	break
+                                    //}
+                                    if (thisI > maxI)
+                                        maxI = thisI;
+                                    totI += thisI; // add to integrated intensity
+                                    peak_com_x += thisI * ((float) thisx); // for center of mass x
+                                    peak_com_y += thisI * ((float) thisy); // for center of mass y
+                                    // peakpixel makes sure we don't count it again
+                                    inx[nat] = inx[p] + search_x[k];
+                                    iny[nat] = iny[p] + search_y[k];
+                                    nat++;
+                                    peakpixel[e] = inpeak;
                                 }
                             }
-                        } while (lastnat != nat);
+                        }
 
                         // Too many or too few pixels means ignore this 'peak'; move on now
                         if (nat < hitfinderMinPixCount || nat > hitfinderMaxPixCount) {
@@ -467,10 +518,11 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
                                 e = thisx + thisy * pix_nx;
 
                                 // If pixel is less than ADC threshold, this pixel is a part of the background and not part of a peak
-                                if (temp[e] < ADCthresh && peakpixel[e] == 0) {
+                                thisI = data[e] * mask[e];
+                                if (thisI < ADCthresh && peakpixel[e] != inpeak) {
                                     np_sigma++;
-                                    sum += temp[e];
-                                    sumsquared += (temp[e] * temp[e]);
+                                    sum += thisI;
+                                    sumsquared += (thisI * thisI);
                                 }
                                 np_counted += 1;
                             }
@@ -541,10 +593,7 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
         }
     }
 
-    free(temp);
-    free(inx);
-    free(iny);
-    free(peakpixel);
+    releasePeakfinderScratch(scratch);
 
     return (peaklist->nPeaks);
 
@@ -574,7 +623,7 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
     int hit = 0;
     int fail;
     int stride = pix_nx;
-    int i, fs, ss, e, thise, p, ce, ne, nat, lastnat, cs, cf;
+    int fs, ss, e, thise, p, ce, ne, nat, lastnat, cs, cf;
     int peakindex, newpeak;
     float dist, itot, ftot, stot, maxI;
     float thisI, snr, bg, bgsig;
@@ -585,17 +634,11 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
     lastnat = 0;
     maxI = 0;
 
-    /* For counting neighbor pixels */
-    int *nexte = (int *) calloc(pix_nn, sizeof(int));
-    int *killpeak = (int *) calloc(pix_nn, sizeof(int));
-    for (i = 0; i < pix_nn; i++) {
-        killpeak[i] = 0;
-    }
-
-    int * natmask = (int *) calloc(pix_nn, sizeof(int));
-    for (long i = 0; i < pix_nn; i++) {
-        natmask[i] = mask[i];
-    }
+    /* For counting neighbor pixels (pixels already counted are stamped in natmask, masked pixels are never counted) */
+    tPeakfinderScratch *scratch = acquirePeakfinderScratch(pix_nn);
+    long *nexte = scratch->queue_x;
+    uint32_t *natmask = scratch->pixelStamp;
+    uint32_t counted = scratch->stamp;
 
     /* Shift in linear indices to eight nearest neighbors */
     int shift[8] = { +1, -1, +stride, -stride,
@@ -603,17 +646,9 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
             -stride - 1, -stride + 1 };
 
     /*
-     *	Create a buffer for image data so we don't nuke the main image by mistake
+     *	The mask is applied on the fly (data*mask, 0 to ignore regions - this makes data below threshold for peak finding)
+     *	rather than on a copy of the frame
      */
-    float *temp = (float*) calloc(pix_nn, sizeof(float));
-    memcpy(temp, data, pix_nn * sizeof(float));
-
-    /*
-     *	Apply mask (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
-     */
-    for (long i = 0; i < pix_nn; i++) {
-        temp[i] *= mask[i];
-    }
 
     // Loop over modules (8x8 array)
     for (long mj = 0; mj < nasics_y; mj++) {
@@ -638,16 +673,16 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
                     e = ss * stride + fs;
 
                     /* Check simple intensity threshold first */
-                    if (temp[e] < ADCthresh)
+                    if (data[e] * mask[e] < ADCthresh)
                         continue;
 
                     /* Check if this pixel value is larger than all of its neighbors */
                     for (int k = 0; k < 8; k++)
-                        if (temp[e] <= temp[e + shift[k]])
+                        if (data[e] * mask[e] <= data[e + shift[k]] * mask[e + shift[k]])
                             continue;
 
                     /* get SNR for this pixel */
-                    fail = box_snr(temp, mask, e, bgrad, hitfinderLocalBGRadius, stride, &snr, &bg, &bgsig);
+                    fail = box_snr(data, mask, e, bgrad, hitfinderLocalBGRadius, stride, &snr, &bg, &bgsig);
                     if (fail)
                         continue;
                     /* Check SNR threshold */
@@ -659,7 +694,7 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
                     nexte[0] = e;
                     ce = 0;
                     maxI = 0;
-                    itot = temp[e] - bg;
+                    itot = data[e] * mask[e] - bg;
                     cf = e % stride;
                     cs = e / stride;
                     ftot = itot * (float) cf;
@@ -675,15 +710,15 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
                             if (ne < 0 || ne >= pix_nn)
                                 continue;
                             // Check that we aren't recounting the same pixel
-                            if (natmask[ne] == 0)
+                            if (mask[ne] == 0 || natmask[ne] == counted)
                                 continue;
                             /* Check SNR condition */
-                            if ((temp[ne] - bg) / bgsig > hitfinderMinSNR) {
-                                natmask[ne] = 0; /* Mask this pixel (don't count it again) */
+                            if ((data[ne] * mask[ne] - bg) / bgsig > hitfinderMinSNR) {
+                                natmask[ne] = counted; /* Mask this pixel (don't count it again) */
                                 nexte[nat] = ne; /* Queue this location to search it's neighbors later */
                                 nat++; /* Increment the number of connected pixels */
                                 /* Track some info needed for rough center of mass: */
-                                thisI = temp[ne] - bg;
+                                thisI = data[ne] * mask[ne] - bg;
                                 itot += thisI;
                                 cf = ne % stride;
                                 cs = ne / stride;
@@ -731,11 +766,11 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
                     for (cs = ss - bgrad; cs <= ss + bgrad; cs++) {
                         for (cf = fs - bgrad; cf <= fs + bgrad; cf++) {
                             ce = cs * stride + cf;
-                            if (ce < 0 || ce > pix_nn)
+                            if (ce < 0 || ce >= pix_nn)
                                 continue;
                             if (isAnyOfBitOptionsSet(mask[ce], combined_pixel_options))
                                 continue;
-                            thisI = temp[ce] - bg;
+                            thisI = data[ce] * mask[ce] - bg;
                             itot += thisI;
                             ftot += thisI * (float) cf;
                             stot += thisI * (float) cs;
@@ -780,15 +815,12 @@ int peakfinder6(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
 
     nohit:
 
-    free(nexte);
-    free(natmask);
-    free(temp);
-    free(killpeak);
+    releasePeakfinderScratch(scratch);
 
     return (peaklist->nPeaks);
 }
 
-/* Calculate signal-to-noise ratio for the central pixel, using a square
+/* Calculate signal-to-noise ratio for the central pixel (of im*mask), using a square
  * concentric annulus */
 
 int box_snr(float * im, char* mask, int center, int radius, int thickness,
@@ -831,9 +863,13 @@ int box_snr(float * im, char* mask, int center, int radius, int thickness,
             bgcount += mask[b];
             bgcount += mask[c];
             bgcount += mask[d];
-            bg += im[a] + im[b] + im[c] + im[d];
-            bgsq += im[a] * im[a] + im[b] * im[b] +
-                    im[c] * im[c] + im[d] * im[d];
+            float ia = im[a] * mask[a];
+            float ib = im[b] * mask[b];
+            float ic = im[c] * mask[c];
+            float id = im[d] * mask[d];
+            bg += ia + ib + ic + id;
+            bgsq += ia * ia + ib * ib +
+                    ic * ic + id * id;
         }
     }
 
@@ -846,7 +882,7 @@ int box_snr(float * im, char* mask, int center, int radius, int thickness,
     bg = bg / bgcount;
     bgsq = bgsq / bgcount;
     bgsig = sqrt(bgsq - bg * bg);
-    snr = (im[center] - bg) / bgsig;
+    snr = (im[center] * mask[center] - bg) / bgsig;
 
     *SNR = snr;
     *background = bg;
@@ -24,18 +24,121 @@ void initPixelmask(cEventData *eventData, cGlobal *global){
 		if (threadSafetyLevel > 1) pthread_mutex_lock(&global->detector[detIndex].pixelmask_shared_mutex);
 
         // Some bad pixels may have been passed from the file reader (eg: AGIPD).
-        for (long i = 0; i < global->detector[detIndex].pix_nn; i++) {
-            eventData->detector[detIndex].pixelmask[i] |= global->detector[detIndex].pixelmask_shared[i];
+        // Resolution limits are those of the geometry this event was handed, which may be older than pixelmask_shared
+        // Pixels that end up different from pixelmask_shared start the list of per-event mask changes
+        cPixelDetectorEvent *detectorEvent = &eventData->detector[detIndex];
+        uint16_t *pixelmask = detectorEvent->pixelmask;
+        uint16_t *pixelmask_shared = global->detector[detIndex].pixelmask_shared;
+        long epoch = global->detector[detIndex].pixelmask_shared_epoch;
+        detectorEvent->nPixelmaskChanges = 0;
+        tGeometrySnapshot *geometry = detectorEvent->geometry;
+        if (geometry == NULL) {
+            for (long i = 0; i < global->detector[detIndex].pix_nn; i++) {
+                uint16_t shared = pixelmask_shared[i];
+                pixelmask[i] |= shared;
+                if (pixelmask[i] != shared)
+                    detectorEvent->markPixelmask(i);
+            }
+        }
+        else {
+            uint16_t *resolutionBits = geometry->resolutionBits;
+            for (long i = 0; i < global->detector[detIndex].pix_nn; i++) {
+                uint16_t shared = pixelmask_shared[i];
+                pixelmask[i] |= (shared & ~PIXEL_IS_OUT_OF_RESOLUTION_LIMITS) | resolutionBits[i];
+                if (pixelmask[i] != shared)
+                    detectorEvent->markPixelmask(i);
+            }
         }
         //memcpy(eventData->detector[detIndex].pixelmask,global->detector[detIndex].pixelmask_shared,global->detector[detIndex].pix_nn*sizeof(uint16_t));
 
+        // pixelmask_shared changed under us (lower thread safety levels): the list does not describe a single epoch
+        detectorEvent->pixelmaskEpoch = epoch;
+        if (global->detector[detIndex].pixelmask_shared_epoch != epoch)
+            detectorEvent->nPixelmaskChanges = detectorEvent->maxPixelmaskChanges + 1;
+
 		if (threadSafetyLevel > 1) pthread_mutex_unlock(&global->detector[detIndex].pixelmask_shared_mutex);
 	}
 }
 
-void checkSaturatedPixels(uint16_t *data_raw16, uint16_t *mask, long pix_nn, long pixelSaturationADC, long pixelMinimumAllowedADC, long pixelMaximumAllowedADC) {
+/*
+ *	Per-event mask bits set without recording the pixel in the change list (only used for bookkeeping)
+ *	Derived masks that depend on them always compare the whole mask
+ */
+#define PIXEL_UNTRACKED_EVENT_BITS (PIXEL_IS_ARTIFACT_CORRECTED | PIXEL_FAILED_ARTIFACT_CORRECTION | PIXEL_IS_PEAK_FOR_HITFINDER | PIXEL_IS_PHOTON_BACKGROUND_CORRECTED)
+
+/*
+ *	Char mask for this event (1 = use pixel, 0 = ignore), equivalent to isNoneOfBitOptionsSet(pixelmask[i], bits)
+ *	The static part comes from the derived mask cache of pixelmask_shared. Pixels where the event mask differs
+ *	(saturation, jet streaks, bad pixels from the file reader) are patched into a pooled copy; normally only the
+ *	pixels in the event's change list are looked at. If the list overflowed or pixelmask_shared was updated after
+ *	this event started, the whole mask is compared against the snapshot instead.
+ */
+void acquireEventMask(cEventData *eventData, cGlobal *global, long detIndex, uint16_t bits, tEventMask *eventMask) {
+	cPixelDetectorCommon *detector = &global->detector[detIndex];
+	cPixelDetectorEvent *detectorEvent = &eventData->detector[detIndex];
+	long		pix_nn = detector->pix_nn;
+	uint16_t	*pixelmask = detectorEvent->pixelmask;
+
+	tDerivedMask *entry = detector->pixelmask_derived.acquire(detector->pixelmask_shared, &detector->pixelmask_shared_epoch, bits);
+	eventMask->entry = entry;
+	eventMask->mask = entry->mask;
+	eventMask->overlay = NULL;
+	eventMask->nOverlay = 0;
+
+	bool sparse = entry->consistent && entry->epoch == detectorEvent->pixelmaskEpoch &&
+		detectorEvent->nPixelmaskChanges <= detectorEvent->maxPixelmaskChanges && isNoneOfBitOptionsSet(bits, PIXEL_UNTRACKED_EVENT_BITS);
+
+	if(sparse) {
+		if(detectorEvent->nPixelmaskChanges == 0)
+			return;
+		tOverlayBuffer *overlay = detector->pixelmask_derived.acquireOverlay(entry);
+		for(long k=0; k<detectorEvent->nPixelmaskChanges; k++) {
+			long i = detectorEvent->pixelmaskChanges[k];
+			char m = isNoneOfBitOptionsSet(pixelmask[i], bits);
+			if(m == entry->mask[i] || m == overlay->mask[i])
+				continue;
+			overlay->mask[i] = m;
+			overlay->patched[overlay->nPatched++] = i;
+		}
+		eventMask->nOverlay = overlay->nPatched;
+		eventMask->overlay = overlay;
+		eventMask->mask = overlay->mask;
+		return;
+	}
+
+	uint16_t	*snapshot = entry->snapshot;
+	long		maxPatched = detectorEvent->maxPixelmaskChanges;
+	for(long i=0; i<pix_nn; i++) {
+		if((pixelmask[i] & bits) == snapshot[i])
+			continue;
+		if(eventMask->overlay == NULL) {
+			eventMask->overlay = detector->pixelmask_derived.acquireOverlay(entry);
+			eventMask->mask = eventMask->overlay->mask;
+		}
+		tOverlayBuffer *overlay = eventMask->overlay;
+		overlay->mask[i] = isNoneOfBitOptionsSet(pixelmask[i], bits);
+		if(overlay->nPatched >= 0 && overlay->nPatched < maxPatched)
+			overlay->patched[overlay->nPatched++] = i;
+		else
+			overlay->nPatched = -1;		// Too many to undo, copied in full next time
+		eventMask->nOverlay++;
+	}
+}
+
+void releaseEventMask(cGlobal *global, long detIndex, tEventMask *eventMask) {
+	global->detector[detIndex].pixelmask_derived.releaseOverlay(eventMask->overlay);
+	global->detector[detIndex].pixelmask_derived.release(eventMask->entry);
+	eventMask->mask = NULL;
+	eventMask->entry = NULL;
+	eventMask->overlay = NULL;
+	eventMask->nOverlay = 0;
+}
+
+
+void checkSaturatedPixels(uint16_t *data_raw16, uint16_t *mask, long pix_nn, long pixelSaturationADC, long pixelMinimumAllowedADC, long pixelMaximumAllowedADC, cPixelDetectorEvent *detectorEvent) {
 	for(long i=0; i<pix_nn; i++)
     {
+        uint16_t old = mask[i];
         if ( data_raw16[i] >= pixelSaturationADC)
         {
 			mask[i] |= PIXEL_IS_SATURATED;
@@ -56,13 +159,16 @@ void checkSaturatedPixels(uint16_t *data_raw16, uint16_t *mask, long pix_nn, lon
             mask[i] |= PIXEL_IS_BAD;
             data_raw16[i] = 0;
         }
+        if (detectorEvent != NULL && mask[i] != old)
+            detectorEvent->markPixelmask(i);
 
     }
 }
 
 
-void checkSaturatedPixels(float *raw_data_float, uint16_t *mask, long pix_nn, long pixelSaturationADC, long pixelMinimumAllowedADC, long pixelMaximumAllowedADC) {
+void checkSaturatedPixels(float *raw_data_float, uint16_t *mask, long pix_nn, long pixelSaturationADC, long pixelMinimumAllowedADC, long pixelMaximumAllowedADC, cPixelDetectorEvent *detectorEvent) {
     for(long i=0; i<pix_nn; i++) {
+        uint16_t old = mask[i];
         if ( raw_data_float[i] >= pixelSaturationADC)
         {
             mask[i] |= PIXEL_IS_SATURATED;
@@ -83,10 +189,12 @@ void checkSaturatedPixels(float *raw_data_float, uint16_t *mask, long pix_nn, lo
             mask[i] |= PIXEL_IS_BAD;
             raw_data_float[i] = 0;
         }
+        if (detectorEvent != NULL && mask[i] != old)
+            detectorEvent->markPixelmask(i);
     }
 }
 
-void checkSaturatedPixelsPnccd(uint16_t *data_raw16, uint16_t *mask){
+void checkSaturatedPixelsPnccd(uint16_t *data_raw16, uint16_t *mask, cPixelDetectorEvent *detectorEvent){
 	long i,x,y,mx,my,q;
 	long asic_nx = PNCCD_ASIC_NX;
 	long asic_ny = PNCCD_ASIC_NY;
@@ -101,6 +209,8 @@ void checkSaturatedPixelsPnccd(uint16_t *data_raw16, uint16_t *mask){
 				for(x=0; x<asic_nx; x++){
 					i = my * (asic_ny*asic_nx*nasics_x) + y * asic_nx*nasics_x + mx*asic_nx + x;
 					if (data_raw16[i] > saturation_threshold[q]){
+						if (detectorEvent != NULL && isNoneOfBitOptionsSet(mask[i], PIXEL_IS_SATURATED))
+							detectorEvent->markPixelmask(i);
 						mask[i] |= PIXEL_IS_SATURATED; 
 					}
 				}
@@ -118,7 +228,7 @@ void checkSaturatedPixels(cEventData *eventData, cGlobal *global){
 			if ((strcmp(global->detector[detIndex].detectorType, "pnccd") == 0) && (global->detector[detIndex].maskPnccdSaturatedPixels))
             {
 				DEBUG3("Check for saturated pixels (PNCCD). (detectorID=%ld)",global->detector[detIndex].detectorID);										
-				checkSaturatedPixelsPnccd(raw_data,mask);
+				checkSaturatedPixelsPnccd(raw_data,mask,&eventData->detector[detIndex]);
 			}
             else
             {
@@ -128,7 +238,7 @@ void checkSaturatedPixels(cEventData *eventData, cGlobal *global){
                 long        pixelMinimumAllowedADC = global->detector[detIndex].pixelMinimumAllowedADC;
                 long        pixelMaximumAllowedADC = global->detector[detIndex].pixelMaximumAllowedADC;
 				//checkSaturatedPixels(raw_data, mask, nn, pixelSaturationADC, pixelMinimumAllowedADC);
-                checkSaturatedPixels(raw_data_float, mask, nn, pixelSaturationADC, pixelMinimumAllowedADC, pixelMaximumAllowedADC);
+                checkSaturatedPixels(raw_data_float, mask, nn, pixelSaturationADC, pixelMinimumAllowedADC, pixelMaximumAllowedADC, &eventData->detector[detIndex]);
 			}
 		}
 	}
@@ -195,6 +305,7 @@ void updateNoisyPixelBuffer(cEventData *eventData, cGlobal *global, int hit) {
 						nNoisy++;				
 					}		
 				}
+				global->detector[detIndex].pixelmask_shared_epoch++;
 				if (threadSafetyLevel > 1) pthread_mutex_unlock(&global->detector[detIndex].pixelmask_shared_mutex);					
 				free(std);
 				global->detector[detIndex].nNoisy = nNoisy;
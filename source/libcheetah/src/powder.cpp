@@ -265,6 +265,9 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
         ERROR("Couldn't create HDF5 group\n");
         H5Fclose(fh);
     }
+	hid_t ph = -1;
+	if (global->nRunShards > 1)
+		ph = H5Gcreate(fh, "partial", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
 	
 	// Setting compression level
 	if (global->h5compress) {
@@ -301,61 +304,44 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 				double *powder_squared = dataV.getPowderSquared(powderClass);
 				long *powder_counter = dataV.getPowderCounter(powderClass);
 				pthread_mutex_t *mutex = dataV.getPowderMutex(powderClass);
+
+				// Masked powders require a per-pixel correction
+				bool masked = (global->detector[detIndex].savePowderMasked != 0 && powder_counter != NULL);
 				
-				// Copy powder pattern to buffer
+				// Copy running sums to buffers
 				powderBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
+				powderSquaredBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
+				long *powderCounterBuffer = NULL;
+				if (masked)
+					powderCounterBuffer = (long*) calloc(dataV.pix_nn, sizeof(long));
 				if (global->threadSafetyLevel > 0)
 					pthread_mutex_lock(mutex);
 				memcpy(powderBuffer, powder, dataV.pix_nn*sizeof(double));
+				memcpy(powderSquaredBuffer, powder_squared, dataV.pix_nn*sizeof(double));
+				if (masked)
+					memcpy(powderCounterBuffer, powder_counter, dataV.pix_nn*sizeof(long));
 				if (global->threadSafetyLevel > 0)
 					pthread_mutex_unlock(mutex);
                 
-				// Masked powders require a per-pixel correction
-				if(global->detector[detIndex].savePowderMasked != 0 && powder_counter != NULL) {
-					for (long i=0; i<dataV.pix_nn; i++) {
-						if(powder_counter[i] != 0)
-							powderBuffer[i] /= powder_counter[i];
-						else
-							powderBuffer[i] = 0;
-					}
-				}
+				// Powder, average and fluctuations (sigma)
+				double *powderValueBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
+				double *powderAverageBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
+				powderSigmaBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
+				powderStatistics(dataV.pix_nn, nframes, powderBuffer, powderSquaredBuffer, powderCounterBuffer, powderValueBuffer, powderAverageBuffer, powderSigmaBuffer);
+
 				// Write powder to dataset
 				dh = H5Dcreate(gh, dataV.name, H5T_NATIVE_DOUBLE, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
 				if (dh < 0) ERROR("Could not create dataset.\n");
-				H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderBuffer);
+				H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderValueBuffer);
 				H5Dclose(dh);
                 
                 // Also write the average
-                for (long i=0; i<dataV.pix_nn; i++) {
-                    powderBuffer[i] /= detector->nPowderFrames[powderClass];
-                }
                 sprintf(sBuffer,"%s_average",dataV.name);
                 dh = H5Dcreate(gh, sBuffer, H5T_NATIVE_DOUBLE, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
                 if (dh < 0) ERROR("Could not create dataset.\n");
-                H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderBuffer);
+                H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderAverageBuffer);
                 H5Dclose(dh);
 
-				
-				// Fluctuations (sigma)
-				powderSquaredBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
-				powderSigmaBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
-				if (global->threadSafetyLevel > 0)
-					pthread_mutex_lock(mutex);
-				memcpy(powderSquaredBuffer, powder_squared, dataV.pix_nn*sizeof(double));
-				if (global->threadSafetyLevel > 0)
-					pthread_mutex_unlock(mutex);
-				// Masked powders require a per-pixel correction
-				if(global->detector[detIndex].savePowderMasked != 0 && powder_counter != NULL) {
-					for (long i=0; i<dataV.pix_nn; i++) {
-						if(powder_counter[i] != 0)
-							powderSigmaBuffer[i] = sqrt(powderSquaredBuffer[i]/powder_counter[i] - powderBuffer[i]*powderBuffer[i]);
-					}
-				}
-				else {
-					for (long i=0; i<dataV.pix_nn; i++) {
-						powderSigmaBuffer[i] = sqrt(powderSquaredBuffer[i]/nframes - (powderBuffer[i]/nframes)*(powderBuffer[i]/nframes));
-					}
-				}
 				// Write to data set
 				sprintf(sBuffer,"%s_sigma",dataV.name);
 				dh = H5Dcreate(gh, sBuffer, H5T_NATIVE_DOUBLE, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
@@ -371,9 +357,40 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 					H5Lcreate_soft(sBuffer, fh, "/data/correcteddata",0,0);
 				}
 
+				// Run shards also keep the running sums, for cheetah-merge
+				if (global->nRunShards > 1) {
+					dh = H5Dcreate(ph, dataV.name, H5T_NATIVE_DOUBLE, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
+					H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderBuffer);
+					H5Dclose(dh);
+					// A truncated name could clash with another dataset, such sums are left out
+					int n = snprintf(sBuffer, sizeof(sBuffer), "%s_squared", dataV.name);
+					if (n < 0 || n >= (int) sizeof(sBuffer)) {
+						printf("Error: dataset name too long, not saving %s_squared\n", dataV.name);
+					}
+					else {
+						dh = H5Dcreate(ph, sBuffer, H5T_NATIVE_DOUBLE, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
+						H5Dwrite(dh, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderSquaredBuffer);
+						H5Dclose(dh);
+					}
+					if (masked) {
+						n = snprintf(sBuffer, sizeof(sBuffer), "%s_counter", dataV.name);
+						if (n < 0 || n >= (int) sizeof(sBuffer)) {
+							printf("Error: dataset name too long, not saving %s_counter\n", dataV.name);
+						}
+						else {
+							dh = H5Dcreate(ph, sBuffer, H5T_NATIVE_LONG, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
+							H5Dwrite(dh, H5T_NATIVE_LONG, H5S_ALL, H5S_ALL, H5P_DEFAULT, powderCounterBuffer);
+							H5Dclose(dh);
+						}
+					}
+				}
+
 				
                 free(powderBuffer);
 				free(powderSquaredBuffer);
+				free(powderCounterBuffer);
+				free(powderValueBuffer);
+				free(powderAverageBuffer);
 				free(powderSigmaBuffer);
 				H5Sclose(sh);
 			}
@@ -407,6 +424,8 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 	
     // Clean up stale HDF5 links
     H5Gclose(gh);
+    if (ph >= 0)
+        H5Gclose(ph);
     int n_ids;
     hid_t ids[256];
     n_ids = H5Fget_obj_ids(fh, H5F_OBJ_ALL, 256, ids);
@@ -439,6 +458,34 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 
 
 
+/*
+ *	Values saved for one powder dataset, computed from its running sums
+ *	(counter is NULL unless the powder is masked per pixel).
+ *	cheetah-merge uses the same function, so merged run shards give the same files as a single process.
+ */
+void powderStatistics(long pix_nn, long nframes, double *sum, double *squared, long *counter, double *value, double *average, double *sigma) {
+	for (long i=0; i<pix_nn; i++) {
+		value[i] = sum[i];
+		if (counter != NULL) {
+			if (counter[i] != 0)
+				value[i] /= counter[i];
+			else
+				value[i] = 0;
+		}
+		average[i] = value[i] / nframes;
+		if (counter != NULL) {
+			if (counter[i] != 0)
+				sigma[i] = sqrt(squared[i]/counter[i] - average[i]*average[i]);
+			else
+				sigma[i] = 0;
+		}
+		else {
+			sigma[i] = sqrt(squared[i]/nframes - (average[i]/nframes)*(average[i]/nframes));
+		}
+	}
+}
+
+
 /*
  *	Compute and save dark calibration
  */
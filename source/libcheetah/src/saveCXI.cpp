@@ -10,6 +10,8 @@
 										
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <pthread.h>
 #include <math.h>
 #include <fstream> 
@@ -607,6 +609,55 @@ static T * generateThumbnail(const T * src,const int srcWidth, const int srcHeig
 }
 
 
+/*
+ *	Select the pixels of a frame that are kept in sparse storage
+ *	Threshold mode: all pixels above threshold
+ *	Peak mode (haloRadius > 0): all pixels within haloRadius of a peak in peaklist
+ *	Returns the number of pixels, index and value are allocated here (in ascending pixel order) and have to be freed by the caller
+ */
+static long sparsifyFrame(const float *data, long pix_nx, long pix_nn, float threshold, tPeakList *peaklist, long haloRadius, int **index, float **value)
+{
+	long nPix = 0;
+	char *keep = NULL;
+
+	if(haloRadius > 0 && peaklist != NULL) {
+		long pix_ny = pix_nn/pix_nx;
+		long r2 = haloRadius*haloRadius;
+		keep = (char *) calloc(pix_nn, sizeof(char));
+		for(long p=0; p<peaklist->nPeaks && p<peaklist->nPeaks_max; p++) {
+			long cx = lrint(peaklist->peak_com_x[p]);
+			long cy = lrint(peaklist->peak_com_y[p]);
+			for(long y=std::max(0L, cy-haloRadius); y<=std::min(pix_ny-1, cy+haloRadius); y++) {
+				for(long x=std::max(0L, cx-haloRadius); x<=std::min(pix_nx-1, cx+haloRadius); x++) {
+					if((x-cx)*(x-cx) + (y-cy)*(y-cy) <= r2)
+						keep[y*pix_nx+x] = 1;
+				}
+			}
+		}
+		for(long i=0; i<pix_nn; i++)
+			nPix += keep[i];
+	}
+	else {
+		for(long i=0; i<pix_nn; i++)
+			if(data[i] > threshold)
+				nPix++;
+	}
+
+	*index = (int *) malloc(std::max(nPix, 1L)*sizeof(int));
+	*value = (float *) malloc(std::max(nPix, 1L)*sizeof(float));
+	long n = 0;
+	for(long i=0; i<pix_nn && n<nPix; i++) {
+		if(keep ? keep[i] : data[i] > threshold) {
+			(*index)[n] = (int) i;
+			(*value)[n] = data[i];
+			n++;
+		}
+	}
+	free(keep);
+	return nPix;
+}
+
+
 /*
 
   CXI file skeleton
@@ -626,6 +677,7 @@ static T * generateThumbnail(const T * src,const int srcWidth, const int srcHeig
   |   |   |                                                |
   |   |   |- data [non-assembled data, 3D array]           |
   |   |   |- (mask) [non-asslembled masks, 3D array]       |
+  |   |   |- (sparse_index, sparse_value) [sparse frames]  |
   |   |   |- mask_shared [non-assembled mask, 2D array]    | 
   |   |   |- ...                                           | symlink
   |   .   .                                                |
@@ -865,6 +917,12 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
             detector->createStack("x_pixel_size",H5T_NATIVE_DOUBLE);
             detector->createStack("y_pixel_size",H5T_NATIVE_DOUBLE);
 
+            // Pixels in each AGIPD gain stage (0,1,2) and bad pixels, counted by the reader
+            if(!strcmp(global->facility, "EuXFEL")) {
+                detector->createStack("pixels_in_gain_stage",H5T_NATIVE_LONG,3);
+                detector->createStack("bad_pixels",H5T_NATIVE_LONG);
+            }
+
             detector->createLink("experiment_identifier", "/entry_1/experiment_identifier");
 
             int sBufferLen = sprintf(sBuffer,"%s [%s]",global->detector[detIndex].detectorType,global->detector[detIndex].detectorName);
@@ -921,7 +979,17 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
                         // Create group /entry_1/instrument_1/detector_[i]/[datver]/
                         Node * data_node = detector->createGroup(dataV.name_version);
                         data_node->createLink("experiment_identifier", "/entry_1/experiment_identifier");
-                        data_node->createStack("data", h5type,pix_nx, pix_ny);
+                        if(!global->detector[detIndex].saveSparseOnly) {
+                            data_node->createStack("data", h5type,pix_nx, pix_ny);
+                        }
+                        // Sparse frames: linear pixel index (into pix_nx x pix_ny) and value of each stored pixel
+                        if(global->detector[detIndex].saveSparse) {
+                            data_node->createStack("sparse_npixels", H5T_NATIVE_INT);
+                            data_node->createStack("sparse_index", H5T_NATIVE_INT32, 0,H5S_UNLIMITED,H5S_UNLIMITED,0,
+                                                   CXI::peaksChunkSize[0],CXI::peaksChunkSize[1],"experiment_identifier:nPixels");
+                            data_node->createStack("sparse_value", H5T_NATIVE_FLOAT, 0,H5S_UNLIMITED,H5S_UNLIMITED,0,
+                                                   CXI::peaksChunkSize[0],CXI::peaksChunkSize[1],"experiment_identifier:nPixels");
+                        }
                         if(global->detector[detIndex].savePixelmask){
                             data_node->createStack("mask",H5T_NATIVE_UINT16,pix_nx, pix_ny);
                         }
@@ -934,7 +1002,14 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
                         
                         // If this is the main data version we create links to all datasets
                         if (dataV.isMainVersion) {
-                            detector->addDatasetLink("data",data_node->path().c_str());
+                            if(!global->detector[detIndex].saveSparseOnly) {
+                                detector->addDatasetLink("data",data_node->path().c_str());
+                            }
+                            if(global->detector[detIndex].saveSparse) {
+                                detector->addDatasetLink("sparse_npixels",data_node->path().c_str());
+                                detector->addDatasetLink("sparse_index",data_node->path().c_str());
+                                detector->addDatasetLink("sparse_value",data_node->path().c_str());
+                            }
                             if(global->detector[detIndex].savePixelmask){
                                 detector->addDatasetLink("mask",data_node->path().c_str());
                             }
@@ -1738,11 +1813,89 @@ static std::vector<CXI::Node* > openCXIFiles = std::vector<CXI::Node *>();
 static std::vector<std::string> openResultsFilenames = std::vector<std::string>();
 static std::vector<CXI::Node* > openResultsFiles = std::vector<CXI::Node *>();
 
+/*
+ *	Sharded output (cxiShards > 1)
+ *	Each CXI and results file is split into shard files <name>-sNN.cxi / <name>-sNN.h5, optionally spread over cxiShardDirs.
+ *	Frames are assigned a shard and stack slice in order (reserveCXI) and written afterwards under the shard's own lock,
+ *	so each shard file is written by one thread at a time while the other shards are being written in parallel.
+ *	When the files are closed a master file with the unsharded name is written: stacks become virtual datasets
+ *	concatenating the shards in shard order, everything else (geometry, powder sums...) is copied from the first shard.
+ */
+static std::vector<std::string> cxiMasterFilenames = std::vector<std::string>();
+static std::vector<std::vector<std::string> > cxiMasterShards = std::vector<std::vector<std::string> >();
+
+
+// Shard file name from the unsharded name
+static void cxiShardFilename(cGlobal *global, const char *filename, long shard, char *shardFilename){
+	char	stem[MAX_FILENAME_LENGTH];
+	char	dir[MAX_FILENAME_LENGTH];
+	const char *ext = strrchr(filename, '.');
+	if(ext == NULL)
+		ext = filename + strlen(filename);
+
+	strncpy(stem, filename, ext-filename);
+	stem[ext-filename] = 0;
+
+	// Directory number shard modulo the number of directories given
+	strcpy(dir, "");
+	if(strlen(global->cxiShardDirs) > 0){
+		std::vector<std::string> dirs;
+		std::string list(global->cxiShardDirs);
+		size_t start = 0;
+		while(start <= list.size()){
+			size_t end = list.find(',', start);
+			if(end == std::string::npos)
+				end = list.size();
+			if(end > start)
+				dirs.push_back(list.substr(start, end-start));
+			start = end+1;
+		}
+		if(dirs.size() > 0)
+			sprintf(dir, "%s/", dirs[shard % dirs.size()].c_str());
+	}
+	sprintf(shardFilename, "%s%s-s%02ld%s", dir, stem, shard, ext);
+}
+
+// Remember which shard belongs to which master file (needs &global->saveCXI_mutex locked)
+static void addCXIShard(const char *master, const char *shardFilename, long shard){
+	uint	i;
+	for(i=0; i<cxiMasterFilenames.size(); i++){
+		if(cxiMasterFilenames[i] == std::string(master))
+			break;
+	}
+	if(i == cxiMasterFilenames.size()){
+		cxiMasterFilenames.push_back(master);
+		cxiMasterShards.push_back(std::vector<std::string>());
+	}
+	if(cxiMasterShards[i].size() <= (size_t) shard)
+		cxiMasterShards[i].resize(shard+1);
+	cxiMasterShards[i][shard] = shardFilename;
+}
+
+// Frames reserved but not yet written, per shard
+static volatile long cxiShardWriters[MAX_CXI_SHARDS];
+
+// Choose the shard for one frame, preferring one nobody is about to write to, else the least busy
+static long reserveCXIShard(cGlobal *global, long hint){
+	long	nShards = global->cxiShards;
+	long	first = hint % nShards;
+	long	best = first;
+	for(long i=0; i<nShards && cxiShardWriters[best] > 0; i++){
+		long shard = (first+i) % nShards;
+		if(cxiShardWriters[shard] < cxiShardWriters[best])
+			best = shard;
+	}
+	__sync_fetch_and_add(&cxiShardWriters[best], 1);
+	return best;
+}
+
 
 // CXI file
 static CXI::Node *getCXIFileByName(cGlobal *global, cEventData *eventData, int powderClass){
 	char filename[MAX_FILENAME_LENGTH];
+	char masterFilename[MAX_FILENAME_LENGTH];
 	long chunk;
+	long shard = (eventData != NULL) ? eventData->cxiShard : 0;
 	
 	if(global->saveByPowderClass){
 		// Powder class chunks according to number of frames in each powder class
@@ -1757,6 +1910,9 @@ static CXI::Node *getCXIFileByName(cGlobal *global, cEventData *eventData, int p
 		chunk = (long) floorf(chunk / (float) global->cxiChunkSize);
 		sprintf(filename,"%s-r%04d-c%02ld.cxi", global->experimentID, global->runNumber, chunk);
 	}
+	strcpy(masterFilename, filename);
+	if(global->cxiShards > 1)
+		cxiShardFilename(global, masterFilename, shard, filename);
 	if (eventData != NULL)
 		strcpy(eventData->filename, filename);
 
@@ -1777,6 +1933,8 @@ static CXI::Node *getCXIFileByName(cGlobal *global, cEventData *eventData, int p
 	CXI::Node *cxi = createCXISkeleton(filename, global);
 	openCXIFilenames.push_back(filename);
 	openCXIFiles.push_back(cxi);
+	if(global->cxiShards > 1)
+		addCXIShard(masterFilename, filename, shard);
 	
 	pthread_mutex_unlock(&global->saveCXI_mutex);
 	return cxi;
@@ -1785,7 +1943,9 @@ static CXI::Node *getCXIFileByName(cGlobal *global, cEventData *eventData, int p
 // Results file
 static CXI::Node *getResultsFileByName(cGlobal *global, cEventData *eventData, int powderClass){
     char filename[MAX_FILENAME_LENGTH];
+    char masterFilename[MAX_FILENAME_LENGTH];
     long chunk;
+    long shard = (eventData != NULL) ? eventData->cxiShard : 0;
     
     if(global->saveByPowderClass){
         // Powder class chunks according to number of frames in each powder class
@@ -1800,6 +1960,9 @@ static CXI::Node *getResultsFileByName(cGlobal *global, cEventData *eventData, i
         chunk = (long) floorf(chunk / (float) global->cxiChunkSize);
         sprintf(filename,"%s-r%04d-c%02ld.h5", global->experimentID, global->runNumber, chunk);
     }
+    strcpy(masterFilename, filename);
+    if(global->cxiShards > 1)
+        cxiShardFilename(global, masterFilename, shard, filename);
     if (eventData != NULL)
         strcpy(eventData->filename, filename);
     
@@ -1820,6 +1983,8 @@ static CXI::Node *getResultsFileByName(cGlobal *global, cEventData *eventData, i
     CXI::Node *results = createResultsSkeleton(filename, global);
     openResultsFilenames.push_back(filename);
     openResultsFiles.push_back(results);
+    if(global->cxiShards > 1)
+        addCXIShard(masterFilename, filename, shard);
     
     pthread_mutex_unlock(&global->saveCXI_mutex);
     return results;
@@ -1956,6 +2121,230 @@ static void  closeCXI(CXI::Node *cxi){
 	delete cxi;
 }
 
+/*
+ *	Master file for sharded output
+ *	Stacks (chunked, unlimited first dimension) become virtual datasets concatenating the sources in order,
+ *	everything else is copied from the first source. Also used by cheetah-merge across run shards.
+ */
+#if H5_VERSION_GE(1,10,0)
+typedef struct {
+	hid_t	master;
+	std::vector<hid_t> sources;			// Open source files, the first one is the template
+	std::vector<std::string> links;		// Source file names as stored in the virtual datasets
+	std::vector<long> nFrames;			// Stack size of each source (-1 until a stack is found)
+} tCXIMaster;
+
+static herr_t copyCXIAttribute(hid_t src, const char *name, const H5A_info_t *, void *op_data){
+	hid_t	dst = *(hid_t *) op_data;
+	hid_t	attr = H5Aopen(src, name, H5P_DEFAULT);
+	hid_t	type = H5Aget_type(attr);
+	hid_t	space = H5Aget_space(attr);
+	size_t	size = H5Tget_size(type) * H5Sget_simple_extent_npoints(space);
+	char	*buffer = (char *) calloc(size+1, 1);
+
+	if(H5Aread(attr, type, buffer) >= 0){
+		hid_t a = H5Acreate2(dst, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+		if(a >= 0){
+			H5Awrite(a, type, buffer);
+			H5Aclose(a);
+		}
+	}
+	free(buffer);
+	H5Sclose(space);
+	H5Tclose(type);
+	H5Aclose(attr);
+	return 0;
+}
+
+// Stack size of one dataset in a source file (0 if missing or of a different shape)
+static hsize_t cxiSourceStackSize(hid_t file, const char *path, int ndims, hsize_t *dims){
+	hsize_t	n = 0;
+	hid_t	dataset;
+	H5E_BEGIN_TRY {
+		dataset = H5Dopen2(file, path, H5P_DEFAULT);
+	} H5E_END_TRY;
+	if(dataset < 0)
+		return 0;
+
+	hid_t	dataspace = H5Dget_space(dataset);
+	hsize_t	sdims[H5S_MAX_RANK];
+	if(H5Sget_simple_extent_ndims(dataspace) == ndims){
+		H5Sget_simple_extent_dims(dataspace, sdims, NULL);
+		n = sdims[0];
+		for(int i=1; i<ndims; i++)
+			if(sdims[i] != dims[i])
+				n = 0;
+	}
+	H5Sclose(dataspace);
+	H5Dclose(dataset);
+	return n;
+}
+
+static herr_t copyCXIMasterLink(hid_t root, const char *path, const H5L_info_t *info, void *op_data){
+	tCXIMaster	*m = (tCXIMaster *) op_data;
+
+	// Soft links (data_1 -> detector_1...) are recreated as they are
+	if(info->type == H5L_TYPE_SOFT){
+		char	target[MAX_FILENAME_LENGTH];
+		if(H5Lget_val(root, path, target, sizeof(target), H5P_DEFAULT) >= 0)
+			H5Lcreate_soft(target, m->master, path, H5P_DEFAULT, H5P_DEFAULT);
+		return 0;
+	}
+	if(info->type != H5L_TYPE_HARD)
+		return 0;
+
+	H5O_info_t	oinfo;
+	if(H5Oget_info_by_name(root, path, &oinfo, H5P_DEFAULT) < 0)
+		return 0;
+
+	// Groups
+	if(oinfo.type == H5O_TYPE_GROUP){
+		hid_t src = H5Gopen2(root, path, H5P_DEFAULT);
+		hid_t dst = H5Gcreate2(m->master, path, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		H5Aiterate2(src, H5_INDEX_NAME, H5_ITER_INC, NULL, copyCXIAttribute, &dst);
+		H5Gclose(dst);
+		H5Gclose(src);
+		return 0;
+	}
+	if(oinfo.type != H5O_TYPE_DATASET)
+		return 0;
+
+	// Datasets: stacks become virtual datasets, anything else is copied from the first source
+	hid_t	dataset = H5Dopen2(root, path, H5P_DEFAULT);
+	hid_t	dataspace = H5Dget_space(dataset);
+	hid_t	dcpl = H5Dget_create_plist(dataset);
+	int		ndims = H5Sget_simple_extent_ndims(dataspace);
+	hsize_t	dims[H5S_MAX_RANK];
+	hsize_t	maxdims[H5S_MAX_RANK];
+	H5Sget_simple_extent_dims(dataspace, dims, maxdims);
+
+	// (stacks of a master file are themselves virtual, so that masters can be merged again)
+	H5D_layout_t layout = H5Pget_layout(dcpl);
+	bool	stack = (ndims >= 1 && ((maxdims[0] == H5S_UNLIMITED && layout == H5D_CHUNKED) || layout == H5D_VIRTUAL));
+	std::vector<hsize_t> n(m->sources.size(), 0);
+	hsize_t	nTotal = 0;
+	if(stack){
+		for(uint k=0; k<m->sources.size(); k++){
+			n[k] = cxiSourceStackSize(m->sources[k], path, ndims, dims);
+			if(m->nFrames[k] < 0)
+				m->nFrames[k] = n[k];
+			nTotal += n[k];
+		}
+	}
+
+	if(!stack || nTotal == 0){
+		H5Ocopy(root, path, m->master, path, H5P_DEFAULT, H5P_DEFAULT);
+	}
+	else {
+		hid_t	datatype = H5Dget_type(dataset);
+		hid_t	vdcpl = H5Pcreate(H5P_DATASET_CREATE);
+		hsize_t	vdims[H5S_MAX_RANK];
+		hsize_t	start[H5S_MAX_RANK];
+		char	dsetPath[MAX_FILENAME_LENGTH];
+
+		// Same fill value as the sources
+		char	*fill = (char *) calloc(H5Tget_size(datatype), 1);
+		if(H5Pget_fill_value(dcpl, datatype, fill) >= 0)
+			H5Pset_fill_value(vdcpl, datatype, fill);
+		free(fill);
+
+		for(int i=0; i<ndims; i++){
+			vdims[i] = dims[i];
+			start[i] = 0;
+		}
+		vdims[0] = nTotal;
+		hid_t vspace = H5Screate_simple(ndims, vdims, NULL);
+
+		sprintf(dsetPath, "/%s", path);
+		for(uint k=0; k<m->sources.size(); k++){
+			if(n[k] == 0)
+				continue;
+			vdims[0] = n[k];
+			hid_t srcspace = H5Screate_simple(ndims, vdims, NULL);
+			H5Sselect_hyperslab(vspace, H5S_SELECT_SET, start, NULL, vdims, NULL);
+			H5Pset_virtual(vdcpl, vspace, m->links[k].c_str(), dsetPath, srcspace);
+			H5Sclose(srcspace);
+			start[0] += n[k];
+		}
+		H5Sselect_all(vspace);
+
+		hid_t vds = H5Dcreate2(m->master, path, datatype, vspace, H5P_DEFAULT, vdcpl, H5P_DEFAULT);
+		if(vds < 0){
+			fprintf(stderr, "Cannot create virtual dataset %s\n", path);
+		}
+		else {
+			H5Aiterate2(dataset, H5_INDEX_NAME, H5_ITER_INC, NULL, copyCXIAttribute, &vds);
+			int	nEvents = (int) nTotal;
+			hid_t a = H5Aopen(vds, CXI::ATTR_NAME_NUM_EVENTS, H5P_DEFAULT);
+			if(a >= 0){
+				H5Awrite(a, H5T_NATIVE_INT32, &nEvents);
+				H5Aclose(a);
+			}
+			H5Dclose(vds);
+		}
+		H5Sclose(vspace);
+		H5Pclose(vdcpl);
+		H5Tclose(datatype);
+	}
+
+	H5Pclose(dcpl);
+	H5Sclose(dataspace);
+	H5Dclose(dataset);
+	return 0;
+}
+#endif
+
+/*
+ *	Write master file <filename> over the given sources (in order).
+ *	links: names of the sources as stored in the file (relative to the master file), NULL to use the source names.
+ *	nFrames: if not NULL, returns the stack size of each source.
+ */
+int writeCXIMaster(const char *filename, std::vector<std::string> &sources, std::vector<std::string> *links, std::vector<long> *nFrames){
+	#if H5_VERSION_GE(1,10,0)
+	tCXIMaster	m;
+
+	if(sources.size() == 0)
+		return 1;
+	for(uint k=0; k<sources.size(); k++){
+		hid_t fh = H5Fopen(sources[k].c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+		if(fh < 0){
+			fprintf(stderr, "Cannot open %s, %s not written\n", sources[k].c_str(), filename);
+			for(uint i=0; i<m.sources.size(); i++)
+				H5Fclose(m.sources[i]);
+			return 1;
+		}
+		m.sources.push_back(fh);
+		m.links.push_back(links != NULL ? (*links)[k] : sources[k]);
+		m.nFrames.push_back(-1);
+	}
+	m.master = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	if(m.master < 0){
+		fprintf(stderr, "Cannot create %s\n", filename);
+		for(uint i=0; i<m.sources.size(); i++)
+			H5Fclose(m.sources[i]);
+		return 1;
+	}
+
+	// Links are visited in name order, groups before their members
+	H5Aiterate2(m.sources[0], H5_INDEX_NAME, H5_ITER_INC, NULL, copyCXIAttribute, &m.master);
+	H5Lvisit(m.sources[0], H5_INDEX_NAME, H5_ITER_INC, copyCXIMasterLink, &m);
+
+	H5Fclose(m.master);
+	for(uint i=0; i<m.sources.size(); i++)
+		H5Fclose(m.sources[i]);
+	if(nFrames != NULL){
+		nFrames->clear();
+		for(uint k=0; k<m.nFrames.size(); k++)
+			nFrames->push_back(m.nFrames[k] < 0 ? 0 : m.nFrames[k]);
+	}
+	return 0;
+	#else
+	fprintf(stderr, "Virtual datasets need HDF5 1.10 or later, %s not written (the source files are complete)\n", filename);
+	return 1;
+	#endif
+}
+
+
 /* Close each open file */
 void closeCXIFiles(cGlobal * global){
 
@@ -1986,6 +2375,18 @@ void closeCXIFiles(cGlobal * global){
     openResultsFiles.clear();
     openResultsFilenames.clear();
 
+    /* Sharded output: master files with virtual datasets across the shards */
+    for(uint i=0; i<cxiMasterFilenames.size(); i++){
+        printf("Writing %s\n",cxiMasterFilenames[i].c_str());
+        std::vector<std::string> shards;
+        for(uint k=0; k<cxiMasterShards[i].size(); k++)
+            if(!cxiMasterShards[i][k].empty())
+                shards.push_back(cxiMasterShards[i][k]);
+        writeCXIMaster(cxiMasterFilenames[i].c_str(), shards, NULL, NULL);
+    }
+    cxiMasterFilenames.clear();
+    cxiMasterShards.clear();
+
     pthread_mutex_unlock(&global->saveCXI_mutex);
 
 	//#endif
@@ -2004,20 +2405,56 @@ void writeCXIHitstats(cEventData *eventData, cGlobal *global ){
 		pthread_mutex_lock(&global->swmr_mutex);
 	}
 	#endif
-	/* Get the existing CXI file or open a new one */
-	CXI::Node *results = getResultsFileByName(global, eventData, eventData->powderClass);
+	/* Results file reserved for this frame by reserveCXI() */
+	CXI::Node *results = eventData->cxiResults;
 
-	pthread_mutex_lock(&global->saveCXI_mutex);
-	(*results)["event_data"]["hit"].write(&eventData->hit,global->nCXIEvents);
-	(*results)["event_data"]["nPeaks"].write(&eventData->nPeaks,global->nCXIEvents);
-    (*results)["event_data"]["hitScore"].write(&eventData->hitScore,global->nCXIEvents);
+	pthread_mutex_lock(&global->cxiShard_mutex[eventData->cxiShard]);
+	long	eventIndex = eventData->cxiEventIndex;
+	(*results)["event_data"]["hit"].write(&eventData->hit,eventIndex);
+	(*results)["event_data"]["nPeaks"].write(&eventData->nPeaks,eventIndex);
+    (*results)["event_data"]["hitScore"].write(&eventData->hitScore,eventIndex);
+	pthread_mutex_unlock(&global->cxiShard_mutex[eventData->cxiShard]);
 
-	global->nCXIEvents += 1;
 	#ifdef H5F_ACC_SWMR_WRITE
 	if(global->cxiSWMR){
 		pthread_mutex_unlock(&global->swmr_mutex);
 	}
 	#endif
+}
+
+
+/*
+ *  Reserve the place of this frame in the CXI and results files (shard, file, stack slice)
+ *  Called under &global->saveSynchronisation_mutex so stacks stay in step with the logs and the other outputs;
+ *  the data is written afterwards by writeCXI() and writeCXIHitstats(), which only need the shard lock.
+ */
+void reserveCXI(cEventData *eventData, cGlobal *global ){
+	eventData->cxiShard = 0;
+	if(global->cxiShards > 1)
+		eventData->cxiShard = reserveCXIShard(global, eventData->threadNum);
+
+    /*
+	 *	Get the existing CXI and Results file or open a new one
+	 *	(needs &global->saveCXI_mutex unlocked)
+	 */
+	eventData->cxiFile = getCXIFileByName(global, eventData, eventData->powderClass);
+	eventData->cxiResults = getResultsFileByName(global, eventData, eventData->powderClass);
+
+	/*
+	 *	Get position in CXI stack
+	 *	And set same stack slice for results file to ensure synchronisation
+	 */
+	eventData->stackSlice = eventData->cxiFile->getStackSlice();
+	eventData->cxiResults->stackCounter = eventData->cxiFile->stackCounter;
+
+	pthread_mutex_lock(&global->saveCXI_mutex);
+	global->nFramesSavedPerClass[eventData->powderClass] += 1;
+	global->nCXIHits += 1;
+	// Shard files are indexed by their own stack
+	eventData->cxiEventIndex = global->nCXIEvents;
+	if(global->cxiShards > 1)
+		eventData->cxiEventIndex = eventData->stackSlice;
+	global->nCXIEvents += 1;
 	pthread_mutex_unlock(&global->saveCXI_mutex);
 }
 
@@ -2054,30 +2491,13 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
     
     
     /*
-	 *	Get the existing CXI and Results file or open a new one
-	 *	(needs &global->saveCXI_mutex unlocked)
+	 *	Files and stack slice were reserved by reserveCXI()
+	 *	The shard (the only one without sharding) is ours until the frame is written
 	 */
-	CXI::Node *cxi = getCXIFileByName(global, eventData, eventData->powderClass);
-    CXI::Node *results = getResultsFileByName(global, eventData, eventData->powderClass);
-
-	/*
-	 *	Get position in CXI stack
-	 *	And set same stack slice for results file to ensure synchronisation
-	 */
-	uint stackSlice;
-	stackSlice = cxi->getStackSlice();
-    eventData->stackSlice = stackSlice;
-    //results->setStackSlice(stackSlice);
-	results->stackCounter = cxi->stackCounter;
-
-
-    /*
-     *	Lock writing to one thread at a time to ensure stack synchronisation
-     */
-    pthread_mutex_lock(&global->saveCXI_mutex);
-	global->nFramesSavedPerClass[eventData->powderClass] += 1;
-    global->nCXIHits += 1;
-    pthread_mutex_unlock(&global->saveCXI_mutex);       // Moved up here on 23 May, should work.... revert if problems
+	CXI::Node *cxi = eventData->cxiFile;
+    CXI::Node *results = eventData->cxiResults;
+	uint stackSlice = eventData->stackSlice;
+	pthread_mutex_lock(&global->cxiShard_mutex[eventData->cxiShard]);
     timer_cxiWait.stop();
 
     
@@ -2088,6 +2508,9 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
     writeCXIData(cxi, eventData, global, stackSlice);
     writeResultsData(results, eventData, global, stackSlice);
     timer_cxiWrite.stop();
+    pthread_mutex_unlock(&global->cxiShard_mutex[eventData->cxiShard]);
+    if(global->cxiShards > 1)
+        __sync_fetch_and_sub(&cxiShardWriters[eventData->cxiShard], 1);
     global->timeProfile.addToTimer(timer_cxiWait.duration, global->timeProfile.TIMER_H5WAIT);
     global->timeProfile.addToTimer(timer_cxiWrite.duration, global->timeProfile.TIMER_H5WRITE);
 
@@ -2308,6 +2731,11 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
             detector["distance"].write(&tmp,stackSlice);
             detector["x_pixel_size"].write(&pixelSize,stackSlice);
             detector["y_pixel_size"].write(&pixelSize,stackSlice);
+
+            if(!strcmp(global->facility, "EuXFEL")) {
+                detector["pixels_in_gain_stage"].write(eventData->detector[detIndex].nPixelsInGainStage,stackSlice);
+                detector["bad_pixels"].write(&eventData->detector[detIndex].nBadPixels,stackSlice);
+            }
             
             // DATA_FORMAT_NON_ASSEMBLED
             if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_NON_ASSEMBLED)) {
@@ -2357,7 +2785,25 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
                     // Non-assembled images (3D: N_frames x Ny_frame x Nx_frame)
                     else {
                         Node &data_node = detector[dataV.name_version];
-                        data_node["data"].write(data, stackSlice, pix_nn);
+                        if(!global->detector[detIndex].saveSparseOnly) {
+                            data_node["data"].write(data, stackSlice, pix_nn);
+                        }
+                        if(global->detector[detIndex].saveSparse) {
+                            // Peaks are only known for the hitfinder detector, all others fall back to the threshold
+                            tPeakList *peaklist = NULL;
+                            if(global->hitfinder && detIndex == global->hitfinderDetIndex) {
+                                peaklist = &eventData->peaklist;
+                            }
+                            int *sparseIndex;
+                            float *sparseValue;
+                            int nPix = (int) sparsifyFrame(data, pix_nx, pix_nn, global->detector[detIndex].sparseThreshold, peaklist,
+                                                           global->detector[detIndex].sparseHaloRadius, &sparseIndex, &sparseValue);
+                            data_node["sparse_npixels"].write(&nPix, stackSlice);
+                            data_node["sparse_index"].write(sparseIndex, stackSlice, nPix, true);
+                            data_node["sparse_value"].write(sparseValue, stackSlice, nPix, true);
+                            free(sparseIndex);
+                            free(sparseValue);
+                        }
                         if(global->detector[detIndex].savePixelmask) {
                             data_node["mask"].write(pixelmask, stackSlice, pix_nn);
                         }
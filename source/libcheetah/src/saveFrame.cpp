@@ -738,6 +738,12 @@ void writePeakFile(cEventData *eventData, cGlobal *global){
 	if(eventData->nPeaks <= 0) {
 		return;
 	}
+
+	// Version 3: binary column log (peaks.bin)
+	if(global->binaryLogs) {
+		writePeakLog(eventData, global);
+		return;
+	}
 	
 	// Dump peak info to file
 	
@@ -45,33 +45,44 @@ void saveSpectrumStacks(cGlobal *global) {
 
 
 
+/*
+ *	Stack file names and index logs of the current run
+ */
+void setStackOutput(cGlobal *global, long powderClass) {
+	char	prefix[1024];
+
+	sprintf(prefix, "r%04u-FEEspectrum-class%li", global->runNumber, powderClass);
+	global->FEEspectrumStack[powderClass].setOutput(prefix, global->FEElogfp[powderClass]);
+	sprintf(prefix, "r%04u-espectrumstack-class%li", global->runNumber, powderClass);
+	global->espectrumStack[powderClass].setOutput(prefix, NULL);
+	sprintf(prefix, "r%04u-TimeTool-class%li", global->runNumber, powderClass);
+	global->TimeToolStack[powderClass].setOutput(prefix, global->TimeToolLogfp[powderClass]);
+}
+
+
 /*
  *	FEE spectrometer
  */
 
 void addFEEspectrumToStack(cEventData *eventData, cGlobal *global, int powderClass){
 	
-    float   *stack = global->FEEspectrumStack[powderClass];
     uint32_t  *spectrum = eventData->FEEspec_hproj;
     long	speclength = global->FEEspectrumWidth;
-    long    stackCounter = global->FEEspectrumStackCounter[powderClass];
-    long    stackSize = global->FEEspectrumStackSize;
+    long    stackCounter;
 
 	// No FEE data means go home
-	if(!eventData->FEEspec_present)
+	if(!global->useFEEspectrum || !eventData->FEEspec_present)
 		return;
 		
 	
-    // Lock
-	pthread_mutex_lock(&global->FEEspectrumStack_mutex[powderClass]);
+    // Locks the stack until endRow()
+	float	*row = global->FEEspectrumStack[powderClass].beginRow(&stackCounter);
 	
-    // Data offsets
-    long stackoffset = stackCounter % stackSize;
-    long dataoffset = stackoffset*speclength;
-	
-    // Copy data and increment counter
-    for(long i=0; i<eventData->FEEspec_hproj_size; i++) {
-        stack[dataoffset+i] = (float) spectrum[i];
+    // Copy data
+    long	n = eventData->FEEspec_hproj_size;
+    if(n > speclength) n = speclength;
+    for(long i=0; i<n; i++) {
+        row[i] = (float) spectrum[i];
     }
 	
 	
@@ -79,65 +90,20 @@ void addFEEspectrumToStack(cEventData *eventData, cGlobal *global, int powderCla
 	fprintf(global->FEElogfp[powderClass], "%li, %li, %s/%s\n", stackCounter, eventData->frameNumber, eventData->eventSubdir, eventData->eventname);
 
 
-    // Increment counter
-    global->FEEspectrumStackCounter[powderClass] += 1;
-	
-	
-    // Save data once stack is full
-    if((global->FEEspectrumStackCounter[powderClass] % stackSize) == 0) {
-        printf("Saving FEE spectrum stack: %i\n", powderClass);
-        saveFEEspectrumStack(global, powderClass);
-        
-        for(long j=0; j<speclength*stackSize; j++)
-            global->FEEspectrumStack[powderClass][j] = 0;
-    }
-	
-    pthread_mutex_unlock(&global->FEEspectrumStack_mutex[powderClass]);
+    // Increment counter, a full stack goes to the stack writer
+	global->FEEspectrumStack[powderClass].endRow();
 }
 
 
 /*
- *  Save FEE spectral stacks
+ *  Save FEE spectral stacks (the stack being filled; full stacks are written as they fill up)
  */
 void saveFEEspectrumStack(cGlobal *global, int powderClass) {
 	
-    if(!global->useFEEspectrum)
-        return;
-	
-	char	filename[1024];
-    float   *stack = global->FEEspectrumStack[powderClass];
-    long	speclength = global->FEEspectrumWidth;
-    long    stackCounter = global->FEEspectrumStackCounter[powderClass];
-    long    stackSize = global->FEEspectrumStackSize;
-    pthread_mutex_t mutex = global->FEEspectrumStack_mutex[powderClass];
-	
-	if(global->FEEspectrumStackCounter[powderClass]==0)
+	if(!global->useFEEspectrum)
 		return;
 	
-    // Lock
-	pthread_mutex_lock(&mutex);
-	
-	
-	// If stack is not full, how many rows are full?
-	long    nRows = stackSize;
-	if(stackCounter % stackSize != 0)
-		nRows = (stackCounter % stackSize);
-	
-	// We re-use stacks, what is this number?
-	long	stackNum = stackCounter / stackSize;
- 	if(stackNum == 0) stackNum = 1;
-	
-    sprintf(filename,"r%04u-FEEspectrum-class%i-stack%li.h5", global->runNumber, powderClass, stackNum);
-    printf("Saving FEE spectral stack of length %li: %s with length\n", speclength, filename);
-    writeSimpleHDF5(filename, stack, speclength, nRows,(hid_t)  H5T_NATIVE_FLOAT);
-	
-	
-	// Flush stack index buffer
-	if(global->FEElogfp[powderClass] != NULL)
-		fflush(global->FEElogfp[powderClass]);
-	
-	pthread_mutex_unlock(&mutex);
-	
+	global->FEEspectrumStack[powderClass].save();
 }
 
 
@@ -168,24 +134,76 @@ void integrateSpectrum(cEventData *eventData, cGlobal *global) {
 }
 
 
-void integrateSpectrum(cEventData *eventData, cGlobal *global, int specWidth,int specHeight) {
-	// integrate spectrum into single line and output to event data
+/*
+ *	The tilted integration only depends on the camera geometry, so the spectrum bin of every camera pixel
+ *	(and the darkcal summed into each bin) is worked out once here rather than for every hit
+ */
+void setupSpectrumProjection(cGlobal *global) {
 	float PIE = 3.141;
 	float ttilt = tanf(global->espectrumTiltAng*PIE/180);
-	int opalindex;
-	int newind;
+	long	specWidth = global->espectrumWidth;
+	long	specHeight = global->espectrumLength;
+	int		newind;
+
+	free(global->espectrumProjection);
+	free(global->espectrumProjectedDark);
+	global->espectrumProjectionWidth = specWidth;
+	global->espectrumProjectionHeight = specHeight;
+	global->espectrumProjection = (int *) malloc(specWidth*specHeight*sizeof(int));
+	global->espectrumProjectedDark = (double *) calloc(specHeight, sizeof(double));
 
 	for (long i=0; i<specHeight; i++) {
 		for (long j=0; j<specWidth; j++) {
+			long	opalindex = i*specWidth + j;   // index of the 2D camera array
 			newind = i + (int) ceilf(j*ttilt);        // index of the integrated array, must be integer,!
 			if (newind >= 0 && newind < specHeight) {
-				opalindex = i*specWidth + j;   // index of the 2D camera array
-				eventData->energySpectrum1D[newind]+=eventData->CXIspec_image[opalindex];
-				if (global->espectrumDarkSubtract) {
-					eventData->energySpectrum1D[newind]-=global->espectrumDarkcal[opalindex];
+				global->espectrumProjection[opalindex] = newind;
+				if (global->espectrumDarkSubtract)
+					global->espectrumProjectedDark[newind] += global->espectrumDarkcal[opalindex];
+			}
+			else
+				global->espectrumProjection[opalindex] = -1;
+		}
+	}
+}
+
+
+void integrateSpectrum(cEventData *eventData, cGlobal *global, int specWidth,int specHeight) {
+	// integrate spectrum into single line and output to event data
+	double	*spectrum = eventData->energySpectrum1D;
+	int		*projection = global->espectrumProjection;
+	long	npix = (long) specWidth*specHeight;
+
+	// Camera not the size given in the configuration: project pixel by pixel
+	if (projection == NULL || specWidth != global->espectrumProjectionWidth || specHeight != global->espectrumProjectionHeight) {
+		float PIE = 3.141;
+		float ttilt = tanf(global->espectrumTiltAng*PIE/180);
+		int opalindex;
+		int newind;
+
+		for (long i=0; i<specHeight; i++) {
+			for (long j=0; j<specWidth; j++) {
+				newind = i + (int) ceilf(j*ttilt);        // index of the integrated array, must be integer,!
+				if (newind >= 0 && newind < specHeight) {
+					opalindex = i*specWidth + j;   // index of the 2D camera array
+					spectrum[newind]+=eventData->CXIspec_image[opalindex];
+					if (global->espectrumDarkSubtract) {
+						spectrum[newind]-=global->espectrumDarkcal[opalindex];
+					}
 				}
 			}
 		}
+		return;
+	}
+
+	for (long p=0; p<npix; p++) {
+		int	newind = projection[p];
+		if (newind >= 0)
+			spectrum[newind] += eventData->CXIspec_image[p];
+	}
+	if (global->espectrumDarkSubtract) {
+		for (long i=0; i<specHeight; i++)
+			spectrum[i] -= global->espectrumProjectedDark[i];
 	}
 	return;
 }
@@ -195,42 +213,16 @@ void addToSpectrumStack(cEventData *eventData, cGlobal *global, int powderClass)
 	
 
 	// Extract variables
-	float   *stack = global->espectrumStack[powderClass];
     double  *spectrum = eventData->energySpectrum1D;
     long	speclength = global->espectrumLength;
-    long    stackSize = global->espectrumStackSize;
 
 	
-	// Lock
-	pthread_mutex_t mutex = global->espectrumStack_mutex[powderClass];
-	pthread_mutex_lock(&mutex);
-	long    stackCounter = global->espectrumStackCounter[powderClass];
-
-	
-    // Data offsets
-    long stackoffset = stackCounter % stackSize;
-    long dataoffset = stackoffset*speclength;
-	
-    // Copy data and increment counter
+	// Copy data, a full stack goes to the stack writer
+	float	*row = global->espectrumStack[powderClass].beginRow(NULL);
     for(long i=0; i<speclength; i++) {
-        stack[dataoffset+i] = (float) spectrum[i];
-    }
-	
-    // Increment counter
-    global->espectrumStackCounter[powderClass] += 1;
-	
-	
-    // Save data once stack is full
-    if((stackCounter % stackSize) == 0) {
-        
-        printf("Saving espectrum stack: %i\n", powderClass);
-        saveEspectrumStack(global, powderClass);
-        
-        for(long j=0; j<speclength*stackSize; j++)
-            global->espectrumStack[powderClass][j] = 0;
+        row[i] = (float) spectrum[i];
     }
-	
-    pthread_mutex_unlock(&mutex);
+	global->espectrumStack[powderClass].endRow();
 	
 }
 
@@ -252,44 +244,14 @@ void saveEspectrumStacks(cGlobal *global) {
 
 
 /*
- *  Save radial average stack
+ *  Save radial average stack (the stack being filled; full stacks are written as they fill up)
  */
 void saveEspectrumStack(cGlobal *global, int powderClass) {
 	
-	char	filename[1024];
-    float   *stack = global->espectrumStack[powderClass];
-    long	speclength = global->espectrumLength;
-    long    stackCounter = global->espectrumStackCounter[powderClass];
-    long    stackSize = global->espectrumStackSize;
-    pthread_mutex_t mutex = global->espectrumStack_mutex[powderClass];
-	
-
-    if(!global->espectrum)
-        return;
-
-	if(global->espectrumStackCounter[powderClass]==0)
+	if(!global->espectrum)
 		return;
-	
-    // Lock
-	pthread_mutex_lock(&mutex);
 
-	
-	// We re-use stacks, what is this number?
-	long	stackNum = stackCounter / stackSize;
- 	if(stackNum == 0) stackNum = 1;
-	
-	// If stack is not full, how many rows are full?
-    long    nRows = stackSize;
-    if(stackCounter % stackSize != 0)
-        nRows = (stackCounter % stackSize);
-	
-	
-    sprintf(filename,"r%04u-espectrumstack-class%i-stack%li.h5", global->runNumber, powderClass, stackNum);
-    printf("Saving spectral stack: %s\n", filename);
-    writeSimpleHDF5(filename, stack, speclength, nRows, (hid_t) H5T_NATIVE_FLOAT);
-	
-	pthread_mutex_unlock(&mutex);
-	
+	global->espectrumStack[powderClass].save();
 }
 
 
@@ -0,0 +1,237 @@
+/*
+ *  stackWriter.cpp
+ *  cheetah
+ *
+ *  Double-buffered 1D trace stacks and their background writer (see stackWriter.h)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <hdf5.h>
+
+#include "cheetah.h"
+#include "stackWriter.h"
+
+
+cStackWriter::cStackWriter() {
+	queueHead = NULL;
+	queueTail = NULL;
+	busy = 0;
+	running = 0;
+	done = 0;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&queued, NULL);
+	pthread_cond_init(&idle, NULL);
+}
+
+cStackWriter::~cStackWriter() {
+	finish();
+	pthread_cond_destroy(&idle);
+	pthread_cond_destroy(&queued);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+/*
+ *	The writer thread is started with the first job
+ */
+void cStackWriter::queue(tStackJob *job) {
+	job->next = NULL;
+	pthread_mutex_lock(&mutex);
+	if(queueTail != NULL)
+		queueTail->next = job;
+	else
+		queueHead = job;
+	queueTail = job;
+
+	if(!running) {
+		done = 0;
+		if(pthread_create(&writer, NULL, writerThread, (void *) this) != 0) {
+			printf("Error: could not start stack writer thread\n");
+			exit(1);
+		}
+		running = 1;
+	}
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void *cStackWriter::writerThread(void *arg) {
+	cStackWriter	*self = (cStackWriter *) arg;
+
+	pthread_mutex_lock(&self->mutex);
+	while(true) {
+		while(self->queueHead == NULL && !self->done)
+			pthread_cond_wait(&self->queued, &self->mutex);
+		tStackJob	*job = self->queueHead;
+		if(job == NULL)
+			break;
+		self->queueHead = job->next;
+		if(self->queueHead == NULL)
+			self->queueTail = NULL;
+		self->busy = 1;
+		pthread_mutex_unlock(&self->mutex);
+
+		if(job->filename[0] != 0) {
+			printf("Saving stack: %s\n", job->filename);
+			writeSimpleHDF5(job->filename, job->data, job->width, job->nRows, (hid_t) H5T_NATIVE_FLOAT);
+		}
+		if(job->indexfp != NULL)
+			fflush(job->indexfp);
+		if(job->owner != NULL)
+			job->owner->recycle(job->data);
+		else
+			free(job->data);
+		free(job);
+
+		pthread_mutex_lock(&self->mutex);
+		self->busy = 0;
+		if(self->queueHead == NULL)
+			pthread_cond_broadcast(&self->idle);
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+
+/*
+ *	Wait until everything queued so far is on disk
+ */
+void cStackWriter::drain(void) {
+	pthread_mutex_lock(&mutex);
+	while(queueHead != NULL || busy)
+		pthread_cond_wait(&idle, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
+
+void cStackWriter::finish(void) {
+	pthread_mutex_lock(&mutex);
+	int		wasRunning = running;
+	done = 1;
+	running = 0;
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&mutex);
+	if(wasRunning)
+		pthread_join(writer, NULL);
+}
+
+
+
+cStackBuffer::cStackBuffer() {
+	writer = NULL;
+	width = 0;
+	stackSize = 0;
+	counter = 0;
+	prefix[0] = 0;
+	indexfp = NULL;
+	filling = NULL;
+	spare = NULL;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&spareReturned, NULL);
+}
+
+cStackBuffer::~cStackBuffer() {
+	free(filling);
+	free(spare);
+	pthread_cond_destroy(&spareReturned);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+void cStackBuffer::setup(cStackWriter *writer0, long width0, long stackSize0) {
+	writer = writer0;
+	width = width0;
+	stackSize = stackSize0;
+	counter = 0;
+	free(filling);
+	free(spare);
+	filling = (float *) calloc(width*stackSize, sizeof(float));
+	spare = (float *) calloc(width*stackSize, sizeof(float));
+}
+
+void cStackBuffer::setOutput(const char *prefix0, FILE *indexfp0) {
+	pthread_mutex_lock(&mutex);
+	strcpy(prefix, prefix0);
+	indexfp = indexfp0;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+tStackJob *cStackBuffer::newJob(float *data, long nRows, long stackNum, cStackBuffer *owner) {
+	tStackJob	*job = (tStackJob *) calloc(1, sizeof(tStackJob));
+	// A truncated name could overwrite some other file, such a stack is dropped by the writer (empty filename)
+	int	n = snprintf(job->filename, sizeof(job->filename), "%s-stack%li.h5", prefix, stackNum);
+	if(n < 0 || n >= (int) sizeof(job->filename)) {
+		printf("Error: stack filename too long, not saving stack %li of %s\n", stackNum, prefix);
+		job->filename[0] = 0;
+	}
+	job->data = data;
+	job->width = width;
+	job->nRows = nRows;
+	job->indexfp = indexfp;
+	job->owner = owner;
+	return job;
+}
+
+
+/*
+ *	Row for the next trace, zeroed. The stack stays locked until endRow(), so that index logs written
+ *	in between stay in step with the stack positions
+ */
+float *cStackBuffer::beginRow(long *stackCounter) {
+	pthread_mutex_lock(&mutex);
+	if(stackCounter != NULL)
+		*stackCounter = counter;
+	float	*row = filling + (counter % stackSize)*width;
+	memset(row, 0, width*sizeof(float));
+	return row;
+}
+
+void cStackBuffer::endRow(void) {
+	counter += 1;
+
+	// Full stack goes to the writer, the spare buffer takes over
+	if((counter % stackSize) == 0) {
+		while(spare == NULL)
+			pthread_cond_wait(&spareReturned, &mutex);
+		tStackJob	*job = newJob(filling, stackSize, counter/stackSize, this);
+		filling = spare;
+		spare = NULL;
+		writer->queue(job);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void cStackBuffer::recycle(float *buffer) {
+	pthread_mutex_lock(&mutex);
+	spare = buffer;
+	pthread_cond_signal(&spareReturned);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+ *	Periodic and final saves: a copy of the rows of the stack being filled
+ *	(full stacks have already been handed to the writer)
+ */
+void cStackBuffer::save(void) {
+	if(writer == NULL)
+		return;
+
+	pthread_mutex_lock(&mutex);
+	long	nRows = counter % stackSize;
+	if(nRows == 0) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	float	*copy = (float *) malloc(nRows*width*sizeof(float));
+	memcpy(copy, filling, nRows*width*sizeof(float));
+	tStackJob	*job = newJob(copy, nRows, counter/stackSize + 1, NULL);
+	pthread_mutex_unlock(&mutex);
+
+	writer->queue(job);
+}
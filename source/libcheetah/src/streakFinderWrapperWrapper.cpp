@@ -63,6 +63,7 @@ void initStreakFinder(cGlobal *global)
             uint_fast8_t streak_elongation_min_steps_count = global->detector[detIndex].streak_elongation_min_steps_count;
             uint_fast8_t streak_pixel_mask_radius = global->detector[detIndex].streak_pixel_mask_radius;
             uint_fast8_t streak_num_lines_to_check = global->detector[detIndex].streak_num_lines_to_check;
+            uint_fast8_t streak_thread_count = global->detector[detIndex].streak_thread_count;
 
             detectorCategory_t streak_detector_type = detectorCategory_UNDEFINED;
             if (strcmp(global->detector[detIndex].detectorType, "cspad") == 0) {
@@ -84,7 +85,8 @@ void initStreakFinder(cGlobal *global)
             global->detector[detIndex].streakfinderConstants = precomputeStreakFinderConstantArguments(streak_filter_length, streak_min_filter_length,
                     streak_filter_step, streak_sigma_factor, streak_elongation_min_steps_count, streak_elongation_radius_factor, streak_pixel_mask_radius,
                     streak_num_lines_to_check, streak_detector_type, streak_background_region_preset, streak_background_region_dist_from_edge, asic_nx, asic_ny,
-                    nasics_x, nasics_y, pix_x, pix_y, mask, streak_background_region_mask);
+                    nasics_x, nasics_y, pix_x, pix_y, mask, streak_background_region_mask, global->detector[detIndex].streak_cache_dir,
+                    streak_thread_count);
 
             //	Cleanup memory
             free(mask);
@@ -183,10 +185,13 @@ void streakFinder(cEventData *eventData, cGlobal *global)
 // In the output mask, 1 means there is a streak, 0 means that there is data
 // So !=0 pixel is in jet, ==0 pixel is not in jet
             for (long i = 0; i < pix_nn; i++) {
+                if ((streak_mask[i] != 0) == isBitOptionSet(pixelmask[i], PIXEL_IS_IN_JET))
+                    continue;
                 if (streak_mask[i] != 0) {
                     eventData->detector[detIndex].pixelmask[i] |= PIXEL_IS_IN_JET;
                 } else
                     eventData->detector[detIndex].pixelmask[i] &= ~PIXEL_IS_IN_JET;
+                eventData->detector[detIndex].markPixelmask(i);
             }
 
 //	Cleanup memory
@@ -0,0 +1,334 @@
+/*
+ *  streamWriter.cpp
+ *  cheetah
+ *
+ *  CrystFEL stream output (see streamWriter.h)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "cheetah.h"
+#include "streamWriter.h"
+
+
+cStreamWriter::cStreamWriter() {
+	fp = NULL;
+	nChunks = 0;
+	pix_nx = 0;
+	pix_ny = 0;
+	queueHead = NULL;
+	queueTail = NULL;
+	nQueued = 0;
+	done = 0;
+	running = 0;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&queued, NULL);
+	pthread_cond_init(&space, NULL);
+}
+
+cStreamWriter::~cStreamWriter() {
+	close();
+	pthread_cond_destroy(&space);
+	pthread_cond_destroy(&queued);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+/*
+ *	Open the stream, write the header and start the writer thread
+ */
+int cStreamWriter::setup(const char *filename, const char *geometryFile, cPixelDetectorCommon *detector) {
+	pix_nx = detector->pix_nx;
+	pix_ny = detector->pix_ny;
+
+	std::string	geometry;
+	panels.clear();
+	if(geometryFile != NULL && geometryFile[0] != 0) {
+		if(readGeometry(geometryFile, geometry))
+			return 1;
+	}
+	else {
+		generateGeometry(detector, geometry);
+	}
+
+	fp = fopen(filename, "w");
+	if(fp == NULL) {
+		printf("Error: Can not open %s for writing\n", filename);
+		return 1;
+	}
+	printf("Writing CrystFEL stream to %s (%li panels)\n", filename, (long) panels.size());
+	fprintf(fp, "CrystFEL stream format 2.3\n");
+	fprintf(fp, "Generated by Cheetah\n");
+	fprintf(fp, "----- Begin geometry file -----\n");
+	fputs(geometry.c_str(), fp);
+	if(geometry.size() > 0 && geometry[geometry.size()-1] != '\n')
+		fputc('\n', fp);
+	fprintf(fp, "----- End geometry file -----\n");
+
+	done = 0;
+	if(pthread_create(&writer, NULL, writerThread, (void *) this) != 0) {
+		printf("Error: could not start stream writer thread\n");
+		fclose(fp);
+		fp = NULL;
+		return 1;
+	}
+	running = 1;
+	return 0;
+}
+
+
+/*
+ *	Panels are taken from <panel>/min_fs, max_fs, min_ss and max_ss (bad regions are ignored)
+ */
+int cStreamWriter::readGeometry(const char *geometryFile, std::string &text) {
+	FILE	*gfp = fopen(geometryFile, "r");
+	if(gfp == NULL) {
+		printf("Error: Can not open CrystFEL geometry %s\n", geometryFile);
+		return 1;
+	}
+
+	char	line[1024];
+	while(fgets(line, sizeof(line), gfp) != NULL) {
+		text += line;
+
+		char	*comment = strchr(line, ';');
+		if(comment != NULL)
+			*comment = 0;
+		char	*slash = strchr(line, '/');
+		char	*equals = strchr(line, '=');
+		if(slash == NULL || equals == NULL || slash > equals)
+			continue;
+
+		char	name[256], key[256];
+		long	value;
+		if(sscanf(line, " %255[^/]/%255[^= \t] = %ld", name, key, &value) != 3)
+			continue;
+		if(strncmp(name, "bad", 3) == 0)
+			continue;
+
+		long	p;
+		for(p=0; p<(long) panels.size(); p++)
+			if(panels[p].name == name)
+				break;
+		if(p == (long) panels.size()) {
+			tStreamPanel	panel;
+			panel.name = name;
+			panel.min_fs = panel.max_fs = panel.min_ss = panel.max_ss = -1;
+			panels.push_back(panel);
+		}
+		if(!strcmp(key, "min_fs")) panels[p].min_fs = value;
+		else if(!strcmp(key, "max_fs")) panels[p].max_fs = value;
+		else if(!strcmp(key, "min_ss")) panels[p].min_ss = value;
+		else if(!strcmp(key, "max_ss")) panels[p].max_ss = value;
+	}
+	fclose(gfp);
+
+	// Names that were not panels (no pixel range)
+	for(long p=(long) panels.size()-1; p>=0; p--)
+		if(panels[p].min_fs < 0 || panels[p].max_fs < 0 || panels[p].min_ss < 0 || panels[p].max_ss < 0)
+			panels.erase(panels.begin()+p);
+
+	if(panels.size() == 0) {
+		printf("Error: no panels found in CrystFEL geometry %s\n", geometryFile);
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ *	One panel per ASIC, placed from the pixel map (which is in pixels, with pixel centres on the coordinates)
+ */
+void cStreamWriter::generateGeometry(cPixelDetectorCommon *detector, std::string &text) {
+	char	line[1024];
+
+	text += "; CrystFEL geometry generated by Cheetah from ";
+	text += detector->geometryFile;
+	text += "\n; One panel per ASIC, give a geometry with streamGeometry= to use your own panels\n";
+	sprintf(line, "res = %g\n", 1.0/detector->pixelSize);
+	text += line;
+	sprintf(line, "clen = %g\n", detector->defaultCameraLengthMm*detector->cameraLengthScale);
+	text += line;
+	text += "data = /entry_1/data_1/data\n";
+	text += "dim0 = %\n";
+	text += "dim1 = ss\n";
+	text += "dim2 = fs\n\n";
+
+	long	nx = detector->asic_nx;
+	long	ny = detector->asic_ny;
+	for(long ay=0; ay<detector->nasics_y; ay++) {
+		for(long ax=0; ax<detector->nasics_x; ax++) {
+			tStreamPanel	panel;
+			sprintf(line, "a%li", ay*detector->nasics_x + ax);
+			panel.name = line;
+			panel.min_fs = ax*nx;
+			panel.max_fs = (ax+1)*nx - 1;
+			panel.min_ss = ay*ny;
+			panel.max_ss = (ay+1)*ny - 1;
+			panels.push_back(panel);
+
+			long	i0 = panel.min_ss*pix_nx + panel.min_fs;
+			long	ifs = i0 + (nx > 1 ? 1 : 0);
+			long	iss = i0 + (ny > 1 ? pix_nx : 0);
+			double	fsx = detector->pix_x[ifs] - detector->pix_x[i0];
+			double	fsy = detector->pix_y[ifs] - detector->pix_y[i0];
+			double	ssx = detector->pix_x[iss] - detector->pix_x[i0];
+			double	ssy = detector->pix_y[iss] - detector->pix_y[i0];
+			const char *n = panel.name.c_str();
+
+			sprintf(line, "%s/min_fs = %li\n%s/max_fs = %li\n%s/min_ss = %li\n%s/max_ss = %li\n",
+					n, panel.min_fs, n, panel.max_fs, n, panel.min_ss, n, panel.max_ss);
+			text += line;
+			sprintf(line, "%s/fs = %+fx %+fy\n%s/ss = %+fx %+fy\n", n, fsx, fsy, n, ssx, ssy);
+			text += line;
+			sprintf(line, "%s/corner_x = %f\n%s/corner_y = %f\n\n", n, detector->pix_x[i0] - 0.5*(fsx+ssx), n, detector->pix_y[i0] - 0.5*(fsy+ssy));
+			text += line;
+		}
+	}
+}
+
+
+/*
+ *	Copy the peaks of a hit into the queue (waits if the writer is STREAM_MAX_QUEUED_CHUNKS behind)
+ */
+void cStreamWriter::addHit(cEventData *eventData, cGlobal *global, long detIndex) {
+	if(fp == NULL)
+		return;
+
+	// nPeaks is a pixel count or similar for some hitfinders, and may exceed the peaklist size for the others
+	long	n = std::min(eventData->peaklist.nPeaks, eventData->peaklist.nPeaks_max);
+	tStreamChunk	*chunk = new tStreamChunk;
+	chunk->filename = eventData->filename;
+	chunk->stackSlice = eventData->stackSlice;
+	chunk->photonEnergyeV = eventData->photonEnergyeV;
+	chunk->cameraLength = eventData->detector[detIndex].detectorZ * global->detector[detIndex].cameraLengthScale;
+	chunk->nPeaks = n;
+	chunk->fs = (float *) malloc(4*n*sizeof(float) + 1);
+	chunk->ss = chunk->fs + n;
+	chunk->resA = chunk->ss + n;
+	chunk->intensity = chunk->resA + n;
+	memcpy(chunk->fs, eventData->peaklist.peak_com_x, n*sizeof(float));
+	memcpy(chunk->ss, eventData->peaklist.peak_com_y, n*sizeof(float));
+	memcpy(chunk->resA, eventData->peaklist.peak_com_res, n*sizeof(float));
+	memcpy(chunk->intensity, eventData->peaklist.peak_totalintensity, n*sizeof(float));
+	chunk->next = NULL;
+
+	pthread_mutex_lock(&mutex);
+	while(nQueued >= STREAM_MAX_QUEUED_CHUNKS)
+		pthread_cond_wait(&space, &mutex);
+	if(queueTail != NULL)
+		queueTail->next = chunk;
+	else
+		queueHead = chunk;
+	queueTail = chunk;
+	nQueued++;
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+long cStreamWriter::findPanel(float fs, float ss) {
+	long	ifs = lrintf(fs);
+	long	iss = lrintf(ss);
+	for(long p=0; p<(long) panels.size(); p++)
+		if(ifs >= panels[p].min_fs && ifs <= panels[p].max_fs && iss >= panels[p].min_ss && iss <= panels[p].max_ss)
+			return p;
+	return -1;
+}
+
+
+/*
+ *	Peak positions are written as CrystFEL does: in data file coordinates with the panel name,
+ *	pixel corners on integers (Cheetah has the pixel centres there, hence the half pixel)
+ */
+void cStreamWriter::writeChunk(tStreamChunk *chunk) {
+	nChunks++;
+	fprintf(fp, "----- Begin chunk -----\n");
+	fprintf(fp, "Image filename: %s\n", chunk->filename.c_str());
+	fprintf(fp, "Event: //%li\n", chunk->stackSlice);
+	fprintf(fp, "Image serial number: %li\n", nChunks);
+	fprintf(fp, "hit = 1\n");
+	fprintf(fp, "indexed_by = none\n");
+	fprintf(fp, "photon_energy_eV = %f\n", chunk->photonEnergyeV);
+	fprintf(fp, "average_camera_length = %f m\n", chunk->cameraLength);
+
+	long	nWritten = 0;
+	std::vector<long> panel(chunk->nPeaks);
+	for(long i=0; i<chunk->nPeaks; i++) {
+		panel[i] = findPanel(chunk->fs[i], chunk->ss[i]);
+		if(panel[i] >= 0)
+			nWritten++;
+	}
+	fprintf(fp, "num_peaks = %li\n", nWritten);
+	fprintf(fp, "Peaks from peak search\n");
+	fprintf(fp, "  fs/px   ss/px (1/d)/nm^-1   Intensity  Panel\n");
+	for(long i=0; i<chunk->nPeaks; i++) {
+		if(panel[i] < 0)
+			continue;
+		float	invd = (chunk->resA[i] > 0) ? 10.0/chunk->resA[i] : 0;
+		fprintf(fp, "%7.2f %7.2f %10.2f  %10.2f   %s\n", chunk->fs[i] + 0.5, chunk->ss[i] + 0.5, invd, chunk->intensity[i], panels[panel[i]].name.c_str());
+	}
+	fprintf(fp, "End of peak list\n");
+	fprintf(fp, "----- End chunk -----\n");
+}
+
+
+void *cStreamWriter::writerThread(void *arg) {
+	cStreamWriter	*self = (cStreamWriter *) arg;
+
+	pthread_mutex_lock(&self->mutex);
+	while(true) {
+		while(self->queueHead == NULL && !self->done)
+			pthread_cond_wait(&self->queued, &self->mutex);
+		if(self->queueHead == NULL)
+			break;
+
+		// Take everything queued so far and write it without holding the lock
+		tStreamChunk	*chunks = self->queueHead;
+		self->queueHead = NULL;
+		self->queueTail = NULL;
+		self->nQueued = 0;
+		pthread_cond_broadcast(&self->space);
+		pthread_mutex_unlock(&self->mutex);
+
+		while(chunks != NULL) {
+			tStreamChunk	*next = chunks->next;
+			self->writeChunk(chunks);
+			free(chunks->fs);
+			delete chunks;
+			chunks = next;
+		}
+		fflush(self->fp);
+		pthread_mutex_lock(&self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return NULL;
+}
+
+
+/*
+ *	Write out what is still queued and close the stream
+ */
+void cStreamWriter::close(void) {
+	if(running) {
+		pthread_mutex_lock(&mutex);
+		done = 1;
+		pthread_cond_signal(&queued);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(writer, NULL);
+		running = 0;
+		printf("%li chunks written to CrystFEL stream\n", nChunks);
+	}
+	if(fp != NULL) {
+		fclose(fp);
+		fp = NULL;
+	}
+}
@@ -30,9 +30,7 @@ void saveTimeToolStacks(cGlobal *global) {
     if(global->useTimeTool) {
 		printf("Saving Time tool stacks\n");
 		for(long powderType=0; powderType < global->nPowderClasses; powderType++) {
-            pthread_mutex_lock(&global->TimeToolStack_mutex[powderType]);
 			saveTimeToolStack(global, powderType);
-            pthread_mutex_unlock(&global->TimeToolStack_mutex[powderType]);
 		}
 	}
 }
@@ -46,28 +44,22 @@ void saveTimeToolStacks(cGlobal *global) {
 
 void addTimeToolToStack(cEventData *eventData, cGlobal *global, int powderClass){
 	
-    float   *stack = global->TimeToolStack[powderClass];
     float	*timetrace = eventData->TimeTool_hproj;
     long	length = global->TimeToolStackWidth;
-    long    stackCounter = global->TimeToolStackCounter[powderClass];
-    long    stackSize = global->TimeToolStackSize;
+    long    stackCounter;
 
 	// No FEE data means go home
-	if(!eventData->TimeTool_present)
+	if(!global->useTimeTool || !eventData->TimeTool_present)
 		return;
 		
 	
-    // Lock
-	pthread_mutex_lock(&global->TimeToolStack_mutex[powderClass]);
+    // Locks the stack until endRow(), the row is zeroed
+	float	*row = global->TimeToolStack[powderClass].beginRow(&stackCounter);
 	
-    // Data offsets
-    long stackoffset = stackCounter % stackSize;
-    long dataoffset = stackoffset*length;
-	
-    // Copy data and increment counter
+    // Copy data
 	if (timetrace != NULL) {
 		for(long i=0; i<length; i++) {
-			stack[dataoffset+i] = (float) timetrace[i];
+			row[i] = (float) timetrace[i];
 		}
 	}
 	
@@ -75,63 +67,18 @@ void addTimeToolToStack(cEventData *eventData, cGlobal *global, int powderClass)
 	fprintf(global->TimeToolLogfp[powderClass], "%li, %li, %li, %s/%s\n", stackCounter, eventData->frameNumber, eventData->stackSlice, eventData->eventSubdir, eventData->eventname);
 
 
-    // Increment counter
-    global->TimeToolStackCounter[powderClass] += 1;
-	
-	
-    // Save data once stack is full
-    if((global->TimeToolStackCounter[powderClass] % stackSize) == 0) {
-        printf("Saving Time tool stack: %i\n", powderClass);
-        saveTimeToolStack(global, powderClass);
-        
-        for(long j=0; j<length*stackSize; j++)
-            global->TimeToolStack[powderClass][j] = 0;
-    }
-	
-    pthread_mutex_unlock(&global->TimeToolStack_mutex[powderClass]);
+    // Increment counter, a full stack goes to the stack writer
+	global->TimeToolStack[powderClass].endRow();
 }
 
 
 /*
- *  Save time tool stack
+ *  Save time tool stack (the stack being filled; full stacks are written as they fill up)
  */
 void saveTimeToolStack(cGlobal *global, int powderClass) {
 	
-    if(!global->useTimeTool)
-        return;
-	
-	char	filename[1024];
-    float   *stack = global->TimeToolStack[powderClass];
-    long	length = global->TimeToolStackWidth;
-    long    stackCounter = global->TimeToolStackCounter[powderClass];
-    long    stackSize = global->TimeToolStackSize;
-    pthread_mutex_t mutex = global->TimeToolStack_mutex[powderClass];
-	
-	if(global->TimeToolStackCounter[powderClass]==0)
+	if(!global->useTimeTool)
 		return;
 	
-    // Lock - moved, due to double lock when called from addTimeToolToStack() causing lockup
-	//pthread_mutex_lock(&mutex);
-	
-	
-	// We re-use stacks - this number is so that we dont overwrite old stacks
-	long	stackNum = stackCounter / stackSize;
-	
-	// If stack is not full, how many rows are full?
-    long    nRows = stackSize;
-    if(stackCounter % stackSize != 0)
-        nRows = (stackCounter % stackSize);
-	
-    sprintf(filename,"r%04u-TimeTool-class%i-stack%li.h5", global->runNumber, powderClass, stackNum);
-    printf("Saving time tool stack: %s\n", filename);
-    writeSimpleHDF5(filename, stack, length, nRows, (hid_t) H5T_NATIVE_FLOAT);
-	
-	
-	// Flush stack index buffer
-	if(global->TimeToolLogfp[powderClass] != NULL)
-		fflush(global->TimeToolLogfp[powderClass]);
-	
-	//pthread_mutex_unlock(&mutex);
-	
+	global->TimeToolStack[powderClass].save();
 }
-
@@ -36,10 +36,14 @@ void *worker(void *threadarg)
     cMyTimer timer_worker;
     timer_worker.start();
 
+    // Per-stage timing, booked into the latency histograms of global->timeProfile at cleanup
+    cStageTimer stageTimer;
+
     // Turn threadarg into a more useful form
     cGlobal *global;
     cEventData *eventData;
     int hit = 0;
+    int vetoed = 0;
     float hitRatio;
     double processRate;
     eventData = (cEventData*) threadarg;
@@ -56,6 +60,13 @@ void *worker(void *threadarg)
     std::stringstream sstm1;
     std::ofstream outHit;
 
+    // Hit pre-screen outcome, booked against the full hitfinder result further down
+    tHitPrescreenResult prescreenResult;
+    prescreenResult.screened = 0;
+
+    // Place in the CXI files taken under the synchronisation lock, written once it is released
+    bool cxiReserved = false;
+
     //---------------------------//
     //--------MONITORING---------//
     //---------------------------//
@@ -96,6 +107,7 @@ void *worker(void *threadarg)
     }
 
     // Initialise pixelmask with pixelmask_shared
+    stageTimer.start();
     initPixelmask(eventData, global);
 
     // Initialise raw data array (float) THIS MIGHT SLOW THINGS DOWN, WE MIGHT WANT TO CHANGE THIS
@@ -108,12 +120,14 @@ void *worker(void *threadarg)
 
     // Initialise data_detCorr with data_raw16
     initDetectorCorrection(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_INIT);
 
     // Check for saturated pixels before applying any other corrections
     checkSaturatedPixels(eventData, global);
 
     // Subtract darkcal image (static electronic offsets)
     subtractDarkcal(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_DARK);
 
     // If no darkcal file: Subtract persistent background here (background = photon background + static electronic offsets)
     // Commenting this out because it was was causing crashes with memory access violations (and the problem went away when this was commented out) <-- Anton 14 Dec 2014
@@ -128,6 +142,9 @@ void *worker(void *threadarg)
     cspadSubtractUnbondedPixels(eventData, global);
     cspadSubtractBehindWires(eventData, global);
 
+    // Generic common mode (cmEstimator), any detector
+    commonModeSubtract(eventData, global);
+
     // Fix pnCCD artefacts:
     // pnCCD offset correction (read out artifacts prominent in lines with high signal)
     // pnCCD wiring error (shift in one set of rows relative to another - and yes, it's a wiring error).
@@ -138,6 +155,7 @@ void *worker(void *threadarg)
     pnccdFixWiringError(eventData, global);
     pnccdLineInterpolation(eventData, global);
     pnccdLineMasking(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_COMMONMODE);
 
     // Apply gain correction
     applyGainCorrection(eventData, global);
@@ -148,6 +166,7 @@ void *worker(void *threadarg)
     // Histogram of detector values
     addToHistogram(eventData, global, 0);
     //addToHistogram(eventData, global, hit);
+    stageTimer.lap(cTimingProfiler::STAGE_HOTPIXELS);
 
     //  Inside-thread speed test
     if (global->ioSpeedTest == 4) {
@@ -156,7 +175,9 @@ void *worker(void *threadarg)
     }
 
     // Subtract residual common mode offsets (cmModule=2)
+    stageTimer.start();
     cspadModuleSubtract2(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_COMMONMODE);
 
     // Set bad pixels to zero
     setBadPixelsToZero(eventData, global);
@@ -164,6 +185,7 @@ void *worker(void *threadarg)
     // Identify hot pixels and set them to zero
     updateHotPixelBuffer(eventData, global);
     setHotPixelsToZero(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_HOTPIXELS);
 
     // Inside-thread speed test
     if (global->ioSpeedTest == 5) {
@@ -177,6 +199,7 @@ void *worker(void *threadarg)
     DEBUG2("Background correction");
 
     // Initialise data_detPhotCorr with data_detCorr
+    stageTimer.start();
     initPhotonCorrection(eventData, global);
 
     // Some of these conversions are mutually exclusive
@@ -193,12 +216,40 @@ void *worker(void *threadarg)
 
     // If a darkcal file is available: Subtract persistent background is for photon subtraction (persistent background = photon background)
     subtractPersistentBackground(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_BACKGROUND);
+
+    // Hit pre-screen
+    // Cheap statistics on a binned view of the frame, vetoes obvious blanks before streak finding,
+    // radial/local background subtraction and peakfinding
+    if (global->hitfinder && global->hitfinderPrescreen && (global->hitfinderForInitials ||
+            !(eventData->threadNum < global->nInitFrames || !calibrated))) {
+        stageTimer.start();
+        vetoed = hitfinderPrescreen(eventData, global, &prescreenResult);
+        stageTimer.lap(cTimingProfiler::STAGE_PRESCREEN);
+
+        if (vetoed) {
+            hit = 0;
+            eventData->hit = 0;
+            // Vetoed blanks that still go into the blank sums get the same background subtraction as the other blanks
+            if (!(global->hitfinderPrescreenSkipBlankSums && !global->saveBlanks)) {
+                subtractRadialBackground(eventData, global);
+                stageTimer.lap(cTimingProfiler::STAGE_RADIALBACKGROUND);
+                if (!global->hitfinderFastScan) {
+                    subtractLocalBackground(eventData, global);
+                    stageTimer.lap(cTimingProfiler::STAGE_LOCALBACKGROUND);
+                }
+            }
+            goto hitknown;
+        }
+    }
 
     // Streak finder
     streakFinder(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_STREAKFINDER);
 
     // Radial background subtraction (!!! Radial background subtraction subtracts a photon background, therefore moved here)
     subtractRadialBackground(eventData, global);
+    stageTimer.lap(cTimingProfiler::STAGE_RADIALBACKGROUND);
 
     // Hitfinder fast-scan
     // Looks at the inner part of the detector first to see whether it's worth looking at the rest
@@ -210,8 +261,10 @@ void *worker(void *threadarg)
                 printf("\n\n\n\n\n\nERROR!!!!! Fast scan not implemented with peakFinder9 yet!!!!!!!!!!\n\n\n\n\n\n\n\n");
             }
 
+            stageTimer.start();
             hit = hitfinderFastScan(eventData, global);
             eventData->hit = hit;
+            stageTimer.lap(cTimingProfiler::STAGE_HITFINDER);
 
             if (!hit)
                 goto hitknown;
@@ -220,7 +273,9 @@ void *worker(void *threadarg)
 
     // Local background subtraction - this is photon background correction
     if (!global->hitfinderFastScan) {
+        stageTimer.start();
         subtractLocalBackground(eventData, global);
+        stageTimer.lap(cTimingProfiler::STAGE_LOCALBACKGROUND);
     }
 
     //----------------------------------------//
@@ -232,8 +287,13 @@ void *worker(void *threadarg)
 
         DEBUG2("Hit finding");
 
+        stageTimer.start();
         hit = hitfinder(eventData, global);
         eventData->hit = hit;
+        stageTimer.lap(cTimingProfiler::STAGE_HITFINDER);
+
+        // Agreement of the pre-screen with the full path
+        hitfinderPrescreenOutcome(global, &prescreenResult, hit);
 
         pthread_mutex_lock(&global->hitclass_mutex);
         for (int coord = 0; coord < 3; coord++) {
@@ -267,10 +327,13 @@ void *worker(void *threadarg)
     hitRatio = 100. * (global->nhits / (float) global->nhitsandblanks);
 
     // Update running backround estimate based on non-hits
+    stageTimer.start();
     updateBackgroundBuffer(eventData, global, hit);
+    stageTimer.lap(cTimingProfiler::STAGE_BACKGROUND);
 
     // Identify noisy pixels
     updateNoisyPixelBuffer(eventData, global, hit);
+    stageTimer.lap(cTimingProfiler::STAGE_HOTPIXELS);
 
     // Skip first set of frames to build up running estimate of background...
     if (eventData->threadNum < global->nInitFrames || !calibrated) {
@@ -298,17 +361,24 @@ void *worker(void *threadarg)
         goto cleanup;
     }
 
-    // Assemble, downsample and radially average current frame
-    assemble2D(eventData, global);
-    //downsample(eventData, global);
-
-    // Powder
-    // Maintain a running sum of data (powder patterns)
-    addToPowder(eventData, global);
-
-    // Calculate radial averages
-    calculateRadialAverage(eventData, global);
-    addToRadialAverageStack(eventData, global);
+    // Blanks vetoed by the pre-screen are not assembled or summed unless they are saved
+    if (!(vetoed && global->hitfinderPrescreenSkipBlankSums && !global->saveBlanks)) {
+        // Assemble, downsample and radially average current frame
+        stageTimer.start();
+        assemble2D(eventData, global);
+        //downsample(eventData, global);
+        stageTimer.lap(cTimingProfiler::STAGE_ASSEMBLE);
+
+        // Powder
+        // Maintain a running sum of data (powder patterns)
+        addToPowder(eventData, global);
+        stageTimer.lap(cTimingProfiler::STAGE_POWDER);
+
+        // Calculate radial averages
+        calculateRadialAverage(eventData, global);
+        addToRadialAverageStack(eventData, global);
+        stageTimer.lap(cTimingProfiler::STAGE_RADIAL);
+    }
 
     // Calculate the one dimesional beam spectrum
     integrateSpectrum(eventData, global);
@@ -335,6 +405,10 @@ void *worker(void *threadarg)
         goto cleanup;
     }
 
+    // Live view of recent hits (shared memory)
+    if (hit && global->useLiveView)
+        publishLiveViewHit(eventData, global);
+
     //----------------------//
     //---WRITE-DATA-TO-H5---//
     //----------------------//
@@ -362,6 +436,7 @@ void *worker(void *threadarg)
                     ((global->hdf5dump > 0) && ((eventData->frameNumber % global->hdf5dump) == 0));
 
     // Synchronisation of all writing so that stacks, CXI file, etc stay in step with each other
+    stageTimer.start();
     pthread_mutex_lock(&global->saveSynchronisation_mutex);
 
     if (global->generateDarkcal || global->generateGaincal) {
@@ -375,8 +450,9 @@ void *worker(void *threadarg)
             if (global->saveCXI) {
                 printf("r%04u:%li (%2.1lf Hz, %3.3f %% hits): Writing %s (hit=%i,npeaks=%i)\n", global->runNumber, eventData->threadNum, processRate, hitRatio,
                         eventData->eventStamp, hit, eventData->nPeaks);
-                writeCXI(eventData, global);
-                writeCXIHitstats(eventData, global);
+                // Only the place in the files is taken here, the data is written below without holding up the other writers
+                reserveCXI(eventData, global);
+                cxiReserved = true;
                 addTimeToolToStack(eventData, global, powderClass);
                 addFEEspectrumToStack(eventData, global, powderClass);
             }
@@ -397,16 +473,40 @@ void *worker(void *threadarg)
     }
 
     // If this is a hit, write out peak info to peak list file	
-    if (hit && global->savePeakInfo) {
-        writePeakFile(eventData, global);
+    if (!global->binaryLogs) {
+        if (hit && global->savePeakInfo) {
+            writePeakFile(eventData, global);
+        }
+
+        DEBUG2("Logbook keeping");
+        writeLog(eventData, global);
     }
 
-    DEBUG2("Logbook keeping");
-    writeLog(eventData, global);
+    // Peaks of this hit for the CrystFEL stream, only for frames that have a place in a CXI file to point at
+    // (eventData->filename and stackSlice are set by reserveCXI)
+    if (hit && global->saveStream && eventData->writeFlag && global->saveCXI && cxiReserved) {
+        global->streamWriter.addHit(eventData, global, global->hitfinderDetIndex);
+    }
 
     // Release synchronisation lock 
     pthread_mutex_unlock(&global->saveSynchronisation_mutex);
 
+    // CXI data goes in under the lock of its shard only
+    if (cxiReserved) {
+        writeCXI(eventData, global);
+        writeCXIHitstats(eventData, global);
+    }
+
+    // Binary logs only copy a few values into a batch, no need to hold up the other writers for that
+    if (global->binaryLogs) {
+        if (hit && global->savePeakInfo) {
+            writePeakFile(eventData, global);
+        }
+        DEBUG2("Logbook keeping");
+        writeLog(eventData, global);
+    }
+    stageTimer.lap(cTimingProfiler::STAGE_WRITE);
+
     // Inside-thread speed test
     if (global->ioSpeedTest == 10) {
         printf("r%04u:%li (%3.1fHz): I/O Speed test #1 (after saving frames)\n", global->runNumber, eventData->frameNumber, global->datarate);
@@ -419,11 +519,16 @@ void *worker(void *threadarg)
     cleanup:
     DEBUG2("Clean up and exit");
 
+    // Book stage timings of this frame
+    stageTimer.finish(cTimingProfiler::STAGE_TOTAL);
+    global->timeProfile.addStageTimes(stageTimer, eventData->threadNum);
+
     // Save accumulated data periodically
     // Update counters
     pthread_mutex_lock(&global->saveinterval_mutex);
     global->nprocessedframes += 1;
     global->nrecentprocessedframes += 1;
+    long nprocessedframes = global->nprocessedframes;
 
     //
     // Save some types of information from time to time (for example, powder patterns get updated while running)
@@ -466,6 +571,10 @@ void *worker(void *threadarg)
     }
     pthread_mutex_unlock(&global->saveinterval_mutex);
 
+    // Refresh live view powder snapshot (outside the save interval lock, skipped if another worker is at it)
+    if (global->useLiveView && global->liveViewPowderInterval > 0 && (nprocessedframes % global->liveViewPowderInterval) == 0)
+        publishLiveViewPowder(global);
+
 
     // Decrement thread pool counter by one
     pthread_mutex_lock(&global->nActiveThreads_mutex);